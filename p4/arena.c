@@ -0,0 +1,161 @@
+/**
+ * @file arena.c
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This component is responsible for allocating the many small objects of a huge policy
+ * without the cost malloc() adds to each one. Objects of one size are cut from regions
+ * of ARENA_REGION bytes mapped straight from the system. A region is backed by a huge
+ * page when the system has some reserved, and is otherwise aligned to one and offered
+ * to the kernel to back with a transparent huge page, so a scan over many rules misses
+ * the TLB far less often.
+ */
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+/** Offset of the first object in a region, after the link to the previous region */
+#define ARENA_HEADER 64
+
+/** Alignment of every object */
+#define ARENA_ALIGN 8
+
+/**
+ * This function maps a region aligned to its own size, backed by a huge page if one
+ * is reserved.
+ *
+ * @param huge the value to be updated with 1 if the region is backed by a reserved huge
+ * page and 0 if not
+ *
+ * @return the region, or NULL if memory runs out
+ */
+static void *region_map(int *huge) {
+
+#ifdef MAP_HUGETLB
+    void *mem = mmap(NULL, ARENA_REGION, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    if (mem != MAP_FAILED) {
+        *huge = 1;
+        return mem;
+    }
+#endif
+
+    *huge = 0;
+
+    //Map twice the size and trim it, so the region starts on a huge page boundary
+    char *raw = (char *) mmap(NULL, 2 * ARENA_REGION, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+
+    char *start = (char *) (((uintptr_t) raw + ARENA_REGION - 1) & ~(ARENA_REGION - 1));
+
+    if (start > raw) {
+        munmap(raw, start - raw);
+    }
+    if (start + ARENA_REGION < raw + 2 * ARENA_REGION) {
+        munmap(start + ARENA_REGION, raw + 2 * ARENA_REGION - (start + ARENA_REGION));
+    }
+
+#ifdef MADV_HUGEPAGE
+    madvise(start, ARENA_REGION, MADV_HUGEPAGE);
+#endif
+
+    return start;
+}
+
+/**
+ * This function sets up an empty arena. No memory is mapped until the first object is
+ * allocated.
+ *
+ * @param arena the arena
+ * @param size the size of an object in bytes
+ */
+void arena_init(arena_t *arena, size_t size) {
+
+    arena->size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    arena->free = NULL;
+    arena->next = NULL;
+    arena->end = NULL;
+    arena->regions = NULL;
+    arena->count = 0;
+    arena->huge = 0;
+    arena->live = 0;
+}
+
+/**
+ * This function hands out an object, mapping a new region if every one is in use.
+ *
+ * @param arena the arena
+ *
+ * @return the object, or NULL if memory runs out
+ */
+void *arena_alloc(arena_t *arena) {
+
+    void *ptr = arena->free;
+
+    if (ptr) {
+        arena->free = *(void **) ptr;
+        arena->live++;
+        return ptr;
+    }
+
+    if (arena->next + arena->size > arena->end || !arena->next) {
+        int huge;
+        char *region = (char *) region_map(&huge);
+
+        if (!region) {
+            return NULL;
+        }
+
+        *(void **) region = arena->regions;
+        arena->regions = region;
+        arena->next = region + ARENA_HEADER;
+        arena->end = region + ARENA_REGION;
+        arena->count++;
+        arena->huge += huge;
+    }
+
+    ptr = arena->next;
+    arena->next += arena->size;
+    arena->live++;
+
+    return ptr;
+}
+
+/**
+ * This function gives an object back to its arena.
+ *
+ * @param arena the arena
+ * @param ptr the object, or NULL
+ */
+void arena_free(arena_t *arena, void *ptr) {
+
+    if (ptr) {
+        *(void **) ptr = arena->free;
+        arena->free = ptr;
+        arena->live--;
+    }
+}
+
+/**
+ * This function unmaps every region of an arena, freeing every object in it at once,
+ * and leaves it empty but ready to be used again.
+ *
+ * @param arena the arena
+ */
+void arena_release(arena_t *arena) {
+
+    void *region = arena->regions;
+
+    while (region) {
+        void *prev = *(void **) region;
+        munmap(region, ARENA_REGION);
+        region = prev;
+    }
+
+    arena_init(arena, arena->size);
+}
@@ -0,0 +1,75 @@
+/**
+ * @file arena.h
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This file acts as the interface for the arena.c file
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/** Size of a region an arena maps at once (one huge page) */
+#define ARENA_REGION (2UL << 20)
+
+/**
+ * Representation of a pool of objects of one size, carved out of large regions mapped
+ * straight from the system rather than allocated one at a time. Objects carry no
+ * header, and freed objects are kept on a list to be handed out again. An arena is not
+ * thread-safe; only the thread that changes the policy uses one.
+ * .size: the size of an object in bytes
+ * .free: the most recently freed object, each holding a pointer to the one before
+ * .next: the next object never handed out in the newest region
+ * .end: the end of the newest region
+ * .regions: the newest region, each starting with a pointer to the one before
+ * .count: the number of regions mapped
+ * .huge: the number of regions backed by huge pages reserved for the purpose
+ * .live: the number of objects handed out and not yet freed
+ */
+typedef struct arena {
+    size_t size;
+    void *free;
+    char *next;
+    char *end;
+    void *regions;
+    unsigned long count;
+    unsigned long huge;
+    unsigned long live;
+} arena_t;
+
+/**
+ * This function sets up an empty arena. No memory is mapped until the first object is
+ * allocated.
+ *
+ * @param arena the arena
+ * @param size the size of an object in bytes
+ */
+void arena_init(arena_t *arena, size_t size);
+
+/**
+ * This function hands out an object, mapping a new region if every one is in use.
+ *
+ * @param arena the arena
+ *
+ * @return the object, or NULL if memory runs out
+ */
+void *arena_alloc(arena_t *arena);
+
+/**
+ * This function gives an object back to its arena.
+ *
+ * @param arena the arena
+ * @param ptr the object, or NULL
+ */
+void arena_free(arena_t *arena, void *ptr);
+
+/**
+ * This function unmaps every region of an arena, freeing every object in it at once,
+ * and leaves it empty but ready to be used again.
+ *
+ * @param arena the arena
+ */
+void arena_release(arena_t *arena);
+
+#endif
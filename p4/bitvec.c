@@ -0,0 +1,632 @@
+/**
+ * @file bitvec.c
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This component is responsible for the bit-vector classification engine.
+ * Every field of a rule either names one value or is a wildcard, so the values of a
+ * field split into the distinct values rules name and everything else. Each of these
+ * gets a bitmap with a bit set for every rule that matches it. A lookup finds the
+ * bitmap for each field of the packet, ANDs the five together a vector at a time, and
+ * the lowest set bit is the first matching rule. The cost of a lookup is bounded by
+ * the size of the policy rather than by where the first match is.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "bitvec.h"
+#include "stats.h"
+
+/** Number of fields a rule matches on */
+#define BITVEC_FIELDS 5
+
+/** Number of bits in a bitmap word */
+#define BITVEC_WORD_BITS 64
+
+/** Number of bitmap words ANDed at once */
+#define BITVEC_LANE 4
+
+/** Number of rules covered by one vector of a bitmap */
+#define BITVEC_BLOCK_BITS (BITVEC_WORD_BITS * BITVEC_LANE)
+
+/** Alignment of the bitmaps, so they can be read a vector at a time */
+#define BITVEC_ALIGN 32
+
+/** Most distinct values a field may have and still keep a full bitmap for each */
+#define BITVEC_DENSE_VALUES 64
+
+/** A word of a bitmap */
+typedef unsigned long long bitvec_word_t;
+
+/** A vector of BITVEC_LANE bitmap words, covering BITVEC_BLOCK_BITS rules */
+typedef bitvec_word_t bitvec_vec_t
+        __attribute__((vector_size(BITVEC_LANE * sizeof(bitvec_word_t))));
+
+/**
+ * Representation of the bitmaps of one field. A field with few distinct values keeps a
+ * full bitmap for each, with the rules that have a wildcard for the field included in
+ * every one. A field with more keeps only the blocks of each value's bitmap that have a
+ * bit set, and a single full bitmap of the rules with a wildcard.
+ * .len: the number of distinct values rules name
+ * .values: the values in increasing order
+ * .any: whether any rule has a wildcard for the field
+ * .sparse: whether the field keeps only the blocks of each value that have a bit set
+ * .maps: for a full field, .len bitmaps, one for each value, followed by the bitmap for
+ * every other value; for a sparse field, the bitmap of rules with a wildcard (or NULL)
+ * .start: for a sparse field, the first block of each value, followed by the total
+ * .block: for a sparse field, the position of each block in the bitmap
+ * .bits: for a sparse field, the bits of each block
+ */
+typedef struct bitvec_field {
+    unsigned int len;
+    unsigned int *values;
+    int any;
+    int sparse;
+    bitvec_vec_t *maps;
+    unsigned int *start;
+    unsigned int *block;
+    bitvec_vec_t *bits;
+} bitvec_field_t;
+
+/**
+ * Representation of a bit-vector index
+ * .blocks: the number of vectors in a full bitmap
+ * .bytes: the amount of memory the bitmaps take
+ * .fields: the bitmaps of each field
+ */
+typedef struct bitvec {
+    unsigned int blocks;
+    size_t bytes;
+    bitvec_field_t fields[BITVEC_FIELDS];
+} bitvec_t;
+
+/**
+ * Representation of the bitmap of the value a packet has for one field, read in order
+ * of increasing block during a lookup
+ * .full: the full bitmap, or NULL for a sparse field
+ * .any: for a sparse field, the bitmap of rules with a wildcard, or NULL
+ * .block: for a sparse field, the position of each block
+ * .bits: for a sparse field, the bits of each block
+ * .at: for a sparse field, the next block of the value not yet passed
+ * .end: for a sparse field, the end of the value's blocks
+ */
+typedef struct bitvec_cursor {
+    const bitvec_vec_t *full;
+    const bitvec_vec_t *any;
+    const unsigned int *block;
+    const bitvec_vec_t *bits;
+    unsigned int at;
+    unsigned int end;
+} bitvec_cursor_t;
+
+/**
+ * This function finds the value a rule matches for a field.
+ *
+ * @param rule the rule
+ * @param f the field (protocol, source address, source port, destination address,
+ * destination port)
+ * @param value the value to be updated with the value the rule names
+ *
+ * @return 1 if the rule has a wildcard for the field, 0 otherwise
+ */
+static int rule_value(rule_t *rule, int f, unsigned int *value) {
+
+    port_match_t port;
+
+    switch (f) {
+    case 0:
+        *value = PACKET_PROTOCOL(rule->match.value);
+        return 0;
+    case 1:
+        *value = PACKET_SRC_IP(rule->match.value);
+        return 0;
+    case 3:
+        *value = PACKET_DST_IP(rule->match.value);
+        return 0;
+    default:
+        port = f == 2 ? MATCH_SRC_PORT(rule->match) : MATCH_DST_PORT(rule->match);
+        *value = port;
+        return port == MATCH_PORT_ANY;
+    }
+}
+
+/**
+ * This function finds the value of a field of a packet.
+ *
+ * @param pkt the packet
+ * @param f the field, as for rule_value()
+ *
+ * @return the value
+ */
+static unsigned int packet_value(packet_t *pkt, int f) {
+
+    switch (f) {
+    case 0:
+        return PACKET_PROTOCOL(*pkt);
+    case 1:
+        return PACKET_SRC_IP(*pkt);
+    case 2:
+        return PACKET_SRC_PORT(*pkt);
+    case 3:
+        return PACKET_DST_IP(*pkt);
+    default:
+        return PACKET_DST_PORT(*pkt);
+    }
+}
+
+/**
+ * This function compares two keys for qsort().
+ *
+ * @param a the first key
+ * @param b the second key
+ *
+ * @return negative, zero or positive as for qsort()
+ */
+static int key_cmp(const void *a, const void *b) {
+
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * This function finds the bitmap of a value of a field.
+ *
+ * @param field the field
+ * @param value the value
+ *
+ * @return the index of the value, or field->len if no rule names it
+ */
+static unsigned int value_find(bitvec_field_t *field, unsigned int value) {
+
+    unsigned int lo = 0;
+    unsigned int hi = field->len;
+
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if (field->values[mid] < value) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo < field->len && field->values[lo] == value) {
+        return lo;
+    }
+
+    return field->len;
+}
+
+/**
+ * This function collects the distinct values rules name for a field.
+ *
+ * @param field the field to be populated
+ * @param rules the rules
+ * @param n the number of rules
+ * @param f the field, as for rule_value()
+ * @param keys the value to be updated with the value and index of each rule naming a
+ * value, in increasing order (room for @n)
+ * @param map the value to be updated with the index of the value each rule names
+ * (.len for a wildcard)
+ *
+ * @return the number of keys, or -1 if unsuccessful
+ */
+static int field_values(bitvec_field_t *field, rule_t *rules, unsigned int n, int f,
+        uint64_t *keys, unsigned int *map) {
+
+    unsigned int exact = 0;
+
+    for (unsigned int i = 0; i < n; i++) {
+        unsigned int value;
+        if (rule_value(&rules[i], f, &value)) {
+            field->any = 1;
+        } else {
+            keys[exact++] = (uint64_t) value << 32 | i;
+        }
+    }
+
+    //Sorting by value then index groups each value's rules, in order
+    qsort(keys, exact, sizeof(uint64_t), key_cmp);
+
+    field->values = (unsigned int *) malloc((exact ? exact : 1) * sizeof(unsigned int));
+
+    if (!field->values) {
+        return -1;
+    }
+
+    field->len = 0;
+    for (unsigned int k = 0; k < exact; k++) {
+        unsigned int value = keys[k] >> 32;
+
+        if (field->len == 0 || field->values[field->len - 1] != value) {
+            field->values[field->len++] = value;
+        }
+        map[(unsigned int) keys[k]] = field->len - 1;
+    }
+
+    for (unsigned int i = 0; i < n; i++) {
+        unsigned int value;
+        if (rule_value(&rules[i], f, &value)) {
+            map[i] = field->len;
+        }
+    }
+
+    return exact;
+}
+
+/**
+ * This function frees a bit-vector index.
+ *
+ * @param index the index
+ */
+void bitvec_free(void *index) {
+
+    bitvec_t *bv = (bitvec_t *) index;
+
+    for (int f = 0; f < BITVEC_FIELDS; f++) {
+        free(bv->fields[f].values);
+        free(bv->fields[f].maps);
+        free(bv->fields[f].start);
+        free(bv->fields[f].block);
+        free(bv->fields[f].bits);
+    }
+
+    free(bv);
+}
+
+/**
+ * This function allocates zeroed vectors aligned so they can be read a vector at a time.
+ *
+ * @param count the number of vectors
+ *
+ * @return the vectors, or NULL if unsuccessful
+ */
+static bitvec_vec_t *vec_alloc(size_t count) {
+
+    void *mem;
+
+    if (posix_memalign(&mem, BITVEC_ALIGN, (count ? count : 1) * sizeof(bitvec_vec_t)) != 0) {
+        return NULL;
+    }
+
+    memset(mem, 0, count * sizeof(bitvec_vec_t));
+
+    return (bitvec_vec_t *) mem;
+}
+
+/**
+ * This function sets the bit of a rule in a block of a bitmap.
+ *
+ * @param vec the block the rule falls in
+ * @param i the index of the rule
+ */
+static void vec_set(bitvec_vec_t *vec, unsigned int i) {
+
+    (*vec)[i % BITVEC_BLOCK_BITS / BITVEC_WORD_BITS] |= 1ULL << (i % BITVEC_WORD_BITS);
+}
+
+/**
+ * This function builds a full bitmap of each value of a field.
+ *
+ * @param field the field
+ * @param map the index of the value each rule names (.len for a wildcard)
+ * @param n the number of rules
+ * @param blocks the number of vectors in a bitmap
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int field_full(bitvec_field_t *field, unsigned int *map, unsigned int n,
+        unsigned int blocks) {
+
+    field->maps = vec_alloc((size_t) (field->len + 1) * blocks);
+
+    if (!field->maps) {
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < n; i++) {
+        vec_set(&field->maps[(size_t) map[i] * blocks + i / BITVEC_BLOCK_BITS], i);
+    }
+
+    //Rules with a wildcard match every value as well
+    bitvec_vec_t *other = field->maps + (size_t) field->len * blocks;
+
+    for (unsigned int v = 0; v < field->len && field->any; v++) {
+        bitvec_vec_t *vec = field->maps + (size_t) v * blocks;
+
+        for (unsigned int b = 0; b < blocks; b++) {
+            vec[b] |= other[b];
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * This function builds the blocks of each value of a field that have a bit set, and a
+ * full bitmap of the rules with a wildcard for it.
+ *
+ * @param field the field
+ * @param keys the keys of the rules naming a value, as made by field_values()
+ * @param exact the number of keys
+ * @param map the index of the value each rule names (.len for a wildcard)
+ * @param n the number of rules
+ * @param blocks the number of vectors in a bitmap
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int field_sparse(bitvec_field_t *field, uint64_t *keys, unsigned int exact,
+        unsigned int *map, unsigned int n, unsigned int blocks) {
+
+    field->start = (unsigned int *) malloc((field->len + 1) * sizeof(unsigned int));
+    field->block = (unsigned int *) malloc((exact ? exact : 1) * sizeof(unsigned int));
+    field->bits = vec_alloc(exact);
+
+    if (field->any) {
+        field->maps = vec_alloc(blocks);
+    }
+
+    if (!field->start || !field->block || !field->bits || (field->any && !field->maps)) {
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < n && field->any; i++) {
+        if (map[i] == field->len) {
+            vec_set(&field->maps[i / BITVEC_BLOCK_BITS], i);
+        }
+    }
+
+    unsigned int count = 0;
+    unsigned int k = 0;
+
+    for (unsigned int v = 0; v < field->len; v++) {
+        field->start[v] = count;
+
+        for (; k < exact && map[(unsigned int) keys[k]] == v; k++) {
+            unsigned int i = (unsigned int) keys[k];
+            unsigned int b = i / BITVEC_BLOCK_BITS;
+
+            if (count == field->start[v] || field->block[count - 1] != b) {
+                field->block[count++] = b;
+            }
+            vec_set(&field->bits[count - 1], i);
+        }
+    }
+    field->start[field->len] = count;
+
+    return 0;
+}
+
+/**
+ * This function builds a bit-vector index of a policy. For each field it keeps the
+ * distinct values rules match on, each with a bitmap of the rules that match it.
+ *
+ * @param rules the rules in order
+ * @param n the number of rules
+ *
+ * @return the index, or NULL if the policy is too large or memory runs out
+ */
+void *bitvec_build(rule_t *rules, unsigned int n) {
+
+    if (n == 0 || n > BITVEC_MAX_RULES) {
+        return NULL;
+    }
+
+    bitvec_t *bv = (bitvec_t *) calloc(1, sizeof(bitvec_t));
+    uint64_t *keys = (uint64_t *) malloc(n * sizeof(uint64_t));
+    unsigned int *map = (unsigned int *) malloc(n * sizeof(unsigned int));
+
+    if (!bv || !keys || !map) {
+        free(bv);
+        free(keys);
+        free(map);
+        return NULL;
+    }
+
+    bv->blocks = (n + BITVEC_BLOCK_BITS - 1) / BITVEC_BLOCK_BITS;
+
+    size_t bytes = 0;
+    int ret = 0;
+
+    for (int f = 0; f < BITVEC_FIELDS && ret == 0; f++) {
+        bitvec_field_t *field = &bv->fields[f];
+        int exact = field_values(field, rules, n, f, keys, map);
+
+        if (exact == -1) {
+            ret = -1;
+            break;
+        }
+
+        field->sparse = field->len > BITVEC_DENSE_VALUES;
+        if (field->sparse) {
+            bytes += (size_t) exact * (sizeof(bitvec_vec_t) + sizeof(unsigned int))
+                    + (size_t) bv->blocks * sizeof(bitvec_vec_t);
+        } else {
+            bytes += (size_t) (field->len + 1) * bv->blocks * sizeof(bitvec_vec_t);
+        }
+
+        if (bytes > BITVEC_MAX_BYTES) {
+            ret = -1;
+        } else if (field->sparse) {
+            ret = field_sparse(field, keys, exact, map, n, bv->blocks);
+        } else {
+            ret = field_full(field, map, n, bv->blocks);
+        }
+    }
+
+    free(keys);
+    free(map);
+
+    if (ret == -1) {
+        bitvec_free(bv);
+        return NULL;
+    }
+
+    bv->bytes = bytes;
+
+    return bv;
+}
+
+/**
+ * This function ANDs a block of the bitmap a cursor reads into @vec. Blocks must be
+ * asked for in increasing order.
+ *
+ * @param c the cursor
+ * @param b the position of the block
+ * @param vec the bits to be ANDed with the block
+ */
+static inline void cursor_and(bitvec_cursor_t *c, unsigned int b, bitvec_vec_t *vec) {
+
+    if (c->full) {
+        *vec &= c->full[b];
+        return;
+    }
+
+    while (c->at < c->end && c->block[c->at] < b) {
+        c->at++;
+    }
+
+    if (c->at < c->end && c->block[c->at] == b) {
+        *vec &= c->any ? c->bits[c->at] | c->any[b] : c->bits[c->at];
+    } else if (c->any) {
+        *vec &= c->any[b];
+    } else {
+        *vec = (bitvec_vec_t) { 0, 0, 0, 0 };
+    }
+}
+
+/**
+ * This function finds the lowest set bit of a block.
+ *
+ * @param b the position of the block
+ * @param vec the bits of the block
+ *
+ * @return the index of the rule of the lowest set bit, or -1 if no bit is set
+ */
+static inline int vec_first(unsigned int b, const bitvec_vec_t *vec) {
+
+    if (((*vec)[0] | (*vec)[1] | (*vec)[2] | (*vec)[3]) == 0) {
+        return -1;
+    }
+
+    for (int j = 0; j < BITVEC_LANE; j++) {
+        if ((*vec)[j]) {
+            return b * BITVEC_BLOCK_BITS + j * BITVEC_WORD_BITS + __builtin_ctzll((*vec)[j]);
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * This function finds the first rule matching a packet by ANDing the bitmaps of the
+ * packet's field values and taking the lowest set bit.
+ *
+ * @param index the index
+ * @param pkt the packet
+ *
+ * @return the index (from 0) of the first matching rule, or -1
+ */
+int bitvec_lookup(void *index, packet_t *pkt) {
+
+    bitvec_t *bv = (bitvec_t *) index;
+    bitvec_cursor_t cur[BITVEC_FIELDS];
+    int driver = -1;
+
+    for (int f = 0; f < BITVEC_FIELDS; f++) {
+        bitvec_field_t *field = &bv->fields[f];
+        bitvec_cursor_t *c = &cur[f];
+        unsigned int v = value_find(field, packet_value(pkt, f));
+
+        //A value no rule names or wildcards matches nothing
+        if (v == field->len && !field->any) {
+            stats_engine_count(0, 0);
+            return -1;
+        }
+
+        if (!field->sparse) {
+            c->full = field->maps + (size_t) v * bv->blocks;
+            continue;
+        }
+
+        c->full = NULL;
+        c->any = field->maps;
+        c->block = field->block;
+        c->bits = field->bits;
+        c->at = v < field->len ? field->start[v] : 0;
+        c->end = v < field->len ? field->start[v + 1] : 0;
+
+        //Only the blocks of a value no rule wildcards can hold a match, so the
+        //shortest such value decides which blocks are worth looking at
+        if (!field->any && (driver == -1
+                || c->end - c->at < cur[driver].end - cur[driver].at)) {
+            driver = f;
+        }
+    }
+
+    if (driver != -1) {
+        bitvec_cursor_t *d = &cur[driver];
+        unsigned int from = d->at;
+
+        for (; d->at < d->end; d->at++) {
+            unsigned int b = d->block[d->at];
+            bitvec_vec_t vec = d->bits[d->at];
+
+            for (int f = 0; f < BITVEC_FIELDS; f++) {
+                if (f != driver) {
+                    cursor_and(&cur[f], b, &vec);
+                }
+            }
+
+            int i = vec_first(b, &vec);
+            if (i != -1) {
+                stats_engine_count(d->at - from + 1, 0);
+                return i;
+            }
+        }
+
+        stats_engine_count(d->end - from, 0);
+        return -1;
+    }
+
+    for (unsigned int b = 0; b < bv->blocks; b++) {
+        bitvec_vec_t vec = { ~0ULL, ~0ULL, ~0ULL, ~0ULL };
+
+        for (int f = 0; f < BITVEC_FIELDS; f++) {
+            cursor_and(&cur[f], b, &vec);
+        }
+
+        int i = vec_first(b, &vec);
+        if (i != -1) {
+            stats_engine_count(b + 1, 0);
+            return i;
+        }
+    }
+
+    stats_engine_count(bv->blocks, 0);
+    return -1;
+}
+
+/**
+ * This function prints the shape of a bit-vector index.
+ *
+ * @param index the index
+ * @param stream the file stream to print to
+ */
+void bitvec_print(void *index, FILE *stream) {
+
+    static const char *names[BITVEC_FIELDS] = { "protocol", "source address",
+            "source port", "destination address", "destination port" };
+    bitvec_t *bv = (bitvec_t *) index;
+
+    for (int f = 0; f < BITVEC_FIELDS; f++) {
+        fprintf(stream, "Field %s: %u values (%s bitmaps%s)\n", names[f],
+                bv->fields[f].len, bv->fields[f].sparse ? "sparse" : "full",
+                bv->fields[f].any ? ", wildcards" : "");
+    }
+    fprintf(stream, "Memory: %zu KB in blocks of %d rules\n", bv->bytes >> 10,
+            BITVEC_BLOCK_BITS);
+}
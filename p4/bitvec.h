@@ -0,0 +1,56 @@
+/**
+ * @file bitvec.h
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This file acts as the interface for the bitvec.c file
+ */
+
+#ifndef BITVEC_H
+#define BITVEC_H
+
+#include "policy.h"
+
+/** Largest policy the bit-vector engine is built for */
+#define BITVEC_MAX_RULES 32768
+
+/** Largest amount of memory the bitmaps of one index may take */
+#define BITVEC_MAX_BYTES (128UL << 20)
+
+/**
+ * This function builds a bit-vector index of a policy. For each field it keeps the
+ * distinct values rules match on, each with a bitmap of the rules that match it.
+ *
+ * @param rules the rules in order
+ * @param n the number of rules
+ *
+ * @return the index, or NULL if the policy is too large or memory runs out
+ */
+void *bitvec_build(rule_t *rules, unsigned int n);
+
+/**
+ * This function finds the first rule matching a packet by ANDing the bitmaps of the
+ * packet's field values and taking the lowest set bit.
+ *
+ * @param index the index
+ * @param pkt the packet
+ *
+ * @return the index (from 0) of the first matching rule, or -1
+ */
+int bitvec_lookup(void *index, packet_t *pkt);
+
+/**
+ * This function prints the shape of a bit-vector index.
+ *
+ * @param index the index
+ * @param stream the file stream to print to
+ */
+void bitvec_print(void *index, FILE *stream);
+
+/**
+ * This function frees a bit-vector index.
+ *
+ * @param index the index
+ */
+void bitvec_free(void *index);
+
+#endif
@@ -0,0 +1,196 @@
+/**
+ * @file bloom.c
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This component is responsible for telling quickly that no rule can match a packet.
+ * IPv4 rules match exact addresses, a protocol and either exact or wildcard ports, so
+ * the key a rule matches is the packet's key under one of a handful of masks. The
+ * filter keeps the masked key of every rule, and a packet whose key misses under every
+ * mask is certain to fall through to the default policy without the rules being
+ * searched at all. A hit may be a false positive, so it only sends the packet on to
+ * the index or the scan.
+ */
+
+#include <stdlib.h>
+#include "bloom.h"
+
+/** Multipliers the keys are hashed with (64-bit golden ratio and a large odd one) */
+#define BLOOM_HASH_MULT 0x9E3779B97F4A7C15ULL
+#define BLOOM_HASH_MULT2 0xC4CEB9FE1A85EC53ULL
+
+/** Shift that folds the high half of a hash into its low half */
+#define BLOOM_FOLD_SHIFT 32
+
+/** Number of bits in a word of the filter */
+#define BLOOM_WORD_BITS 64
+
+/** Number of bits of the hash that pick a bit within a word */
+#define BLOOM_BIT_SHIFT 6
+
+/** Mask of the bits of the hash that pick a bit within a word */
+#define BLOOM_BIT_MASK (BLOOM_WORD_BITS - 1)
+
+/** Used for turning a ratio into a percentage */
+#define PERCENT 100.0
+
+/**
+ * The hash of a key masked the way the rules of a pattern mask it, before its high half
+ * is folded in. The hash is spelled out as macros since a packet that misses is hashed
+ * once for every pattern.
+ */
+#define BLOOM_HASH(addrs, ports) (((addrs) ^ (ports) * BLOOM_HASH_MULT) \
+        * BLOOM_HASH_MULT2)
+
+/** The word of the filter a hash falls in (picked by its upper half) */
+#define BLOOM_WORD(bloom, h) ((bloom)->words[(h) >> BLOOM_FOLD_SHIFT & (bloom)->mask])
+
+/** The bits a hash sets within its word (picked by its low bits) */
+#define BLOOM_BITS(h) (1ULL << ((h) & BLOOM_BIT_MASK) \
+        | 1ULL << ((h) >> BLOOM_BIT_SHIFT & BLOOM_BIT_MASK) \
+        | 1ULL << ((h) >> 2 * BLOOM_BIT_SHIFT & BLOOM_BIT_MASK) \
+        | 1ULL << ((h) >> 3 * BLOOM_BIT_SHIFT & BLOOM_BIT_MASK))
+
+/**
+ * This function creates an empty filter sized for @capacity rules.
+ *
+ * @param capacity the number of rules
+ *
+ * @return the filter, or NULL if memory runs out
+ */
+bloom_t *bloom_new(unsigned int capacity) {
+
+    if (capacity < BLOOM_MIN_RULES) {
+        capacity = BLOOM_MIN_RULES;
+    }
+
+    uint64_t words = 1;
+    while (words * BLOOM_WORD_BITS < (uint64_t) capacity * BLOOM_BITS_PER_RULE) {
+        words <<= 1;
+    }
+
+    bloom_t *bloom = (bloom_t *) malloc(sizeof(bloom_t));
+    uint64_t *bits = (uint64_t *) calloc(words, sizeof(uint64_t));
+
+    if (!bloom || !bits) {
+        free(bloom);
+        free(bits);
+        return NULL;
+    }
+
+    bloom->words = bits;
+    bloom->mask = words - 1;
+    bloom->capacity = capacity;
+    bloom->patterns = 0;
+
+    return bloom;
+}
+
+/**
+ * This function adds the key of an IPv4 rule to the filter. Only one thread may add
+ * at a time, but any number may probe meanwhile.
+ *
+ * @param bloom the filter
+ * @param match the fields the rule matches
+ *
+ * @return 0 if successful, -1 if the rule's mask would be one pattern too many
+ */
+int bloom_add(bloom_t *bloom, const packet_match_t *match) {
+
+    unsigned int p = 0;
+
+    while (p < bloom->patterns && (bloom->addrs[p] != match->mask.addrs
+            || bloom->ports[p] != match->mask.ports)) {
+        p++;
+    }
+
+    if (p == BLOOM_MAX_PATTERNS) {
+        return -1;
+    }
+
+    uint64_t h = BLOOM_HASH(match->value.addrs, match->value.ports);
+    h ^= h >> BLOOM_FOLD_SHIFT;
+
+    //Readers of older snapshots may see the key early, which only costs them a false
+    //positive; the snapshot holding the rule is published after it is all there
+    __atomic_fetch_or(&BLOOM_WORD(bloom, h), BLOOM_BITS(h), __ATOMIC_RELAXED);
+
+    if (p == bloom->patterns) {
+        __atomic_store_n(&bloom->addrs[p], match->mask.addrs, __ATOMIC_RELAXED);
+        __atomic_store_n(&bloom->ports[p], match->mask.ports, __ATOMIC_RELAXED);
+        __atomic_store_n(&bloom->patterns, p + 1, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+/**
+ * This function checks whether any rule added to the filter might match an IPv4
+ * packet.
+ *
+ * @param bloom the filter
+ * @param pkt the packet
+ *
+ * @return 1 if a rule might match, 0 if none does
+ */
+int bloom_test(const bloom_t *bloom, const packet_t *pkt) {
+
+    unsigned int patterns = __atomic_load_n(&bloom->patterns, __ATOMIC_ACQUIRE);
+
+    for (unsigned int p = 0; p < patterns; p++) {
+        uint64_t addrs = __atomic_load_n(&bloom->addrs[p], __ATOMIC_RELAXED);
+        uint64_t ports = __atomic_load_n(&bloom->ports[p], __ATOMIC_RELAXED);
+        uint64_t h = BLOOM_HASH(pkt->addrs & addrs, pkt->ports & ports);
+        h ^= h >> BLOOM_FOLD_SHIFT;
+        uint64_t bits = BLOOM_BITS(h);
+        uint64_t word = __atomic_load_n(&BLOOM_WORD(bloom, h), __ATOMIC_RELAXED);
+
+        if ((word & bits) == bits) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * This function prints the size and fill of the filter, and the rate of false
+ * positives a probe can expect from it.
+ *
+ * @param bloom the filter
+ * @param stream the file stream to print to
+ */
+void bloom_print(const bloom_t *bloom, FILE *stream) {
+
+    uint64_t words = bloom->mask + 1;
+    uint64_t set = 0;
+
+    for (uint64_t i = 0; i < words; i++) {
+        uint64_t word = __atomic_load_n(&bloom->words[i], __ATOMIC_RELAXED);
+        set += __builtin_popcountll(word);
+    }
+
+    double fill = (double) set / (words * BLOOM_WORD_BITS);
+    double fpr = 1.0;
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        fpr *= fill;
+    }
+
+    fprintf(stream, "Filter size: %lu bits for %u rules, %u patterns, %.2f%% of bits set "
+            "(%.4f%% false positives expected per probe)\n",
+            (unsigned long) (words * BLOOM_WORD_BITS), bloom->capacity,
+            __atomic_load_n(&bloom->patterns, __ATOMIC_RELAXED), PERCENT * fill,
+            PERCENT * fpr);
+}
+
+/**
+ * This function frees a filter.
+ *
+ * @param bloom the filter, or NULL
+ */
+void bloom_free(bloom_t *bloom) {
+
+    if (bloom) {
+        free(bloom->words);
+        free(bloom);
+    }
+}
@@ -0,0 +1,94 @@
+/**
+ * @file bloom.h
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This file acts as the interface for the bloom.c file
+ */
+
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdio.h>
+#include "packet.h"
+
+/** Number of bits of the filter given to each rule it is sized for */
+#define BLOOM_BITS_PER_RULE 16
+
+/** Number of bits set for each key, all within one word */
+#define BLOOM_HASHES 4
+
+/** Fewest rules a filter is sized for */
+#define BLOOM_MIN_RULES 256
+
+/** Most distinct masks (wildcard patterns) the rules of a filter may have */
+#define BLOOM_MAX_PATTERNS 8
+
+/**
+ * Representation of a blocked Bloom filter of the IPv4 keys rules match. Each key sets
+ * BLOOM_HASHES bits of a single word, so a probe costs one memory access. A packet is
+ * probed once for each distinct mask the rules use, masked the way those rules mask it.
+ * Bits and patterns are only ever added, so readers may probe while the writer adds.
+ * .words: the bits
+ * .mask: the number of words less one
+ * .capacity: the number of rules the filter is sized for
+ * .patterns: the number of distinct masks
+ * .addrs: the address mask of each pattern
+ * .ports: the port mask of each pattern
+ */
+typedef struct bloom {
+    uint64_t *words;
+    uint64_t mask;
+    unsigned int capacity;
+    unsigned int patterns;
+    uint64_t addrs[BLOOM_MAX_PATTERNS];
+    uint64_t ports[BLOOM_MAX_PATTERNS];
+} bloom_t;
+
+/**
+ * This function creates an empty filter sized for @capacity rules.
+ *
+ * @param capacity the number of rules
+ *
+ * @return the filter, or NULL if memory runs out
+ */
+bloom_t *bloom_new(unsigned int capacity);
+
+/**
+ * This function adds the key of an IPv4 rule to the filter. Only one thread may add
+ * at a time, but any number may probe meanwhile.
+ *
+ * @param bloom the filter
+ * @param match the fields the rule matches
+ *
+ * @return 0 if successful, -1 if the rule's mask would be one pattern too many
+ */
+int bloom_add(bloom_t *bloom, const packet_match_t *match);
+
+/**
+ * This function checks whether any rule added to the filter might match an IPv4
+ * packet.
+ *
+ * @param bloom the filter
+ * @param pkt the packet
+ *
+ * @return 1 if a rule might match, 0 if none does
+ */
+int bloom_test(const bloom_t *bloom, const packet_t *pkt);
+
+/**
+ * This function prints the size and fill of the filter, and the rate of false
+ * positives a probe can expect from it.
+ *
+ * @param bloom the filter
+ * @param stream the file stream to print to
+ */
+void bloom_print(const bloom_t *bloom, FILE *stream);
+
+/**
+ * This function frees a filter.
+ *
+ * @param bloom the filter, or NULL
+ */
+void bloom_free(bloom_t *bloom);
+
+#endif
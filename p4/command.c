@@ -27,6 +27,139 @@
 /** Constant for the tokens of the ip */
 #define IP_TOKENS 5
 
+/** Turns a number into a string literal */
+#define STRINGIFY(x) #x
+
+/** Turns the value of a macro into a string literal */
+#define STRINGIFY_VALUE(x) STRINGIFY(x)
+
+/** Conversion reading one token of at most TOKEN_MAX characters */
+#define TOKEN_FORMAT "%" STRINGIFY_VALUE(TOKEN_MAX) "s"
+
+/**
+ * This function parses a port, or * if it is accepted.
+ *
+ * @param text the text of the port
+ * @param port the value to be updated with the port
+ * @param any whether * is accepted as the port
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int parse_port(char *text, port_match_t *port, int any) {
+
+    unsigned int value;
+    if (text[0] == '*') {
+        if (!any) {
+            return -1;
+        }
+        *port = MATCH_PORT_ANY;
+    } else if (sscanf(text, "%u", &value) != 1 || value > PORT_MAX) {
+        return -1;
+    } else {
+        *port = value;
+    }
+
+    return 0;
+}
+
+/**
+ * This function parses an a.b.c.d:port or [address]:port token. Only a rule (@any)
+ * may give an IPv6 prefix.
+ *
+ * @param token the token
+ * @param ep the endpoint to be populated
+ * @param any whether * is accepted as the port
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int parse_endpoint(char *token, fw_endpoint_t *ep, int any) {
+
+    if (token[0] == '[') {
+        char *close = strchr(token, ']');
+
+        if (!close || close[1] != ':'
+                || ipv6_parse(token + 1, close - token - 1, &ep->ip6,
+                        any ? &ep->prefix : NULL) == -1) {
+            return -1;
+        }
+
+        if (!any) {
+            ep->prefix = IPV6_BITS;
+        }
+        ep->v6 = 1;
+        ep->ip = 0;
+
+        return parse_port(close + 2, &ep->port, any);
+    }
+
+    char text[PORT_SIZE];
+    unsigned int nums[NUMS_SIZE];
+    if (sscanf(token, "%u.%u.%u.%u:%9s", &nums[0], &nums[1], &nums[2],
+            &nums[INDEX3], text) != IP_TOKENS) {
+        return -1;
+    }
+
+    if (nums[0] > IP_OCTET_MAX || nums[0] < IP_OCTET_MIN
+            || nums[1] > IP_OCTET_MAX || nums[1] < IP_OCTET_MIN
+            || nums[2] > IP_OCTET_MAX || nums[2] < IP_OCTET_MIN
+            || nums[INDEX3] > IP_OCTET_MAX || nums[INDEX3] < IP_OCTET_MIN) {
+        return -1;
+    }
+
+    ep->v6 = 0;
+    ep->ip = ipaddr_pack(nums);
+
+    return parse_port(text, &ep->port, any);
+}
+
+/**
+ * This function builds the match of a rule, or of a test packet, from its endpoints.
+ *
+ * @param protocol the protocol
+ * @param src the source endpoint
+ * @param dst the destination endpoint
+ * @param match the value to be updated with the match
+ * @param match6 the value to be updated with the match of IPv6 addresses (zeroed for
+ * IPv4 endpoints)
+ *
+ * @return 0 if successful, -1 if the endpoints are of different families
+ */
+int endpoint_match(protocol_t protocol, fw_endpoint_t *src, fw_endpoint_t *dst,
+        packet_match_t *match, match6_t *match6) {
+
+    if (src->v6 != dst->v6) {
+        return -1;
+    }
+
+    if (src->v6) {
+        *match = packet_match_key6(protocol, &src->ip6, src->prefix, src->port,
+                &dst->ip6, dst->prefix, dst->port, match6);
+    } else {
+        *match = packet_match_key(protocol, src->ip, src->port, dst->ip, dst->port);
+        memset(match6, 0, sizeof(*match6));
+    }
+
+    return 0;
+}
+
+/**
+ * This function finds the packet a test command tests.
+ *
+ * @param cmd the test command
+ *
+ * @return the packet; its .key is the whole of an IPv4 packet
+ */
+packet6_t command_packet(const fw_cmd_t *cmd) {
+
+    packet6_t pkt;
+
+    pkt.key = cmd->match.value;
+    pkt.src = cmd->match6.src;
+    pkt.dst = cmd->match6.dst;
+
+    return pkt;
+}
+
 /**
  * This function will parse the next command from stream and populate the fw_cmd_t structure.
  *
@@ -48,17 +181,23 @@ int parse_command(FILE *stream, fw_cmd_t *cmd) {
             break;
         }
 
-        buffer[i++] = ch;
+        //The rest of an overlong line is dropped
+        if (i < LINE_SIZE - 1) {
+            buffer[i++] = ch;
+        }
     }
 
     //Null terminator
     buffer[i] = '\0';
 
-    char buff[TOKENS][EST_LINE];
-    int tokens = sscanf(buffer, "%s %s %s %s %s %s", buff[0], buff[1], buff[2],
+    //Tokens a line leaves out read as empty
+    char buff[TOKENS][EST_LINE] = { "" };
+    int tokens = sscanf(buffer, TOKEN_FORMAT " " TOKEN_FORMAT " " TOKEN_FORMAT " "
+            TOKEN_FORMAT " " TOKEN_FORMAT " " TOKEN_FORMAT, buff[0], buff[1], buff[2],
             buff[INDEX3], buff[INDEX4], buff[INDEX5]);
 
-    if (tokens == 0) {
+    //A blank line, or none at the end of the stream
+    if (tokens < 1) {
         return 0;
     }
 
@@ -81,6 +220,7 @@ int parse_command(FILE *stream, fw_cmd_t *cmd) {
     //For INSERT
     else if (strcmp(buff[0], "insert") == 0) {
         cmd->cmd = INSERT;
+        protocol_t protocol;
 
         //POS
         if (sscanf(buff[1], "%d", &cmd->pos) != 1) {
@@ -97,68 +237,19 @@ int parse_command(FILE *stream, fw_cmd_t *cmd) {
 
         //PROTOCOL
         if (strcmp(buff[INDEX3], "tcp") == 0) {
-            cmd->protocol = PROTO_TCP;
+            protocol = PROTO_TCP;
         } else if (strcmp(buff[INDEX3], "udp") == 0) {
-            cmd->protocol = PROTO_UDP;
-        } else {
-            return -1;
-        }
-
-        //SRC
-        char port[PORT_SIZE];
-        unsigned int nums[NUMS_SIZE];
-        if (sscanf(buff[INDEX4], "%u.%u.%u.%u:%s", &nums[0], &nums[1], &nums[2],
-                &nums[INDEX3], port) != IP_TOKENS) {
-            return -1;
-        }
-
-        if (nums[0] > IP_OCTET_MAX || nums[0] < IP_OCTET_MIN
-                || nums[1] > IP_OCTET_MAX || nums[1] < IP_OCTET_MIN
-                || nums[2] > IP_OCTET_MAX || nums[2] < IP_OCTET_MIN
-                || nums[INDEX3] > IP_OCTET_MAX || nums[INDEX3] < IP_OCTET_MIN) {
-            return -1;
-        }
-
-        cmd->src_ip.a = nums[0];
-        cmd->src_ip.b = nums[1];
-        cmd->src_ip.c = nums[2];
-        cmd->src_ip.d = nums[INDEX3];
-
-        if (port[0] == '*') {
-            cmd->src_port = MATCH_PORT_ANY;
-        } else if (sscanf(port, "%u", &cmd->src_port) == 1) {
-            if (cmd->src_port > PORT_MAX || cmd->src_port < PORT_MIN) {
-                return -1;
-            }
+            protocol = PROTO_UDP;
         } else {
             return -1;
         }
 
-        //DST
-        if (sscanf(buff[INDEX5], "%u.%u.%u.%u:%s", &nums[0], &nums[1], &nums[2],
-                &nums[INDEX3], port) != IP_TOKENS) {
-            return -1;
-        }
-
-        if (nums[0] > IP_OCTET_MAX || nums[0] < IP_OCTET_MIN
-                || nums[1] > IP_OCTET_MAX || nums[1] < IP_OCTET_MIN
-                || nums[2] > IP_OCTET_MAX || nums[2] < IP_OCTET_MIN
-                || nums[INDEX3] > IP_OCTET_MAX || nums[INDEX3] < IP_OCTET_MIN) {
-            return -1;
-        }
-
-        cmd->dst_ip.a = nums[0];
-        cmd->dst_ip.b = nums[1];
-        cmd->dst_ip.c = nums[2];
-        cmd->dst_ip.d = nums[INDEX3];
-
-        if (port[0] == '*') {
-            cmd->dst_port = MATCH_PORT_ANY;
-        } else if (sscanf(port, "%u", &cmd->dst_port) == 1) {
-            if (cmd->dst_port > PORT_MAX || cmd->dst_port < PORT_MIN) {
-                return -1;
-            }
-        } else {
+        //SRC and DST
+        fw_endpoint_t src, dst;
+        if (parse_endpoint(buff[INDEX4], &src, 1) == -1
+                || parse_endpoint(buff[INDEX5], &dst, 1) == -1
+                || endpoint_match(protocol, &src, &dst, &cmd->match,
+                        &cmd->match6) == -1) {
             return -1;
         }
 
@@ -168,6 +259,7 @@ int parse_command(FILE *stream, fw_cmd_t *cmd) {
     //For APPEND
     else if (strcmp(buff[0], "append") == 0) {
         cmd->cmd = APPEND;
+        protocol_t protocol;
 
         //ACTION
         if (strcmp(buff[1], "allow") == 0) {
@@ -178,68 +270,19 @@ int parse_command(FILE *stream, fw_cmd_t *cmd) {
 
         //PROTOCOL
         if (strcmp(buff[2], "tcp") == 0) {
-            cmd->protocol = PROTO_TCP;
+            protocol = PROTO_TCP;
         } else if (strcmp(buff[2], "udp") == 0) {
-            cmd->protocol = PROTO_UDP;
-        } else {
-            return -1;
-        }
-
-        //SRC
-        char port[PORT_SIZE];
-        unsigned int nums[INDEX4];
-        if (sscanf(buff[INDEX3], "%u.%u.%u.%u:%s", &nums[0], &nums[1], &nums[2],
-                &nums[INDEX3], port) != IP_TOKENS) {
-            return -1;
-        }
-
-        if (nums[0] > IP_OCTET_MAX || nums[0] < IP_OCTET_MIN
-                || nums[1] > IP_OCTET_MAX || nums[1] < IP_OCTET_MIN
-                || nums[2] > IP_OCTET_MAX || nums[2] < IP_OCTET_MIN
-                || nums[INDEX3] > IP_OCTET_MAX || nums[INDEX3] < IP_OCTET_MIN) {
-            return -1;
-        }
-
-        cmd->src_ip.a = nums[0];
-        cmd->src_ip.b = nums[1];
-        cmd->src_ip.c = nums[2];
-        cmd->src_ip.d = nums[INDEX3];
-
-        if (port[0] == '*') {
-            cmd->src_port = MATCH_PORT_ANY;
-        } else if (sscanf(port, "%u", &cmd->src_port) == 1) {
-            if (cmd->src_port > PORT_MAX || cmd->src_port < PORT_MIN) {
-                return -1;
-            }
+            protocol = PROTO_UDP;
         } else {
             return -1;
         }
 
-        //DST
-        if (sscanf(buff[INDEX4], "%u.%u.%u.%u:%s", &nums[0], &nums[1], &nums[2],
-                &nums[INDEX3], port) != IP_TOKENS) {
-            return -1;
-        }
-
-        if (nums[0] > IP_OCTET_MAX || nums[0] < IP_OCTET_MIN
-                || nums[1] > IP_OCTET_MAX || nums[1] < IP_OCTET_MIN
-                || nums[2] > IP_OCTET_MAX || nums[2] < IP_OCTET_MIN
-                || nums[INDEX3] > IP_OCTET_MAX || nums[INDEX3] < IP_OCTET_MIN) {
-            return -1;
-        }
-
-        cmd->dst_ip.a = nums[0];
-        cmd->dst_ip.b = nums[1];
-        cmd->dst_ip.c = nums[2];
-        cmd->dst_ip.d = nums[INDEX3];
-
-        if (port[0] == '*') {
-            cmd->dst_port = MATCH_PORT_ANY;
-        } else if (sscanf(port, "%u", &cmd->dst_port) == 1) {
-            if (cmd->dst_port > PORT_MAX || cmd->dst_port < PORT_MIN) {
-                return -1;
-            }
-        } else {
+        //SRC and DST
+        fw_endpoint_t src, dst;
+        if (parse_endpoint(buff[INDEX3], &src, 1) == -1
+                || parse_endpoint(buff[INDEX4], &dst, 1) == -1
+                || endpoint_match(protocol, &src, &dst, &cmd->match,
+                        &cmd->match6) == -1) {
             return -1;
         }
 
@@ -262,93 +305,160 @@ int parse_command(FILE *stream, fw_cmd_t *cmd) {
     //For TEST
     else if (strcmp(buff[0], "test") == 0) {
         cmd->cmd = TEST;
+        protocol_t protocol;
 
         if (strcmp(buff[1], "tcp") == 0) {
-            cmd->protocol = PROTO_TCP;
+            protocol = PROTO_TCP;
         } else if (strcmp(buff[1], "udp") == 0) {
-            cmd->protocol = PROTO_UDP;
+            protocol = PROTO_UDP;
         } else {
             return -1;
         }
 
-        //For SRC
-        char port[PORT_SIZE];
-        unsigned int nums[NUMS_SIZE];
-        if (sscanf(buff[2], "%u.%u.%u.%u:%s", &nums[0], &nums[1], &nums[2],
-                &nums[INDEX3], port) != IP_TOKENS) {
+        //SRC and DST
+        fw_endpoint_t src, dst;
+        if (parse_endpoint(buff[2], &src, 0) == -1
+                || parse_endpoint(buff[INDEX3], &dst, 0) == -1
+                || endpoint_match(protocol, &src, &dst, &cmd->match,
+                        &cmd->match6) == -1) {
             return -1;
         }
 
-        if (nums[0] > IP_OCTET_MAX || nums[0] < IP_OCTET_MIN
-                || nums[1] > IP_OCTET_MAX || nums[1] < IP_OCTET_MIN
-                || nums[2] > IP_OCTET_MAX || nums[2] < IP_OCTET_MIN
-                || nums[INDEX3] > IP_OCTET_MAX || nums[INDEX3] < IP_OCTET_MIN) {
+        return 0;
+    }
+
+    //For PRINT
+    else if (strcmp(buff[0], "print") == 0) {
+        cmd->cmd = PRINT;
+
+        if (strcmp(buff[1], "all") == 0) {
+            cmd->pos = -1;
+        } else if (strcmp(buff[1], "counts") == 0) {
+            cmd->pos = PRINT_COUNTS;
+        } else if (sscanf(buff[1], "%d", &cmd->pos) != 1) {
+            //PRINT ERROR
             return -1;
         }
 
-        cmd->src_ip.a = nums[0];
-        cmd->src_ip.b = nums[1];
-        cmd->src_ip.c = nums[2];
-        cmd->src_ip.d = nums[INDEX3];
+        return 0;
+    }
 
-        if (port[0] == '*') {
-            cmd->src_port = MATCH_PORT_ANY;
-        } else if (sscanf(port, "%u", &cmd->src_port) != 1) {
-            return -1;
+    //For HELP
+    else if (strcmp(buff[0], "help") == 0) {
+        cmd->cmd = HELP;
+
+        return 0;
+    }
+
+    //For STATS
+    else if (strcmp(buff[0], "stats") == 0) {
+        cmd->cmd = STATS;
+        cmd->pos = 0;
+
+        if (tokens > 1) {
+            if (strcmp(buff[1], "latency") == 0) {
+                cmd->pos = STATS_LATENCY;
+            } else if (strcmp(buff[1], "engine") == 0) {
+                cmd->pos = STATS_ENGINE;
+            } else if (strcmp(buff[1], "conntrack") == 0) {
+                cmd->pos = STATS_CONNTRACK;
+            } else if (strcmp(buff[1], "pipeline") == 0) {
+                cmd->pos = STATS_PIPELINE;
+            } else if (strcmp(buff[1], "filter") == 0) {
+                cmd->pos = STATS_FILTER;
+            } else {
+                return -1;
+            }
         }
 
-        if (cmd->src_port > PORT_MAX || cmd->src_port < PORT_MIN) {
-            return -1;
+        return 0;
+    }
+
+    //For OPTIMIZE
+    else if (strcmp(buff[0], "optimize") == 0) {
+        cmd->cmd = OPTIMIZE;
+        cmd->pos = 0;
+
+        if (tokens > 1) {
+            if (strcmp(buff[1], "apply") == 0) {
+                cmd->pos = OPTIMIZE_APPLY;
+            } else {
+                return -1;
+            }
         }
 
-        //For DST
-        if (sscanf(buff[INDEX3], "%u.%u.%u.%u:%s", &nums[0], &nums[1], &nums[2],
-                &nums[INDEX3], port) != IP_TOKENS) {
+        return 0;
+    }
+
+    //For REORDER
+    else if (strcmp(buff[0], "reorder") == 0) {
+        cmd->cmd = REORDER;
+
+        if (tokens > 1) {
             return -1;
         }
 
-        if (nums[0] > IP_OCTET_MAX || nums[0] < IP_OCTET_MIN
-                || nums[1] > IP_OCTET_MAX || nums[1] < IP_OCTET_MIN
-                || nums[2] > IP_OCTET_MAX || nums[2] < IP_OCTET_MIN
-                || nums[INDEX3] > IP_OCTET_MAX || nums[INDEX3] < IP_OCTET_MIN) {
+        return 0;
+    }
+
+    //For TOP
+    else if (strcmp(buff[0], "top") == 0) {
+        cmd->cmd = TOP;
+        cmd->pos = 0;
+
+        //COUNT
+        if (tokens > 1 && (sscanf(buff[1], "%d", &cmd->pos) != 1 || cmd->pos <= 0)) {
             return -1;
         }
 
-        cmd->dst_ip.a = nums[0];
-        cmd->dst_ip.b = nums[1];
-        cmd->dst_ip.c = nums[2];
-        cmd->dst_ip.d = nums[INDEX3];
+        return 0;
+    }
+
+    //For BEGIN, COMMIT and ABORT
+    else if (strcmp(buff[0], "begin") == 0 || strcmp(buff[0], "commit") == 0
+            || strcmp(buff[0], "abort") == 0) {
+        cmd->cmd = buff[0][0] == 'b' ? BEGIN : buff[0][0] == 'c' ? COMMIT : ABORT;
 
-        if (port[0] == '*') {
-            cmd->dst_port = MATCH_PORT_ANY;
-        } else if (sscanf(port, "%u", &cmd->dst_port) != 1) {
+        if (tokens > 1) {
             return -1;
         }
 
-        if (cmd->dst_port > PORT_MAX || cmd->dst_port < PORT_MIN) {
+        return 0;
+    }
+
+    //For MEM
+    else if (strcmp(buff[0], "mem") == 0) {
+        cmd->cmd = MEM;
+
+        if (tokens > 1) {
             return -1;
         }
 
         return 0;
     }
 
-    //For PRINT
-    else if (strcmp(buff[0], "print") == 0) {
-        cmd->cmd = PRINT;
+    //For SAVE, LOAD and PUBLISH
+    else if (strcmp(buff[0], "save") == 0 || strcmp(buff[0], "load") == 0
+            || strcmp(buff[0], "publish") == 0) {
+        cmd->cmd = buff[0][0] == 's' ? SAVE : buff[0][0] == 'l' ? LOAD : PUBLISH;
 
-        if (strcmp(buff[1], "all") == 0) {
-            cmd->pos = -1;
-        } else if (sscanf(buff[1], "%d", &cmd->pos) != 1) {
-            //PRINT ERROR
+        if (tokens < 2) {
             return -1;
         }
 
+        strcpy(cmd->file, buff[1]);
+
         return 0;
     }
 
-    //For HELP
-    else if (strcmp(buff[0], "help") == 0) {
-        cmd->cmd = HELP;
+    //For TICK
+    else if (strcmp(buff[0], "tick") == 0) {
+        cmd->cmd = TICK;
+
+        //SECONDS
+        if (sscanf(buff[1], "%d", &cmd->pos) != 1 || cmd->pos < 0) {
+            return -1;
+        }
 
         return 0;
     }
@@ -28,15 +28,63 @@
 #define HELP 7
 /** Constant used for Quit command */
 #define QUIT 8
+/** Constant used for Stats command */
+#define STATS 9
+/** Constant used for Optimize command */
+#define OPTIMIZE 10
+/** Constant used for Save command */
+#define SAVE 11
+/** Constant used for Load command */
+#define LOAD 12
+/** Constant used for Tick command */
+#define TICK 13
+/** Constant used for Reorder command */
+#define REORDER 14
+/** Constant used for Mem command */
+#define MEM 15
+/** Constant used for Publish command */
+#define PUBLISH 16
+/** Constant used for Top command */
+#define TOP 17
+/** Constant used for Begin command */
+#define BEGIN 18
+/** Constant used for Commit command */
+#define COMMIT 19
+/** Constant used for Abort command */
+#define ABORT 20
+
+/** Position used by the Print command to show hit counts next to every rule */
+#define PRINT_COUNTS -2
+
+/** Position used by the Stats command to show the latency histogram */
+#define STATS_LATENCY 1
+
+/** Position used by the Stats command to show the classification engine's index */
+#define STATS_ENGINE 2
+
+/** Position used by the Stats command to show the connection table */
+#define STATS_CONNTRACK 3
+
+/** Position used by the Stats command to show the throughput of each pipeline stage */
+#define STATS_PIPELINE 4
+
+/** Position used by the Stats command to show the filter checked before the engine */
+#define STATS_FILTER 5
+
+/** Position used by the Optimize command to remove the rules it finds */
+#define OPTIMIZE_APPLY 1
 
 /** Constant used for the size of the line */
-#define LINE_SIZE 128
+#define LINE_SIZE 256
 
 /** Constant used for the number of tokens */
 #define TOKENS 6
 
+/** Longest token kept from a line; the rest of a longer token is dropped */
+#define TOKEN_MAX 63
+
 /** Constant used for an estimated line length from the input */
-#define EST_LINE 40
+#define EST_LINE (TOKEN_MAX + 1)
 
 /** Representation for a command that has been parsed. */
 typedef struct fw_cmd {
@@ -44,14 +92,54 @@ typedef struct fw_cmd {
     int cmd;
     unsigned int action;
     int pos;
-    protocol_t protocol;
-    ipaddr_t src_ip;
-    port_match_t src_port;
-    ipaddr_t dst_ip;
-    port_match_t dst_port;
+    packet_match_t match;
+    match6_t match6;
+    char file[EST_LINE];
 
 } fw_cmd_t;
 
+/**
+ * Representation of one side of a rule or packet as written in a command, either
+ * a.b.c.d:port or [address]:port for IPv6, where a rule may give a prefix as
+ * [address/length]:port
+ * .v6: 1 for an IPv6 address, 0 for IPv4
+ * .ip: the packed IPv4 address
+ * .ip6: the IPv6 address
+ * .prefix: the length of the IPv6 prefix
+ * .port: the port, or MATCH_PORT_ANY
+ */
+typedef struct fw_endpoint {
+    int v6;
+    uint32_t ip;
+    ipv6_t ip6;
+    int prefix;
+    port_match_t port;
+} fw_endpoint_t;
+
+/**
+ * This function builds the match of a rule, or of a test packet, from its endpoints.
+ *
+ * @param protocol the protocol
+ * @param src the source endpoint
+ * @param dst the destination endpoint
+ * @param match the value to be updated with the match
+ * @param match6 the value to be updated with the match of IPv6 addresses (zeroed for
+ * IPv4 endpoints)
+ *
+ * @return 0 if successful, -1 if the endpoints are of different families
+ */
+int endpoint_match(protocol_t protocol, fw_endpoint_t *src, fw_endpoint_t *dst,
+        packet_match_t *match, match6_t *match6);
+
+/**
+ * This function finds the packet a test command tests.
+ *
+ * @param cmd the test command
+ *
+ * @return the packet; its .key is the whole of an IPv4 packet
+ */
+packet6_t command_packet(const fw_cmd_t *cmd);
+
 /**
  * This function will parse the next command from stream and populate the fw_cmd_t structure.
  *
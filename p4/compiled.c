@@ -0,0 +1,256 @@
+/**
+ * @file compiled.c
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This component is responsible for turning a policy into C source for a shared object
+ * and for loading such a shared object back into the policy. The generated matcher
+ * hard-codes every rule, so the compiler sees the whole policy as constants and no
+ * data structure is walked to classify a packet. Rules match the protocol and both
+ * addresses exactly, so the matcher switches on those and only compares ports, in
+ * policy order, among the rules that share them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <dlfcn.h>
+#include "compiled.h"
+
+/**
+ * Representation of a rule being sorted into the switch statements
+ * .rule: the rule, packed
+ * .pos: the index of the rule in the policy
+ */
+typedef struct compiled_rule {
+    image_rule_t rule;
+    int pos;
+} compiled_rule_t;
+
+/**
+ * This function sorts rules by protocol, source address, destination address and then
+ * policy order.
+ *
+ * @param a the first rule
+ * @param b the second rule
+ *
+ * @return negative, zero or positive as @a sorts before, with or after @b
+ */
+static int compiled_cmp(const void *a, const void *b) {
+
+    const compiled_rule_t *x = (const compiled_rule_t *) a;
+    const compiled_rule_t *y = (const compiled_rule_t *) b;
+
+    if (x->rule.protocol != y->rule.protocol) {
+        return x->rule.protocol < y->rule.protocol ? -1 : 1;
+    }
+
+    if (x->rule.src_ip != y->rule.src_ip) {
+        return x->rule.src_ip < y->rule.src_ip ? -1 : 1;
+    }
+
+    if (x->rule.dst_ip != y->rule.dst_ip) {
+        return x->rule.dst_ip < y->rule.dst_ip ? -1 : 1;
+    }
+
+    return x->pos - y->pos;
+}
+
+/**
+ * This function writes the port comparisons of the rules that share a protocol and
+ * both addresses. A rule with no exact port matches every packet that gets to it, so
+ * nothing after it is written.
+ *
+ * @param stream the file stream to write to
+ * @param rules the rules in policy order
+ * @param n the number of rules
+ */
+static void write_ports(FILE *stream, compiled_rule_t *rules, int n) {
+
+    for (int i = 0; i < n; i++) {
+        image_rule_t *r = &rules[i].rule;
+
+        if (r->src_port == MATCH_PORT_ANY && r->dst_port == MATCH_PORT_ANY) {
+            fprintf(stream, "        return %d;\n", rules[i].pos);
+            return;
+        }
+
+        if (r->src_port == MATCH_PORT_ANY) {
+            fprintf(stream, "        if (dst_port == %d) return %d;\n", r->dst_port,
+                    rules[i].pos);
+        } else if (r->dst_port == MATCH_PORT_ANY) {
+            fprintf(stream, "        if (src_port == %d) return %d;\n", r->src_port,
+                    rules[i].pos);
+        } else {
+            fprintf(stream, "        if (src_port == %d && dst_port == %d) return %d;\n",
+                    r->src_port, r->dst_port, rules[i].pos);
+        }
+    }
+
+    fprintf(stream, "        return -1;\n");
+}
+
+/**
+ * This function writes a policy as C source for a shared object. The source exports
+ * the rules in their image form along with fw_match(), which hard-codes the rules as
+ * switch statements on the protocol and packed addresses followed by comparisons on
+ * the ports, in policy order. Only IPv4 rules can be hard-coded, so nothing is written
+ * for a policy with IPv6 rules.
+ *
+ * @param stream the file stream to write to
+ * @param rules the rules of the policy in order
+ * @param len the number of rules
+ * @param def the default policy
+ * @param source the name of the rules file, for the comment at the top
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+int compiled_write(FILE *stream, rule_t *rules, int len, unsigned int def,
+        char *source) {
+
+    if (len < 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < len; i++) {
+        if (PACKET_IS_V6(rules[i].match.value)) {
+            return -1;
+        }
+    }
+
+    compiled_rule_t *sorted = (compiled_rule_t *) malloc(
+            (len ? len : 1) * sizeof(compiled_rule_t));
+
+    if (!sorted) {
+        return -1;
+    }
+
+    for (int i = 0; i < len; i++) {
+        rule_pack(&rules[i], &sorted[i].rule);
+        sorted[i].pos = i;
+    }
+
+    fprintf(stream, "/*\n"
+            " * Generated by fwcompile from %s; do not edit.\n"
+            " *\n"
+            " * Build it with:  cc -O2 -shared -fPIC <this file> -o <name>.so\n"
+            " * and load it with:  fwsim --compiled ./<name>.so\n"
+            " */\n\n", source);
+    fprintf(stream, "#include <stdint.h>\n\n");
+    fprintf(stream, "/* A rule, laid out as image_rule_t */\n"
+            "struct fw_rule {\n"
+            "    uint32_t src_ip;\n"
+            "    uint32_t dst_ip;\n"
+            "    int32_t src_port;\n"
+            "    int32_t dst_port;\n"
+            "    uint16_t protocol;\n"
+            "    uint16_t action;\n"
+            "};\n\n");
+    fprintf(stream, "const uint32_t fw_abi = %d;\n", COMPILED_ABI);
+    fprintf(stream, "const uint32_t fw_rule_size = sizeof(struct fw_rule);\n");
+    fprintf(stream, "const uint32_t fw_default = %u;\n", def);
+    fprintf(stream, "const uint32_t fw_count = %d;\n\n", len);
+
+    fprintf(stream, "const struct fw_rule fw_rules[%d] = {\n", len ? len : 1);
+    for (int i = 0; i < len; i++) {
+        image_rule_t *r = &sorted[i].rule;
+        fprintf(stream, "    { 0x%08xu, 0x%08xu, %d, %d, %u, %u },\n", r->src_ip,
+                r->dst_ip, r->src_port, r->dst_port, r->protocol, r->action);
+    }
+    fprintf(stream, "};\n");
+
+    qsort(sorted, len, sizeof(compiled_rule_t), compiled_cmp);
+
+    //One function for each protocol and source address keeps every function small
+    //enough for the compiler to optimize whole
+    int funcs = 0;
+    for (int lo = 0, hi; lo < len; lo = hi) {
+        for (hi = lo; hi < len && sorted[hi].rule.protocol == sorted[lo].rule.protocol
+                && sorted[hi].rule.src_ip == sorted[lo].rule.src_ip; hi++);
+
+        fprintf(stream, "\nstatic int match_%d(uint32_t src_port, uint32_t dst_ip,"
+                " uint32_t dst_port) {\n", funcs++);
+        fprintf(stream, "    switch (dst_ip) {\n");
+
+        for (int a = lo, b; a < hi; a = b) {
+            for (b = a; b < hi && sorted[b].rule.dst_ip == sorted[a].rule.dst_ip; b++);
+
+            fprintf(stream, "    case 0x%08xu:\n", sorted[a].rule.dst_ip);
+            write_ports(stream, sorted + a, b - a);
+        }
+
+        fprintf(stream, "    }\n    return -1;\n}\n");
+    }
+
+    fprintf(stream, "\nint fw_match(uint32_t protocol, uint32_t src_ip, uint32_t src_port,"
+            " uint32_t dst_ip,\n        uint32_t dst_port) {\n");
+    fprintf(stream, "    switch (protocol) {\n");
+
+    funcs = 0;
+    for (int lo = 0, hi; lo < len; lo = hi) {
+        for (hi = lo; hi < len && sorted[hi].rule.protocol == sorted[lo].rule.protocol;
+                hi++);
+
+        fprintf(stream, "    case %u:\n", sorted[lo].rule.protocol);
+        fprintf(stream, "        switch (src_ip) {\n");
+
+        for (int a = lo, b; a < hi; a = b) {
+            for (b = a; b < hi && sorted[b].rule.src_ip == sorted[a].rule.src_ip; b++);
+
+            fprintf(stream, "        case 0x%08xu: return match_%d(src_port, dst_ip,"
+                    " dst_port);\n", sorted[a].rule.src_ip, funcs++);
+        }
+
+        fprintf(stream, "        }\n        break;\n");
+    }
+
+    fprintf(stream, "    }\n    return -1;\n}\n");
+
+    free(sorted);
+
+    return ferror(stream) ? -1 : 0;
+}
+
+/**
+ * This function closes a shared object once the policy no longer uses it.
+ *
+ * @param arg the handle of the shared object
+ */
+static void compiled_close(void *arg) {
+
+    dlclose(arg);
+}
+
+/**
+ * This function replaces the policy with one built into a shared object from the
+ * source compiled_write() writes. The rules are used in place and packets are
+ * classified with the generated fw_match() until the policy is changed.
+ *
+ * @param filename the path of the shared object, as dlopen() takes it
+ *
+ * @return the number of rules loaded, or -1 if unsuccessful
+ */
+int compiled_load(char *filename) {
+
+    void *handle = dlopen(filename, RTLD_NOW | RTLD_LOCAL);
+
+    if (!handle) {
+        return -1;
+    }
+
+    const uint32_t *abi = (const uint32_t *) dlsym(handle, "fw_abi");
+    const uint32_t *rule_size = (const uint32_t *) dlsym(handle, "fw_rule_size");
+    const uint32_t *def = (const uint32_t *) dlsym(handle, "fw_default");
+    const uint32_t *count = (const uint32_t *) dlsym(handle, "fw_count");
+    const image_rule_t *rules = (const image_rule_t *) dlsym(handle, "fw_rules");
+    policy_matcher_t match = (policy_matcher_t) dlsym(handle, "fw_match");
+
+    if (!abi || !rule_size || !def || !count || !rules || !match
+            || *abi != COMPILED_ABI || *rule_size != sizeof(image_rule_t)
+            || policy_load_matcher(rules, *count, *def, match, compiled_close,
+                    handle) == -1) {
+        dlclose(handle);
+        return -1;
+    }
+
+    return *count;
+}
@@ -0,0 +1,46 @@
+/**
+ * @file compiled.h
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This file acts as the interface for the compiled.c file
+ */
+
+#ifndef COMPILED_H
+#define COMPILED_H
+
+#include <stdio.h>
+#include "policy.h"
+
+/** Version of the symbols a generated policy exports, bumped whenever they change */
+#define COMPILED_ABI 1
+
+/**
+ * This function writes a policy as C source for a shared object. The source exports
+ * the rules in their image form along with fw_match(), which hard-codes the rules as
+ * switch statements on the protocol and packed addresses followed by comparisons on
+ * the ports, in policy order. Only IPv4 rules can be hard-coded, so nothing is written
+ * for a policy with IPv6 rules.
+ *
+ * @param stream the file stream to write to
+ * @param rules the rules of the policy in order
+ * @param len the number of rules
+ * @param def the default policy
+ * @param source the name of the rules file, for the comment at the top
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+int compiled_write(FILE *stream, rule_t *rules, int len, unsigned int def,
+        char *source);
+
+/**
+ * This function replaces the policy with one built into a shared object from the
+ * source compiled_write() writes. The rules are used in place and packets are
+ * classified with the generated fw_match() until the policy is changed.
+ *
+ * @param filename the path of the shared object, as dlopen() takes it
+ *
+ * @return the number of rules loaded, or -1 if unsuccessful
+ */
+int compiled_load(char *filename);
+
+#endif
@@ -0,0 +1,662 @@
+/**
+ * @file conntrack.c
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This component is responsible for tracking the connections the policy has allowed.
+ * A connection is keyed by its 5-tuple with the two endpoints in a canonical order, so
+ * both directions of a connection find the same entry. The table is split into shards,
+ * each with its own lock, hash chains, least recently used list and timer wheel, so
+ * threads only contend when their packets land in the same shard. A full shard evicts
+ * its least recently used connection.
+ * Idle timeouts run on a clock of whole seconds that only moves when the caller
+ * advances it. Each connection sits in the wheel slot of the second it expires; a hit
+ * only moves its expiry forward, and the connection is moved to its new slot when the
+ * old one comes round. A connection more than one turn of the wheel away stays in its
+ * slot until its turn.
+ * TCP flags are not part of a packet, so every connection is treated as established
+ * from its first allowed packet until it is idle for its protocol's timeout.
+ * Only TCP and UDP connections are tracked, each with its own timeout. Packets of any
+ * other protocol have no ports to tell their flows apart and are always classified
+ * by the policy. The command language and the pcap decoder only produce TCP and UDP
+ * today, so this only matters once they take more.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "conntrack.h"
+#include "policy.h"
+#include "stats.h"
+
+/** Multiplier used for hashing the connection key (64-bit golden ratio) */
+#define CT_HASH_MULT 0x9E3779B97F4A7C15ULL
+
+/** Bit size of the 64-bit hash */
+#define HASH_BITS 64
+
+/** Number of bits of the hash used to pick a shard */
+#define CT_SHARD_BITS 4
+
+/** Number of shards of a large table */
+#define CT_SHARDS (1 << CT_SHARD_BITS)
+
+/** Fewest connections per shard before the table is split; smaller tables use one */
+#define CT_SHARD_MIN 256
+
+/** Number of one-second slots of each timer wheel (must be a power of two) */
+#define CT_WHEEL_SLOTS 256
+
+/** Used for turning a ratio into a percentage */
+#define PERCENT 100.0
+
+/**
+ * Representation of a tracked connection
+ * .key: the packet with the endpoints in canonical order (only its key for IPv4)
+ * .expires: the second the connection expires unless it sees another packet
+ * .next: the next connection in the same hash chain
+ * .lru_prev: the connection used just more recently, or NULL
+ * .lru_next: the connection used just less recently, or NULL
+ * .wheel_prev: the previous connection in the same wheel slot, or NULL
+ * .wheel_next: the next connection in the same wheel slot, or NULL
+ * .slot: the wheel slot the connection is in
+ */
+typedef struct ct_entry {
+    packet6_t key;
+    unsigned long expires;
+    struct ct_entry *next;
+    struct ct_entry *lru_prev;
+    struct ct_entry *lru_next;
+    struct ct_entry *wheel_prev;
+    struct ct_entry *wheel_next;
+    unsigned int slot;
+} ct_entry_t;
+
+/**
+ * Representation of a shard of the connection table
+ * .lock: held while the shard is read or changed
+ * .pool: the entries of the shard, allocated at once
+ * .free: the unused entries, chained through .next
+ * .buckets: the hash chains
+ * .bucket_bits: the number of bits of the hash used to pick a chain
+ * .lru_head: the most recently used connection
+ * .lru_tail: the least recently used connection
+ * .wheel: the connections expiring in each slot
+ * .wheel_now: the last second the wheel has been advanced to
+ * .count: the number of connections
+ * .cap: the most connections the shard holds
+ * .peak: the most connections the shard has held at once
+ * .lookups: the number of lookups
+ * .hits: the number of lookups that found an established connection
+ * .lookup_ns: the total time spent in lookups
+ * .inserted: the number of connections added
+ * .evicted: the number of connections evicted to make room
+ * .expired: the number of connections dropped for being idle
+ */
+typedef struct ct_shard {
+    pthread_mutex_t lock;
+    ct_entry_t *pool;
+    ct_entry_t *free;
+    ct_entry_t **buckets;
+    unsigned int bucket_bits;
+    ct_entry_t *lru_head;
+    ct_entry_t *lru_tail;
+    ct_entry_t *wheel[CT_WHEEL_SLOTS];
+    unsigned long wheel_now;
+    unsigned int count;
+    unsigned int cap;
+    unsigned int peak;
+    unsigned long lookups;
+    unsigned long hits;
+    long long lookup_ns;
+    unsigned long inserted;
+    unsigned long evicted;
+    unsigned long expired;
+} ct_shard_t;
+
+/** The shards of the table, or NULL while connection tracking is off */
+static ct_shard_t *shards;
+
+/** Number of shards of the table */
+static unsigned int shard_count;
+
+/** The connection tracking clock, in seconds */
+static unsigned long clock_now;
+
+/**
+ * This function puts the endpoints of a packet in canonical order: the endpoint with
+ * the lower address (then port) first.
+ *
+ * @param pkt the key of the packet
+ *
+ * @return the key of the packet's connection, with its addresses if it is IPv6 (and all
+ * 0 if not)
+ */
+static packet6_t ct_key(const packet_t *pkt) {
+
+    port_t sport = PACKET_SRC_PORT(*pkt);
+    port_t dport = PACKET_DST_PORT(*pkt);
+    int v6 = PACKET_IS_V6(*pkt);
+    int swap;
+    packet6_t key;
+
+    if (v6) {
+        key = *PACKET_V6(pkt);
+    } else {
+        memset(&key, 0, sizeof(key));
+        key.key = *pkt;
+    }
+
+    if (v6) {
+        const ipv6_t *s = &key.src;
+        const ipv6_t *d = &key.dst;
+
+        if (s->w[0] != d->w[0]) {
+            swap = s->w[0] > d->w[0];
+        } else if (s->w[1] != d->w[1]) {
+            swap = s->w[1] > d->w[1];
+        } else {
+            swap = sport > dport;
+        }
+    } else if (PACKET_SRC_IP(*pkt) != PACKET_DST_IP(*pkt)) {
+        swap = PACKET_SRC_IP(*pkt) > PACKET_DST_IP(*pkt);
+    } else {
+        swap = sport > dport;
+    }
+
+    if (swap) {
+        ipv6_t src = key.src;
+
+        key.key.addrs = (uint64_t) PACKET_DST_IP(*pkt) << KEY_ADDR_BITS
+                | PACKET_SRC_IP(*pkt);
+        key.key.ports = (pkt->ports & ~(KEY_SRC_PORT_MASK | KEY_DST_PORT_MASK))
+                | (uint64_t) dport << KEY_PORT_BITS | sport;
+        key.src = key.dst;
+        key.dst = src;
+    }
+
+    return key;
+}
+
+/**
+ * This function hashes a connection key.
+ *
+ * @param key the connection key
+ *
+ * @return the hash
+ */
+static uint64_t ct_hash(const packet6_t *key) {
+
+    uint64_t h = key->key.addrs ^ key->key.ports * CT_HASH_MULT;
+
+    h = (h ^ key->src.w[0]) * CT_HASH_MULT;
+    h = (h ^ key->src.w[1]) * CT_HASH_MULT;
+    h = (h ^ key->dst.w[0]) * CT_HASH_MULT;
+    h = (h ^ key->dst.w[1]) * CT_HASH_MULT;
+
+    return h;
+}
+
+/**
+ * This function finds the shard of a hash.
+ *
+ * @param h the hash
+ *
+ * @return the shard
+ */
+static ct_shard_t *ct_shard(uint64_t h) {
+
+    return &shards[shard_count > 1 ? h >> (HASH_BITS - CT_SHARD_BITS) : 0];
+}
+
+/**
+ * This function finds the hash chain of a hash in a shard.
+ *
+ * @param shard the shard
+ * @param h the hash
+ *
+ * @return the head of the chain
+ */
+static ct_entry_t **ct_bucket(ct_shard_t *shard, uint64_t h) {
+
+    return &shard->buckets[(h >> CT_SHARD_BITS) & ((1u << shard->bucket_bits) - 1)];
+}
+
+/**
+ * This function checks whether the connection of a packet is tracked, which it is only
+ * for TCP and UDP.
+ *
+ * @param pkt the packet
+ *
+ * @return 1 if it is tracked, 0 if not
+ */
+static int ct_tracked(const packet_t *pkt) {
+
+    protocol_t protocol = PACKET_PROTOCOL(*pkt);
+
+    return protocol == PROTO_TCP || protocol == PROTO_UDP;
+}
+
+/**
+ * This function finds the idle timeout of a connection, which must be tracked.
+ *
+ * @param key the connection key
+ *
+ * @return the timeout in seconds
+ */
+static unsigned long ct_timeout(const packet6_t *key) {
+
+    return PACKET_PROTOCOL(key->key) == PROTO_TCP ? CONNTRACK_TIMEOUT_TCP
+            : CONNTRACK_TIMEOUT_UDP;
+}
+
+/**
+ * This function takes a connection out of the least recently used list.
+ *
+ * @param shard the shard of the connection
+ * @param e the connection
+ */
+static void lru_unlink(ct_shard_t *shard, ct_entry_t *e) {
+
+    if (e->lru_prev) {
+        e->lru_prev->lru_next = e->lru_next;
+    } else {
+        shard->lru_head = e->lru_next;
+    }
+
+    if (e->lru_next) {
+        e->lru_next->lru_prev = e->lru_prev;
+    } else {
+        shard->lru_tail = e->lru_prev;
+    }
+}
+
+/**
+ * This function puts a connection at the front of the least recently used list.
+ *
+ * @param shard the shard of the connection
+ * @param e the connection
+ */
+static void lru_push(ct_shard_t *shard, ct_entry_t *e) {
+
+    e->lru_prev = NULL;
+    e->lru_next = shard->lru_head;
+
+    if (shard->lru_head) {
+        shard->lru_head->lru_prev = e;
+    } else {
+        shard->lru_tail = e;
+    }
+    shard->lru_head = e;
+}
+
+/**
+ * This function takes a connection out of its wheel slot.
+ *
+ * @param shard the shard of the connection
+ * @param e the connection
+ */
+static void wheel_unlink(ct_shard_t *shard, ct_entry_t *e) {
+
+    if (e->wheel_prev) {
+        e->wheel_prev->wheel_next = e->wheel_next;
+    } else {
+        shard->wheel[e->slot] = e->wheel_next;
+    }
+
+    if (e->wheel_next) {
+        e->wheel_next->wheel_prev = e->wheel_prev;
+    }
+}
+
+/**
+ * This function puts a connection in the wheel slot of the second it expires.
+ *
+ * @param shard the shard of the connection
+ * @param e the connection
+ */
+static void wheel_push(ct_shard_t *shard, ct_entry_t *e) {
+
+    e->slot = e->expires & (CT_WHEEL_SLOTS - 1);
+    e->wheel_prev = NULL;
+    e->wheel_next = shard->wheel[e->slot];
+
+    if (e->wheel_next) {
+        e->wheel_next->wheel_prev = e;
+    }
+    shard->wheel[e->slot] = e;
+}
+
+/**
+ * This function drops a connection from a shard and returns its entry to the free
+ * list.
+ *
+ * @param shard the shard of the connection
+ * @param e the connection
+ */
+static void ct_remove(ct_shard_t *shard, ct_entry_t *e) {
+
+    ct_entry_t **link = ct_bucket(shard, ct_hash(&e->key));
+
+    while (*link != e) {
+        link = &(*link)->next;
+    }
+    *link = e->next;
+
+    lru_unlink(shard, e);
+    wheel_unlink(shard, e);
+
+    e->next = shard->free;
+    shard->free = e;
+    shard->count--;
+}
+
+/**
+ * This function finds a live connection in a shard and marks it as just used. The
+ * shard must be locked.
+ *
+ * @param shard the shard
+ * @param key the connection key
+ * @param h the hash of the key
+ * @param now the current second
+ *
+ * @return the connection, or NULL if it is not tracked
+ */
+static ct_entry_t *ct_find(ct_shard_t *shard, const packet6_t *key, uint64_t h,
+        unsigned long now) {
+
+    for (ct_entry_t *e = *ct_bucket(shard, h); e; e = e->next) {
+        if (memcmp(&e->key, key, sizeof(*key)) == 0) {
+            if (e->expires <= now) {
+                return NULL;
+            }
+
+            e->expires = now + ct_timeout(key);
+            lru_unlink(shard, e);
+            lru_push(shard, e);
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * This function starts tracking a connection, evicting the least recently used one if
+ * the shard is full. The shard must be locked.
+ *
+ * @param shard the shard
+ * @param key the connection key
+ * @param h the hash of the key
+ * @param now the current second
+ */
+static void ct_insert(ct_shard_t *shard, const packet6_t *key, uint64_t h,
+        unsigned long now) {
+
+    ct_entry_t **bucket = ct_bucket(shard, h);
+
+    for (ct_entry_t *e = *bucket; e; e = e->next) {
+        if (memcmp(&e->key, key, sizeof(*key)) == 0) {
+            //Another thread got here first, or the old connection is being replaced
+            e->expires = now + ct_timeout(key);
+            lru_unlink(shard, e);
+            lru_push(shard, e);
+            return;
+        }
+    }
+
+    if (!shard->free) {
+        ct_remove(shard, shard->lru_tail);
+        shard->evicted++;
+    }
+
+    ct_entry_t *e = shard->free;
+    shard->free = e->next;
+
+    e->key = *key;
+    e->expires = now + ct_timeout(key);
+    e->next = *bucket;
+    *bucket = e;
+
+    lru_push(shard, e);
+    wheel_push(shard, e);
+
+    shard->count++;
+    shard->inserted++;
+    if (shard->count > shard->peak) {
+        shard->peak = shard->count;
+    }
+}
+
+/**
+ * This function turns on connection tracking with room for @max_flows connections.
+ *
+ * @param max_flows the most connections tracked at once
+ *
+ * @return 0 if successful, -1 if @max_flows is 0 or memory runs out
+ */
+int conntrack_init(unsigned int max_flows) {
+
+    if (max_flows == 0) {
+        return -1;
+    }
+
+    conntrack_free();
+
+    unsigned int n = max_flows >= CT_SHARDS * CT_SHARD_MIN ? CT_SHARDS : 1;
+    ct_shard_t *list = (ct_shard_t *) calloc(n, sizeof(ct_shard_t));
+
+    if (!list) {
+        return -1;
+    }
+
+    shards = list;
+    shard_count = n;
+
+    for (unsigned int i = 0; i < n; i++) {
+        ct_shard_t *shard = &list[i];
+        unsigned int cap = max_flows / n + (i < max_flows % n);
+
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->cap = cap;
+        shard->wheel_now = clock_now;
+
+        //At least as many chains as connections
+        while ((1u << shard->bucket_bits) < cap) {
+            shard->bucket_bits++;
+        }
+
+        shard->pool = (ct_entry_t *) malloc(cap * sizeof(ct_entry_t));
+        shard->buckets = (ct_entry_t **) calloc(1u << shard->bucket_bits,
+                sizeof(ct_entry_t *));
+
+        if (!shard->pool || !shard->buckets) {
+            conntrack_free();
+            return -1;
+        }
+
+        for (unsigned int j = 0; j < cap; j++) {
+            shard->pool[j].next = j + 1 < cap ? &shard->pool[j + 1] : NULL;
+        }
+        shard->free = shard->pool;
+    }
+
+    return 0;
+}
+
+/**
+ * This function reports whether connection tracking is on.
+ *
+ * @return 1 if it is on, 0 if not
+ */
+int conntrack_enabled() {
+
+    return shards != NULL;
+}
+
+/**
+ * This function classifies a packet, first against the established connections and
+ * then against the policy, tracking the connection of every TCP or UDP packet the
+ * policy allows. Packets of other protocols go straight to the policy.
+ *
+ * @param pkt the packet being tested, which for an IPv6 packet is the .key of its
+ * packet6_t
+ * @param pos the value to be updated with the position of the matched rule, -1 for the
+ * default policy or CONNTRACK_ESTABLISHED for an established connection
+ *
+ * @return the action for the packet
+ */
+int conntrack_test(packet_t *pkt, int *pos) {
+
+    if (!shards || !ct_tracked(pkt)) {
+        return policy_test(pkt, pos);
+    }
+
+    long long start = stats_now_ns();
+    packet6_t key = ct_key(pkt);
+    uint64_t h = ct_hash(&key);
+    ct_shard_t *shard = ct_shard(h);
+    unsigned long now = __atomic_load_n(&clock_now, __ATOMIC_ACQUIRE);
+
+    pthread_mutex_lock(&shard->lock);
+
+    int hit = ct_find(shard, &key, h, now) != NULL;
+
+    shard->lookups++;
+    shard->hits += hit;
+    shard->lookup_ns += stats_now_ns() - start;
+    pthread_mutex_unlock(&shard->lock);
+
+    if (hit) {
+        *pos = CONNTRACK_ESTABLISHED;
+        return ACTION_ALLOW;
+    }
+
+    int action = policy_test(pkt, pos);
+
+    if (action == ACTION_ALLOW) {
+        pthread_mutex_lock(&shard->lock);
+        ct_insert(shard, &key, h, now);
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    return action;
+}
+
+/**
+ * This function moves the connection tracking clock forward to @now and drops every
+ * connection that has been idle for longer than its timeout.
+ *
+ * @param now the time in seconds
+ */
+void conntrack_advance(unsigned long now) {
+
+    if (now <= __atomic_load_n(&clock_now, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    __atomic_store_n(&clock_now, now, __ATOMIC_RELEASE);
+
+    for (unsigned int i = 0; shards && i < shard_count; i++) {
+        ct_shard_t *shard = &shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+
+        //Every slot comes round at most once, however far the clock moved
+        unsigned long from = shard->wheel_now + 1;
+        if (now - shard->wheel_now > CT_WHEEL_SLOTS) {
+            from = now - CT_WHEEL_SLOTS + 1;
+        }
+
+        for (unsigned long t = from; t <= now; t++) {
+            ct_entry_t *e = shard->wheel[t & (CT_WHEEL_SLOTS - 1)];
+
+            while (e) {
+                ct_entry_t *next = e->wheel_next;
+
+                if (e->expires <= now) {
+                    ct_remove(shard, e);
+                    shard->expired++;
+                } else if ((e->expires & (CT_WHEEL_SLOTS - 1)) != e->slot) {
+                    wheel_unlink(shard, e);
+                    wheel_push(shard, e);
+                }
+                e = next;
+            }
+        }
+
+        shard->wheel_now = now;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/**
+ * This function returns the connection tracking clock.
+ *
+ * @return the time in seconds
+ */
+unsigned long conntrack_now() {
+
+    return __atomic_load_n(&clock_now, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * This function prints how full the connection table is, how many connections were
+ * evicted and expired and how long lookups took.
+ *
+ * @param stream the file stream to print to
+ */
+void conntrack_print(FILE *stream) {
+
+    if (!shards) {
+        fprintf(stream, "Connection tracking: off\n");
+        return;
+    }
+
+    unsigned long count = 0, cap = 0, peak = 0, lookups = 0, hits = 0;
+    unsigned long inserted = 0, evicted = 0, expired = 0;
+    long long ns = 0;
+
+    for (unsigned int i = 0; i < shard_count; i++) {
+        ct_shard_t *shard = &shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        count += shard->count;
+        cap += shard->cap;
+        peak += shard->peak;
+        lookups += shard->lookups;
+        hits += shard->hits;
+        ns += shard->lookup_ns;
+        inserted += shard->inserted;
+        evicted += shard->evicted;
+        expired += shard->expired;
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    fprintf(stream, "Connections: %lu of %lu (%.1f%% full, peak %lu) in %u shard%s\n",
+            count, cap, PERCENT * count / cap, peak, shard_count,
+            shard_count == 1 ? "" : "s");
+    fprintf(stream, "Tracked: %lu, evicted: %lu, expired: %lu, clock: %lu s\n",
+            inserted, evicted, expired, conntrack_now());
+    fprintf(stream, "Lookups: %lu (%lu established, %.1f ns on average)\n", lookups,
+            hits, lookups ? (double) ns / lookups : 0.0);
+}
+
+/**
+ * This function turns off connection tracking and frees the connection table.
+ */
+void conntrack_free() {
+
+    if (!shards) {
+        return;
+    }
+
+    for (unsigned int i = 0; i < shard_count; i++) {
+        pthread_mutex_destroy(&shards[i].lock);
+        free(shards[i].pool);
+        free(shards[i].buckets);
+    }
+
+    free(shards);
+    shards = NULL;
+    shard_count = 0;
+}
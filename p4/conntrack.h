@@ -0,0 +1,87 @@
+/**
+ * @file conntrack.h
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This file acts as the interface for the conntrack.c file
+ */
+
+#ifndef CONNTRACK_H
+#define CONNTRACK_H
+
+#include <stdio.h>
+#include "packet.h"
+
+/** Position reported for a packet admitted by an established connection */
+#define CONNTRACK_ESTABLISHED -2
+
+/** Seconds a TCP connection may stay idle before it is dropped */
+#define CONNTRACK_TIMEOUT_TCP 300
+
+/** Seconds a UDP flow may stay idle before it is dropped */
+#define CONNTRACK_TIMEOUT_UDP 30
+
+/**
+ * This function turns on connection tracking with room for @max_flows connections.
+ * Once it is on, conntrack_test() admits every packet of a connection the policy has
+ * allowed, in either direction, until the connection is idle for too long or is
+ * evicted to make room for a newer one.
+ *
+ * @param max_flows the most connections tracked at once
+ *
+ * @return 0 if successful, -1 if @max_flows is 0 or memory runs out
+ */
+int conntrack_init(unsigned int max_flows);
+
+/**
+ * This function reports whether connection tracking is on.
+ *
+ * @return 1 if it is on, 0 if not
+ */
+int conntrack_enabled();
+
+/**
+ * This function classifies a packet, first against the established connections and
+ * then against the policy, tracking the connection of every TCP or UDP packet the
+ * policy allows. Packets of other protocols go straight to the policy. Without
+ * connection tracking it is policy_test(). It may be called from any number
+ * of threads.
+ *
+ * @param pkt the packet being tested, which for an IPv6 packet is the .key of its
+ * packet6_t
+ * @param pos the value to be updated with the position of the matched rule, -1 for the
+ * default policy or CONNTRACK_ESTABLISHED for an established connection
+ *
+ * @return the action for the packet
+ */
+int conntrack_test(packet_t *pkt, int *pos);
+
+/**
+ * This function moves the connection tracking clock forward to @now and drops every
+ * connection that has been idle for longer than its timeout. The clock never moves
+ * back.
+ *
+ * @param now the time in seconds
+ */
+void conntrack_advance(unsigned long now);
+
+/**
+ * This function returns the connection tracking clock.
+ *
+ * @return the time in seconds
+ */
+unsigned long conntrack_now();
+
+/**
+ * This function prints how full the connection table is, how many connections were
+ * evicted and expired and how long lookups took.
+ *
+ * @param stream the file stream to print to
+ */
+void conntrack_print(FILE *stream);
+
+/**
+ * This function turns off connection tracking and frees the connection table.
+ */
+void conntrack_free();
+
+#endif
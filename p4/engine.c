@@ -0,0 +1,40 @@
+/**
+ * @file engine.c
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This component is responsible for the list of classification engines the policy can
+ * be compiled with.
+ */
+
+#include <string.h>
+#include "engine.h"
+#include "bitvec.h"
+#include "hicuts.h"
+#include "tss.h"
+
+/** Every engine, the default first */
+static const engine_t engines[] = {
+    { "linear", 0, NULL, NULL, NULL, NULL, NULL, NULL },
+    { "bitvector", BITVEC_MAX_RULES, bitvec_build, bitvec_lookup, bitvec_print,
+            bitvec_free, NULL, NULL },
+    { "hicuts", 0, hicuts_build, hicuts_lookup, hicuts_print, hicuts_free, NULL, NULL },
+    { "tss", 0, tss_build, tss_lookup, tss_print, tss_free, tss_insert, tss_remove },
+};
+
+/**
+ * This function finds a classification engine by name.
+ *
+ * @param name the name of the engine
+ *
+ * @return the engine, or NULL if there is no engine with that name
+ */
+const engine_t *engine_find(char *name) {
+
+    for (int i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+        if (strcmp(engines[i].name, name) == 0) {
+            return &engines[i];
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,48 @@
+/**
+ * @file engine.h
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This file acts as the interface for the engine.c file
+ */
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "policy.h"
+
+/**
+ * Representation of a classification engine, which compiles the rules of a snapshot
+ * into an index that finds the first matching rule without scanning every rule.
+ * The linear engine has no functions; the rules are simply scanned in order.
+ * .name: the name the engine is selected by
+ * .max_rules: the largest policy the engine builds an index for (0 for no limit)
+ * .build: builds an index of @n rules in order, or returns NULL if it cannot
+ * .lookup: finds the index (from 0) of the first rule matching @pkt, or -1
+ * .print: prints the shape of an index
+ * .free: frees an index
+ * .insert: for an engine that updates its index rather than rebuilding it, returns a
+ * copy of @index with @rule inserted at @pos (from 0) that shares whatever is unchanged
+ * with it, or NULL if it cannot; NULL for other engines
+ * .remove: likewise returns a copy of @index with the rule at @pos removed, or NULL
+ */
+typedef struct engine {
+    const char *name;
+    unsigned int max_rules;
+    void *(*build)(rule_t *rules, unsigned int n);
+    int (*lookup)(void *index, packet_t *pkt);
+    void (*print)(void *index, FILE *stream);
+    void (*free)(void *index);
+    void *(*insert)(void *index, rule_t *rule, unsigned int pos);
+    void *(*remove)(void *index, unsigned int pos);
+} engine_t;
+
+/**
+ * This function finds a classification engine by name.
+ *
+ * @param name the name of the engine
+ *
+ * @return the engine, or NULL if there is no engine with that name
+ */
+const engine_t *engine_find(char *name);
+
+#endif
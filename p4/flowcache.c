@@ -0,0 +1,170 @@
+/**
+ * @file flowcache.c
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This component is responsible for caching classification results per flow.
+ * It is a fixed-size, set-associative table keyed by the full 5-tuple. Entries are
+ * tagged with the policy generation they were computed under, so changing the policy
+ * invalidates every entry at once without touching the table.
+ * Each thread has its own cache, so lookups never contend with other threads. Hits
+ * and misses are counted in the thread's stats shard, so they are summed over every
+ * thread that classifies packets.
+ */
+
+#include <stdlib.h>
+#include "flowcache.h"
+#include "stats.h"
+
+/** Multiplier used for hashing the flow key (64-bit golden ratio) */
+#define FLOW_HASH_MULT 0x9E3779B97F4A7C15ULL
+
+/** Bit size of the 64-bit hash */
+#define HASH_BITS 64
+
+/**
+ * Representation of a cached flow
+ * .ips: the source and destination addresses packed into one word
+ * .ports: the protocol and both ports packed into one word
+ * .gen: the policy generation the result belongs to (0 if unused)
+ * .action: the cached action
+ * .pos: the cached rule position
+ */
+typedef struct flow_entry {
+    unsigned long long ips;
+    unsigned long long ports;
+    unsigned long gen;
+    int action;
+    int pos;
+} flow_entry_t;
+
+/** The calling thread's cache, each set ordered from most to least recently used. */
+static __thread flow_entry_t (*cache)[FLOW_CACHE_WAYS];
+
+/**
+ * This function reads the two words of the key of @pkt.
+ *
+ * @param pkt the packet being packed
+ * @param ips the value to be updated with the packed addresses
+ * @param ports the value to be updated with the packed protocol and ports
+ */
+static void flow_key(packet_t *pkt, unsigned long long *ips,
+        unsigned long long *ports) {
+
+    *ips = pkt->addrs;
+    *ports = pkt->ports;
+}
+
+/**
+ * This function picks the set for a packed flow key.
+ *
+ * @param ips the packed addresses
+ * @param ports the packed protocol and ports
+ *
+ * @return the index of the set
+ */
+static unsigned int flow_set(unsigned long long ips, unsigned long long ports) {
+
+    unsigned long long h = (ips ^ (ports * FLOW_HASH_MULT)) * FLOW_HASH_MULT;
+    return (unsigned int) (h >> (HASH_BITS - FLOW_CACHE_SET_BITS));
+}
+
+/**
+ * This function looks up @pkt in the calling thread's flow cache. An entry only
+ * counts as a hit if it was stored while the policy was at generation @gen.
+ *
+ * @param pkt the packet being looked up
+ * @param gen the current policy generation
+ * @param action the value to be updated with the cached action
+ * @param pos the value to be updated with the cached rule position
+ *
+ * @return 1 on a hit and 0 on a miss
+ */
+int flow_cache_lookup(packet_t *pkt, unsigned long gen, int *action, int *pos) {
+
+    if (!cache) {
+        cache = (flow_entry_t (*)[FLOW_CACHE_WAYS]) calloc(FLOW_CACHE_SETS,
+                sizeof(*cache));
+    }
+
+    unsigned long long ips, ports;
+    flow_key(pkt, &ips, &ports);
+
+    if (!cache) {
+        stats_cache_count(0);
+        return 0;
+    }
+
+    flow_entry_t *set = cache[flow_set(ips, ports)];
+
+    for (int i = 0; i < FLOW_CACHE_WAYS; i++) {
+        if (set[i].gen == gen && set[i].ips == ips && set[i].ports == ports) {
+            flow_entry_t hit = set[i];
+
+            //Move the entry to the front of its set
+            for (int j = i; j > 0; j--) {
+                set[j] = set[j - 1];
+            }
+            set[0] = hit;
+
+            *action = hit.action;
+            *pos = hit.pos;
+            stats_cache_count(1);
+            return 1;
+        }
+    }
+
+    stats_cache_count(0);
+    return 0;
+}
+
+/**
+ * This function stores the result of classifying @pkt in the flow cache, evicting the
+ * least recently used entry of its set if needed.
+ *
+ * @param pkt the packet that was classified
+ * @param gen the policy generation the result belongs to
+ * @param action the action the policy returned
+ * @param pos the position of the matched rule (or -1 for the default policy)
+ */
+void flow_cache_insert(packet_t *pkt, unsigned long gen, int action, int pos) {
+
+    if (!cache) {
+        return;
+    }
+
+    unsigned long long ips, ports;
+    flow_key(pkt, &ips, &ports);
+    flow_entry_t *set = cache[flow_set(ips, ports)];
+
+    //Shift everything down, dropping the last entry
+    for (int i = FLOW_CACHE_WAYS - 1; i > 0; i--) {
+        set[i] = set[i - 1];
+    }
+
+    set[0].ips = ips;
+    set[0].ports = ports;
+    set[0].gen = gen;
+    set[0].action = action;
+    set[0].pos = pos;
+}
+
+/**
+ * This function releases the calling thread's cache.
+ */
+void flow_cache_free() {
+
+    free(cache);
+    cache = NULL;
+}
+
+/**
+ * This function reports how many lookups hit and missed the flow caches of every
+ * thread.
+ *
+ * @param hits the value to be updated with the number of hits
+ * @param misses the value to be updated with the number of misses
+ */
+void flow_cache_stats(unsigned long *hits, unsigned long *misses) {
+
+    stats_cache(hits, misses);
+}
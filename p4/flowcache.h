@@ -0,0 +1,61 @@
+/**
+ * @file flowcache.h
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This file acts as the interface for the flowcache.c file
+ */
+
+#ifndef FLOWCACHE_H
+#define FLOWCACHE_H
+
+#include "packet.h"
+
+/** Number of bits of a flow's hash that pick its set in the flow cache */
+#define FLOW_CACHE_SET_BITS 12
+
+/** Number of sets in the flow cache */
+#define FLOW_CACHE_SETS (1 << FLOW_CACHE_SET_BITS)
+
+/** Number of entries (ways) in each set of the flow cache */
+#define FLOW_CACHE_WAYS 4
+
+/**
+ * This function looks up @pkt in the calling thread's flow cache. An entry only
+ * counts as a hit if it was stored while the policy was at generation @gen.
+ *
+ * @param pkt the packet being looked up
+ * @param gen the current policy generation
+ * @param action the value to be updated with the cached action
+ * @param pos the value to be updated with the cached rule position
+ *
+ * @return 1 on a hit and 0 on a miss
+ */
+int flow_cache_lookup(packet_t *pkt, unsigned long gen, int *action, int *pos);
+
+/**
+ * This function stores the result of classifying @pkt in the flow cache, evicting the
+ * least recently used entry of its set if needed.
+ *
+ * @param pkt the packet that was classified
+ * @param gen the policy generation the result belongs to
+ * @param action the action the policy returned
+ * @param pos the position of the matched rule (or -1 for the default policy)
+ */
+void flow_cache_insert(packet_t *pkt, unsigned long gen, int action, int pos);
+
+/**
+ * This function releases the calling thread's cache. Threads that classify packets
+ * should call it before they exit.
+ */
+void flow_cache_free();
+
+/**
+ * This function reports how many lookups hit and missed the flow caches of every
+ * thread.
+ *
+ * @param hits the value to be updated with the number of hits
+ * @param misses the value to be updated with the number of misses
+ */
+void flow_cache_stats(unsigned long *hits, unsigned long *misses);
+
+#endif
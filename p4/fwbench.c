@@ -0,0 +1,245 @@
+/**
+ * @file fwbench.c
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This is the top-level component of the classifier benchmark.
+ * It loads a rules file (or a compiled image, with --snapshot) into the policy with the
+ * selected engine, then classifies every test command of a trace file with
+ * policy_test() and prints one line of CSV with how long the rules took to load, how
+ * much memory the policy holds and how many packets were classified per second. The
+ * memory counts the heap, the arenas of the compact encoding and mapped images.
+ * Traces and rules files are written by fwgen.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+#include "policy.h"
+#include "loader.h"
+#include "image.h"
+#include "flowcache.h"
+#include "stats.h"
+
+/** Number of nanoseconds in a millisecond */
+#define NSEC_PER_MSEC 1000000.0
+
+/** Number of nanoseconds in a second */
+#define NSEC_PER_SEC 1000000000.0
+
+/** Number of bytes in a kilobyte */
+#define KB 1024
+
+/** Initial capacity of the array of packets read from a trace */
+#define BENCH_INIT_PACKETS 4096
+
+/** Columns of the CSV, in order */
+#define BENCH_HEADER "engine,rules,trace,packets,load_ms,memory_kb,packets_per_sec," \
+        "ns_per_packet,cache_hit_pct,allowed"
+
+/** Print out a usage message. */
+static void usage() {
+    fprintf(stderr, "Usage: fwbench [--header] [--engine linear|bitvector|hicuts|tss]"
+            " [--compact-rules] [--snapshot] <rule_file> <trace_file>\n");
+}
+
+/**
+ * This function finds how many bytes are in use: the heap, plus the arenas the policy
+ * maps itself and the image files it has mapped, which the heap does not see.
+ *
+ * @return the number of bytes
+ */
+static size_t memory_used() {
+
+    struct mallinfo2 mi = mallinfo2();
+
+    return mi.uordblks + mi.hblkhd + policy_mapped() + image_mapped();
+}
+
+/**
+ * This function reads the packets of the test commands of a trace file. Every other
+ * command is skipped.
+ *
+ * @param filename the name of the trace file
+ * @param packets the value to be updated with the dynamically allocated packets
+ *
+ * @return the number of packets read, or -1 if the file could not be read
+ */
+static long read_trace(char *filename, packet6_t **packets) {
+
+    FILE *fp = fopen(filename, "r");
+
+    if (!fp) {
+        return -1;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    char *buf = size >= 0 ? (char *) malloc(size + 1) : NULL;
+    long cap = BENCH_INIT_PACKETS;
+    long n = 0;
+    packet6_t *list = (packet6_t *) malloc(cap * sizeof(packet6_t));
+
+    if (!buf || !list || fread(buf, 1, size, fp) != (size_t) size) {
+        free(buf);
+        free(list);
+        fclose(fp);
+        return -1;
+    }
+
+    fclose(fp);
+
+    const char *cur = buf;
+    const char *end = buf + size;
+
+    while (cur < end) {
+        fw_cmd_t cmd;
+
+        if (lex_command(&cur, end, &cmd) != 1 || cmd.cmd != TEST) {
+            continue;
+        }
+
+        if (n == cap) {
+            packet6_t *grown = (packet6_t *) realloc(list, cap * 2 * sizeof(packet6_t));
+            if (!grown) {
+                free(buf);
+                free(list);
+                return -1;
+            }
+            list = grown;
+            cap *= 2;
+        }
+
+        list[n++] = command_packet(&cmd);
+    }
+
+    free(buf);
+    *packets = list;
+
+    return n;
+}
+
+/**
+ * This function loads the rules, classifies the packets and prints the results as a
+ * line of CSV.
+ *
+ * @param rules_file the name of the rules file
+ * @param trace_file the name of the trace file
+ * @param snapshot whether the rules file is a compiled image
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int bench(char *rules_file, char *trace_file, int snapshot) {
+
+    packet6_t *packets;
+    long n = read_trace(trace_file, &packets);
+
+    if (n == -1) {
+        fprintf(stderr, "Error: Could not read %s.\n", trace_file);
+        return -1;
+    }
+
+    size_t used = memory_used();
+    long long start = stats_now_ns();
+    int loaded = snapshot ? image_load(rules_file) : load_rules_fast(rules_file);
+    long long load_ns = stats_now_ns() - start;
+    long memory = ((long) memory_used() - (long) used) / KB;
+
+    if (loaded == -1) {
+        fprintf(stderr, "Error: Could not read %s.\n", rules_file);
+        free(packets);
+        return -1;
+    }
+
+    long allowed = 0;
+    int pos;
+    start = stats_now_ns();
+
+    for (long i = 0; i < n; i++) {
+        allowed += policy_test(&packets[i].key, &pos) == ACTION_ALLOW;
+    }
+
+    long long test_ns = stats_now_ns() - start;
+    unsigned long hits, misses;
+    flow_cache_stats(&hits, &misses);
+
+    printf("%s,%d,%s,%ld,%.3f,%ld,%.0f,%.1f,%.1f,%ld\n", policy_engine_name(), loaded,
+            trace_file, n, load_ns / NSEC_PER_MSEC, memory,
+            test_ns ? n * NSEC_PER_SEC / test_ns : 0, n ? (double) test_ns / n : 0,
+            hits + misses ? 100.0 * hits / (hits + misses) : 0, allowed);
+
+    free(packets);
+
+    return 0;
+}
+
+/**
+ * Starting point for the program. Process command-line arguments, then run the
+ * benchmark.
+ *
+ * @param argc number of command-line arguments.
+ * @param argv list of command-line arguments.
+ *
+ * @return program exit status
+ */
+int main(int argc, char *argv[]) {
+
+    char *engine = NULL;
+    char *rules = NULL;
+    char *trace = NULL;
+    int header = 0;
+    int snapshot = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp("--header", argv[i]) == 0) {
+            header = 1;
+        } else if (strcmp("--engine", argv[i]) == 0 && i + 1 < argc) {
+            engine = argv[++i];
+        } else if (strcmp("--compact-rules", argv[i]) == 0) {
+            policy_set_compact(1);
+        } else if (strcmp("--snapshot", argv[i]) == 0) {
+            snapshot = 1;
+        } else if (!rules && argv[i][0] != '-') {
+            rules = argv[i];
+        } else if (!trace && argv[i][0] != '-') {
+            trace = argv[i];
+        } else {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (header) {
+        printf("%s\n", BENCH_HEADER);
+    }
+
+    if (!rules || !trace) {
+        if (header && !rules && !trace) {
+            return EXIT_SUCCESS;
+        }
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    policy_init();
+    policy_set_default(ACTION_DENY);
+
+    int status = EXIT_SUCCESS;
+
+    if (engine && policy_set_engine(engine) == -1) {
+        fprintf(stderr, "Error: Unknown engine %s.\n", engine);
+        usage();
+        status = EXIT_FAILURE;
+    } else if (bench(rules, trace, snapshot) == -1) {
+        status = EXIT_FAILURE;
+    }
+
+    policy_free();
+    flow_cache_free();
+    stats_free();
+
+    return status;
+}
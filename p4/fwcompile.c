@@ -0,0 +1,87 @@
+/**
+ * @file fwcompile.c
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This is the top-level component of the policy compiler.
+ * It reads a rules file and writes C source for a shared object that hard-codes the
+ * policy, which fwsim can load with --compiled.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "policy.h"
+#include "loader.h"
+#include "compiled.h"
+
+/** Print out a usage message. */
+static void usage() {
+    fprintf(stderr, "Usage: fwcompile [-o <output_file>] <rule_file>\n");
+}
+
+/**
+ * Starting point for the program. Process command-line arguments, then compile the
+ * rules file to standard output or the output file.
+ *
+ * @param argc number of command-line arguments.
+ * @param argv list of command-line arguments.
+ *
+ * @return program exit status
+ */
+int main(int argc, char *argv[]) {
+
+    char *out = NULL;
+    char *in = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp("-o", argv[i]) == 0 && i + 1 < argc) {
+            out = argv[++i];
+        } else if (!in && argv[i][0] != '-') {
+            in = argv[i];
+        } else {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!in) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    rule_t *rules;
+    int def;
+    int len = read_rules(in, &rules, &def);
+
+    if (len == -1) {
+        fprintf(stderr, "Error: Could not read %s.\n", in);
+        return EXIT_FAILURE;
+    }
+
+    //fwsim starts with a deny default
+    if (def == -1) {
+        def = ACTION_DENY;
+    }
+
+    FILE *fp = out ? fopen(out, "w") : stdout;
+    int status = EXIT_SUCCESS;
+
+    if (!fp) {
+        fprintf(stderr, "Error: Could not write %s.\n", out);
+        status = EXIT_FAILURE;
+    } else {
+        if (compiled_write(fp, rules, len, def, in) == -1) {
+            fprintf(stderr, "Error: Could not compile %s.\n", in);
+            status = EXIT_FAILURE;
+        }
+        if (out && fclose(fp) != 0) {
+            fprintf(stderr, "Error: Could not write %s.\n", out);
+            status = EXIT_FAILURE;
+        }
+    }
+
+    free(rules);
+
+    return status;
+}
@@ -0,0 +1,1256 @@
+/**
+ * @file fwfuzz.c
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This is the top-level component of the differential fuzzer.
+ * It generates random cases from a seed, each a run of changes to the policy (appends,
+ * inserts, deletes, new defaults and reloads as a compiled image, some of them grouped
+ * into transactions) mixed with packets to test. Every case is played against the policy with each engine in turn, and every
+ * verdict policy_test() gives is checked against a plain first-match scan with
+ * packet_match() over the same rules. A case that disagrees is shrunk to the fewest
+ * operations that still disagree and printed as commands for fwsim.
+ * With --large, every case first loads thousands of rules in one transaction, drawn
+ * from wide pools of addresses and ports, so the engines' paths for big and sparse
+ * policies (sparse bit vector fields, deep cut trees, split tuple tries) are played
+ * too.
+ * With --threads, reader threads test a case's packets over and over while its
+ * changes are made, and every verdict given while the policy stood still is checked
+ * against the reference for that version of the policy, so a flow cache entry that
+ * outlives its generation is caught.
+ * With --compiled, every case builds an IPv4 policy, writes it as C with
+ * compiled_write(), builds that into a shared object and loads it, then tests packets
+ * against the generated matcher, so the code fwcompile writes is checked too.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "policy.h"
+#include "compiled.h"
+#include "flowcache.h"
+#include "stats.h"
+#include "rcu.h"
+
+/** Number of cases run unless told otherwise */
+#define FUZZ_CASES 200
+
+/** Most operations in a case */
+#define FUZZ_MAX_OPS 160
+
+/** Most rules a case's policy holds at once */
+#define FUZZ_MAX_RULES 64
+
+/** Number of distinct addresses rules and packets are drawn from, per family */
+#define FUZZ_ADDRS 4
+
+/** Most rules a large case loads before its other operations */
+#define FUZZ_LARGE_RULES 4096
+
+/** Most operations in a large case: the rules it loads, inside a transaction, and the
+ * operations of an ordinary case after them */
+#define FUZZ_LARGE_OPS (FUZZ_LARGE_RULES + 2 + FUZZ_MAX_OPS)
+
+/** Number of distinct addresses rules and packets of a large case are drawn from, per
+ * family */
+#define FUZZ_LARGE_ADDRS 1024
+
+/** Number of distinct ports rules and packets of a large case are drawn from */
+#define FUZZ_LARGE_PORTS 512
+
+/** First port past the ordinary ones a large case draws from */
+#define FUZZ_LARGE_PORT_BASE 1024
+
+/** Most packets the reader threads of a case test over and over */
+#define FUZZ_PROBES 32
+
+/** Most reader threads */
+#define FUZZ_MAX_THREADS 16
+
+/** First IPv4 address rules and packets are drawn from (10.0.0.1) */
+#define FUZZ_BASE_IP 0x0A000001u
+
+/** High word of the IPv6 addresses rules and packets are drawn from (2001:db8::/64) */
+#define FUZZ_BASE_IP6 0x20010DB800000000ULL
+
+/** One in this many rules and packets is IPv6 */
+#define FUZZ_V6_ODDS 6
+
+/** One in this many ports of a rule is a wildcard */
+#define FUZZ_ANY_ODDS 3
+
+/** One in this many packets is drawn at random rather than from a rule */
+#define FUZZ_RANDOM_ODDS 3
+
+/** File a case reloads its policy through in the reproducer, as fwsim does it */
+#define FUZZ_IMAGE_FILE "fwfuzz.img"
+
+/** File the source of a compiled policy is written to */
+#define FUZZ_COMPILED_SOURCE "fwfuzz-gen.c"
+
+/** Command that builds the source of a compiled policy, followed by the output path */
+#define FUZZ_COMPILED_BUILD "gcc -O2 -shared -fPIC " FUZZ_COMPILED_SOURCE " -o "
+
+/** Longest path a compiled policy is built to */
+#define FUZZ_COMPILED_PATH 64
+
+/** Used to indicate an appended rule */
+#define OP_APPEND 0
+
+/** Used to indicate an inserted rule */
+#define OP_INSERT 1
+
+/** Used to indicate a deleted rule */
+#define OP_DELETE 2
+
+/** Used to indicate a new default policy */
+#define OP_DEFAULT 3
+
+/** Used to indicate the policy reloaded as a compiled image, or with --compiled as a
+ * shared object */
+#define OP_IMAGE 4
+
+/** Used to indicate an opened transaction */
+#define OP_BEGIN 5
+
+/** Used to indicate a committed transaction */
+#define OP_COMMIT 6
+
+/** Used to indicate a tested packet */
+#define OP_TEST 7
+
+/** Number of kinds of operation drawn with equal odds, before tests are added */
+#define OP_CHANGES 7
+
+/** One in this many operations changes the policy; the rest test packets */
+#define FUZZ_CHANGE_ODDS 3
+
+/** Ports rules and packets are drawn from */
+static const port_t fuzz_ports[] = { 22, 53, 80, 443 };
+
+/** Lengths the prefixes of IPv6 rules are drawn from */
+static const int fuzz_prefixes[] = { 0, 32, 64, 127, 128 };
+
+/** Engines cases are played against unless told otherwise */
+static char *fuzz_engines[] = { "linear", "bitvector", "hicuts", "tss" };
+
+/**
+ * Representation of one operation of a case
+ * .kind: OP_APPEND, OP_INSERT, OP_DELETE, OP_DEFAULT, OP_IMAGE, OP_BEGIN, OP_COMMIT or
+ * OP_TEST
+ * .pos: the position (from 1) for OP_INSERT and OP_DELETE
+ * .rule: the rule for OP_APPEND and OP_INSERT, and the action for OP_DEFAULT
+ * .pkt: the packet for OP_TEST
+ * .played: whether the operation applied when the case was last played
+ * .at: the position a rule was inserted at when last played, or 0 if it was appended
+ */
+typedef struct fuzz_op {
+    int kind;
+    int pos;
+    rule_t rule;
+    packet6_t pkt;
+    int played;
+    int at;
+} fuzz_op_t;
+
+/**
+ * Representation of the policy as the reference sees it
+ * .rules: the rules in order
+ * .len: the number of rules
+ * .def: the default policy
+ */
+typedef struct fuzz_ref {
+    rule_t rules[FUZZ_LARGE_RULES];
+    int len;
+    unsigned int def;
+} fuzz_ref_t;
+
+/**
+ * Representation of the first verdict of a case that disagreed with the reference
+ * .op: the index of the operation
+ * .action: the action policy_test() gave, or -1 if a change could not be applied
+ * .pos: the index of the rule policy_test() matched, or -1
+ * .want_action: the action the reference gave
+ * .want_pos: the index of the rule the reference matched, or -1
+ * .probe: the packet a reader thread disagreed on, or -1 if the case itself disagreed
+ */
+typedef struct fuzz_fail {
+    int op;
+    int action;
+    int pos;
+    int want_action;
+    int want_pos;
+    int probe;
+} fuzz_fail_t;
+
+/**
+ * Representation of what the reference gives a packet
+ * .action: the action
+ * .pos: the index of the matched rule, or -1
+ */
+typedef struct fuzz_verdict {
+    int action;
+    int pos;
+} fuzz_verdict_t;
+
+/**
+ * Representation of a reader thread
+ * .thread: the thread
+ * .failed: whether it got a verdict the reference disagrees with
+ * .probe: the packet it disagreed on
+ * .version: the version of the policy it disagreed with
+ * .action: the action policy_test() gave
+ * .pos: the index of the rule policy_test() matched, or -1
+ */
+typedef struct fuzz_reader {
+    pthread_t thread;
+    int failed;
+    int probe;
+    unsigned long version;
+    int action;
+    int pos;
+} fuzz_reader_t;
+
+/** Whether the policy keeps its rules in the compact encoding */
+static int fuzz_compact;
+
+/** Whether cases load a large policy first */
+static int fuzz_large;
+
+/** Whether cases test their policy as a compiled shared object */
+static int fuzz_compiled;
+
+/** Number of shared objects built so far, which names the next one so dlopen() never
+ * hands back one that is still loaded */
+static int fuzz_builds;
+
+/** Most rules a case's policy holds at once */
+static int fuzz_max_rules = FUZZ_MAX_RULES;
+
+/** Number of distinct addresses rules and packets are drawn from, per family */
+static unsigned int fuzz_addrs = FUZZ_ADDRS;
+
+/** Number of distinct ports rules and packets are drawn from */
+static unsigned int fuzz_nports = sizeof(fuzz_ports) / sizeof(fuzz_ports[0]);
+
+/** The operations of the current case */
+static fuzz_op_t fuzz_ops[FUZZ_LARGE_OPS];
+
+/** The operations of a case being shrunk that are played next */
+static fuzz_op_t fuzz_trial[FUZZ_LARGE_OPS];
+
+/** The rules drawn so far in the case being drawn */
+static rule_t fuzz_drawn[FUZZ_LARGE_OPS];
+
+/** The policy as the reference sees it */
+static fuzz_ref_t fuzz_ref;
+
+/** The policy as the reference sees it with the open transaction's changes */
+static fuzz_ref_t fuzz_staged;
+
+/** The changes the open transaction has staged */
+static policy_edit_t fuzz_edits[FUZZ_LARGE_OPS];
+
+/** Number of reader threads, or 0 to test packets on the main thread only */
+static int fuzz_threads;
+
+/** The reader threads */
+static fuzz_reader_t fuzz_readers[FUZZ_MAX_THREADS];
+
+/** The packets the reader threads test */
+static packet6_t fuzz_probes[FUZZ_PROBES];
+
+/** Number of packets the reader threads test */
+static int fuzz_nprobes;
+
+/** What the reference gives each packet the readers test, for each version of the
+ * policy */
+static fuzz_verdict_t fuzz_expected[FUZZ_LARGE_OPS + 1][FUZZ_PROBES];
+
+/** The operation that made each version of the policy, or -1 for the first */
+static int fuzz_version_op[FUZZ_LARGE_OPS + 1];
+
+/** Twice the version of the policy, plus one while it is being changed */
+static unsigned long fuzz_seq;
+
+/** Whether the reader threads should stop */
+static int fuzz_stop;
+
+/** Print out a usage message. */
+static void usage() {
+    fprintf(stderr, "Usage: fwfuzz [-s <seed>] [-n <cases>]"
+            " [--engine linear|bitvector|hicuts|tss] [--compact-rules] [--large]"
+            " [--threads <n>] [--compiled]\n");
+}
+
+/**
+ * This function draws the next random number (xorshift64*).
+ *
+ * @param state the state of the generator, which must not be 0
+ *
+ * @return the number
+ */
+static uint64_t rng_next(uint64_t *state) {
+
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * This function draws a random number below @n.
+ *
+ * @param state the state of the generator
+ * @param n the bound, which must be positive
+ *
+ * @return the number
+ */
+static unsigned int rng_below(uint64_t *state, unsigned int n) {
+
+    return (unsigned int) (rng_next(state) >> 32) % n;
+}
+
+/**
+ * This function finds the @i-th IPv6 address rules and packets are drawn from. They
+ * fall in two /64 prefixes that differ only in their last bit, and within each in two
+ * hosts that differ only in their last two bits, so every prefix length tells some of
+ * them apart.
+ *
+ * @param i the index of the address (below fuzz_addrs)
+ *
+ * @return the address
+ */
+static ipv6_t fuzz_addr6(unsigned int i) {
+
+    ipv6_t addr;
+
+    addr.w[0] = FUZZ_BASE_IP6 + (i >> 1);
+    addr.w[1] = (i & 1) + 1;
+
+    return addr;
+}
+
+/**
+ * This function draws a port from the pool rules and packets are drawn from. Past the
+ * ordinary ports, the pool of a large case runs up from FUZZ_LARGE_PORT_BASE.
+ *
+ * @param state the state of the generator
+ *
+ * @return the port
+ */
+static port_t fuzz_port(uint64_t *state) {
+
+    unsigned int i = rng_below(state, fuzz_nports);
+    unsigned int n = sizeof(fuzz_ports) / sizeof(fuzz_ports[0]);
+
+    return i < n ? fuzz_ports[i] : (port_t) (FUZZ_LARGE_PORT_BASE + i - n);
+}
+
+/**
+ * This function draws a port for a rule, which may be a wildcard.
+ *
+ * @param state the state of the generator
+ *
+ * @return the port, or MATCH_PORT_ANY
+ */
+static port_match_t fuzz_rule_port(uint64_t *state) {
+
+    if (rng_below(state, FUZZ_ANY_ODDS) == 0) {
+        return MATCH_PORT_ANY;
+    }
+
+    return fuzz_port(state);
+}
+
+/**
+ * This function draws a random rule. Compiled policies cannot hold IPv6 rules, so
+ * none are drawn with --compiled.
+ *
+ * @param state the state of the generator
+ *
+ * @return the rule
+ */
+static rule_t fuzz_rule(uint64_t *state) {
+
+    rule_t rule;
+    protocol_t protocol = rng_below(state, 2) ? PROTO_UDP : PROTO_TCP;
+
+    rule.action = rng_below(state, 2) ? ACTION_DENY : ACTION_ALLOW;
+
+    if (!fuzz_compiled && rng_below(state, FUZZ_V6_ODDS) == 0) {
+        int n = sizeof(fuzz_prefixes) / sizeof(fuzz_prefixes[0]);
+        ipv6_t src = fuzz_addr6(rng_below(state, fuzz_addrs));
+        ipv6_t dst = fuzz_addr6(rng_below(state, fuzz_addrs));
+        int src_len = fuzz_prefixes[rng_below(state, n)];
+        int dst_len = fuzz_prefixes[rng_below(state, n)];
+        port_match_t src_port = fuzz_rule_port(state);
+
+        rule.match = packet_match_key6(protocol, &src, src_len, src_port, &dst, dst_len,
+                fuzz_rule_port(state), &rule.match6);
+    } else {
+        uint32_t src = FUZZ_BASE_IP + rng_below(state, fuzz_addrs);
+        uint32_t dst = FUZZ_BASE_IP + rng_below(state, fuzz_addrs);
+        port_match_t src_port = fuzz_rule_port(state);
+
+        rule.match = packet_match_key(protocol, src, src_port, dst, fuzz_rule_port(state));
+        memset(&rule.match6, 0, sizeof(match6_t));
+    }
+
+    return rule;
+}
+
+/**
+ * This function draws a packet, either one that a rule drawn earlier matches (the
+ * ports it leaves open filled in at random) or one drawn at random.
+ *
+ * @param state the state of the generator
+ * @param rules the rules drawn so far in the case
+ * @param n the number of rules
+ *
+ * @return the packet, with its addresses all 0 if it is IPv4
+ */
+static packet6_t fuzz_packet(uint64_t *state, rule_t *rules, int n) {
+
+    packet6_t pkt;
+    memset(&pkt, 0, sizeof(pkt));
+
+    if (n == 0 || rng_below(state, FUZZ_RANDOM_ODDS) == 0) {
+        rule_t rule = fuzz_rule(state);
+        port_t src_port = fuzz_port(state);
+
+        if (PACKET_IS_V6(rule.match.value)) {
+            ipv6_t src = fuzz_addr6(rng_below(state, fuzz_addrs));
+            ipv6_t dst = fuzz_addr6(rng_below(state, fuzz_addrs));
+            return packet_key6(PACKET_PROTOCOL(rule.match.value), &src, src_port, &dst,
+                    fuzz_port(state));
+        }
+
+        pkt.key = packet_key(PACKET_PROTOCOL(rule.match.value),
+                PACKET_SRC_IP(rule.match.value), src_port,
+                PACKET_DST_IP(rule.match.value), fuzz_port(state));
+        return pkt;
+    }
+
+    rule_t *r = &rules[rng_below(state, n)];
+    packet_match_t *m = &r->match;
+    port_match_t src_port = MATCH_SRC_PORT(*m);
+    port_match_t dst_port = MATCH_DST_PORT(*m);
+    port_t src = src_port == MATCH_PORT_ANY ? fuzz_port(state) : (port_t) src_port;
+    port_t dst = dst_port == MATCH_PORT_ANY ? fuzz_port(state) : (port_t) dst_port;
+
+    if (PACKET_IS_V6(m->value)) {
+        return packet_key6(PACKET_PROTOCOL(m->value), &r->match6.src, src, &r->match6.dst,
+                dst);
+    }
+
+    pkt.key = packet_key(PACKET_PROTOCOL(m->value), PACKET_SRC_IP(m->value), src,
+            PACKET_DST_IP(m->value), dst);
+    return pkt;
+}
+
+/**
+ * This function draws the operations of a compiled case: rules and defaults, the
+ * policy they make built into a shared object, and packets to test against it.
+ *
+ * @param state the state of the generator
+ * @param ops the array to be populated, FUZZ_LARGE_OPS long
+ *
+ * @return the number of operations
+ */
+static int fuzz_compiled_case(uint64_t *state, fuzz_op_t *ops) {
+
+    int n = 1 + rng_below(state, fuzz_max_rules);
+    int ndrawn = 0;
+
+    for (int i = 0; i < n; i++) {
+        ops[i].pos = 0;
+
+        if (rng_below(state, OP_CHANGES) == 0) {
+            ops[i].kind = OP_DEFAULT;
+            ops[i].rule.action = rng_below(state, 2) ? ACTION_DENY : ACTION_ALLOW;
+        } else {
+            ops[i].kind = OP_APPEND;
+            ops[i].rule = fuzz_rule(state);
+            fuzz_drawn[ndrawn++] = ops[i].rule;
+        }
+    }
+
+    ops[n++].kind = OP_IMAGE;
+
+    int end = n + 1 + rng_below(state, FUZZ_MAX_OPS);
+    for (; n < end; n++) {
+        ops[n].kind = OP_TEST;
+        ops[n].pkt = fuzz_packet(state, fuzz_drawn, ndrawn);
+    }
+
+    return n;
+}
+
+/**
+ * This function draws the operations of a case. A large case starts by loading at
+ * least half of fuzz_max_rules rules in one transaction.
+ *
+ * @param state the state of the generator
+ * @param ops the array to be populated, FUZZ_LARGE_OPS long
+ *
+ * @return the number of operations
+ */
+static int fuzz_case(uint64_t *state, fuzz_op_t *ops) {
+
+    int n = 0;
+    int len = 0;
+    int ndrawn = 0;
+
+    if (fuzz_compiled) {
+        return fuzz_compiled_case(state, ops);
+    }
+
+    if (fuzz_large) {
+        int bulk = fuzz_max_rules / 2 + rng_below(state, fuzz_max_rules / 2 + 1);
+
+        ops[n++].kind = OP_BEGIN;
+        for (int i = 0; i < bulk; i++) {
+            ops[n].kind = OP_APPEND;
+            ops[n].pos = 0;
+            ops[n].rule = fuzz_rule(state);
+            fuzz_drawn[ndrawn++] = ops[n++].rule;
+        }
+        ops[n++].kind = OP_COMMIT;
+        len = bulk;
+    }
+
+    int start = n;
+    n += 1 + rng_below(state, FUZZ_MAX_OPS);
+
+    for (int i = start; i < n; i++) {
+        fuzz_op_t *op = &ops[i];
+
+        op->pos = 0;
+        op->kind = rng_below(state, FUZZ_CHANGE_ODDS) == 0
+                ? (int) rng_below(state, OP_CHANGES) : OP_TEST;
+
+        //Keep the policy from emptying out too often
+        if (op->kind == OP_DELETE && rng_below(state, 2)) {
+            op->kind = OP_APPEND;
+        }
+
+        if (op->kind == OP_APPEND || op->kind == OP_INSERT) {
+            op->rule = fuzz_rule(state);
+            fuzz_drawn[ndrawn++] = op->rule;
+            op->pos = op->kind == OP_INSERT ? 1 + (int) rng_below(state, len + 1) : 0;
+            len += len < fuzz_max_rules;
+        } else if (op->kind == OP_DELETE) {
+            op->pos = len ? 1 + (int) rng_below(state, len) : 1;
+            len -= len > 0;
+        } else if (op->kind == OP_DEFAULT) {
+            op->rule.action = rng_below(state, 2) ? ACTION_DENY : ACTION_ALLOW;
+        } else if (op->kind == OP_TEST) {
+            op->pkt = fuzz_packet(state, fuzz_drawn, ndrawn);
+        }
+    }
+
+    return n;
+}
+
+/**
+ * This function frees the copy of the rules a policy reloaded as an image was given.
+ *
+ * @param arg the rules
+ */
+static void image_release(void *arg) {
+
+    free(arg);
+}
+
+/**
+ * This function reloads the policy as a compiled image of its own rules.
+ *
+ * @param rules the rules
+ * @param len the number of rules
+ * @param def the default policy
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int fuzz_reload(rule_t *rules, int len, unsigned int def) {
+
+    if (len < 0) {
+        return -1;
+    }
+
+    image_rule_t *recs = (image_rule_t *) malloc((len ? len : 1) * sizeof(image_rule_t));
+
+    if (!recs) {
+        return -1;
+    }
+
+    for (int i = 0; i < len; i++) {
+        rule_pack(&rules[i], &recs[i]);
+    }
+
+    if (policy_load_image(recs, len, def, image_release, recs) == -1) {
+        free(recs);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * This function replaces the policy with its own rules built into a shared object:
+ * the source compiled_write() gives is built with FUZZ_COMPILED_BUILD and loaded with
+ * compiled_load(). The shared object is unlinked once loaded.
+ *
+ * @param rules the rules
+ * @param len the number of rules
+ * @param def the default policy
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int fuzz_compile(rule_t *rules, int len, unsigned int def) {
+
+    char path[FUZZ_COMPILED_PATH];
+    char cmd[sizeof(FUZZ_COMPILED_BUILD) + FUZZ_COMPILED_PATH];
+    FILE *fp = fopen(FUZZ_COMPILED_SOURCE, "w");
+
+    if (!fp) {
+        return -1;
+    }
+
+    int ret = compiled_write(fp, rules, len, def, "fwfuzz");
+
+    if (fclose(fp) != 0 || ret == -1) {
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "./fwfuzz-%d.so", fuzz_builds++);
+    snprintf(cmd, sizeof(cmd), "%s%s", FUZZ_COMPILED_BUILD, path);
+
+    if (system(cmd) != 0) {
+        return -1;
+    }
+
+    ret = compiled_load(path) == -1 ? -1 : 0;
+    unlink(path);
+
+    return ret;
+}
+
+/**
+ * This function checks whether the rules hold an IPv6 rule, which images cannot.
+ *
+ * @param rules the rules
+ * @param len the number of rules
+ *
+ * @return 1 if they do, 0 if not
+ */
+static int has_v6(const rule_t *rules, int len) {
+
+    for (int i = 0; i < len; i++) {
+        if (PACKET_IS_V6(rules[i].match.value)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * This function finds what the reference gives a packet: the first rule that matches
+ * it, or the default policy.
+ *
+ * @param ref the policy as the reference sees it
+ * @param pkt the packet
+ *
+ * @return the verdict
+ */
+static fuzz_verdict_t fuzz_verdict(const fuzz_ref_t *ref, const packet6_t *pkt) {
+
+    fuzz_verdict_t v = { ref->def, -1 };
+    int v6 = PACKET_IS_V6(pkt->key);
+
+    for (int j = 0; j < ref->len && v.pos == -1; j++) {
+        if (packet_match(&ref->rules[j].match, &pkt->key)
+                && (!v6 || packet_match6(&ref->rules[j].match6, pkt))) {
+            v.action = ref->rules[j].action;
+            v.pos = j;
+        }
+    }
+
+    return v;
+}
+
+/**
+ * This function is run by each reader thread. It tests the probe packets over and
+ * over, and checks every verdict given while no change was being made (fuzz_seq even
+ * and the same before and after) against the reference for that version.
+ *
+ * @param arg the reader
+ *
+ * @return NULL
+ */
+static void *fuzz_read(void *arg) {
+
+    fuzz_reader_t *r = (fuzz_reader_t *) arg;
+
+    while (!r->failed && !__atomic_load_n(&fuzz_stop, __ATOMIC_SEQ_CST)) {
+        for (int p = 0; p < fuzz_nprobes && !r->failed; p++) {
+            packet6_t pkt = fuzz_probes[p];
+            unsigned long before = __atomic_load_n(&fuzz_seq, __ATOMIC_SEQ_CST);
+            int pos;
+            int action = policy_test(&pkt.key, &pos);
+            unsigned long after = __atomic_load_n(&fuzz_seq, __ATOMIC_SEQ_CST);
+            fuzz_verdict_t *want = &fuzz_expected[before / 2][p];
+
+            if (before == after && !(before & 1)
+                    && (action != want->action || pos != want->pos)) {
+                r->failed = 1;
+                r->probe = p;
+                r->version = before / 2;
+                r->action = action;
+                r->pos = pos;
+            }
+        }
+    }
+
+    flow_cache_free();
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+/**
+ * This function records what the reference gives each probe packet for a version of
+ * the policy once it is in place, and lets the readers check against it.
+ *
+ * @param ref the policy as the reference sees it
+ * @param version the version
+ * @param op the operation that made the version, or -1 for the first
+ */
+static void fuzz_publish(const fuzz_ref_t *ref, unsigned long version, int op) {
+
+    for (int p = 0; p < fuzz_nprobes; p++) {
+        fuzz_expected[version][p] = fuzz_verdict(ref, &fuzz_probes[p]);
+    }
+    fuzz_version_op[version] = op;
+
+    __atomic_store_n(&fuzz_seq, version * 2, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * This function starts the reader threads on the packets a case tests.
+ *
+ * @param ops the operations
+ * @param n the number of operations
+ * @param ref the policy as the reference sees it
+ *
+ * @return the number of threads started
+ */
+static int fuzz_readers_start(fuzz_op_t *ops, int n, const fuzz_ref_t *ref) {
+
+    fuzz_nprobes = 0;
+    for (int i = 0; i < n && fuzz_nprobes < FUZZ_PROBES; i++) {
+        if (ops[i].kind == OP_TEST) {
+            fuzz_probes[fuzz_nprobes++] = ops[i].pkt;
+        }
+    }
+
+    if (fuzz_nprobes == 0) {
+        return 0;
+    }
+
+    fuzz_stop = 0;
+    fuzz_publish(ref, 0, -1);
+
+    int started = 0;
+    while (started < fuzz_threads) {
+        fuzz_reader_t *r = &fuzz_readers[started];
+
+        r->failed = 0;
+        if (pthread_create(&r->thread, NULL, fuzz_read, r) != 0) {
+            break;
+        }
+        started++;
+    }
+
+    return started;
+}
+
+/**
+ * This function stops the reader threads and picks up the first disagreement one of
+ * them found.
+ *
+ * @param started the number of threads started
+ * @param fail the value to be updated with the disagreement
+ *
+ * @return 1 if a reader disagreed with the reference, 0 if not
+ */
+static int fuzz_readers_stop(int started, fuzz_fail_t *fail) {
+
+    int failed = 0;
+
+    __atomic_store_n(&fuzz_stop, 1, __ATOMIC_SEQ_CST);
+
+    for (int t = 0; t < started; t++) {
+        fuzz_reader_t *r = &fuzz_readers[t];
+
+        pthread_join(r->thread, NULL);
+
+        if (r->failed && !failed) {
+            fuzz_verdict_t *want = &fuzz_expected[r->version][r->probe];
+
+            fail->op = fuzz_version_op[r->version];
+            fail->action = r->action;
+            fail->pos = r->pos;
+            fail->want_action = want->action;
+            fail->want_pos = want->pos;
+            fail->probe = r->probe;
+            failed = 1;
+        }
+    }
+
+    return failed;
+}
+
+/**
+ * This function plays a case against a fresh policy with one engine, keeping the
+ * reference rules alongside. Operations that do not apply to the policy as it stands
+ * (deleting a rule that is not there, say) are skipped, so any subset of a case can be
+ * played. Changes made while a transaction is open are staged and applied to the
+ * reference only when it commits; packets are tested against the committed rules.
+ * With fuzz_threads set, reader threads test the case's packets while it is played.
+ *
+ * @param ops the operations, whose .played and .at are updated
+ * @param n the number of operations
+ * @param engine the name of the engine
+ * @param fail the value to be updated with the first disagreement
+ *
+ * @return 1 if the policy disagreed with the reference, 0 if not
+ */
+static int fuzz_play(fuzz_op_t *ops, int n, char *engine, fuzz_fail_t *fail) {
+
+    fuzz_ref_t *ref = &fuzz_ref;
+    fuzz_ref_t *staged = &fuzz_staged;
+    policy_edit_t *edits = fuzz_edits;
+    int nedits = 0;
+    int open = 0;
+    int failed = 0;
+    int readers = 0;
+    unsigned long version = 0;
+
+    ref->len = 0;
+    ref->def = ACTION_DENY;
+
+    policy_set_compact(fuzz_compact);
+    policy_init();
+    policy_set_default(ref->def);
+    policy_set_engine(engine);
+
+    if (fuzz_threads) {
+        readers = fuzz_readers_start(ops, n, ref);
+    }
+
+    for (int i = 0; i < n && !failed; i++) {
+        fuzz_op_t *op = &ops[i];
+        fuzz_ref_t *cur = open ? staged : ref;
+        policy_edit_t *edit = &edits[nedits];
+        int ret = 0;
+
+        //Changes staged in a transaction leave the policy the readers see alone
+        int live = readers && op->kind != OP_TEST && (!open || op->kind == OP_COMMIT);
+
+        if (live) {
+            __atomic_store_n(&fuzz_seq, version * 2 + 1, __ATOMIC_SEQ_CST);
+        }
+
+        fail->op = i;
+        fail->action = -1;
+        fail->pos = -1;
+        fail->want_action = -1;
+        fail->want_pos = -1;
+        fail->probe = -1;
+
+        op->played = 1;
+        op->at = 0;
+
+        if ((op->kind == OP_APPEND || op->kind == OP_INSERT) && cur->len < fuzz_max_rules) {
+            int pos;
+
+            op->at = op->kind == OP_INSERT && op->pos <= cur->len ? op->pos : 0;
+            pos = op->at ? op->at : cur->len + 1;
+
+            if (open) {
+                edit->kind = EDIT_INSERT;
+                edit->pos = op->at ? op->at : -1;
+                edit->rule = op->rule;
+                nedits++;
+            } else {
+                ret = op->at ? policy_insert(op->rule, pos) : policy_append(op->rule);
+            }
+
+            memmove(&cur->rules[pos], &cur->rules[pos - 1],
+                    (cur->len - pos + 1) * sizeof(rule_t));
+            cur->rules[pos - 1] = op->rule;
+            cur->len++;
+        } else if (op->kind == OP_DELETE && op->pos <= cur->len) {
+            if (open) {
+                edit->kind = EDIT_DELETE;
+                edit->pos = op->pos;
+                nedits++;
+            } else {
+                ret = policy_delete(op->pos);
+            }
+
+            memmove(&cur->rules[op->pos - 1], &cur->rules[op->pos],
+                    (cur->len - op->pos) * sizeof(rule_t));
+            cur->len--;
+        } else if (op->kind == OP_DEFAULT) {
+            if (open) {
+                edit->kind = EDIT_DEFAULT;
+                edit->rule.action = op->rule.action;
+                nedits++;
+            } else {
+                ret = policy_set_default(op->rule.action);
+            }
+
+            cur->def = op->rule.action;
+        } else if (op->kind == OP_IMAGE && !open && fuzz_compiled) {
+            ret = fuzz_compile(ref->rules, ref->len, ref->def);
+        } else if (op->kind == OP_IMAGE && !open && !has_v6(ref->rules, ref->len)) {
+            ret = fuzz_reload(ref->rules, ref->len, ref->def);
+        } else if (op->kind == OP_BEGIN && !open) {
+            staged->len = ref->len;
+            staged->def = ref->def;
+            memcpy(staged->rules, ref->rules, ref->len * sizeof(rule_t));
+            nedits = 0;
+            open = 1;
+        } else if (op->kind == OP_COMMIT && open) {
+            unsigned int bad;
+
+            fuzz_ref_t *committed = staged;
+
+            ret = policy_commit(edits, nedits, &bad);
+            staged = ref;
+            ref = committed;
+            open = 0;
+        } else if (op->kind == OP_TEST) {
+            fuzz_verdict_t want = fuzz_verdict(ref, &op->pkt);
+
+            fail->want_action = want.action;
+            fail->want_pos = want.pos;
+            fail->action = policy_test(&op->pkt.key, &fail->pos);
+            failed = fail->action != fail->want_action || fail->pos != fail->want_pos;
+        } else {
+            op->played = 0;
+        }
+
+        if (ret == -1) {
+            failed = 1;
+        }
+
+        if (live) {
+            fuzz_publish(ref, ++version, i);
+        }
+    }
+
+    if (readers) {
+        fuzz_fail_t seen;
+
+        if (fuzz_readers_stop(readers, &seen) && !failed) {
+            *fail = seen;
+            failed = 1;
+        }
+    }
+
+    policy_free();
+
+    return failed;
+}
+
+/**
+ * This function shrinks a case that disagrees with the reference, removing runs of
+ * operations (halving their length whenever none can go) for as long as what is left
+ * still disagrees.
+ *
+ * @param ops the operations, which are updated with the shrunk case
+ * @param n the number of operations
+ * @param engine the name of the engine the case disagrees with
+ * @param fail the value to be updated with the disagreement of the shrunk case
+ *
+ * @return the number of operations left
+ */
+static int fuzz_shrink(fuzz_op_t *ops, int n, char *engine, fuzz_fail_t *fail) {
+
+    fuzz_op_t *trial = fuzz_trial;
+    fuzz_fail_t seen;
+
+    fuzz_play(ops, n, engine, fail);
+    n = fail->op + 1;
+
+    for (int run = n / 2; run >= 1; ) {
+        int shrunk = 0;
+
+        for (int start = 0; start + run <= n; ) {
+            memcpy(trial, ops, start * sizeof(fuzz_op_t));
+            memcpy(trial + start, ops + start + run, (n - start - run) * sizeof(fuzz_op_t));
+
+            if (fuzz_play(trial, n - run, engine, &seen)) {
+                n = seen.op + 1;
+                memcpy(ops, trial, n * sizeof(fuzz_op_t));
+                *fail = seen;
+                shrunk = 1;
+            } else {
+                start += run;
+            }
+        }
+
+        if (!shrunk) {
+            run /= 2;
+        } else if (run > n / 2) {
+            run = n / 2;
+        }
+    }
+
+    return n;
+}
+
+/**
+ * This function writes a packet as the arguments of a test command.
+ *
+ * @param stream the file stream to write to
+ * @param pkt the key of the packet
+ */
+static void packet_print(FILE *stream, const packet_t *pkt) {
+
+    const char *protocol = PACKET_PROTOCOL(*pkt) == PROTO_UDP ? "udp" : "tcp";
+
+    if (PACKET_IS_V6(*pkt)) {
+        char src[IPV6_TEXT_SIZE];
+        char dst[IPV6_TEXT_SIZE];
+
+        ipv6_format(&PACKET_V6(pkt)->src, src);
+        ipv6_format(&PACKET_V6(pkt)->dst, dst);
+        fprintf(stream, "%s [%s]:%u [%s]:%u", protocol, src, PACKET_SRC_PORT(*pkt), dst,
+                PACKET_DST_PORT(*pkt));
+    } else {
+        char src[IPV4_TEXT_SIZE];
+        char dst[IPV4_TEXT_SIZE];
+
+        ipv4_format(PACKET_SRC_IP(*pkt), src);
+        ipv4_format(PACKET_DST_IP(*pkt), dst);
+        fprintf(stream, "%s %s:%u %s:%u", protocol, src, PACKET_SRC_PORT(*pkt), dst,
+                PACKET_DST_PORT(*pkt));
+    }
+}
+
+/**
+ * This function writes a verdict the way fwsim words it.
+ *
+ * @param stream the file stream to write to
+ * @param action the action, or -1 if a change could not be applied
+ * @param pos the index of the matched rule, or -1
+ */
+static void verdict_print(FILE *stream, int action, int pos) {
+
+    if (action == -1) {
+        fprintf(stream, "the change failed");
+    } else if (pos == -1) {
+        fprintf(stream, "%s via default policy", action == ACTION_ALLOW ? "allowed" : "denied");
+    } else {
+        fprintf(stream, "%s via [%d]", action == ACTION_ALLOW ? "allowed" : "denied",
+                pos + 1);
+    }
+}
+
+/**
+ * This function prints a shrunk case as commands for fwsim, leaving out the operations
+ * that were skipped when it was played. A compiled case is printed as the rules file
+ * fwcompile builds the policy from, then the input fwsim tests it with.
+ *
+ * @param stream the file stream to print to
+ * @param ops the operations
+ * @param n the number of operations
+ * @param engine the name of the engine the case disagrees with
+ * @param fail the disagreement
+ */
+static void fuzz_print(FILE *stream, fuzz_op_t *ops, int n, char *engine,
+        fuzz_fail_t *fail) {
+
+    if (fuzz_compiled) {
+        fprintf(stream, "Reproducer (./fwcompile -o %s <rules> && %sfwfuzz.so"
+                " && ./fwsim --compiled ./fwfuzz.so < <input>), rules:\n",
+                FUZZ_COMPILED_SOURCE, FUZZ_COMPILED_BUILD);
+    } else {
+        fprintf(stream, "Reproducer (./fwsim --engine %s%s):\n", engine,
+                fuzz_compact ? " --compact-rules" : "");
+    }
+
+    for (int i = 0; i < n; i++) {
+        fuzz_op_t *op = &ops[i];
+
+        if (!op->played) {
+            continue;
+        }
+
+        if (op->kind == OP_APPEND || op->kind == OP_INSERT) {
+            if (op->at) {
+                fprintf(stream, "insert %d ", op->at);
+            } else {
+                fprintf(stream, "append ");
+            }
+            rule_print(stream, &op->rule);
+        } else if (op->kind == OP_DELETE) {
+            fprintf(stream, "delete %d\n", op->pos);
+        } else if (op->kind == OP_DEFAULT) {
+            fprintf(stream, "default %s\n",
+                    op->rule.action == ACTION_ALLOW ? "allow" : "deny");
+        } else if (op->kind == OP_IMAGE && fuzz_compiled) {
+            fprintf(stream, "Input:\n");
+        } else if (op->kind == OP_IMAGE) {
+            fprintf(stream, "save %s\nload %s\n", FUZZ_IMAGE_FILE, FUZZ_IMAGE_FILE);
+        } else if (op->kind == OP_BEGIN) {
+            fprintf(stream, "begin\n");
+        } else if (op->kind == OP_COMMIT) {
+            fprintf(stream, "commit\n");
+        } else if (op->kind == OP_TEST) {
+            fprintf(stream, "test ");
+            packet_print(stream, &op->pkt.key);
+            fprintf(stream, "\n");
+        }
+    }
+
+    fprintf(stream, "Expected ");
+    verdict_print(stream, fail->want_action, fail->want_pos);
+    fprintf(stream, ", got ");
+    verdict_print(stream, fail->action, fail->pos);
+    fprintf(stream, ".\n");
+}
+
+/**
+ * Starting point for the program. Process command-line arguments, then play every
+ * case against every engine until one disagrees with the reference.
+ *
+ * @param argc number of command-line arguments.
+ * @param argv list of command-line arguments.
+ *
+ * @return program exit status
+ */
+int main(int argc, char *argv[]) {
+
+    unsigned long seed = 1;
+    int cases = FUZZ_CASES;
+    char **engines = fuzz_engines;
+    int nengines = sizeof(fuzz_engines) / sizeof(fuzz_engines[0]);
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp("-s", argv[i]) == 0 && i + 1 < argc) {
+            seed = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp("-n", argv[i]) == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            cases = atoi(argv[++i]);
+        } else if (strcmp("--engine", argv[i]) == 0 && i + 1 < argc) {
+            engines = &argv[++i];
+            nengines = 1;
+        } else if (strcmp("--compact-rules", argv[i]) == 0) {
+            fuzz_compact = 1;
+        } else if (strcmp("--threads", argv[i]) == 0 && i + 1 < argc
+                && atoi(argv[i + 1]) > 0 && atoi(argv[i + 1]) <= FUZZ_MAX_THREADS) {
+            fuzz_threads = atoi(argv[++i]);
+        } else if (strcmp("--large", argv[i]) == 0) {
+            fuzz_large = 1;
+            fuzz_max_rules = FUZZ_LARGE_RULES;
+            fuzz_addrs = FUZZ_LARGE_ADDRS;
+            fuzz_nports = FUZZ_LARGE_PORTS;
+        } else if (strcmp("--compiled", argv[i]) == 0) {
+            fuzz_compiled = 1;
+        } else {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    //The generated matcher stands in for the engine, so one is enough
+    if (fuzz_compiled && engines == fuzz_engines) {
+        nengines = 1;
+    }
+
+    //Make sure the engines exist before blaming them for anything
+    policy_init();
+    for (int e = 0; e < nengines; e++) {
+        if (policy_set_engine(engines[e]) == -1) {
+            fprintf(stderr, "Error: Unknown engine %s.\n", engines[e]);
+            usage();
+            policy_free();
+            stats_free();
+            return EXIT_FAILURE;
+        }
+    }
+    policy_free();
+
+    fuzz_op_t *ops = fuzz_ops;
+    fuzz_fail_t fail;
+    long tests = 0;
+    long changes = 0;
+    int status = EXIT_SUCCESS;
+
+    for (int c = 0; c < cases && status == EXIT_SUCCESS; c++) {
+        //Each case is drawn from its own seed, so it can be replayed alone
+        uint64_t state = (seed << 32 ^ c) * 0x9E3779B97F4A7C15ULL | 1;
+        int n = fuzz_case(&state, ops);
+
+        for (int i = 0; i < n; i++) {
+            tests += ops[i].kind == OP_TEST;
+            changes += ops[i].kind != OP_TEST;
+        }
+
+        for (int e = 0; e < nengines && status == EXIT_SUCCESS; e++) {
+            if (!fuzz_play(ops, n, engines[e], &fail)) {
+                continue;
+            }
+
+            status = EXIT_FAILURE;
+
+            //What a reader saw depends on timing, so it is printed as it is, not shrunk
+            if (fail.probe >= 0) {
+                printf("Case %d of seed %lu disagrees with the reference on engine %s "
+                        "while %d threads tested its packets.\n", c, seed, engines[e],
+                        fuzz_threads);
+                n = fail.op + 1;
+                for (int i = 0; i < n; i++) {
+                    ops[i].played &= ops[i].kind != OP_TEST;
+                }
+                ops[n].kind = OP_TEST;
+                ops[n].pkt = fuzz_probes[fail.probe];
+                ops[n].played = 1;
+                fuzz_print(stdout, ops, n + 1, engines[e], &fail);
+                continue;
+            }
+
+            printf("Case %d of seed %lu disagrees with the reference on engine %s.\n",
+                    c, seed, engines[e]);
+
+            int threads = fuzz_threads;
+            fuzz_threads = 0;
+            n = fuzz_shrink(ops, n, engines[e], &fail);
+            fuzz_threads = threads;
+            fuzz_print(stdout, ops, n, engines[e], &fail);
+        }
+    }
+
+    if (status == EXIT_SUCCESS) {
+        printf("Checked %d %s%scases (%ld changes, %ld packets) on %d engines%s",
+                cases, fuzz_large ? "large " : "", fuzz_compiled ? "compiled " : "",
+                changes, tests, nengines, fuzz_compact ? " with compact rules" : "");
+        if (fuzz_threads) {
+            printf(" with %d reader threads", fuzz_threads);
+        }
+        printf(": no disagreements.\n");
+    }
+
+    flow_cache_free();
+    stats_free();
+
+    return status;
+}
@@ -0,0 +1,552 @@
+/**
+ * @file fwgen.c
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This is the top-level component of the synthetic policy generator.
+ * It writes a seeded rules file and, optionally, a trace of test commands for it,
+ * modeled on the ClassBench generators. Addresses are drawn from a skewed hierarchy of
+ * sites, subnets and hosts so that rules share addresses the way real policies do,
+ * destination ports favour well-known services and source ports are mostly wildcards.
+ * The trace picks a rule at random, makes a header it matches and repeats that header
+ * a Pareto-distributed number of times, so the Pareto scale tunes the locality of the
+ * trace: 0 writes every header once.
+ *
+ * With -6 the same hierarchy is written as IPv6 addresses under 2001:db8::/32, one /48
+ * for each site and one /64 for each subnet, and some rules match a whole site or
+ * subnet instead of a single host, so IPv6 classification can be measured against
+ * IPv4 on policies of the same shape.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "packet.h"
+
+/** Default number of rules */
+#define GEN_RULES 1000
+
+/** Default number of test commands */
+#define GEN_PACKETS 100000
+
+/** Default seed */
+#define GEN_SEED 1
+
+/** Default shape of the Pareto distribution of burst lengths */
+#define GEN_PARETO_A 1.0
+
+/** Default scale of the Pareto distribution of burst lengths (no locality) */
+#define GEN_PARETO_B 0.0
+
+/** Number of rules that share a site, on average */
+#define GEN_RULES_PER_SITE 4096
+
+/** Number of subnets in a site */
+#define GEN_SUBNETS 256
+
+/** Number of hosts in a subnet that clients are drawn from */
+#define GEN_CLIENTS 254
+
+/** Number of hosts in a subnet that servers are drawn from */
+#define GEN_SERVERS 16
+
+/** First octet of the first site */
+#define GEN_SITE_BASE 10
+
+/** Lowest ephemeral port */
+#define GEN_EPHEMERAL 1024
+
+/** Percentage of rules with a wildcard source port */
+#define GEN_SRC_ANY 80
+
+/** Percentage of rules with a wildcard destination port */
+#define GEN_DST_ANY 15
+
+/** Percentage of exact destination ports that are well-known services */
+#define GEN_DST_WELL_KNOWN 80
+
+/** Percentage of rules that are UDP */
+#define GEN_UDP 20
+
+/** Percentage of rules that deny */
+#define GEN_DENY 30
+
+/** Length of the IPv6 prefix of a site */
+#define GEN_V6_SITE_LEN 48
+
+/** Length of the IPv6 prefix of a subnet */
+#define GEN_V6_SUBNET_LEN 64
+
+/** Percentage of IPv6 rules whose source is a whole subnet */
+#define GEN_V6_SRC_SUBNET 30
+
+/** Percentage of IPv6 rules whose source is a whole site */
+#define GEN_V6_SRC_SITE 20
+
+/** Percentage of IPv6 rules whose destination is a whole subnet */
+#define GEN_V6_DST_SUBNET 15
+
+/** Percentage of IPv6 rules whose destination is a whole site */
+#define GEN_V6_DST_SITE 5
+
+/** Number of distinct values a percentage is drawn from */
+#define PERCENT 100
+
+/** Well-known destination ports, most common first */
+static const port_t well_known[] = { 80, 443, 53, 22, 25, 8080, 110, 143, 123, 3306,
+        161, 21, 993, 995, 389, 5432, 1433, 23, 636, 6379 };
+
+/**
+ * Representation of a generated rule
+ * .protocol: PROTO_TCP or PROTO_UDP
+ * .src_ip: the packed source address
+ * .dst_ip: the packed destination address
+ * .src_port: the source port, or MATCH_PORT_ANY
+ * .dst_port: the destination port, or MATCH_PORT_ANY
+ * .src_len: the length of the source prefix when written as IPv6
+ * .dst_len: the length of the destination prefix when written as IPv6
+ * .deny: 1 if the rule denies, 0 if it allows
+ */
+typedef struct gen_rule {
+    protocol_t protocol;
+    uint32_t src_ip;
+    uint32_t dst_ip;
+    int src_len;
+    int dst_len;
+    port_match_t src_port;
+    port_match_t dst_port;
+    int deny;
+} gen_rule_t;
+
+/** State of the random number generator */
+static uint64_t rng_state;
+
+/** Whether addresses are written as IPv6 */
+static int gen_v6;
+
+/**
+ * This function draws the next value of a SplitMix64 generator, which gives the same
+ * sequence for a seed on every platform.
+ *
+ * @return the value
+ */
+static uint64_t rng_next() {
+
+    uint64_t z = (rng_state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+
+    return z ^ (z >> 31);
+}
+
+/**
+ * This function draws a value below @n, uniformly.
+ *
+ * @param n the number of values
+ *
+ * @return the value
+ */
+static unsigned int rng_below(unsigned int n) {
+
+    return (unsigned int) (rng_next() % n);
+}
+
+/**
+ * This function draws a value below @n, favouring small values: the probability of a
+ * value falls off roughly harmonically, so a few values are drawn most of the time and
+ * the rest form a long tail.
+ *
+ * @param n the number of values
+ *
+ * @return the value
+ */
+static unsigned int rng_skewed(unsigned int n) {
+
+    return rng_below(rng_below(n) + 1);
+}
+
+/**
+ * This function draws a value in (0, 1].
+ *
+ * @return the value
+ */
+static double rng_unit() {
+
+    return ((rng_next() >> 11) + 1) * (1.0 / (1ULL << 53));
+}
+
+/**
+ * This function draws the length of a burst from a Pareto distribution, as the
+ * ClassBench trace generator does.
+ *
+ * @param a the shape
+ * @param b the scale, or 0 for bursts of one
+ * @param max the longest burst wanted
+ *
+ * @return the length, from 1 to @max
+ */
+static unsigned long pareto(double a, double b, unsigned long max) {
+
+    if (b <= 0) {
+        return 1;
+    }
+
+    double x = ceil(b / pow(rng_unit(), 1 / a));
+
+    return x < 1 ? 1 : x > max ? max : (unsigned long) x;
+}
+
+/**
+ * This function draws an address from a skewed hierarchy of sites, subnets and hosts.
+ *
+ * @param sites the number of sites
+ * @param hosts the number of hosts in a subnet
+ *
+ * @return the packed address
+ */
+static uint32_t gen_addr(unsigned int sites, unsigned int hosts) {
+
+    unsigned int site = rng_skewed(sites);
+    unsigned int subnet = rng_skewed(GEN_SUBNETS);
+    unsigned int host = rng_skewed(hosts) + 1;
+
+    return ((uint32_t) (GEN_SITE_BASE + site / GEN_SUBNETS) << (BIT_SIZE * 3))
+            | (site % GEN_SUBNETS) << (BIT_SIZE * 2) | subnet << BIT_SIZE | host;
+}
+
+/**
+ * This function draws a port above the well-known range.
+ *
+ * @return the port
+ */
+static port_t gen_ephemeral() {
+
+    return GEN_EPHEMERAL + rng_below(PORT_MAX - GEN_EPHEMERAL + 1);
+}
+
+/**
+ * This function draws the length of the IPv6 prefix of an address.
+ *
+ * @param subnet the percentage of prefixes that are a whole subnet
+ * @param site the percentage of prefixes that are a whole site
+ *
+ * @return the length
+ */
+static int gen_prefix_len(unsigned int subnet, unsigned int site) {
+
+    unsigned int pick = rng_below(PERCENT);
+
+    if (pick < site) {
+        return GEN_V6_SITE_LEN;
+    }
+
+    return pick < site + subnet ? GEN_V6_SUBNET_LEN : IPV6_BITS;
+}
+
+/**
+ * This function generates a rule.
+ *
+ * @param rule the rule to be populated
+ * @param sites the number of sites addresses are drawn from
+ */
+static void gen_rule(gen_rule_t *rule, unsigned int sites) {
+
+    int wk = sizeof(well_known) / sizeof(well_known[0]);
+
+    rule->protocol = rng_below(PERCENT) < GEN_UDP ? PROTO_UDP : PROTO_TCP;
+    rule->src_ip = gen_addr(sites, GEN_CLIENTS);
+    rule->dst_ip = gen_addr(sites, GEN_SERVERS);
+    rule->src_port = rng_below(PERCENT) < GEN_SRC_ANY ? MATCH_PORT_ANY
+            : gen_ephemeral();
+
+    if (rng_below(PERCENT) < GEN_DST_ANY) {
+        rule->dst_port = MATCH_PORT_ANY;
+    } else if (rng_below(PERCENT) < GEN_DST_WELL_KNOWN) {
+        rule->dst_port = well_known[rng_skewed(wk)];
+    } else {
+        rule->dst_port = gen_ephemeral();
+    }
+
+    //Only IPv6 rules draw prefix lengths, so an IPv4 policy is the same for a seed
+    rule->src_len = gen_v6 ? gen_prefix_len(GEN_V6_SRC_SUBNET, GEN_V6_SRC_SITE)
+            : IPV6_BITS;
+    rule->dst_len = gen_v6 ? gen_prefix_len(GEN_V6_DST_SUBNET, GEN_V6_DST_SITE)
+            : IPV6_BITS;
+    rule->deny = rng_below(PERCENT) < GEN_DENY;
+}
+
+/**
+ * This function prints a packed address followed by a colon.
+ *
+ * @param stream the file stream to print to
+ * @param ip the packed address
+ */
+static void print_addr(FILE *stream, uint32_t ip) {
+
+    fprintf(stream, "%u.%u.%u.%u:", ip >> (BIT_SIZE * 3), ip >> (BIT_SIZE * 2)
+            & IP_OCTET_MAX, ip >> BIT_SIZE & IP_OCTET_MAX, ip & IP_OCTET_MAX);
+}
+
+/**
+ * This function prints an address of the hierarchy as an IPv6 prefix in brackets
+ * followed by a colon. The site is the top two octets of the packed address, the
+ * subnet the third and the host the fourth.
+ *
+ * @param stream the file stream to print to
+ * @param ip the packed address
+ * @param len the length of the prefix
+ */
+static void print_addr6(FILE *stream, uint32_t ip, int len) {
+
+    unsigned int site = ip >> (BIT_SIZE * 2);
+    unsigned int subnet = ip >> BIT_SIZE & IP_OCTET_MAX;
+    unsigned int host = ip & IP_OCTET_MAX;
+
+    if (len == GEN_V6_SITE_LEN) {
+        fprintf(stream, "[2001:db8:%x::/%d]:", site, len);
+    } else if (len == GEN_V6_SUBNET_LEN) {
+        fprintf(stream, "[2001:db8:%x:%x::/%d]:", site, subnet, len);
+    } else {
+        fprintf(stream, "[2001:db8:%x:%x::%x]:", site, subnet, host);
+    }
+}
+
+/**
+ * This function prints a rule's address in the family being written.
+ *
+ * @param stream the file stream to print to
+ * @param ip the packed address
+ * @param len the length of the prefix when written as IPv6
+ */
+static void print_rule_addr(FILE *stream, uint32_t ip, int len) {
+
+    if (gen_v6) {
+        print_addr6(stream, ip, len);
+    } else {
+        print_addr(stream, ip);
+    }
+}
+
+/**
+ * This function makes the address of a packet matched by a rule's address, drawing
+ * whatever the rule's IPv6 prefix leaves out.
+ *
+ * @param ip the packed address of the rule
+ * @param len the length of the prefix when written as IPv6
+ * @param hosts the number of hosts in a subnet
+ *
+ * @return the packed address of the packet
+ */
+static uint32_t gen_member(uint32_t ip, int len, unsigned int hosts) {
+
+    if (!gen_v6 || len == IPV6_BITS) {
+        return ip;
+    }
+
+    uint32_t host = rng_skewed(hosts) + 1;
+
+    if (len == GEN_V6_SUBNET_LEN) {
+        return ip >> BIT_SIZE << BIT_SIZE | host;
+    }
+
+    return ip >> (BIT_SIZE * 2) << (BIT_SIZE * 2) | rng_skewed(GEN_SUBNETS) << BIT_SIZE
+            | host;
+}
+
+/**
+ * This function prints a port, or * for MATCH_PORT_ANY.
+ *
+ * @param stream the file stream to print to
+ * @param port the port
+ */
+static void print_port(FILE *stream, port_match_t port) {
+
+    if (port == MATCH_PORT_ANY) {
+        fprintf(stream, "*");
+    } else {
+        fprintf(stream, "%d", port);
+    }
+}
+
+/**
+ * This function writes the rules as a rules file.
+ *
+ * @param stream the file stream to write to
+ * @param rules the rules
+ * @param n the number of rules
+ */
+static void write_rules(FILE *stream, gen_rule_t *rules, unsigned int n) {
+
+    fprintf(stream, "default deny\n");
+
+    for (unsigned int i = 0; i < n; i++) {
+        gen_rule_t *r = &rules[i];
+
+        fprintf(stream, "append %s %s ", r->deny ? "deny" : "allow",
+                r->protocol == PROTO_UDP ? "udp" : "tcp");
+        print_rule_addr(stream, r->src_ip, r->src_len);
+        print_port(stream, r->src_port);
+        fprintf(stream, " ");
+        print_rule_addr(stream, r->dst_ip, r->dst_len);
+        print_port(stream, r->dst_port);
+        fprintf(stream, "\n");
+    }
+}
+
+/**
+ * This function writes a trace of test commands, each burst a header matching a rule
+ * picked at random. Wildcard ports are filled in with ports drawn as for the rules, and
+ * the hosts of IPv6 prefixes with hosts drawn as for the rules.
+ *
+ * @param stream the file stream to write to
+ * @param rules the rules
+ * @param n the number of rules
+ * @param packets the number of test commands
+ * @param a the shape of the distribution of burst lengths
+ * @param b the scale of the distribution of burst lengths
+ */
+static void write_trace(FILE *stream, gen_rule_t *rules, unsigned int n,
+        unsigned long packets, double a, double b) {
+
+    unsigned long written = 0;
+
+    while (written < packets) {
+        gen_rule_t *r = &rules[rng_below(n)];
+        port_t src_port = r->src_port == MATCH_PORT_ANY ? gen_ephemeral() : r->src_port;
+        port_t dst_port = r->dst_port == MATCH_PORT_ANY
+                ? well_known[rng_skewed(sizeof(well_known) / sizeof(well_known[0]))]
+                : r->dst_port;
+        uint32_t src_ip = gen_member(r->src_ip, r->src_len, GEN_CLIENTS);
+        uint32_t dst_ip = gen_member(r->dst_ip, r->dst_len, GEN_SERVERS);
+
+        for (unsigned long k = pareto(a, b, packets - written); k > 0; k--) {
+            fprintf(stream, "test %s ", r->protocol == PROTO_UDP ? "udp" : "tcp");
+            print_rule_addr(stream, src_ip, IPV6_BITS);
+            fprintf(stream, "%u ", src_port);
+            print_rule_addr(stream, dst_ip, IPV6_BITS);
+            fprintf(stream, "%u\n", dst_port);
+            written++;
+        }
+    }
+}
+
+/** Print out a usage message. */
+static void usage() {
+    fprintf(stderr, "Usage: fwgen [-6] [-s <seed>] [-n <rules>] [-p <packets>]"
+            " [-a <pareto_a>] [-b <pareto_b>]\n"
+            "             <rule_file> [<trace_file>]\n");
+}
+
+/**
+ * This function opens a file for writing and writes the rules or trace to it.
+ *
+ * @param filename the name of the file
+ * @param rules the rules
+ * @param n the number of rules
+ * @param packets the number of test commands, or 0 to write the rules
+ * @param a the shape of the distribution of burst lengths
+ * @param b the scale of the distribution of burst lengths
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int write_file(char *filename, gen_rule_t *rules, unsigned int n,
+        unsigned long packets, double a, double b) {
+
+    FILE *fp = fopen(filename, "w");
+
+    if (!fp) {
+        return -1;
+    }
+
+    if (packets) {
+        write_trace(fp, rules, n, packets, a, b);
+    } else {
+        write_rules(fp, rules, n);
+    }
+
+    int err = ferror(fp);
+
+    return fclose(fp) != 0 || err ? -1 : 0;
+}
+
+/**
+ * Starting point for the program. Process command-line arguments, then generate the
+ * rules and write them and the trace.
+ *
+ * @param argc number of command-line arguments.
+ * @param argv list of command-line arguments.
+ *
+ * @return program exit status
+ */
+int main(int argc, char *argv[]) {
+
+    unsigned long long seed = GEN_SEED;
+    unsigned long n = GEN_RULES;
+    unsigned long packets = GEN_PACKETS;
+    double a = GEN_PARETO_A;
+    double b = GEN_PARETO_B;
+    char *rules_file = NULL;
+    char *trace_file = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp("-6", argv[i]) == 0) {
+            gen_v6 = 1;
+        } else if (strcmp("-s", argv[i]) == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp("-n", argv[i]) == 0 && i + 1 < argc
+                && atol(argv[i + 1]) > 0) {
+            n = atol(argv[++i]);
+        } else if (strcmp("-p", argv[i]) == 0 && i + 1 < argc
+                && atol(argv[i + 1]) > 0) {
+            packets = atol(argv[++i]);
+        } else if (strcmp("-a", argv[i]) == 0 && i + 1 < argc
+                && atof(argv[i + 1]) > 0) {
+            a = atof(argv[++i]);
+        } else if (strcmp("-b", argv[i]) == 0 && i + 1 < argc
+                && atof(argv[i + 1]) >= 0) {
+            b = atof(argv[++i]);
+        } else if (!rules_file && argv[i][0] != '-') {
+            rules_file = argv[i];
+        } else if (!trace_file && argv[i][0] != '-') {
+            trace_file = argv[i];
+        } else {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!rules_file) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    gen_rule_t *rules = (gen_rule_t *) malloc(n * sizeof(gen_rule_t));
+
+    if (!rules) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        return EXIT_FAILURE;
+    }
+
+    rng_state = seed;
+    unsigned int sites = 1 + n / GEN_RULES_PER_SITE;
+
+    for (unsigned long i = 0; i < n; i++) {
+        gen_rule(&rules[i], sites);
+    }
+
+    int status = EXIT_SUCCESS;
+
+    if (write_file(rules_file, rules, n, 0, a, b) == -1) {
+        fprintf(stderr, "Error: Could not write %s.\n", rules_file);
+        status = EXIT_FAILURE;
+    } else if (trace_file && write_file(trace_file, rules, n, packets, a, b) == -1) {
+        fprintf(stderr, "Error: Could not write %s.\n", trace_file);
+        status = EXIT_FAILURE;
+    }
+
+    free(rules);
+
+    return status;
+}
@@ -0,0 +1,130 @@
+/**
+ * @file fwopt.c
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This is the top-level component of the offline policy optimizer.
+ * It reads a rules file, reports the rules that can never change the action of a packet
+ * and can write a smaller rules file that is proven to behave identically.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "policy.h"
+#include "loader.h"
+#include "optimize.h"
+
+/** Print out a usage message. */
+static void usage() {
+    fprintf(stderr, "Usage: fwopt [-o <output_file>] <rule_file>\n");
+}
+
+/**
+ * This function writes a policy in the rules file format.
+ *
+ * @param stream the file stream to write to
+ * @param rules the rules of the policy
+ * @param len the number of rules
+ * @param def the default policy
+ */
+static void write_rules(FILE *stream, rule_t *rules, int len, unsigned int def) {
+
+    fprintf(stream, "default %s\n", def == ACTION_ALLOW ? "allow" : "deny");
+
+    for (int i = 0; i < len; i++) {
+        fprintf(stream, "append ");
+        rule_print(stream, &rules[i]);
+    }
+}
+
+/**
+ * Starting point for the program. Process command-line arguments, then optimize the
+ * rules file.
+ *
+ * @param argc number of command-line arguments.
+ * @param argv list of command-line arguments.
+ *
+ * @return program exit status
+ */
+int main(int argc, char *argv[]) {
+
+    char *out = NULL;
+    char *in = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp("-o", argv[i]) == 0 && i + 1 < argc) {
+            out = argv[++i];
+        } else if (!in && argv[i][0] != '-') {
+            in = argv[i];
+        } else {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!in) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    rule_t *rules;
+    int def;
+    int len = read_rules(in, &rules, &def);
+
+    if (len == -1) {
+        fprintf(stderr, "Error: Could not read %s.\n", in);
+        return EXIT_FAILURE;
+    }
+
+    //fwsim starts with a deny default
+    if (def == -1) {
+        def = ACTION_DENY;
+    }
+
+    int *verdict = (int *) malloc((len + 1) * sizeof(int));
+    int *cause = (int *) malloc((len + 1) * sizeof(int));
+    rule_t *kept = (rule_t *) malloc((len + 1) * sizeof(rule_t));
+
+    if (!verdict || !cause || !kept
+            || optimize_find(rules, len, def, verdict, cause) == -1) {
+        fprintf(stderr, "Error: Could not optimize %s.\n", in);
+        return EXIT_FAILURE;
+    }
+
+    optimize_report(stdout, len, verdict, cause);
+
+    int status = EXIT_SUCCESS;
+
+    if (out) {
+        int n = 0;
+        for (int i = 0; i < len; i++) {
+            if (verdict[i] == OPT_KEEP) {
+                kept[n++] = rules[i];
+            }
+        }
+
+        unsigned long checked;
+        FILE *fp = NULL;
+
+        if (optimize_verify(rules, len, kept, n, def, &checked) != 0) {
+            fprintf(stderr, "Error: Optimized policy is not equivalent.\n");
+            status = EXIT_FAILURE;
+        } else if (!(fp = fopen(out, "w"))) {
+            fprintf(stderr, "Error: Could not write %s.\n", out);
+            status = EXIT_FAILURE;
+        } else {
+            write_rules(fp, kept, n, def);
+            fclose(fp);
+            printf("Wrote %d rules to %s, verified with %lu packets.\n", n, out,
+                    checked);
+        }
+    }
+
+    free(rules);
+    free(verdict);
+    free(cause);
+    free(kept);
+
+    return status;
+}
@@ -9,20 +9,81 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include "packet.h"
 #include "policy.h"
 #include "command.h"
+#include "flowcache.h"
+#include "replay.h"
+#include "loader.h"
+#include "stats.h"
+#include "optimize.h"
+#include "image.h"
+#include "compiled.h"
+#include "hicuts.h"
+#include "conntrack.h"
+#include "pipeline.h"
+#include "publish.h"
 
 /** Command prompt shown to the user. */
 #define PROMPT "> "
 
-/** Used for checking the number of arguments */
-#define ARG_CHECK 3
+/** Used for turning a ratio into a percentage */
+#define PERCENT 100.0
+
+/** Used for turning megabytes into bytes */
+#define MB_SHIFT 20
+
+/** Size of the blocks batch mode reads commands in */
+#define BATCH_IN_SIZE (1 << MB_SHIFT)
+
+/** Size of the buffer batch mode writes verdicts to */
+#define BATCH_OUT_SIZE (1 << MB_SHIFT)
+
+/** Room needed for the verdict of a test command */
+#define VERDICT_TEXT_SIZE (RULE_TEXT_SIZE + 32)
+
+/** Initial capacity of the changes a transaction stages */
+#define TXN_INIT_EDITS 64
+
+/** Whether test commands print short verdicts (allow|deny) (<pos>|default|established) */
+static int compact;
+
+/** The verdicts batch mode has not written out yet */
+static char batch_out[BATCH_OUT_SIZE];
+
+/** Number of bytes in batch_out */
+static size_t batch_len;
+
+/** The pipeline batch mode classifies on, or NULL to classify on the main thread */
+static pipeline_t *pipeline;
+
+/** Whether a transaction is open, so changes to the policy are staged */
+static int txn_open;
+
+/** The changes the open transaction has staged */
+static policy_edit_t *txn_edits;
+
+/** Number of staged changes */
+static unsigned int txn_len;
+
+/** Capacity of txn_edits */
+static unsigned int txn_cap;
+
+/** Whether a change could not be staged, so the open transaction must not commit */
+static int txn_failed;
 
 /** Print out a usage message. */
 static void usage() {
-    fprintf(stderr, "Usage: fwsim [-h] [-r <rule_file>]\n");
+    fprintf(stderr, "Usage: fwsim [-h] [-r <rule_file>] [--replay <pcap_file>]"
+            " [--bench-load <rule_file>] [--snapshot <image_file>]\n"
+            "             [--compiled <shared_object>] [--conntrack <max_flows>]\n"
+            "             [--batch] [--compact] [--workers <threads>] [--compact-rules]\n"
+            "             [--attach <name>]\n"
+            "             [--engine linear|bitvector|hicuts|tss] [--tree-leaf <rules>]"
+            " [--tree-mem <MB>]\n");
 }
 
 /** Print out an error message. */
@@ -59,61 +120,565 @@ void helpCommand() {
             "(*|<dst_port>)\n");
     printf("delete <pos>\n");
     printf("test (tcp|udp) <src_ip>:<src_port> <dst_ip>:<dst_port>\n");
-    printf("print (all|<pos>)\n");
+    printf("print (all|counts|<pos>)\n");
+    printf("stats [latency|engine|filter|conntrack|pipeline]\n");
+    printf("optimize [apply]\n");
+    printf("reorder\n");
+    printf("top [<n>]\n");
+    printf("begin\n");
+    printf("commit\n");
+    printf("abort\n");
+    printf("mem\n");
+    printf("save <file>\n");
+    printf("load <file>\n");
+    printf("publish <name>\n");
+    printf("tick <seconds>\n");
     printf("help\n");
     printf("quit\n");
+    printf("\n");
+    printf("Addresses are a.b.c.d or [IPv6]; rules may give [IPv6/length] prefixes.\n");
 }
 
 /**
- * Load firewall rules from a file.
+ * Function used for printing classification statistics
  *
- * @param filename name of a file from which to load the rules.
+ * @param which STATS_LATENCY for the latency histogram, otherwise the counters
  */
-static void load_rules(char *filename) {
+static void statsCommand(int which) {
 
-    FILE *fp = fopen(filename, "r");
+    if (which == STATS_LATENCY) {
+        stats_print_latency(stdout);
+        return;
+    }
 
-    if (!fp) {
+    if (which == STATS_PIPELINE) {
+        pipeline_print(pipeline, stdout);
         return;
     }
 
-    while (1) {
+    if (which == STATS_CONNTRACK) {
+        conntrack_print(stdout);
+        return;
+    }
 
-        fw_cmd_t cmd;
-        cmd.cmd = 0;
-        parse_command(fp, &cmd);
+    if (which == STATS_FILTER) {
+        unsigned long rejected, passed, unmatched;
+        stats_filter(&rejected, &passed, &unmatched);
+        policy_print_filter(stdout);
 
-        if (feof(fp)) {
-            break;
+        //Every packet no rule matches is a negative, which the filter either rejects
+        //or lets through as a false positive
+        double rate = 0.0;
+        if (rejected + unmatched > 0) {
+            rate = PERCENT * unmatched / (rejected + unmatched);
+        }
+
+        printf("Filter lookups: %lu (%lu rejected, %lu passed, %lu false positives, "
+                "%.2f%% false positive rate)\n", rejected + passed, rejected, passed,
+                unmatched, rate);
+        return;
+    }
+
+    if (which == STATS_ENGINE) {
+        unsigned long lookups, steps, rules;
+        stats_engine(&lookups, &steps, &rules);
+        policy_print_engine(stdout);
+
+        double per = lookups ? 1.0 / lookups : 0.0;
+        printf("Index lookups: %lu (%.2f steps, %.2f rules compared on average)\n",
+                lookups, steps * per, rules * per);
+        return;
+    }
+
+    unsigned long hits, misses;
+    flow_cache_stats(&hits, &misses);
+
+    double rate = 0.0;
+    if (hits + misses > 0) {
+        rate = PERCENT * hits / (hits + misses);
+    }
+
+    printf("Flow cache: %lu hits, %lu misses (%.1f%% hit rate)\n", hits, misses,
+            rate);
+    printf("Packets classified: %lu (%lu via default policy)\n", stats_packets(),
+            stats_rule_hits(STATS_DEFAULT));
+}
+
+/**
+ * Function used for finding (and optionally removing) shadowed and redundant rules
+ *
+ * @param apply OPTIMIZE_APPLY to remove the rules after proving the result equivalent
+ */
+static void optimizeCommand(int apply) {
+
+    rule_t *rules;
+    unsigned int def;
+    unsigned long gen;
+    int len = policy_rules(&rules, &def, &gen);
+
+    if (len == -1) {
+        printf("Error: Could not optimize policy.\n");
+        return;
+    }
+
+    int *verdict = (int *) malloc((len + 1) * sizeof(int));
+    int *cause = (int *) malloc((len + 1) * sizeof(int));
+    int *order = (int *) malloc((len + 1) * sizeof(int));
+    rule_t *kept = (rule_t *) malloc((len + 1) * sizeof(rule_t));
+    int removed = -1;
+
+    if (verdict && cause && order && kept) {
+        removed = optimize_find(rules, len, def, verdict, cause);
+    }
+
+    if (removed == -1) {
+        printf("Error: Could not optimize policy.\n");
+    } else {
+        optimize_report(stdout, len, verdict, cause);
+    }
+
+    if (removed > 0 && apply == OPTIMIZE_APPLY) {
+        int n = 0;
+        for (int i = 0; i < len; i++) {
+            if (verdict[i] == OPT_KEEP) {
+                order[n] = i;
+                kept[n++] = rules[i];
+            }
+        }
+
+        unsigned long checked;
+        if (optimize_verify(rules, len, kept, n, def, &checked) != 0) {
+            printf("Error: Optimized policy is not equivalent.\n");
+        } else if (policy_select(gen, order, n) == -1) {
+            printf("Error: Could not optimize policy.\n");
+        } else {
+            printf("Removed %d rules, verified with %lu packets.\n", removed, checked);
+        }
+    }
+
+    free(rules);
+    free(verdict);
+    free(cause);
+    free(order);
+    free(kept);
+}
+
+/**
+ * Function used for moving the rules that have matched the most packets earlier, as
+ * far as they can go without changing the action of any packet
+ */
+static void reorderCommand() {
+
+    rule_t *rules;
+    unsigned int def;
+    unsigned long gen;
+    int len = policy_rules(&rules, &def, &gen);
+
+    if (len == -1) {
+        printf("Error: Could not reorder policy.\n");
+        return;
+    }
+
+    unsigned long *hits = (unsigned long *) malloc((len + 1) * sizeof(unsigned long));
+    int *order = (int *) malloc((len + 1) * sizeof(int));
+    rule_t *sorted = (rule_t *) malloc((len + 1) * sizeof(rule_t));
+    int moved = -1;
+
+    if (hits && order && sorted && policy_hits(gen, hits, len) == 0) {
+        moved = optimize_reorder(rules, len, hits, order);
+    }
+
+    unsigned long checked = 0;
+
+    if (moved > 0) {
+        for (int i = 0; i < len; i++) {
+            sorted[i] = rules[order[i]];
+        }
+
+        if (optimize_verify(rules, len, sorted, len, def, &checked) != 0) {
+            printf("Error: Reordered policy is not equivalent.\n");
+            moved = -1;
+        } else if (policy_select(gen, order, len) == -1) {
+            printf("Error: Could not reorder policy.\n");
+            moved = -1;
+        }
+    } else if (moved == -1) {
+        printf("Error: Could not reorder policy.\n");
+    }
+
+    if (moved != -1) {
+        unsigned long misses = stats_rule_hits(STATS_DEFAULT);
+        double before = optimize_scan_cost(hits, len, misses, NULL);
+        double after = optimize_scan_cost(hits, len, misses, order);
+
+        if (moved > 0) {
+            printf("Moved %d of %d rules, verified with %lu packets.\n", moved, len,
+                    checked);
+        } else {
+            printf("Moved 0 of %d rules.\n", len);
+        }
+        printf("Rules evaluated per packet: %.2f before, %.2f after (%.1f%% fewer).\n",
+                before, after, before > 0 ? PERCENT * (before - after) / before : 0.0);
+    }
+
+    free(rules);
+    free(hits);
+    free(order);
+    free(sorted);
+}
+
+/**
+ * Function used for writing the verdict of a test command
+ *
+ * @param action the action the packet was given
+ * @param pos the position of the matched rule, -1 for the default policy or
+ * CONNTRACK_ESTABLISHED
+ * @param text the buffer to be written to (VERDICT_TEXT_SIZE long)
+ *
+ * @return the number of characters written
+ */
+static int formatVerdict(int action, int pos, char *text) {
+
+    int allowed = action == ACTION_ALLOW;
+    char *p = text;
+
+    if (compact) {
+        p = stpcpy(p, allowed ? "allow " : "deny ");
+
+        if (pos == CONNTRACK_ESTABLISHED) {
+            p = stpcpy(p, "established");
+        } else if (pos == -1) {
+            p = stpcpy(p, "default");
+        } else {
+            p += uint_format(pos + 1, p);
+        }
+        *p++ = '\n';
+
+        return p - text;
+    }
+
+    if (pos == CONNTRACK_ESTABLISHED) {
+        return stpcpy(p, "Allowed via established connection.\n") - text;
+    }
+
+    p = stpcpy(p, allowed ? "Allowed via " : "Denied via ");
+
+    if (pos == -1) {
+        return stpcpy(p, "default policy.\n") - text;
+    }
+
+    int len = policy_format_rule(pos + 1, p);
+
+    return p - text + (len == -1 ? 0 : len);
+}
+
+/**
+ * Function used for classifying a packet and writing the verdict
+ *
+ * @param cmd the test command
+ * @param text the buffer to be written to (VERDICT_TEXT_SIZE long)
+ *
+ * @return the number of characters written
+ */
+static int testCommand(fw_cmd_t *cmd, char *text) {
+
+    int pos;
+    packet6_t packet = command_packet(cmd);
+    int action = conntrack_test(&packet.key, &pos);
+
+    return formatVerdict(action, pos, text);
+}
+
+/**
+ * Function used for staging a change to the policy in the open transaction. If the
+ * change cannot be staged, the transaction is marked failed so it never commits
+ * without it.
+ *
+ * @param cmd the default, insert, append or delete command
+ */
+static void stageCommand(fw_cmd_t *cmd) {
+
+    if (txn_len == txn_cap) {
+        unsigned int cap = txn_cap ? txn_cap * 2 : TXN_INIT_EDITS;
+        policy_edit_t *grown = (policy_edit_t *) realloc(txn_edits,
+                cap * sizeof(policy_edit_t));
+
+        if (!grown) {
+            printf("Error: Could not stage command.\n");
+            txn_failed = 1;
+            return;
+        }
+        txn_edits = grown;
+        txn_cap = cap;
+    }
+
+    policy_edit_t *e = &txn_edits[txn_len++];
+
+    e->kind = cmd->cmd == DELETE ? EDIT_DELETE
+            : cmd->cmd == DEFAULT ? EDIT_DEFAULT : EDIT_INSERT;
+    e->pos = cmd->cmd == APPEND ? -1 : cmd->pos;
+    e->rule.action = cmd->action;
+    e->rule.match = cmd->match;
+    e->rule.match6 = cmd->match6;
+}
+
+/**
+ * Function used for finding whether a command would change or publish the live policy
+ * behind the open transaction's back, which is not allowed until it is committed or
+ * aborted
+ *
+ * @param cmd the command
+ *
+ * @return 1 for load, optimize apply, reorder and publish, otherwise 0
+ */
+static int txnRefuses(fw_cmd_t *cmd) {
+
+    return cmd->cmd == LOAD || cmd->cmd == REORDER || cmd->cmd == PUBLISH
+            || (cmd->cmd == OPTIMIZE && cmd->pos == OPTIMIZE_APPLY);
+}
+
+/**
+ * Function used for opening, committing and aborting transactions. A commit applies
+ * every staged change at once, or none of them if one fails or one could not be
+ * staged. Transactions do not nest: a begin while one is open is an error that leaves
+ * the open transaction, and the changes it has staged, as they are.
+ *
+ * @param which BEGIN, COMMIT or ABORT
+ */
+static void transactionCommand(int which) {
+
+    if (which == BEGIN) {
+        if (txn_open) {
+            printf("Error: A transaction is already open.\n");
+        }
+        txn_open = 1;
+        return;
+    }
+
+    if (!txn_open) {
+        printf("Error: No transaction is open.\n");
+        return;
+    }
+
+    unsigned int failed;
+
+    if (which == COMMIT && txn_failed) {
+        //Committing what was staged would apply only part of the transaction
+        printf("Error: Could not commit transaction.\n");
+    } else if (which == COMMIT && policy_commit(txn_edits, txn_len, &failed) == -1) {
+        if (failed < txn_len && txn_edits[failed].kind == EDIT_INSERT) {
+            addError();
+        } else if (failed < txn_len && txn_edits[failed].kind == EDIT_DELETE) {
+            deleteError();
+        }
+        printf("Error: Could not commit transaction.\n");
+    }
+
+    txn_open = 0;
+    txn_len = 0;
+    txn_failed = 0;
+}
+
+/**
+ * Function used for carrying out a parsed command
+ *
+ * @param cmd the command
+ *
+ * @return 1 for the quit command, otherwise 0
+ */
+static int runCommand(fw_cmd_t *cmd) {
+
+    publish_refresh();
+
+    if (txn_open && (cmd->cmd == DEFAULT || cmd->cmd == INSERT || cmd->cmd == APPEND
+            || cmd->cmd == DELETE)) {
+        stageCommand(cmd);
+    } else if (txn_open && txnRefuses(cmd)) {
+        printf("Error: Commit or abort the open transaction first.\n");
+    } else if (cmd->cmd == DEFAULT) {
+        if (policy_set_default(cmd->action) == -1) {
+            //Print Error
+        }
+    } else if (cmd->cmd == INSERT) {
+        rule_t rule;
+        rule.action = cmd->action;
+        rule.match = cmd->match;
+        rule.match6 = cmd->match6;
+
+        if (policy_insert(rule, cmd->pos) == -1) {
+            addError();
+        }
+    } else if (cmd->cmd == APPEND) {
+        rule_t rule;
+        rule.action = cmd->action;
+        rule.match = cmd->match;
+        rule.match6 = cmd->match6;
+
+        if (policy_append(rule) == -1) {
+            addError();
+        }
+
+    } else if (cmd->cmd == DELETE) {
+        if (policy_delete(cmd->pos) == -1) {
+            deleteError();
         }
 
-        if (cmd.cmd == 0) {
+    } else if (cmd->cmd == TEST) {
+        char text[VERDICT_TEXT_SIZE];
+        fwrite(text, 1, testCommand(cmd, text), stdout);
+    } else if (cmd->cmd == PRINT) {
+
+        if (cmd->pos == -1) {
+            policy_print(stdout);
+        } else if (cmd->pos == PRINT_COUNTS) {
+            policy_print_counts(stdout);
+        } else if (policy_print_rule(stdout, cmd->pos) == -1) {
+            ruleError(cmd->pos);
+        }
+    } else if (cmd->cmd == STATS) {
+        statsCommand(cmd->pos);
+    } else if (cmd->cmd == OPTIMIZE) {
+        optimizeCommand(cmd->pos);
+    } else if (cmd->cmd == REORDER) {
+        reorderCommand();
+    } else if (cmd->cmd == BEGIN || cmd->cmd == COMMIT || cmd->cmd == ABORT) {
+        transactionCommand(cmd->cmd);
+    } else if (cmd->cmd == TOP) {
+        policy_print_top(stdout, cmd->pos);
+    } else if (cmd->cmd == MEM) {
+        policy_print_memory(stdout);
+    } else if (cmd->cmd == SAVE) {
+        if (image_save(cmd->file) == -1) {
+            printf("Error: Could not save policy to %s.\n", cmd->file);
+        }
+    } else if (cmd->cmd == LOAD) {
+        if (image_load(cmd->file) == -1) {
+            printf("Error: Could not load policy from %s.\n", cmd->file);
+        }
+    } else if (cmd->cmd == PUBLISH) {
+        if (publish_policy(cmd->file) == -1) {
+            printf("Error: Could not publish policy to %s.\n", cmd->file);
+        }
+    } else if (cmd->cmd == TICK) {
+        conntrack_advance(conntrack_now() + cmd->pos);
+    } else if (cmd->cmd == HELP) {
+        helpCommand();
+    } else if (cmd->cmd == QUIT) {
+        return 1;
+    } else {
+        //Do nothing
+    }
+
+    return 0;
+}
+
+/**
+ * Function used for writing out the verdicts batch mode has buffered, or waiting for
+ * the pipeline to write out all of its verdicts
+ */
+static void batchFlush() {
+
+    if (pipeline) {
+        pipeline_drain(pipeline);
+    }
+
+    fwrite(batch_out, 1, batch_len, stdout);
+    batch_len = 0;
+}
+
+/**
+ * Function used for reading and carrying out commands without prompts. Standard input
+ * is read in large blocks and lexed in place, and the verdicts of test commands are
+ * written to one large buffer, which is flushed before any other command prints.
+ * With a pipeline, test commands are classified on its workers instead, and it is
+ * drained before any other command runs.
+ */
+static void batchCommands() {
+
+    char *in = (char *) malloc(BATCH_IN_SIZE);
+    size_t have = 0;
+    int quit = 0;
+
+    if (!in) {
+        return;
+    }
+
+    while (!quit) {
+        ssize_t n = read(STDIN_FILENO, in + have, BATCH_IN_SIZE - have);
+
+        if (n == -1 && errno == EINTR) {
             continue;
-        } else if (cmd.cmd == DEFAULT) {
-            if (policy_set_default(cmd.action) == -1) {
+        }
 
+        int eof = n <= 0;
+        have += eof ? 0 : n;
+
+        //Only lex whole lines, unless the input ended or one line fills the block
+        const char *cur = in;
+        const char *stop = in + have;
+
+        if (!eof) {
+            while (stop > in && stop[-1] != '\n') {
+                stop--;
+            }
+            if (stop == in && have < BATCH_IN_SIZE) {
+                continue;
+            }
+            if (stop == in) {
+                stop = in + have;
             }
-        } else if (cmd.cmd == APPEND) {
-            rule_t rule;
-            rule.action = cmd.action;
-            rule.match.protocol = cmd.protocol;
-            rule.match.src_ip = cmd.src_ip;
-            rule.match.src_port = cmd.src_port;
-            rule.match.dst_ip = cmd.dst_ip;
-            rule.match.dst_port = cmd.dst_port;
-
-            if (policy_append(rule) == -1) {
-                //PRINT ERROR
+        }
+
+        while (cur < stop && !quit) {
+            fw_cmd_t cmd = { };
+            int ret = lex_command(&cur, stop, &cmd);
+
+            if (ret == 1 && cmd.cmd == TEST) {
+                publish_refresh();
             }
 
-        } else {
-            //PRINT ERROR
+            if (ret == 1 && cmd.cmd == TEST && pipeline) {
+                packet6_t packet = command_packet(&cmd);
+                pipeline_submit(pipeline, &packet);
+            } else if (ret == 1 && cmd.cmd == TEST) {
+                if (batch_len + VERDICT_TEXT_SIZE > BATCH_OUT_SIZE) {
+                    batchFlush();
+                }
+                batch_len += testCommand(&cmd, batch_out + batch_len);
+            } else if (ret == -1) {
+                batchFlush();
+                parseError();
+            } else if (ret == 1) {
+                batchFlush();
+                quit = runCommand(&cmd);
+            }
+        }
+
+        //Keep the partial line for the next block
+        have = in + have - cur;
+        memmove(in, cur, have);
+
+        if (eof) {
+            break;
         }
     }
 
-    fclose(fp);
+    batchFlush();
+    free(in);
+}
 
-    return;
+/**
+ * Function used for releasing everything the simulator holds before it exits, on
+ * every path out of main
+ */
+static void cleanup() {
+
+    free(txn_edits);
+    publish_detach();
+    policy_free();
+    conntrack_free();
+    flow_cache_free();
+    stats_free();
 }
 
 /**
@@ -127,101 +692,148 @@ static void load_rules(char *filename) {
  */
 int main(int argc, char *argv[]) {
 
-    if (argc == 2) {
-        usage();
-        return EXIT_SUCCESS;
+    char *rules = NULL;
+    char *trace = NULL;
+    char *bench = NULL;
+    char *image = NULL;
+    char *compiled = NULL;
+    char *attach = NULL;
+    char *engine = NULL;
+    int flows = 0;
+    int batch = 0;
+    int workers = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp("-r", argv[i]) == 0 && i + 1 < argc) {
+            rules = argv[++i];
+        } else if (strcmp("--replay", argv[i]) == 0 && i + 1 < argc) {
+            trace = argv[++i];
+        } else if (strcmp("--bench-load", argv[i]) == 0 && i + 1 < argc) {
+            bench = argv[++i];
+        } else if (strcmp("--snapshot", argv[i]) == 0 && i + 1 < argc) {
+            image = argv[++i];
+        } else if (strcmp("--compiled", argv[i]) == 0 && i + 1 < argc) {
+            compiled = argv[++i];
+        } else if (strcmp("--attach", argv[i]) == 0 && i + 1 < argc) {
+            attach = argv[++i];
+        } else if (strcmp("--engine", argv[i]) == 0 && i + 1 < argc) {
+            engine = argv[++i];
+        } else if (strcmp("--batch", argv[i]) == 0) {
+            batch = 1;
+        } else if (strcmp("--compact", argv[i]) == 0) {
+            compact = 1;
+        } else if (strcmp("--compact-rules", argv[i]) == 0) {
+            policy_set_compact(1);
+        } else if (strcmp("--workers", argv[i]) == 0 && i + 1 < argc
+                && atoi(argv[i + 1]) > 0) {
+            workers = atoi(argv[++i]);
+            batch = 1;
+        } else if (strcmp("--conntrack", argv[i]) == 0 && i + 1 < argc
+                && atoi(argv[i + 1]) > 0) {
+            flows = atoi(argv[++i]);
+        } else if (strcmp("--tree-leaf", argv[i]) == 0 && i + 1 < argc
+                && atoi(argv[i + 1]) > 0) {
+            hicuts_set_leaf_size(atoi(argv[++i]));
+        } else if (strcmp("--tree-mem", argv[i]) == 0 && i + 1 < argc
+                && atoi(argv[i + 1]) > 0) {
+            hicuts_set_memory((size_t) atoi(argv[++i]) << MB_SHIFT);
+        } else {
+            usage();
+            return EXIT_SUCCESS;
+        }
     }
 
     policy_init();
     policy_set_default(ACTION_DENY);
 
-    if (argc == ARG_CHECK && strcmp("-r", argv[1]) == 0) {
-        load_rules(argv[2]);
+    if (engine && policy_set_engine(engine) == -1) {
+        fprintf(stderr, "Error: Unknown engine %s.\n", engine);
+        usage();
+
+        cleanup();
+        return EXIT_FAILURE;
     }
 
-    while (!feof(stdin)) {
+    if (flows && conntrack_init(flows) == -1) {
+        fprintf(stderr, "Error: Could not track %d connections.\n", flows);
 
-        printf(PROMPT);
+        cleanup();
+        return EXIT_FAILURE;
+    }
 
-        fw_cmd_t cmd = { };
-        if (parse_command(stdin, &cmd) == -1) {
-            parseError();
-        } else if (cmd.cmd == DEFAULT) {
-            if (policy_set_default(cmd.action) == -1) {
-                //Print Error
-            }
-        } else if (cmd.cmd == INSERT) {
-            rule_t rule;
-            rule.action = cmd.action;
-            rule.match.protocol = cmd.protocol;
-            rule.match.src_ip = cmd.src_ip;
-            rule.match.src_port = cmd.src_port;
-            rule.match.dst_ip = cmd.dst_ip;
-            rule.match.dst_port = cmd.dst_port;
-
-            if (policy_insert(rule, cmd.pos) == -1) {
-                addError();
-            }
-        } else if (cmd.cmd == APPEND) {
-            rule_t rule;
-            rule.action = cmd.action;
-            rule.match.protocol = cmd.protocol;
-            rule.match.src_ip = cmd.src_ip;
-            rule.match.src_port = cmd.src_port;
-            rule.match.dst_ip = cmd.dst_ip;
-            rule.match.dst_port = cmd.dst_port;
-
-            if (policy_append(rule) == -1) {
-                addError();
-            }
+    if (image && image_load(image) == -1) {
+        fprintf(stderr, "Error: Could not load %s.\n", image);
 
-        } else if (cmd.cmd == DELETE) {
-            if (policy_delete(cmd.pos) == -1) {
-                deleteError();
-            }
+        cleanup();
+        return EXIT_FAILURE;
+    }
 
-        } else if (cmd.cmd == TEST) {
-
-            packet_t packet;
-            packet.protocol = cmd.protocol;
-            packet.src_ip = cmd.src_ip;
-            packet.src_port = cmd.src_port;
-            packet.dst_ip = cmd.dst_ip;
-            packet.dst_port = cmd.dst_port;
-
-            if (policy_test(packet, &cmd.pos) == ACTION_ALLOW) {
-                if (cmd.pos == -1) {
-                    printf("Allowed via default policy.\n");
-                } else {
-                    printf("Allowed via ");
-                    policy_print_rule(stdout, cmd.pos + 1);
-                }
-            } else {
-                if (cmd.pos == -1) {
-                    printf("Denied via default policy.\n");
-                } else {
-                    printf("Denied via ");
-                    policy_print_rule(stdout, cmd.pos + 1);
-                }
-            }
-        } else if (cmd.cmd == PRINT) {
+    if (compiled && compiled_load(compiled) == -1) {
+        fprintf(stderr, "Error: Could not load %s.\n", compiled);
 
-            if (cmd.pos == -1) {
-                policy_print(stdout);
-            } else if (policy_print_rule(stdout, cmd.pos) == -1) {
-                ruleError(cmd.pos);
-            }
-        } else if (cmd.cmd == HELP) {
-            helpCommand();
-        } else if (cmd.cmd == QUIT) {
-            break;
-        } else {
-            //Do nothing
+        cleanup();
+        return EXIT_FAILURE;
+    }
+
+    if (attach && publish_attach(attach) == -1) {
+        fprintf(stderr, "Error: Could not attach to %s.\n", attach);
+
+        cleanup();
+        return EXIT_FAILURE;
+    }
+
+    if (rules) {
+        load_rules_fast(rules);
+    }
+
+    if (bench) {
+        int status = loader_bench(bench, stdout) == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+
+        cleanup();
+        return status;
+    }
+
+    if (trace) {
+        int status = EXIT_SUCCESS;
+        if (replay_pcap(trace, stdout) == -1) {
+            fprintf(stderr, "Error: Could not replay %s.\n", trace);
+            status = EXIT_FAILURE;
         }
 
+        cleanup();
+        return status;
     }
 
-    policy_free();
+    if (workers) {
+        pipeline = pipeline_start(workers, formatVerdict, VERDICT_TEXT_SIZE, stdout);
+
+        if (!pipeline) {
+            fprintf(stderr, "Error: Could not start %d workers.\n", workers);
+
+            cleanup();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (batch) {
+        setvbuf(stdout, NULL, _IOFBF, BATCH_OUT_SIZE);
+        batchCommands();
+        pipeline_stop(pipeline);
+    } else {
+        while (!feof(stdin)) {
+
+            printf(PROMPT);
+
+            fw_cmd_t cmd = { };
+            if (parse_command(stdin, &cmd) == -1) {
+                parseError();
+            } else if (runCommand(&cmd)) {
+                break;
+            }
+        }
+    }
+
+    cleanup();
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,691 @@
+/**
+ * @file hicuts.c
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This component is responsible for the decision-tree classification engine (HiCuts).
+ * The space of packets is cut into equal parts along one field at a time, picking the
+ * field whose values tell the rules of a node apart best, until each part holds few
+ * enough rules to scan. A rule with a wildcard for the field is copied into every part,
+ * so the number of parts is limited to keep the copies in proportion. A lookup walks
+ * from the root to a leaf by indexing with the packet's fields and scans the leaf's
+ * rules, which are kept in policy order, for the first match.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "hicuts.h"
+#include "stats.h"
+
+/** Number of fields a rule matches on */
+#define HICUTS_FIELDS 5
+
+/** Most copies of a node's rules its children may hold, as a multiple of them */
+#define HICUTS_SPACE_FACTOR 2
+
+/** Most children a node is cut into */
+#define HICUTS_MAX_CUTS (1U << 16)
+
+/** Deepest a leaf may be */
+#define HICUTS_MAX_DEPTH 64
+
+/** Most rules sampled when counting the distinct values of a field */
+#define HICUTS_SAMPLE 1024
+
+/** Number of bits in a value of a field */
+#define HICUTS_WORD_BITS 32
+
+/** Node shared by every part no rule matches */
+#define HICUTS_EMPTY 0
+
+/** Initial capacity of the arrays of a tree */
+#define HICUTS_INIT 64
+
+/** Number of bits of each field (protocol, source address, source port, destination
+ * address, destination port) */
+static const unsigned char field_bits[HICUTS_FIELDS] = { 32, 32, 16, 32, 16 };
+
+/** Largest number of rules a leaf is cut down to (only touched by the writer) */
+static unsigned int leaf_size = HICUTS_LEAF_SIZE;
+
+/** Amount of memory a tree may grow to (only touched by the writer) */
+static size_t max_bytes = HICUTS_MAX_BYTES;
+
+/**
+ * Representation of a node of the tree
+ * .lo: the start of the block of .dim the children cover
+ * .dim: the field the node is cut along
+ * .shift: the number of bits of .dim each child's range covers
+ * .cuts: the number of children, or 0 for a leaf
+ * .first: the first child in .child of the tree, or the first rule in .leaf
+ * .count: the number of rules of a leaf
+ * .other: the node for packets outside the block the children cover
+ */
+typedef struct hicuts_node {
+    uint32_t lo;
+    unsigned char dim;
+    unsigned char shift;
+    uint32_t cuts;
+    uint32_t first;
+    uint32_t count;
+    uint32_t other;
+} hicuts_node_t;
+
+/**
+ * Representation of a decision tree
+ * .rules: the rules in order, packed
+ * .nodes: the nodes, the shared empty leaf first
+ * .child: the children of every node
+ * .leaf: the rules of every leaf, as indexes into .rules
+ * .nodes_len, .child_len, .leaf_len: the number of entries in use
+ * .nodes_cap, .child_cap, .leaf_cap: the number of entries allocated
+ * .root: the root node
+ * .n: the number of rules
+ * .leaves: the number of leaves
+ * .depth: the depth of the deepest leaf
+ * .leaf_size: the largest number of rules a leaf was cut down to
+ * .budget: the amount of memory the tree could grow to
+ * .pending: the number of rules in lists still waiting to be built into subtrees
+ */
+typedef struct hicuts {
+    image_rule_t *rules;
+    hicuts_node_t *nodes;
+    uint32_t *child;
+    uint32_t *leaf;
+    size_t nodes_len, child_len, leaf_len;
+    size_t nodes_cap, child_cap, leaf_cap;
+    uint32_t root;
+    unsigned int n;
+    unsigned int leaves;
+    unsigned int depth;
+    unsigned int leaf_size;
+    size_t budget;
+    size_t pending;
+} hicuts_t;
+
+/**
+ * This function sets the largest number of rules the tree cuts a leaf down to.
+ * Only affects trees built afterwards.
+ *
+ * @param n the number of rules (at least 1)
+ */
+void hicuts_set_leaf_size(unsigned int n) {
+
+    leaf_size = n ? n : 1;
+}
+
+/**
+ * This function sets the amount of memory a tree may grow to before it stops cutting
+ * and leaves larger leaves instead. Only affects trees built afterwards.
+ *
+ * @param bytes the number of bytes
+ */
+void hicuts_set_memory(size_t bytes) {
+
+    max_bytes = bytes;
+}
+
+/**
+ * This function makes room in one of the arrays of a tree.
+ *
+ * @param array the array
+ * @param cap the number of entries allocated, updated if the array grows
+ * @param need the number of entries needed
+ * @param size the size of an entry
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int grow(void **array, size_t *cap, size_t need, size_t size) {
+
+    if (need <= *cap) {
+        return 0;
+    }
+
+    size_t n = *cap ? *cap * 2 : HICUTS_INIT;
+    if (n < need) {
+        n = need;
+    }
+
+    void *grown = realloc(*array, n * size);
+
+    if (!grown) {
+        return -1;
+    }
+
+    *array = grown;
+    *cap = n;
+
+    return 0;
+}
+
+/**
+ * This function finds the amount of memory a tree takes.
+ *
+ * @param t the tree
+ *
+ * @return the number of bytes
+ */
+static size_t tree_bytes(hicuts_t *t) {
+
+    return sizeof(hicuts_t) + t->n * sizeof(image_rule_t)
+            + t->nodes_len * sizeof(hicuts_node_t)
+            + (t->child_len + t->leaf_len) * sizeof(uint32_t);
+}
+
+/**
+ * This function finds the value a rule matches for a field.
+ *
+ * @param rule the rule
+ * @param f the field (protocol, source address, source port, destination address,
+ * destination port)
+ * @param value the value to be updated with the value the rule names
+ *
+ * @return 1 if the rule has a wildcard for the field, 0 otherwise
+ */
+static int rule_value(const image_rule_t *rule, int f, uint32_t *value) {
+
+    int32_t port;
+
+    switch (f) {
+    case 0:
+        *value = rule->protocol;
+        return 0;
+    case 1:
+        *value = rule->src_ip;
+        return 0;
+    case 3:
+        *value = rule->dst_ip;
+        return 0;
+    default:
+        port = f == 2 ? rule->src_port : rule->dst_port;
+        *value = (uint32_t) port;
+        return port == MATCH_PORT_ANY;
+    }
+}
+
+/**
+ * This function compares two values for qsort().
+ *
+ * @param a the first value
+ * @param b the second value
+ *
+ * @return negative, zero or positive as for qsort()
+ */
+static int value_cmp(const void *a, const void *b) {
+
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * This function estimates how many distinct values the rules of a node name for a
+ * field, from an even sample of them. Cutting along a field copies every rule with a
+ * wildcard for it into each child, so a field most of the rules have a wildcard for is
+ * not worth cutting along and counts as having none.
+ *
+ * @param t the tree
+ * @param list the rules of the node
+ * @param m the number of rules
+ * @param f the field
+ *
+ * @return the number of distinct values in the sample
+ */
+static unsigned int field_distinct(hicuts_t *t, const uint32_t *list, uint32_t m,
+        int f) {
+
+    uint32_t sample[HICUTS_SAMPLE];
+    uint32_t step = (m + HICUTS_SAMPLE - 1) / HICUTS_SAMPLE;
+    unsigned int len = 0;
+    unsigned int wild = 0;
+
+    for (uint32_t k = 0; k < m; k += step) {
+        uint32_t value;
+        if (rule_value(&t->rules[list[k]], f, &value)) {
+            wild++;
+        } else {
+            sample[len++] = value;
+        }
+    }
+
+    if (wild > len) {
+        return 0;
+    }
+
+    qsort(sample, len, sizeof(uint32_t), value_cmp);
+
+    unsigned int distinct = 0;
+    for (unsigned int k = 0; k < len; k++) {
+        if (k == 0 || sample[k] != sample[k - 1]) {
+            distinct++;
+        }
+    }
+
+    return distinct;
+}
+
+/**
+ * This function adds a node to a tree.
+ *
+ * @param t the tree
+ * @param out the value to be updated with the node
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int node_new(hicuts_t *t, uint32_t *out) {
+
+    if (grow((void **) &t->nodes, &t->nodes_cap, t->nodes_len + 1,
+            sizeof(hicuts_node_t)) == -1) {
+        return -1;
+    }
+
+    *out = t->nodes_len++;
+    memset(&t->nodes[*out], 0, sizeof(hicuts_node_t));
+
+    return 0;
+}
+
+/**
+ * This function adds a leaf to a tree. Rules after the first one that matches the
+ * whole range of the leaf can never be reached, so they are left out.
+ *
+ * @param t the tree
+ * @param list the rules of the leaf in order
+ * @param m the number of rules
+ * @param lo the start of the leaf's range along each field
+ * @param bits the number of bits of each field the leaf's range covers
+ * @param out the value to be updated with the leaf
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int leaf_new(hicuts_t *t, const uint32_t *list, uint32_t m, const uint32_t *lo,
+        const unsigned char *bits, uint32_t *out) {
+
+    uint32_t count = 0;
+
+    while (count < m) {
+        const image_rule_t *rule = &t->rules[list[count++]];
+        int covers = 1;
+
+        for (int f = 0; f < HICUTS_FIELDS && covers; f++) {
+            uint32_t value;
+            if (!rule_value(rule, f, &value) && (bits[f] != 0 || value != lo[f])) {
+                covers = 0;
+            }
+        }
+
+        if (covers) {
+            break;
+        }
+    }
+
+    if (node_new(t, out) == -1 || grow((void **) &t->leaf, &t->leaf_cap,
+            t->leaf_len + count, sizeof(uint32_t)) == -1) {
+        return -1;
+    }
+
+    hicuts_node_t *node = &t->nodes[*out];
+    node->first = t->leaf_len;
+    node->count = count;
+    t->pending -= m;
+
+    memcpy(t->leaf + t->leaf_len, list, count * sizeof(uint32_t));
+    t->leaf_len += count;
+    t->leaves++;
+
+    return 0;
+}
+
+/**
+ * This function shares the rules of a node out among its children, copying rules with
+ * a wildcard for the field into every child and keeping each child's rules in order.
+ *
+ * @param t the tree
+ * @param list the rules of the node in order
+ * @param m the number of rules
+ * @param dim the field the node is cut along
+ * @param lo the start of the block of @dim being cut
+ * @param shift the number of bits of @dim each child's range covers
+ * @param cuts the number of children
+ * @param start the value to be updated with where each child's rules start in @lists,
+ * followed by where the rules with a wildcard start and end (zeroed, room for
+ * @cuts + 2)
+ * @param lists the value to be updated with the rules of every child, followed by the
+ * rules with a wildcard
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int share_rules(hicuts_t *t, const uint32_t *list, uint32_t m, int dim,
+        uint32_t lo, unsigned char shift, size_t cuts, uint32_t *start,
+        uint32_t *lists) {
+
+    uint32_t *next = (uint32_t *) malloc(cuts * sizeof(uint32_t));
+
+    if (!next) {
+        return -1;
+    }
+
+    uint32_t wild = 0;
+
+    for (uint32_t j = 0; j < m; j++) {
+        uint32_t value;
+        if (rule_value(&t->rules[list[j]], dim, &value)) {
+            wild++;
+        } else {
+            start[((value - lo) >> shift) + 1]++;
+        }
+    }
+
+    for (size_t i = 0; i < cuts; i++) {
+        start[i + 1] += start[i] + wild;
+        next[i] = start[i];
+    }
+    start[cuts + 1] = start[cuts] + wild;
+
+    uint32_t other = start[cuts];
+
+    for (uint32_t j = 0; j < m; j++) {
+        uint32_t value;
+        if (!rule_value(&t->rules[list[j]], dim, &value)) {
+            lists[next[(value - lo) >> shift]++] = list[j];
+            continue;
+        }
+        for (size_t i = 0; i < cuts; i++) {
+            lists[next[i]++] = list[j];
+        }
+        lists[other++] = list[j];
+    }
+
+    free(next);
+
+    return 0;
+}
+
+/**
+ * This function builds the subtree of a range of packets.
+ *
+ * @param t the tree
+ * @param list the rules that can match packets in the range, in order
+ * @param m the number of rules
+ * @param lo the start of the range along each field (restored before returning)
+ * @param bits the number of bits of each field the range covers (restored before
+ * returning)
+ * @param depth the depth of the subtree's root
+ * @param out the value to be updated with the subtree's root
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int build_node(hicuts_t *t, const uint32_t *list, uint32_t m, uint32_t *lo,
+        unsigned char *bits, unsigned int depth, uint32_t *out) {
+
+    if (depth > t->depth) {
+        t->depth = depth;
+    }
+
+    if (m == 0) {
+        *out = HICUTS_EMPTY;
+        return 0;
+    }
+
+    if (m <= t->leaf_size || depth >= HICUTS_MAX_DEPTH) {
+        return leaf_new(t, list, m, lo, bits, out);
+    }
+
+    //Cut along the field whose values tell the rules apart best
+    int dim = -1;
+    unsigned int best = 1;
+
+    for (int f = 0; f < HICUTS_FIELDS; f++) {
+        if (bits[f] > 0) {
+            unsigned int distinct = field_distinct(t, list, m, f);
+            if (distinct > best) {
+                best = distinct;
+                dim = f;
+            }
+        }
+    }
+
+    if (dim == -1) {
+        return leaf_new(t, list, m, lo, bits, out);
+    }
+
+    //Only the smallest aligned block holding every value the rules name is cut;
+    //packets outside it can only match the rules with a wildcard for the field
+    uint32_t wild = 0;
+    uint32_t min = UINT32_MAX;
+    uint32_t max = 0;
+
+    for (uint32_t j = 0; j < m; j++) {
+        uint32_t value;
+        if (rule_value(&t->rules[list[j]], dim, &value)) {
+            wild++;
+        } else {
+            min = value < min ? value : min;
+            max = value > max ? value : max;
+        }
+    }
+
+    unsigned char width = HICUTS_WORD_BITS - __builtin_clz(min ^ max);
+    uint32_t base = width == HICUTS_WORD_BITS ? 0 : min & ~((1U << width) - 1);
+
+    //Double the cuts while the copies of wildcard rules stay in proportion
+    unsigned int k = 1;
+    size_t limit = (size_t) HICUTS_SPACE_FACTOR * m;
+
+    while (k < width && (2UL << k) <= HICUTS_MAX_CUTS
+            && (size_t) wild * (2UL << k) + (m - wild) + (2UL << k) <= limit) {
+        k++;
+    }
+
+    size_t cuts = 1UL << k;
+    size_t entries = (size_t) wild * (cuts + 1) + (m - wild);
+    size_t spread = entries - (width < bits[dim] ? 0 : wild);
+
+    //Stop cutting once the tree would outgrow its budget, counting every rule still
+    //waiting to be placed in a leaf
+    if (tree_bytes(t) + cuts * (sizeof(hicuts_node_t) + sizeof(uint32_t))
+            + (t->pending - m + spread) * sizeof(uint32_t) > t->budget) {
+        return leaf_new(t, list, m, lo, bits, out);
+    }
+
+    unsigned char shift = width - k;
+    uint32_t *start = (uint32_t *) calloc(cuts + 2, sizeof(uint32_t));
+    uint32_t *lists = (uint32_t *) malloc(entries * sizeof(uint32_t));
+    int ret = -1;
+
+    if (start && lists && node_new(t, out) == 0
+            && grow((void **) &t->child, &t->child_cap, t->child_len + cuts,
+                    sizeof(uint32_t)) == 0
+            && share_rules(t, list, m, dim, base, shift, cuts, start, lists) == 0) {
+        size_t first = t->child_len;
+        t->child_len += cuts;
+
+        hicuts_node_t *node = &t->nodes[*out];
+        node->lo = base;
+        node->dim = dim;
+        node->shift = shift;
+        node->cuts = cuts;
+        node->first = first;
+        node->other = HICUTS_EMPTY;
+
+        uint32_t other = HICUTS_EMPTY;
+        t->pending += spread - m;
+        ret = 0;
+
+        if (width < bits[dim]) {
+            ret = build_node(t, lists + start[cuts], wild, lo, bits, depth + 1, &other);
+            t->nodes[*out].other = other;
+        }
+
+        uint32_t from = lo[dim];
+        unsigned char span = bits[dim];
+        bits[dim] = shift;
+
+        for (size_t i = 0; i < cuts && ret == 0; i++) {
+            uint32_t len = start[i + 1] - start[i];
+            uint32_t c;
+
+            //Children with the same rules hold only rules with a wildcard for this
+            //field, so their subtrees never look at it and can be shared
+            if (i > 0 && len == start[i] - start[i - 1]
+                    && memcmp(lists + start[i], lists + start[i - 1],
+                            len * sizeof(uint32_t)) == 0) {
+                c = t->child[first + i - 1];
+                t->pending -= len;
+            } else {
+                lo[dim] = base + ((uint32_t) i << shift);
+                ret = build_node(t, lists + start[i], len, lo, bits, depth + 1, &c);
+            }
+
+            t->child[first + i] = c;
+        }
+
+        lo[dim] = from;
+        bits[dim] = span;
+    }
+
+    free(start);
+    free(lists);
+
+    return ret;
+}
+
+/**
+ * This function frees a decision tree.
+ *
+ * @param index the tree
+ */
+void hicuts_free(void *index) {
+
+    hicuts_t *t = (hicuts_t *) index;
+
+    free(t->rules);
+    free(t->nodes);
+    free(t->child);
+    free(t->leaf);
+    free(t);
+}
+
+/**
+ * This function builds a decision tree of a policy, cutting the space of packets into
+ * equal parts along one field at a time until few enough rules are left in each part.
+ *
+ * @param rules the rules in order
+ * @param n the number of rules
+ *
+ * @return the tree, or NULL if even an uncut tree does not fit the memory budget or
+ * memory runs out
+ */
+void *hicuts_build(rule_t *rules, unsigned int n) {
+
+    if (n == 0 || sizeof(hicuts_t) + (size_t) n * (sizeof(image_rule_t)
+            + sizeof(uint32_t)) + 2 * sizeof(hicuts_node_t) > max_bytes) {
+        return NULL;
+    }
+
+    hicuts_t *t = (hicuts_t *) calloc(1, sizeof(hicuts_t));
+    uint32_t *list = (uint32_t *) malloc(n * sizeof(uint32_t));
+
+    if (t) {
+        t->rules = (image_rule_t *) malloc(n * sizeof(image_rule_t));
+    }
+
+    if (!t || !list || !t->rules) {
+        if (t) {
+            hicuts_free(t);
+        }
+        free(list);
+        return NULL;
+    }
+
+    t->n = n;
+    t->leaf_size = leaf_size;
+    t->budget = max_bytes;
+    t->pending = n;
+
+    for (unsigned int i = 0; i < n; i++) {
+        rule_pack(&rules[i], &t->rules[i]);
+        list[i] = i;
+    }
+
+    uint32_t lo[HICUTS_FIELDS] = { 0 };
+    unsigned char bits[HICUTS_FIELDS];
+    memcpy(bits, field_bits, sizeof(bits));
+
+    uint32_t empty;
+    int ret = node_new(t, &empty);
+
+    if (ret == 0) {
+        ret = build_node(t, list, n, lo, bits, 0, &t->root);
+    }
+
+    free(list);
+
+    if (ret == -1) {
+        hicuts_free(t);
+        return NULL;
+    }
+
+    return t;
+}
+
+/**
+ * This function finds the first rule matching a packet by walking the tree down to a
+ * leaf and scanning its rules in order.
+ *
+ * @param index the tree
+ * @param pkt the packet
+ *
+ * @return the index (from 0) of the first matching rule, or -1
+ */
+int hicuts_lookup(void *index, packet_t *pkt) {
+
+    hicuts_t *t = (hicuts_t *) index;
+    uint32_t key[HICUTS_FIELDS] = { PACKET_PROTOCOL(*pkt), PACKET_SRC_IP(*pkt),
+            PACKET_SRC_PORT(*pkt), PACKET_DST_IP(*pkt), PACKET_DST_PORT(*pkt) };
+
+    const hicuts_node_t *node = &t->nodes[t->root];
+    unsigned int steps = 1;
+
+    while (node->cuts) {
+        uint32_t i = (key[node->dim] - node->lo) >> node->shift;
+        node = &t->nodes[i < node->cuts ? t->child[node->first + i] : node->other];
+        steps++;
+    }
+
+    const uint32_t *leaf = t->leaf + node->first;
+
+    for (uint32_t k = 0; k < node->count; k++) {
+        const image_rule_t *r = &t->rules[leaf[k]];
+
+        if (r->src_ip == key[1] && r->dst_ip == key[3] && r->protocol == key[0]
+                && (r->src_port == MATCH_PORT_ANY || (uint32_t) r->src_port == key[2])
+                && (r->dst_port == MATCH_PORT_ANY || (uint32_t) r->dst_port == key[4])) {
+            stats_engine_count(steps, k + 1);
+            return leaf[k];
+        }
+    }
+
+    stats_engine_count(steps, node->count);
+
+    return -1;
+}
+
+/**
+ * This function prints the shape of a tree.
+ *
+ * @param index the tree
+ * @param stream the file stream to print to
+ */
+void hicuts_print(void *index, FILE *stream) {
+
+    hicuts_t *t = (hicuts_t *) index;
+
+    fprintf(stream, "Tree: %zu nodes (%u leaves), depth %u\n", t->nodes_len - 1,
+            t->leaves, t->depth);
+    fprintf(stream, "Leaf rules: %zu (%.2f per rule), leaf size %u\n", t->leaf_len,
+            (double) t->leaf_len / t->n, t->leaf_size);
+    fprintf(stream, "Memory: %zu KB (budget %zu KB)\n", tree_bytes(t) >> 10,
+            t->budget >> 10);
+}
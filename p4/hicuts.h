@@ -0,0 +1,74 @@
+/**
+ * @file hicuts.h
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This file acts as the interface for the hicuts.c file
+ */
+
+#ifndef HICUTS_H
+#define HICUTS_H
+
+#include <stddef.h>
+#include "policy.h"
+
+/** Default largest number of rules a leaf of the tree is cut down to */
+#define HICUTS_LEAF_SIZE 8
+
+/** Default amount of memory the tree may grow to before it stops cutting */
+#define HICUTS_MAX_BYTES (256UL << 20)
+
+/**
+ * This function sets the largest number of rules the tree cuts a leaf down to.
+ * Only affects trees built afterwards.
+ *
+ * @param n the number of rules (at least 1)
+ */
+void hicuts_set_leaf_size(unsigned int n);
+
+/**
+ * This function sets the amount of memory a tree may grow to before it stops cutting
+ * and leaves larger leaves instead. Only affects trees built afterwards.
+ *
+ * @param bytes the number of bytes
+ */
+void hicuts_set_memory(size_t bytes);
+
+/**
+ * This function builds a decision tree of a policy, cutting the space of packets into
+ * equal parts along one field at a time until few enough rules are left in each part.
+ *
+ * @param rules the rules in order
+ * @param n the number of rules
+ *
+ * @return the tree, or NULL if even an uncut tree does not fit the memory budget or
+ * memory runs out
+ */
+void *hicuts_build(rule_t *rules, unsigned int n);
+
+/**
+ * This function finds the first rule matching a packet by walking the tree down to a
+ * leaf and scanning its rules in order.
+ *
+ * @param index the tree
+ * @param pkt the packet
+ *
+ * @return the index (from 0) of the first matching rule, or -1
+ */
+int hicuts_lookup(void *index, packet_t *pkt);
+
+/**
+ * This function prints the shape of a tree.
+ *
+ * @param index the tree
+ * @param stream the file stream to print to
+ */
+void hicuts_print(void *index, FILE *stream);
+
+/**
+ * This function frees a decision tree.
+ *
+ * @param index the tree
+ */
+void hicuts_free(void *index);
+
+#endif
@@ -0,0 +1,293 @@
+/**
+ * @file image.c
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This component is responsible for saving the policy as a compiled image and loading
+ * it back. An image is a header followed by the rules in the fixed-width form the
+ * classifier reads, so loading one is a matter of mapping the file and checking it;
+ * nothing is parsed or rebuilt.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "image.h"
+
+/** Suffix of the file an image is written to before it is renamed into place */
+#define IMAGE_TMP_SUFFIX ".tmp"
+
+/**
+ * Representation of a mapped image file
+ * .map: the start of the mapping
+ * .size: the size of the mapping
+ */
+typedef struct image_map {
+    void *map;
+    size_t size;
+} image_map_t;
+
+/** Number of bytes of image files mapped by image_load() and not yet unmapped */
+static size_t mapped_bytes;
+
+/**
+ * This function unmaps an image file once the policy no longer uses it.
+ *
+ * @param arg the image_map_t of the file
+ */
+static void image_unmap(void *arg) {
+
+    image_map_t *m = (image_map_t *) arg;
+
+    munmap(m->map, m->size);
+    __atomic_fetch_sub(&mapped_bytes, m->size, __ATOMIC_RELAXED);
+    free(m);
+}
+
+/**
+ * This function encodes the current policy as a compiled image in memory. Images only
+ * hold IPv4 rules, so a policy with IPv6 rules is not encoded.
+ *
+ * @param size the value to be updated with the size of the image
+ * @param count the value to be updated with the number of rules in it
+ *
+ * @return the dynamically allocated image, or NULL if unsuccessful
+ */
+char *image_encode(size_t *size, int *count) {
+
+    rule_t *rules;
+    unsigned int def;
+    unsigned long gen;
+    int len = policy_rules(&rules, &def, &gen);
+
+    if (len == -1) {
+        return NULL;
+    }
+
+    for (int i = 0; i < len; i++) {
+        if (PACKET_IS_V6(rules[i].match.value)) {
+            free(rules);
+            return NULL;
+        }
+    }
+
+    size_t total = sizeof(image_header_t) + (size_t) len * sizeof(image_rule_t);
+    char *image = (char *) calloc(1, total);
+
+    if (!image) {
+        free(rules);
+        return NULL;
+    }
+
+    image_header_t *hdr = (image_header_t *) image;
+    memcpy(hdr->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    hdr->version = IMAGE_VERSION;
+    hdr->byte_order = IMAGE_BYTE_ORDER;
+    hdr->header_size = sizeof(image_header_t);
+    hdr->rule_size = sizeof(image_rule_t);
+    hdr->def = def;
+    hdr->count = len;
+    hdr->rules_off = sizeof(image_header_t);
+    hdr->size = total;
+
+    image_rule_t *recs = (image_rule_t *) (image + hdr->rules_off);
+    for (int i = 0; i < len; i++) {
+        rule_pack(&rules[i], &recs[i]);
+    }
+
+    free(rules);
+
+    *size = total;
+    *count = len;
+
+    return image;
+}
+
+/**
+ * This function saves the current policy as a compiled image. The image is written
+ * next to @filename and renamed over it, so a policy that is still using an older image
+ * under the same name is never disturbed. Images only hold IPv4 rules, so a policy
+ * with IPv6 rules is not saved.
+ *
+ * @param filename the name of the image file
+ *
+ * @return the number of rules saved, or -1 if unsuccessful
+ */
+int image_save(char *filename) {
+
+    size_t size;
+    int len;
+    char *image = image_encode(&size, &len);
+
+    if (!image) {
+        return -1;
+    }
+
+    char *tmp = (char *) malloc(strlen(filename) + sizeof(IMAGE_TMP_SUFFIX));
+    FILE *fp = NULL;
+
+    if (tmp) {
+        strcpy(tmp, filename);
+        strcat(tmp, IMAGE_TMP_SUFFIX);
+        fp = fopen(tmp, "wb");
+    }
+
+    if (!fp) {
+        free(tmp);
+        free(image);
+        return -1;
+    }
+
+    int ok = fwrite(image, size, 1, fp) == 1;
+
+    if (fclose(fp) != 0) {
+        ok = 0;
+    }
+
+    if (!ok || rename(tmp, filename) == -1) {
+        remove(tmp);
+        len = -1;
+    }
+
+    free(tmp);
+    free(image);
+
+    return len;
+}
+
+/**
+ * This function checks that a mapped file is a well formed image.
+ *
+ * @param map the start of the mapping
+ * @param size the size of the file
+ *
+ * @return 0 if it is, -1 if it is not
+ */
+static int image_check(const char *map, size_t size) {
+
+    const image_header_t *hdr = (const image_header_t *) map;
+
+    if (size < sizeof(image_header_t)
+            || memcmp(hdr->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0
+            || hdr->version != IMAGE_VERSION
+            || hdr->byte_order != IMAGE_BYTE_ORDER
+            || hdr->header_size != sizeof(image_header_t)
+            || hdr->rule_size != sizeof(image_rule_t)
+            || (hdr->def != ACTION_ALLOW && hdr->def != ACTION_DENY)
+            || hdr->size != size) {
+        return -1;
+    }
+
+    //The rules must be aligned and lie inside the file
+    if (hdr->rules_off < sizeof(image_header_t)
+            || hdr->rules_off % sizeof(uint32_t) != 0 || hdr->rules_off > size
+            || hdr->count > (size - hdr->rules_off) / sizeof(image_rule_t)) {
+        return -1;
+    }
+
+    const image_rule_t *rules = (const image_rule_t *) (map + hdr->rules_off);
+
+    for (uint32_t i = 0; i < hdr->count; i++) {
+        if ((rules[i].protocol != PROTO_TCP && rules[i].protocol != PROTO_UDP)
+                || (rules[i].action != ACTION_ALLOW && rules[i].action != ACTION_DENY)
+                || rules[i].src_port < MATCH_PORT_ANY || rules[i].src_port > PORT_MAX
+                || rules[i].dst_port < MATCH_PORT_ANY || rules[i].dst_port > PORT_MAX) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * This function replaces the policy with a compiled image already in memory. The image
+ * is checked and classified against in place without being copied or rebuilt.
+ *
+ * @param map the start of the image, which must stay valid until @release is called
+ * @param size the size of the image
+ * @param release the function called once the policy no longer uses the image; it is
+ * not called if the image is rejected
+ * @param arg the value passed to @release
+ *
+ * @return the number of rules loaded, or -1 if unsuccessful
+ */
+int image_use(const char *map, size_t size, void (*release)(void *), void *arg) {
+
+    const image_header_t *hdr = (const image_header_t *) map;
+
+    if (image_check(map, size) == -1) {
+        return -1;
+    }
+
+    int count = hdr->count;
+    const image_rule_t *rules = (const image_rule_t *) (map + hdr->rules_off);
+
+    if (policy_load_image(rules, count, hdr->def, release, arg) == -1) {
+        return -1;
+    }
+
+    return count;
+}
+
+/**
+ * This function replaces the policy with a compiled image. The file is mapped
+ * read-only, checked, and classified against in place without being rebuilt.
+ *
+ * @param filename the name of the image file
+ *
+ * @return the number of rules loaded, or -1 if unsuccessful
+ */
+int image_load(char *filename) {
+
+    int fd = open(filename, O_RDONLY);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < sizeof(image_header_t)) {
+        close(fd);
+        return -1;
+    }
+
+    image_map_t *m = (image_map_t *) malloc(sizeof(image_map_t));
+
+    if (!m) {
+        close(fd);
+        return -1;
+    }
+
+    m->size = st.st_size;
+    m->map = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (m->map == MAP_FAILED) {
+        free(m);
+        return -1;
+    }
+    __atomic_fetch_add(&mapped_bytes, m->size, __ATOMIC_RELAXED);
+
+    //Once loaded, the policy owns the mapping and unmaps it when done
+    int count = image_use((const char *) m->map, m->size, image_unmap, m);
+
+    if (count == -1) {
+        image_unmap(m);
+    }
+
+    return count;
+}
+
+/**
+ * This function finds how many bytes of image files are mapped into memory, including
+ * images the policy has replaced but readers may still be using.
+ *
+ * @return the number of bytes
+ */
+size_t image_mapped() {
+
+    return __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+}
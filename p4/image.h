@@ -0,0 +1,104 @@
+/**
+ * @file image.h
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This file acts as the interface for the image.c file
+ */
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdint.h>
+#include "policy.h"
+
+/** Magic bytes at the start of every compiled policy image */
+#define IMAGE_MAGIC "FWIMAGE"
+
+/** Version of the image layout, bumped whenever it changes */
+#define IMAGE_VERSION 1
+
+/** Written in native byte order so an image from another byte order is rejected */
+#define IMAGE_BYTE_ORDER 0x01020304
+
+/**
+ * Representation of the header at the start of a compiled policy image. Every part of
+ * the image is found by its offset from the start of the file, so the image can be
+ * mapped anywhere.
+ * .magic: IMAGE_MAGIC
+ * .version: IMAGE_VERSION
+ * .byte_order: IMAGE_BYTE_ORDER
+ * .header_size: the size of this header
+ * .rule_size: the size of one image_rule_t
+ * .def: the default policy
+ * .count: the number of rules
+ * .rules_off: the offset of the rules
+ * .size: the size of the whole image
+ */
+typedef struct image_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t header_size;
+    uint32_t rule_size;
+    uint32_t def;
+    uint32_t count;
+    uint64_t rules_off;
+    uint64_t size;
+} image_header_t;
+
+/**
+ * This function encodes the current policy as a compiled image in memory. Images only
+ * hold IPv4 rules, so a policy with IPv6 rules is not encoded.
+ *
+ * @param size the value to be updated with the size of the image
+ * @param count the value to be updated with the number of rules in it
+ *
+ * @return the dynamically allocated image, or NULL if unsuccessful
+ */
+char *image_encode(size_t *size, int *count);
+
+/**
+ * This function saves the current policy as a compiled image. The image is written
+ * next to @filename and renamed over it, so a policy that is still using an older image
+ * under the same name is never disturbed. Images only hold IPv4 rules, so a policy
+ * with IPv6 rules is not saved.
+ *
+ * @param filename the name of the image file
+ *
+ * @return the number of rules saved, or -1 if unsuccessful
+ */
+int image_save(char *filename);
+
+/**
+ * This function replaces the policy with a compiled image. The file is mapped
+ * read-only, checked, and classified against in place without being rebuilt.
+ *
+ * @param filename the name of the image file
+ *
+ * @return the number of rules loaded, or -1 if unsuccessful
+ */
+int image_load(char *filename);
+
+/**
+ * This function replaces the policy with a compiled image already in memory. The image
+ * is checked and classified against in place without being copied or rebuilt.
+ *
+ * @param map the start of the image, which must stay valid until @release is called
+ * @param size the size of the image
+ * @param release the function called once the policy no longer uses the image; it is
+ * not called if the image is rejected
+ * @param arg the value passed to @release
+ *
+ * @return the number of rules loaded, or -1 if unsuccessful
+ */
+int image_use(const char *map, size_t size, void (*release)(void *), void *arg);
+
+/**
+ * This function finds how many bytes of image files are mapped into memory, including
+ * images the policy has replaced but readers may still be using.
+ *
+ * @return the number of bytes
+ */
+size_t image_mapped();
+
+#endif
@@ -0,0 +1,747 @@
+/**
+ * @file loader.c
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This component is responsible for loading large rules files quickly.
+ * The file is mapped into memory and each line is tokenized in place by a hand-written
+ * scanner, so parsing never allocates, copies or calls into stdio. The parsed rules are
+ * collected and appended to the policy in one step.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "loader.h"
+#include "stats.h"
+
+/** Number of nanoseconds in a second */
+#define NSEC_PER_SEC 1000000000LL
+
+/** Number of octets in an IP address */
+#define IP_OCTETS 4
+
+/** Base used when parsing decimal numbers */
+#define DECIMAL 10
+
+/** Multiplier used when hashing parsed commands (64-bit FNV prime) */
+#define DIGEST_MULT 0x100000001B3ULL
+
+/**
+ * Representation of a token inside the mapped file
+ * .start: the first character of the token
+ * .len: the number of characters in the token
+ */
+typedef struct token {
+    const char *start;
+    int len;
+} token_t;
+
+/**
+ * This function reads the next whitespace separated token on the current line.
+ *
+ * @param cur the current position, updated to just past the token
+ * @param end the end of the input
+ * @param tok the token to be populated
+ *
+ * @return 1 if a token was found, 0 if the line has no more tokens
+ */
+static int next_token(const char **cur, const char *end, token_t *tok) {
+
+    const char *p = *cur;
+
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+        p++;
+    }
+
+    tok->start = p;
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+        p++;
+    }
+
+    tok->len = p - tok->start;
+    *cur = p;
+
+    return tok->len > 0;
+}
+
+/**
+ * This function checks whether a token is the given word.
+ *
+ * @param tok the token
+ * @param word the word to compare against
+ * @param len the length of the word
+ *
+ * @return 1 if they are equal and 0 otherwise
+ */
+static int token_is(token_t *tok, const char *word, int len) {
+
+    return tok->len == len && memcmp(tok->start, word, len) == 0;
+}
+
+/** Compares a token against a string literal */
+#define TOKEN_IS(tok, word) token_is((tok), (word), sizeof(word) - 1)
+
+/**
+ * This function parses an unsigned decimal number from part of a token.
+ *
+ * @param p the first digit, updated to just past the last digit
+ * @param end the end of the token
+ * @param max the largest value accepted
+ * @param out the value to be populated
+ *
+ * @return 0 if successful, -1 if there are no digits or the value is too large
+ */
+static int lex_uint(const char **p, const char *end, unsigned int max,
+        unsigned int *out) {
+
+    const char *s = *p;
+    unsigned int v = 0;
+
+    while (s < end && *s >= '0' && *s <= '9') {
+        v = v * DECIMAL + (*s - '0');
+        if (v > max) {
+            return -1;
+        }
+        s++;
+    }
+
+    if (s == *p) {
+        return -1;
+    }
+
+    *p = s;
+    *out = v;
+
+    return 0;
+}
+
+/**
+ * This function parses a signed decimal number filling a whole token.
+ *
+ * @param tok the token
+ * @param out the value to be populated
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int lex_int(token_t *tok, int *out) {
+
+    const char *p = tok->start;
+    const char *end = p + tok->len;
+    int neg = 0;
+
+    if (p < end && (*p == '-' || *p == '+')) {
+        neg = *p == '-';
+        p++;
+    }
+
+    unsigned int v;
+    if (lex_uint(&p, end, __INT_MAX__, &v) == -1 || p != end) {
+        return -1;
+    }
+
+    *out = neg ? -(int) v : (int) v;
+
+    return 0;
+}
+
+/**
+ * This function parses an a.b.c.d:port or [address]:port token. Only a rule (@any)
+ * may give an IPv6 prefix.
+ *
+ * @param tok the token
+ * @param ep the endpoint to be populated
+ * @param any whether * is accepted as the port
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int lex_ip_port(token_t *tok, fw_endpoint_t *ep, int any) {
+
+    const char *p = tok->start;
+    const char *end = p + tok->len;
+
+    if (*p == '[') {
+        const char *close = memchr(p, ']', tok->len);
+
+        if (!close || ipv6_parse(p + 1, close - p - 1, &ep->ip6,
+                any ? &ep->prefix : NULL) == -1) {
+            return -1;
+        }
+
+        if (!any) {
+            ep->prefix = IPV6_BITS;
+        }
+        ep->v6 = 1;
+        ep->ip = 0;
+        p = close + 1;
+
+        if (p == end || *p != ':') {
+            return -1;
+        }
+        p++;
+    } else {
+        unsigned int nums[IP_OCTETS];
+
+        for (int i = 0; i < IP_OCTETS; i++) {
+            if (lex_uint(&p, end, IP_OCTET_MAX, &nums[i]) == -1) {
+                return -1;
+            }
+
+            char sep = i < IP_OCTETS - 1 ? '.' : ':';
+            if (p == end || *p != sep) {
+                return -1;
+            }
+            p++;
+        }
+
+        ep->v6 = 0;
+        ep->ip = ipaddr_pack(nums);
+    }
+
+    if (any && p + 1 == end && *p == '*') {
+        ep->port = MATCH_PORT_ANY;
+        return 0;
+    }
+
+    unsigned int v;
+    if (lex_uint(&p, end, PORT_MAX, &v) == -1 || p != end) {
+        return -1;
+    }
+    ep->port = v;
+
+    return 0;
+}
+
+/**
+ * This function parses an action token.
+ *
+ * @param tok the token
+ * @param action the action to be populated
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int lex_action(token_t *tok, unsigned int *action) {
+
+    if (TOKEN_IS(tok, "allow")) {
+        *action = ACTION_ALLOW;
+    } else if (TOKEN_IS(tok, "deny")) {
+        *action = ACTION_DENY;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * This function parses the protocol and both endpoints of a rule or test.
+ *
+ * @param cur the current position on the line
+ * @param end the end of the input
+ * @param cmd the command to be populated
+ * @param any whether * is accepted as a port
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int lex_tuple(const char **cur, const char *end, fw_cmd_t *cmd, int any) {
+
+    token_t tok;
+    protocol_t protocol;
+    fw_endpoint_t src, dst;
+
+    if (!next_token(cur, end, &tok)) {
+        return -1;
+    }
+
+    if (TOKEN_IS(&tok, "tcp")) {
+        protocol = PROTO_TCP;
+    } else if (TOKEN_IS(&tok, "udp")) {
+        protocol = PROTO_UDP;
+    } else {
+        return -1;
+    }
+
+    if (!next_token(cur, end, &tok) || lex_ip_port(&tok, &src, any) == -1) {
+        return -1;
+    }
+
+    if (!next_token(cur, end, &tok) || lex_ip_port(&tok, &dst, any) == -1) {
+        return -1;
+    }
+
+    return endpoint_match(protocol, &src, &dst, &cmd->match, &cmd->match6);
+}
+
+/**
+ * This function parses the arguments of a command once its name is known.
+ *
+ * @param cur the current position on the line
+ * @param end the end of the input
+ * @param name the command name
+ * @param cmd the command to be populated
+ *
+ * @return 1 if a command was parsed, 0 for an unknown command, -1 on a parse error
+ */
+static int lex_args(const char **cur, const char *end, token_t *name,
+        fw_cmd_t *cmd) {
+
+    token_t tok;
+
+    if (TOKEN_IS(name, "append")) {
+        cmd->cmd = APPEND;
+        if (!next_token(cur, end, &tok) || lex_action(&tok, &cmd->action) == -1) {
+            return -1;
+        }
+        return lex_tuple(cur, end, cmd, 1) == -1 ? -1 : 1;
+    }
+
+    if (TOKEN_IS(name, "insert")) {
+        cmd->cmd = INSERT;
+        if (!next_token(cur, end, &tok) || lex_int(&tok, &cmd->pos) == -1) {
+            return -1;
+        }
+        if (!next_token(cur, end, &tok) || lex_action(&tok, &cmd->action) == -1) {
+            return -1;
+        }
+        return lex_tuple(cur, end, cmd, 1) == -1 ? -1 : 1;
+    }
+
+    if (TOKEN_IS(name, "test")) {
+        cmd->cmd = TEST;
+        return lex_tuple(cur, end, cmd, 0) == -1 ? -1 : 1;
+    }
+
+    if (TOKEN_IS(name, "default")) {
+        cmd->cmd = DEFAULT;
+        if (!next_token(cur, end, &tok) || lex_action(&tok, &cmd->action) == -1) {
+            return -1;
+        }
+        return 1;
+    }
+
+    if (TOKEN_IS(name, "delete")) {
+        cmd->cmd = DELETE;
+        if (!next_token(cur, end, &tok) || lex_int(&tok, &cmd->pos) == -1) {
+            return -1;
+        }
+        return 1;
+    }
+
+    if (TOKEN_IS(name, "print")) {
+        cmd->cmd = PRINT;
+        if (!next_token(cur, end, &tok)) {
+            return -1;
+        }
+        if (TOKEN_IS(&tok, "all")) {
+            cmd->pos = -1;
+        } else if (TOKEN_IS(&tok, "counts")) {
+            cmd->pos = PRINT_COUNTS;
+        } else if (lex_int(&tok, &cmd->pos) == -1) {
+            return -1;
+        }
+        return 1;
+    }
+
+    if (TOKEN_IS(name, "stats")) {
+        cmd->cmd = STATS;
+        cmd->pos = 0;
+        if (next_token(cur, end, &tok)) {
+            if (TOKEN_IS(&tok, "latency")) {
+                cmd->pos = STATS_LATENCY;
+            } else if (TOKEN_IS(&tok, "engine")) {
+                cmd->pos = STATS_ENGINE;
+            } else if (TOKEN_IS(&tok, "conntrack")) {
+                cmd->pos = STATS_CONNTRACK;
+            } else if (TOKEN_IS(&tok, "pipeline")) {
+                cmd->pos = STATS_PIPELINE;
+            } else if (TOKEN_IS(&tok, "filter")) {
+                cmd->pos = STATS_FILTER;
+            } else {
+                return -1;
+            }
+        }
+        return 1;
+    }
+
+    if (TOKEN_IS(name, "tick")) {
+        cmd->cmd = TICK;
+        if (!next_token(cur, end, &tok) || lex_int(&tok, &cmd->pos) == -1
+                || cmd->pos < 0) {
+            return -1;
+        }
+        return 1;
+    }
+
+    if (TOKEN_IS(name, "optimize")) {
+        cmd->cmd = OPTIMIZE;
+        cmd->pos = 0;
+        if (next_token(cur, end, &tok)) {
+            if (!TOKEN_IS(&tok, "apply")) {
+                return -1;
+            }
+            cmd->pos = OPTIMIZE_APPLY;
+        }
+        return 1;
+    }
+
+    if (TOKEN_IS(name, "reorder")) {
+        cmd->cmd = REORDER;
+        return next_token(cur, end, &tok) ? -1 : 1;
+    }
+
+    if (TOKEN_IS(name, "top")) {
+        cmd->cmd = TOP;
+        cmd->pos = 0;
+        if (next_token(cur, end, &tok) && (lex_int(&tok, &cmd->pos) == -1
+                || cmd->pos <= 0)) {
+            return -1;
+        }
+        return 1;
+    }
+
+    if (TOKEN_IS(name, "begin") || TOKEN_IS(name, "commit") || TOKEN_IS(name, "abort")) {
+        cmd->cmd = TOKEN_IS(name, "begin") ? BEGIN
+                : TOKEN_IS(name, "commit") ? COMMIT : ABORT;
+        return next_token(cur, end, &tok) ? -1 : 1;
+    }
+
+    if (TOKEN_IS(name, "mem")) {
+        cmd->cmd = MEM;
+        return next_token(cur, end, &tok) ? -1 : 1;
+    }
+
+    if (TOKEN_IS(name, "save") || TOKEN_IS(name, "load") || TOKEN_IS(name, "publish")) {
+        cmd->cmd = TOKEN_IS(name, "save") ? SAVE
+                : TOKEN_IS(name, "load") ? LOAD : PUBLISH;
+        if (!next_token(cur, end, &tok) || tok.len >= EST_LINE) {
+            return -1;
+        }
+        memcpy(cmd->file, tok.start, tok.len);
+        cmd->file[tok.len] = '\0';
+        return 1;
+    }
+
+    if (TOKEN_IS(name, "help")) {
+        cmd->cmd = HELP;
+        return 1;
+    }
+
+    if (TOKEN_IS(name, "quit")) {
+        cmd->cmd = QUIT;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * This function parses the command on the line starting at @cur and advances @cur past
+ * the end of the line. It accepts the same command language as parse_command() but
+ * works directly on the bytes in memory, without copying or libc formatting.
+ *
+ * @param cur the start of the line, updated to the start of the next line
+ * @param end the end of the input
+ * @param cmd the command to be populated
+ *
+ * @return 1 if a command was parsed, 0 for a blank or unknown line, -1 on a parse error
+ */
+int lex_command(const char **cur, const char *end, fw_cmd_t *cmd) {
+
+    token_t name;
+    int ret = 0;
+
+    if (next_token(cur, end, &name)) {
+        ret = lex_args(cur, end, &name, cmd);
+    }
+
+    //Skip whatever is left of the line
+    const char *nl = memchr(*cur, '\n', end - *cur);
+    *cur = nl ? nl + 1 : end;
+
+    return ret;
+}
+
+/**
+ * This function maps a whole file read-only into memory.
+ *
+ * @param filename the name of the file
+ * @param size the value to be updated with the size of the file
+ *
+ * @return the start of the mapping, NULL for an empty file, or MAP_FAILED on failure
+ */
+static const char *map_file(char *filename, size_t *size) {
+
+    int fd = open(filename, O_RDONLY);
+
+    if (fd == -1) {
+        return MAP_FAILED;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return MAP_FAILED;
+    }
+
+    *size = st.st_size;
+    if (*size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    const char *map = (const char *) mmap(NULL, *size, PROT_READ, MAP_PRIVATE,
+            fd, 0);
+    close(fd);
+
+    if (map != MAP_FAILED) {
+        madvise((void *) map, *size, MADV_SEQUENTIAL);
+    }
+
+    return map;
+}
+
+/**
+ * This function reads the default and append commands of a rules file into an array.
+ * The file is mapped into memory and tokenized in place.
+ *
+ * @param filename the name of the rules file
+ * @param rules the value to be updated with the dynamically allocated rules
+ * @param def the value to be updated with the last default action, or -1 if none
+ *
+ * @return the number of rules read, or -1 if the file could not be read
+ */
+int read_rules(char *filename, rule_t **rules, int *def) {
+
+    size_t size;
+    const char *map = map_file(filename, &size);
+
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    unsigned int len = 0;
+    unsigned int cap = LOADER_INIT_RULES;
+    rule_t *list = (rule_t *) malloc(cap * sizeof(rule_t));
+    *def = -1;
+
+    const char *cur = map;
+    const char *end = map + size;
+
+    while (list && cur < end) {
+
+        fw_cmd_t cmd;
+        if (lex_command(&cur, end, &cmd) != 1) {
+            continue;
+        }
+
+        if (cmd.cmd == DEFAULT) {
+            *def = cmd.action;
+        } else if (cmd.cmd == APPEND) {
+            if (len == cap) {
+                cap *= 2;
+                rule_t *grown = (rule_t *) realloc(list, cap * sizeof(rule_t));
+
+                if (!grown) {
+                    free(list);
+                    list = NULL;
+                    break;
+                }
+                list = grown;
+            }
+
+            list[len].action = cmd.action;
+            list[len].match = cmd.match;
+            list[len].match6 = cmd.match6;
+            len++;
+        }
+    }
+
+    if (map) {
+        munmap((void *) map, size);
+    }
+
+    if (!list) {
+        return -1;
+    }
+
+    *rules = list;
+
+    return len;
+}
+
+/**
+ * This function loads the default and append commands of a rules file into the policy.
+ * The file is mapped into memory and all of its rules are appended at once.
+ *
+ * @param filename the name of the rules file
+ *
+ * @return the number of rules loaded, or -1 if the file could not be loaded
+ */
+int load_rules_fast(char *filename) {
+
+    rule_t *rules;
+    int def;
+    int len = read_rules(filename, &rules, &def);
+
+    if (len == -1) {
+        return -1;
+    }
+
+    if (len > 0 && policy_append_rules(rules, len) == -1) {
+        len = -1;
+    }
+    free(rules);
+
+    if (len != -1 && def != -1) {
+        policy_set_default(def);
+    }
+
+    return len;
+}
+
+/**
+ * This function folds the fields that a command uses into a running digest.
+ *
+ * @param digest the digest so far
+ * @param cmd the parsed command
+ *
+ * @return the updated digest
+ */
+static unsigned long long cmd_digest(unsigned long long digest, fw_cmd_t *cmd) {
+
+    unsigned long long v[] = { cmd->cmd, 0, 0, 0 };
+
+    if (cmd->cmd == DEFAULT) {
+        v[1] = cmd->action;
+    } else if (cmd->cmd == DELETE || cmd->cmd == PRINT || cmd->cmd == STATS
+            || cmd->cmd == OPTIMIZE || cmd->cmd == TOP) {
+        v[1] = (unsigned int) cmd->pos;
+    } else if (cmd->cmd == APPEND || cmd->cmd == INSERT || cmd->cmd == TEST) {
+        v[1] = cmd->cmd == TEST ? 0 : cmd->action;
+        v[1] = (v[1] << (BIT_SIZE * 4)) | (cmd->cmd == INSERT ? cmd->pos : 0);
+        v[2] = cmd->match.value.addrs;
+        v[3] = cmd->match.value.ports ^ cmd->match.mask.ports * DIGEST_MULT;
+        for (int i = 0; i < IPV6_WORDS; i++) {
+            v[2] = (v[2] ^ cmd->match6.src.w[i]) * DIGEST_MULT
+                    ^ cmd->match6.src_mask.w[i];
+            v[3] = (v[3] ^ cmd->match6.dst.w[i]) * DIGEST_MULT
+                    ^ cmd->match6.dst_mask.w[i];
+        }
+    } else if (cmd->cmd == SAVE || cmd->cmd == LOAD) {
+        for (int i = 0; cmd->file[i]; i++) {
+            v[1] = (v[1] ^ (unsigned char) cmd->file[i]) * DIGEST_MULT;
+        }
+    }
+
+    for (int i = 0; i < sizeof(v) / sizeof(v[0]); i++) {
+        digest = (digest ^ v[i]) * DIGEST_MULT;
+    }
+
+    return digest;
+}
+
+/**
+ * This function prints one line of benchmark results.
+ *
+ * @param stream the file stream to print to
+ * @param name the name of what was measured
+ * @param lines the number of lines processed
+ * @param ns the time taken in nanoseconds
+ */
+static void bench_line(FILE *stream, char *name, unsigned long lines,
+        long long ns) {
+
+    double secs = (double) ns / NSEC_PER_SEC;
+    fprintf(stream, "%-20s %10lu lines %10.3f ms %12.0f lines/sec\n", name, lines,
+            secs * 1000, secs > 0 ? lines / secs : 0.0);
+}
+
+/**
+ * This function parses the rules file @filename with both parse_command() and
+ * lex_command(), checks that they agree, and prints how long each took to @stream.
+ *
+ * @param filename the name of the rules file
+ * @param stream the file stream to print to
+ *
+ * @return 0 if successful, -1 if the file could not be read or the parsers disagree
+ */
+int loader_bench(char *filename, FILE *stream) {
+
+    //The original fgetc/sscanf parser
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        return -1;
+    }
+
+    unsigned long slow_lines = 0;
+    unsigned long long slow_digest = 0;
+    long long t0 = stats_now_ns();
+
+    while (1) {
+        fw_cmd_t cmd = { };
+        int ret = parse_command(fp, &cmd);
+
+        if (feof(fp)) {
+            break;
+        }
+
+        slow_lines++;
+        if (ret == 0 && cmd.cmd != 0) {
+            slow_digest = cmd_digest(slow_digest, &cmd);
+        }
+    }
+
+    long long slow_ns = stats_now_ns() - t0;
+    fclose(fp);
+
+    //The mapped tokenizer
+    size_t size;
+    t0 = stats_now_ns();
+    const char *map = map_file(filename, &size);
+
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    unsigned long fast_lines = 0;
+    unsigned long long fast_digest = 0;
+    const char *cur = map;
+    const char *end = map + size;
+
+    while (cur < end) {
+        fw_cmd_t cmd;
+        if (lex_command(&cur, end, &cmd) == 1) {
+            fast_digest = cmd_digest(fast_digest, &cmd);
+        }
+        fast_lines++;
+    }
+
+    long long fast_ns = stats_now_ns() - t0;
+    if (map) {
+        munmap((void *) map, size);
+    }
+
+    //Loading into the policy as -r does
+    t0 = stats_now_ns();
+    int loaded = load_rules_fast(filename);
+    long long load_ns = stats_now_ns() - t0;
+
+    bench_line(stream, "parse_command", slow_lines, slow_ns);
+    bench_line(stream, "lex_command", fast_lines, fast_ns);
+    bench_line(stream, "load_rules_fast", loaded < 0 ? 0 : loaded, load_ns);
+
+    if (fast_ns > 0) {
+        fprintf(stream, "Speedup: %.1fx\n", (double) slow_ns / fast_ns);
+    }
+
+    if (slow_digest != fast_digest) {
+        fprintf(stream, "Parsers disagree!\n");
+        return -1;
+    }
+
+    fprintf(stream, "Parsers agree.\n");
+
+    return 0;
+}
@@ -0,0 +1,63 @@
+/**
+ * @file loader.h
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This file acts as the interface for the loader.c file
+ */
+
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <stdio.h>
+#include "command.h"
+
+/** Initial capacity of the array of rules collected while loading */
+#define LOADER_INIT_RULES 1024
+
+/**
+ * This function parses the command on the line starting at @cur and advances @cur past
+ * the end of the line. It accepts the same command language as parse_command() but
+ * works directly on the bytes in memory, without copying or libc formatting.
+ *
+ * @param cur the start of the line, updated to the start of the next line
+ * @param end the end of the input
+ * @param cmd the command to be populated
+ *
+ * @return 1 if a command was parsed, 0 for a blank or unknown line, -1 on a parse error
+ */
+int lex_command(const char **cur, const char *end, fw_cmd_t *cmd);
+
+/**
+ * This function reads the default and append commands of a rules file into an array.
+ * The file is mapped into memory and tokenized in place.
+ *
+ * @param filename the name of the rules file
+ * @param rules the value to be updated with the dynamically allocated rules
+ * @param def the value to be updated with the last default action, or -1 if none
+ *
+ * @return the number of rules read, or -1 if the file could not be read
+ */
+int read_rules(char *filename, rule_t **rules, int *def);
+
+/**
+ * This function loads the default and append commands of a rules file into the policy.
+ * The file is mapped into memory and all of its rules are appended at once.
+ *
+ * @param filename the name of the rules file
+ *
+ * @return the number of rules loaded, or -1 if the file could not be loaded
+ */
+int load_rules_fast(char *filename);
+
+/**
+ * This function parses the rules file @filename with both parse_command() and
+ * lex_command(), checks that they agree, and prints how long each took to @stream.
+ *
+ * @param filename the name of the rules file
+ * @param stream the file stream to print to
+ *
+ * @return 0 if successful, -1 if the file could not be read or the parsers disagree
+ */
+int loader_bench(char *filename, FILE *stream);
+
+#endif
@@ -0,0 +1,685 @@
+/**
+ * @file optimize.c
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This component is responsible for finding dead rules in a policy and proving that a
+ * policy without them behaves the same. Two rules can only overlap if they have the same
+ * protocol and addresses, so rules are first grouped by that triple and each group is
+ * analysed on its own. IPv6 rules match prefixes, which may overlap whatever their
+ * addresses, so they are kept together in a group of their own that is left as written.
+ *
+ * The same groups bound how far a rule may move when the policy is reordered to put
+ * the rules that match the most packets first: a rule only has to stay behind the
+ * earlier rules of its own group that it overlaps and disagrees with.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "optimize.h"
+
+/**
+ * Representation of a rule while grouping
+ * .rule: the rule
+ * .side: which policy the rule belongs to (0 or 1)
+ * .index: the index of the rule within its policy
+ */
+typedef struct opt_entry {
+    rule_t *rule;
+    int side;
+    int index;
+} opt_entry_t;
+
+/**
+ * This function compares two entries by protocol, addresses, side and index, sorting
+ * IPv6 rules after the rest by side and index alone.
+ *
+ * @param x the first entry
+ * @param y the second entry
+ *
+ * @return negative, zero or positive as for qsort()
+ */
+static int entry_cmp(const void *x, const void *y) {
+
+    const opt_entry_t *a = (const opt_entry_t *) x;
+    const opt_entry_t *b = (const opt_entry_t *) y;
+
+    int av6 = PACKET_IS_V6(a->rule->match.value);
+    int bv6 = PACKET_IS_V6(b->rule->match.value);
+    if (av6 != bv6) {
+        return av6 - bv6;
+    }
+
+    if (av6) {
+        return a->side != b->side ? a->side - b->side : a->index - b->index;
+    }
+
+    protocol_t ap = PACKET_PROTOCOL(a->rule->match.value);
+    protocol_t bp = PACKET_PROTOCOL(b->rule->match.value);
+    if (ap != bp) {
+        return ap < bp ? -1 : 1;
+    }
+
+    //The source address is the high half, so the word sorts by source then destination
+    uint64_t aa = a->rule->match.value.addrs;
+    uint64_t ba = b->rule->match.value.addrs;
+    if (aa != ba) {
+        return aa < ba ? -1 : 1;
+    }
+
+    if (a->side != b->side) {
+        return a->side - b->side;
+    }
+
+    return a->index - b->index;
+}
+
+/**
+ * This function checks whether two entries have the same protocol and addresses, or
+ * are both IPv6 rules.
+ *
+ * @param a the first entry
+ * @param b the second entry
+ *
+ * @return 1 if they do and 0 otherwise
+ */
+static int same_triple(opt_entry_t *a, opt_entry_t *b) {
+
+    int v6 = PACKET_IS_V6(a->rule->match.value);
+
+    if (v6 != PACKET_IS_V6(b->rule->match.value)) {
+        return 0;
+    }
+
+    return v6 || (a->rule->match.value.addrs == b->rule->match.value.addrs
+            && ((a->rule->match.value.ports ^ b->rule->match.value.ports)
+                    & KEY_PROTO_MASK) == 0);
+}
+
+/**
+ * This function checks whether the IPv6 rules of two policies are the same rules in
+ * the same order.
+ *
+ * @param a the entries of the first policy
+ * @param alen the number of entries of the first policy
+ * @param b the entries of the second policy
+ * @param blen the number of entries of the second policy
+ *
+ * @return 1 if they are and 0 otherwise
+ */
+static int same_rules(opt_entry_t *a, int alen, opt_entry_t *b, int blen) {
+
+    if (alen != blen) {
+        return 0;
+    }
+
+    for (int i = 0; i < alen; i++) {
+        if (a[i].rule->action != b[i].rule->action
+                || memcmp(&a[i].rule->match, &b[i].rule->match,
+                        sizeof(packet_match_t)) != 0
+                || memcmp(&a[i].rule->match6, &b[i].rule->match6,
+                        sizeof(match6_t)) != 0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * This function checks whether one port match includes another.
+ *
+ * @param outer the port match that may be wider
+ * @param inner the port match that may be narrower
+ *
+ * @return 1 if every port matched by @inner is matched by @outer
+ */
+static int port_covers(port_match_t outer, port_match_t inner) {
+
+    return outer == MATCH_PORT_ANY || outer == inner;
+}
+
+/**
+ * This function checks whether two port matches share a port.
+ *
+ * @param a the first port match
+ * @param b the second port match
+ *
+ * @return 1 if some port is matched by both
+ */
+static int port_overlaps(port_match_t a, port_match_t b) {
+
+    return a == MATCH_PORT_ANY || b == MATCH_PORT_ANY || a == b;
+}
+
+/**
+ * This function checks whether a rule matches every packet another rule with the same
+ * protocol and addresses matches.
+ *
+ * @param outer the rule that may be wider
+ * @param inner the rule that may be narrower
+ *
+ * @return 1 if @outer covers @inner
+ */
+static int covers(rule_t *outer, rule_t *inner) {
+
+    return port_covers(MATCH_SRC_PORT(outer->match), MATCH_SRC_PORT(inner->match))
+            && port_covers(MATCH_DST_PORT(outer->match), MATCH_DST_PORT(inner->match));
+}
+
+/**
+ * This function checks whether two rules with the same protocol and addresses match a
+ * common packet.
+ *
+ * @param a the first rule
+ * @param b the second rule
+ *
+ * @return 1 if they overlap
+ */
+static int overlaps(rule_t *a, rule_t *b) {
+
+    return port_overlaps(MATCH_SRC_PORT(a->match), MATCH_SRC_PORT(b->match))
+            && port_overlaps(MATCH_DST_PORT(a->match), MATCH_DST_PORT(b->match));
+}
+
+/**
+ * This function builds the entries for one or two policies sorted into groups.
+ *
+ * @param a the rules of the first policy
+ * @param alen the number of rules in the first policy
+ * @param b the rules of the second policy (may be NULL)
+ * @param blen the number of rules in the second policy
+ *
+ * @return the dynamically allocated entries, or NULL if unsuccessful
+ */
+static opt_entry_t *group(rule_t *a, int alen, rule_t *b, int blen) {
+
+    opt_entry_t *entries = (opt_entry_t *) malloc(
+            (alen + blen + 1) * sizeof(opt_entry_t));
+
+    if (!entries) {
+        return NULL;
+    }
+
+    for (int i = 0; i < alen; i++) {
+        entries[i].rule = &a[i];
+        entries[i].side = 0;
+        entries[i].index = i;
+    }
+
+    for (int i = 0; i < blen; i++) {
+        entries[alen + i].rule = &b[i];
+        entries[alen + i].side = 1;
+        entries[alen + i].index = i;
+    }
+
+    qsort(entries, alen + blen, sizeof(opt_entry_t), entry_cmp);
+
+    return entries;
+}
+
+/**
+ * This function finds the rules of a policy that can be removed without changing the
+ * action of any packet. A rule is shadowed if a single earlier rule matches every packet
+ * it matches. A rule is redundant if every later rule it overlaps has the same action
+ * up to one that covers it, or up to the end when the default has the same action.
+ * IPv6 rules are always kept.
+ *
+ * @param rules the rules of the policy in order
+ * @param len the number of rules
+ * @param def the default policy
+ * @param verdict the array (len long) to be populated with a verdict for each rule
+ * @param cause the array (len long) to be populated with the index of the covering
+ * rule for each removable rule (-1 for the default policy)
+ *
+ * @return the number of removable rules, or -1 if unsuccessful
+ */
+int optimize_find(rule_t *rules, int len, unsigned int def, int *verdict,
+        int *cause) {
+
+    opt_entry_t *entries = group(rules, len, NULL, 0);
+
+    if (!entries) {
+        return -1;
+    }
+
+    int removed = 0;
+
+    for (int start = 0; start < len;) {
+        int end = start + 1;
+        while (end < len && same_triple(&entries[start], &entries[end])) {
+            end++;
+        }
+
+        if (PACKET_IS_V6(entries[start].rule->match.value)) {
+            for (int j = start; j < end; j++) {
+                verdict[entries[j].index] = OPT_KEEP;
+                cause[entries[j].index] = -1;
+            }
+            start = end;
+            continue;
+        }
+
+        //Shadowed: some earlier rule in the group covers it
+        for (int j = start; j < end; j++) {
+            int idx = entries[j].index;
+            verdict[idx] = OPT_KEEP;
+            cause[idx] = -1;
+
+            for (int i = start; i < j; i++) {
+                if (covers(entries[i].rule, entries[j].rule)) {
+                    verdict[idx] = OPT_SHADOWED;
+                    cause[idx] = entries[i].index;
+                    removed++;
+                    break;
+                }
+            }
+        }
+
+        //Redundant: removing it hands its packets to a rule with the same action.
+        //Each removal keeps the behaviour, so later checks can ignore removed rules.
+        for (int j = end - 1; j >= start; j--) {
+            int idx = entries[j].index;
+            if (verdict[idx] != OPT_KEEP) {
+                continue;
+            }
+
+            rule_t *rule = entries[j].rule;
+            int same = rule->action == def;
+            int by = -1;
+
+            for (int k = j + 1; k < end; k++) {
+                if (verdict[entries[k].index] != OPT_KEEP
+                        || !overlaps(rule, entries[k].rule)) {
+                    continue;
+                }
+
+                if (entries[k].rule->action != rule->action) {
+                    same = 0;
+                    break;
+                }
+
+                if (covers(entries[k].rule, rule)) {
+                    same = 1;
+                    by = entries[k].index;
+                    break;
+                }
+            }
+
+            if (same) {
+                verdict[idx] = OPT_REDUNDANT;
+                cause[idx] = by;
+                removed++;
+            }
+        }
+
+        start = end;
+    }
+
+    free(entries);
+
+    return removed;
+}
+
+/**
+ * This function finds the action a group of rules gives a packet.
+ *
+ * @param entries the entries of the group for one policy
+ * @param n the number of entries
+ * @param def the default policy
+ * @param pkt the packet
+ *
+ * @return the action of the first matching rule, or the default policy
+ */
+static int group_test(opt_entry_t *entries, int n, unsigned int def,
+        packet_t pkt) {
+
+    for (int i = 0; i < n; i++) {
+        if (packet_match(&entries[i].rule->match, &pkt)) {
+            return entries[i].rule->action;
+        }
+    }
+
+    return def;
+}
+
+/**
+ * This function collects the distinct ports named by a group for one endpoint, plus
+ * one port that no rule in the group names.
+ *
+ * @param entries the entries of the group
+ * @param n the number of entries
+ * @param dst 1 for destination ports, 0 for source ports
+ * @param ports the array (n + 1 long) to be populated
+ *
+ * @return the number of ports
+ */
+static int group_ports(opt_entry_t *entries, int n, int dst, int *ports) {
+
+    int count = 0;
+
+    for (int i = 0; i < n; i++) {
+        port_match_t p = dst ? MATCH_DST_PORT(entries[i].rule->match)
+                : MATCH_SRC_PORT(entries[i].rule->match);
+
+        if (p == MATCH_PORT_ANY) {
+            continue;
+        }
+
+        int seen = 0;
+        for (int j = 0; j < count && !seen; j++) {
+            seen = ports[j] == p;
+        }
+        if (!seen) {
+            ports[count++] = p;
+        }
+    }
+
+    //At most n ports are named, so one of the first n + 1 is free
+    for (int p = PORT_MIN; p <= PORT_MAX; p++) {
+        int seen = 0;
+        for (int j = 0; j < count && !seen; j++) {
+            seen = ports[j] == p;
+        }
+        if (!seen) {
+            ports[count++] = p;
+            break;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * This function proves that two policies with the same default give every packet the
+ * same action. Since addresses are matched exactly and ports are exact or wildcards,
+ * it is enough to try, for every protocol and address pair in either policy, each
+ * port named by a rule plus one port named by none. IPv6 rules are left as written by
+ * optimize_find(), so both policies must have the same ones in the same order.
+ *
+ * @param a the rules of the first policy
+ * @param alen the number of rules in the first policy
+ * @param b the rules of the second policy
+ * @param blen the number of rules in the second policy
+ * @param def the default policy of both
+ * @param checked the value to be updated with the number of packets tried
+ *
+ * @return 0 if the policies are equivalent, 1 if they differ, -1 if unsuccessful
+ */
+int optimize_verify(rule_t *a, int alen, rule_t *b, int blen,
+        unsigned int def, unsigned long *checked) {
+
+    int total = alen + blen;
+    opt_entry_t *entries = group(a, alen, b, blen);
+    int *sports = (int *) malloc((total + 1) * sizeof(int));
+    int *dports = (int *) malloc((total + 1) * sizeof(int));
+    int ret = 0;
+
+    *checked = 0;
+
+    if (!entries || !sports || !dports) {
+        free(entries);
+        free(sports);
+        free(dports);
+        return -1;
+    }
+
+    for (int start = 0; start < total && ret == 0;) {
+        int end = start + 1;
+        while (end < total && same_triple(&entries[start], &entries[end])) {
+            end++;
+        }
+
+        //Entries from the first policy sort before those from the second
+        int mid = start;
+        while (mid < end && entries[mid].side == 0) {
+            mid++;
+        }
+
+        if (PACKET_IS_V6(entries[start].rule->match.value)) {
+            ret = !same_rules(entries + start, mid - start, entries + mid, end - mid);
+            start = end;
+            continue;
+        }
+
+        int ns = group_ports(entries + start, end - start, 0, sports);
+        int nd = group_ports(entries + start, end - start, 1, dports);
+
+        packet_t base = entries[start].rule->match.value;
+
+        for (int s = 0; s < ns && ret == 0; s++) {
+            for (int d = 0; d < nd && ret == 0; d++) {
+                packet_t pkt = packet_key(PACKET_PROTOCOL(base), PACKET_SRC_IP(base),
+                        sports[s], PACKET_DST_IP(base), dports[d]);
+                (*checked)++;
+
+                if (group_test(entries + start, mid - start, def, pkt)
+                        != group_test(entries + mid, end - mid, def, pkt)) {
+                    ret = 1;
+                }
+            }
+        }
+
+        start = end;
+    }
+
+    free(entries);
+    free(sports);
+    free(dports);
+
+    return ret;
+}
+
+/**
+ * This function checks whether a rule has to stay behind an earlier rule of its group
+ * for every packet to keep its action. Rules that match no packet in common, or that
+ * give the same action, may trade places. IPv6 rules keep their order.
+ *
+ * @param earlier the earlier entry
+ * @param later the later entry of the same group
+ *
+ * @return 1 if @later has to stay behind @earlier and 0 otherwise
+ */
+static int must_follow(opt_entry_t *earlier, opt_entry_t *later) {
+
+    //IPv6 entries are sorted by index, so each only has to follow the one before it
+    if (PACKET_IS_V6(later->rule->match.value)) {
+        return later - earlier == 1;
+    }
+
+    return earlier->rule->action != later->rule->action
+            && overlaps(earlier->rule, later->rule);
+}
+
+/**
+ * This function checks whether one rule should be scanned before another: the rule
+ * with more hits goes first, and rules with as many keep their order.
+ *
+ * @param hits the number of packets each rule has matched
+ * @param a the index of the first rule
+ * @param b the index of the second rule
+ *
+ * @return 1 if @a goes first and 0 otherwise
+ */
+static int hotter(unsigned long *hits, int a, int b) {
+
+    return hits[a] > hits[b] || (hits[a] == hits[b] && a < b);
+}
+
+/**
+ * This function adds a rule to a heap of the rules free to be placed next.
+ *
+ * @param heap the heap
+ * @param n the number of rules in the heap, which is incremented
+ * @param hits the number of packets each rule has matched
+ * @param rule the index of the rule
+ */
+static void heap_push(int *heap, int *n, unsigned long *hits, int rule) {
+
+    int i = (*n)++;
+
+    while (i > 0 && hotter(hits, rule, heap[(i - 1) / 2])) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+
+    heap[i] = rule;
+}
+
+/**
+ * This function takes the rule with the most hits off a heap of the rules free to be
+ * placed next.
+ *
+ * @param heap the heap
+ * @param n the number of rules in the heap (at least one), which is decremented
+ * @param hits the number of packets each rule has matched
+ *
+ * @return the index of the rule
+ */
+static int heap_pop(int *heap, int *n, unsigned long *hits) {
+
+    int top = heap[0];
+    int last = heap[--(*n)];
+    int i = 0;
+
+    while (2 * i + 1 < *n) {
+        int child = 2 * i + 1;
+        if (child + 1 < *n && hotter(hits, heap[child + 1], heap[child])) {
+            child++;
+        }
+        if (!hotter(hits, heap[child], last)) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+
+    heap[i] = last;
+
+    return top;
+}
+
+/**
+ * This function finds an order of the rules of a policy that puts the rules matching
+ * the most packets first without changing the action of any packet. Each rule stays
+ * behind every earlier rule it overlaps with a different action; otherwise the rule
+ * with the most hits of those free to go next is placed next.
+ *
+ * @param rules the rules of the policy in order
+ * @param len the number of rules
+ * @param hits the number of packets each rule has matched
+ * @param order the array (len long) to be populated with the index of each rule in
+ * its new order
+ *
+ * @return the number of rules whose position changed, or -1 if unsuccessful
+ */
+int optimize_reorder(rule_t *rules, int len, unsigned long *hits, int *order) {
+
+    opt_entry_t *entries = group(rules, len, NULL, 0);
+    int *slot = (int *) malloc((len + 1) * sizeof(int));
+    int *end = (int *) malloc((len + 1) * sizeof(int));
+    int *waiting = (int *) malloc((len + 1) * sizeof(int));
+    int *heap = (int *) malloc((len + 1) * sizeof(int));
+    int moved = -1;
+
+    if (entries && slot && end && waiting && heap) {
+        int n = 0;
+
+        //Count the earlier rules of its group each rule has to stay behind
+        for (int start = 0; start < len;) {
+            int stop = start + 1;
+            while (stop < len && same_triple(&entries[start], &entries[stop])) {
+                stop++;
+            }
+
+            for (int k = start; k < stop; k++) {
+                slot[entries[k].index] = k;
+                end[k] = stop;
+                waiting[k] = 0;
+                for (int j = start; j < k; j++) {
+                    waiting[k] += must_follow(&entries[j], &entries[k]);
+                }
+                if (waiting[k] == 0) {
+                    heap_push(heap, &n, hits, entries[k].index);
+                }
+            }
+
+            start = stop;
+        }
+
+        moved = 0;
+        for (int i = 0; i < len; i++) {
+            order[i] = heap_pop(heap, &n, hits);
+            moved += order[i] != i;
+
+            int k = slot[order[i]];
+            for (int j = k + 1; j < end[k]; j++) {
+                if (must_follow(&entries[k], &entries[j]) && --waiting[j] == 0) {
+                    heap_push(heap, &n, hits, entries[j].index);
+                }
+            }
+        }
+    }
+
+    free(entries);
+    free(slot);
+    free(end);
+    free(waiting);
+    free(heap);
+
+    return moved;
+}
+
+/**
+ * This function finds how many rules a scan of the policy in order compares the average
+ * packet against, going by the packets each rule has matched so far.
+ *
+ * @param hits the number of packets each rule has matched
+ * @param len the number of rules
+ * @param def the number of packets no rule matched, which are compared against all
+ * @param order the order the rules are scanned in (indexes from 0), or NULL for the
+ * order they are in
+ *
+ * @return the average number of rules compared, or 0 if no packet has been counted
+ */
+double optimize_scan_cost(unsigned long *hits, int len, unsigned long def, int *order) {
+
+    double compared = (double) def * len;
+    unsigned long packets = def;
+
+    for (int i = 0; i < len; i++) {
+        unsigned long h = hits[order ? order[i] : i];
+        compared += (double) h * (i + 1);
+        packets += h;
+    }
+
+    return packets ? compared / packets : 0.0;
+}
+
+/**
+ * This function prints the removable rules found by optimize_find().
+ *
+ * @param stream the file stream to print to
+ * @param len the number of rules
+ * @param verdict the verdict for each rule
+ * @param cause the covering rule for each removable rule
+ */
+void optimize_report(FILE *stream, int len, int *verdict, int *cause) {
+
+    int removed = 0;
+
+    for (int i = 0; i < len; i++) {
+        if (verdict[i] == OPT_SHADOWED) {
+            fprintf(stream, "[%d] shadowed by [%d]\n", i + 1, cause[i] + 1);
+            removed++;
+        } else if (verdict[i] == OPT_REDUNDANT) {
+            if (cause[i] == -1) {
+                fprintf(stream, "[%d] redundant with default policy\n", i + 1);
+            } else {
+                fprintf(stream, "[%d] redundant with [%d]\n", i + 1, cause[i] + 1);
+            }
+            removed++;
+        }
+    }
+
+    fprintf(stream, "%d of %d rules can be removed.\n", removed, len);
+}
@@ -0,0 +1,99 @@
+/**
+ * @file optimize.h
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This file acts as the interface for the optimize.c file
+ */
+
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+#include <stdio.h>
+#include "policy.h"
+
+/** Verdict for a rule that must be kept */
+#define OPT_KEEP 0
+
+/** Verdict for a rule that can never match because an earlier rule covers it */
+#define OPT_SHADOWED 1
+
+/** Verdict for a rule whose packets get the same action without it */
+#define OPT_REDUNDANT 2
+
+/**
+ * This function finds the rules of a policy that can be removed without changing the
+ * action of any packet. A rule is shadowed if a single earlier rule matches every packet
+ * it matches. A rule is redundant if every later rule it overlaps has the same action
+ * up to one that covers it, or up to the end when the default has the same action.
+ *
+ * @param rules the rules of the policy in order
+ * @param len the number of rules
+ * @param def the default policy
+ * @param verdict the array (len long) to be populated with a verdict for each rule
+ * @param cause the array (len long) to be populated with the index of the covering
+ * rule for each removable rule (-1 for the default policy)
+ *
+ * @return the number of removable rules, or -1 if unsuccessful
+ */
+int optimize_find(rule_t *rules, int len, unsigned int def, int *verdict,
+        int *cause);
+
+/**
+ * This function proves that two policies with the same default give every packet the
+ * same action. Since addresses are matched exactly and ports are exact or wildcards,
+ * it is enough to try, for every protocol and address pair in either policy, each
+ * port named by a rule plus one port named by none.
+ *
+ * @param a the rules of the first policy
+ * @param alen the number of rules in the first policy
+ * @param b the rules of the second policy
+ * @param blen the number of rules in the second policy
+ * @param def the default policy of both
+ * @param checked the value to be updated with the number of packets tried
+ *
+ * @return 0 if the policies are equivalent, 1 if they differ, -1 if unsuccessful
+ */
+int optimize_verify(rule_t *a, int alen, rule_t *b, int blen,
+        unsigned int def, unsigned long *checked);
+
+/**
+ * This function finds an order of the rules of a policy that puts the rules matching
+ * the most packets first without changing the action of any packet. Each rule stays
+ * behind every earlier rule it overlaps with a different action; otherwise the rule
+ * with the most hits of those free to go next is placed next.
+ *
+ * @param rules the rules of the policy in order
+ * @param len the number of rules
+ * @param hits the number of packets each rule has matched
+ * @param order the array (len long) to be populated with the index of each rule in
+ * its new order
+ *
+ * @return the number of rules whose position changed, or -1 if unsuccessful
+ */
+int optimize_reorder(rule_t *rules, int len, unsigned long *hits, int *order);
+
+/**
+ * This function finds how many rules a scan of the policy in order compares the average
+ * packet against, going by the packets each rule has matched so far.
+ *
+ * @param hits the number of packets each rule has matched
+ * @param len the number of rules
+ * @param def the number of packets no rule matched, which are compared against all
+ * @param order the order the rules are scanned in (indexes from 0), or NULL for the
+ * order they are in
+ *
+ * @return the average number of rules compared, or 0 if no packet has been counted
+ */
+double optimize_scan_cost(unsigned long *hits, int len, unsigned long def, int *order);
+
+/**
+ * This function prints the removable rules found by optimize_find().
+ *
+ * @param stream the file stream to print to
+ * @param len the number of rules
+ * @param verdict the verdict for each rule
+ * @param cause the covering rule for each removable rule
+ */
+void optimize_report(FILE *stream, int len, int *verdict, int *cause);
+
+#endif
@@ -7,42 +7,344 @@
  * it should never make calls to those components.
  */
 
+#include <string.h>
+#include <arpa/inet.h>
 #include "packet.h"
 
+/** Number of bytes of an IPv6 address */
+#define IPV6_BYTES 16
+
+/** Number of bytes of a word of an IPv6 address */
+#define IPV6_WORD_BYTES 8
+
+/** Base of a prefix length */
+#define DECIMAL 10
+
+/**
+ * This function packs the fields of a packet into its key.
+ *
+ * @param protocol the protocol
+ * @param src_ip the packed source address
+ * @param src_port the source port
+ * @param dst_ip the packed destination address
+ * @param dst_port the destination port
+ *
+ * @return the key
+ */
+packet_t packet_key(protocol_t protocol, uint32_t src_ip, port_t src_port,
+        uint32_t dst_ip, port_t dst_port) {
+
+    packet_t key;
+    key.addrs = (uint64_t) src_ip << KEY_ADDR_BITS | dst_ip;
+    key.ports = (uint64_t) (protocol & KEY_PROTO_MAX) << KEY_PROTO_SHIFT
+            | (uint64_t) src_port << KEY_PORT_BITS | dst_port;
+
+    return key;
+}
+
 /**
- * This function checks if @packet is matched by @match.
+ * This function packs the fields of an IPv6 packet into its key and addresses.
+ *
+ * @param protocol the protocol
+ * @param src_ip the source address
+ * @param src_port the source port
+ * @param dst_ip the destination address
+ * @param dst_port the destination port
+ *
+ * @return the packet
+ */
+packet6_t packet_key6(protocol_t protocol, const ipv6_t *src_ip, port_t src_port,
+        const ipv6_t *dst_ip, port_t dst_port) {
+
+    packet6_t pkt;
+    pkt.key = packet_key(protocol, 0, src_port, 0, dst_port);
+    pkt.key.ports |= KEY_V6;
+    pkt.src = *src_ip;
+    pkt.dst = *dst_ip;
+
+    return pkt;
+}
+
+/**
+ * This function finds the mask of the ports of a rule.
+ *
+ * @param src_port the source port, or MATCH_PORT_ANY
+ * @param dst_port the destination port, or MATCH_PORT_ANY
+ *
+ * @return the mask of .ports of the key
+ */
+static uint64_t ports_mask(port_match_t src_port, port_match_t dst_port) {
+
+    return KEY_V6 | KEY_PROTO_MASK
+            | (src_port == MATCH_PORT_ANY ? 0 : KEY_SRC_PORT_MASK)
+            | (dst_port == MATCH_PORT_ANY ? 0 : KEY_DST_PORT_MASK);
+}
+
+/**
+ * This function packs the fields a rule matches into a match.
+ *
+ * @param protocol the protocol
+ * @param src_ip the packed source address
+ * @param src_port the source port, or MATCH_PORT_ANY
+ * @param dst_ip the packed destination address
+ * @param dst_port the destination port, or MATCH_PORT_ANY
+ *
+ * @return the match
+ */
+packet_match_t packet_match_key(protocol_t protocol, uint32_t src_ip,
+        port_match_t src_port, uint32_t dst_ip, port_match_t dst_port) {
+
+    packet_match_t match;
+    match.mask.addrs = KEY_ADDRS_MASK;
+    match.mask.ports = ports_mask(src_port, dst_port);
+
+    match.value = packet_key(protocol, src_ip, src_port, dst_ip, dst_port);
+    match.value.ports &= match.mask.ports;
+
+    return match;
+}
+
+/**
+ * This function packs the fields an IPv6 rule matches into a match and the match of
+ * its addresses.
+ *
+ * @param protocol the protocol
+ * @param src_ip the source prefix
+ * @param src_len the length of the source prefix (0 to IPV6_BITS)
+ * @param src_port the source port, or MATCH_PORT_ANY
+ * @param dst_ip the destination prefix
+ * @param dst_len the length of the destination prefix (0 to IPV6_BITS)
+ * @param dst_port the destination port, or MATCH_PORT_ANY
+ * @param match6 the value to be updated with the match of the addresses
+ *
+ * @return the match
+ */
+packet_match_t packet_match_key6(protocol_t protocol, const ipv6_t *src_ip, int src_len,
+        port_match_t src_port, const ipv6_t *dst_ip, int dst_len, port_match_t dst_port,
+        match6_t *match6) {
+
+    packet_match_t match;
+    match.mask.addrs = 0;
+    match.mask.ports = ports_mask(src_port, dst_port);
+
+    match.value = packet_key6(protocol, src_ip, src_port, dst_ip, dst_port).key;
+    match.value.ports &= match.mask.ports;
+
+    match6->src_mask = ipv6_mask(src_len);
+    match6->dst_mask = ipv6_mask(dst_len);
+
+    for (int i = 0; i < IPV6_WORDS; i++) {
+        match6->src.w[i] = src_ip->w[i] & match6->src_mask.w[i];
+        match6->dst.w[i] = dst_ip->w[i] & match6->dst_mask.w[i];
+    }
+
+    return match;
+}
+
+/**
+ * This function checks if @packet is matched by @match. The addresses of an IPv6
+ * packet are left to packet_match6().
  *
  * @return 1 if match and 0 if no match.
  */
-int packet_match(packet_match_t match, packet_t packet) {
+int packet_match(const packet_match_t *match, const packet_t *packet) {
+
+    return ((packet->addrs & match->mask.addrs) == match->value.addrs)
+            & ((packet->ports & match->mask.ports) == match->value.ports);
+}
+
+/**
+ * This function checks if the addresses of an IPv6 packet are matched by @match.
+ *
+ * @param match the match of the addresses of an IPv6 rule
+ * @param packet the packet
+ *
+ * @return 1 if match and 0 if no match.
+ */
+int packet_match6(const match6_t *match, const packet6_t *packet) {
+
+    return ((packet->src.w[0] & match->src_mask.w[0]) == match->src.w[0])
+            & ((packet->src.w[1] & match->src_mask.w[1]) == match->src.w[1])
+            & ((packet->dst.w[0] & match->dst_mask.w[0]) == match->dst.w[0])
+            & ((packet->dst.w[1] & match->dst_mask.w[1]) == match->dst.w[1]);
+}
+
+/**
+ * This function finds the mask of an IPv6 prefix of a given length.
+ *
+ * @param len the length (0 to IPV6_BITS)
+ *
+ * @return the mask
+ */
+ipv6_t ipv6_mask(int len) {
+
+    ipv6_t mask;
 
-    if (match.protocol != packet.protocol) {
-        return 0;
+    for (int i = 0; i < IPV6_WORDS; i++) {
+        int bits = len - i * IPV6_WORD_BITS;
+
+        if (bits <= 0) {
+            mask.w[i] = 0;
+        } else if (bits >= IPV6_WORD_BITS) {
+            mask.w[i] = UINT64_MAX;
+        } else {
+            mask.w[i] = UINT64_MAX << (IPV6_WORD_BITS - bits);
+        }
     }
 
-    if (match.src_ip.a != packet.src_ip.a || match.src_ip.b != packet.src_ip.b
-            || match.src_ip.c != packet.src_ip.c
-            || match.src_ip.d != packet.src_ip.d) {
-        return 0;
+    return mask;
+}
+
+/**
+ * This function finds the length of the prefix an IPv6 mask keeps.
+ *
+ * @param mask the mask, as made by ipv6_mask()
+ *
+ * @return the length
+ */
+int ipv6_prefix_len(const ipv6_t *mask) {
+
+    return __builtin_popcountll(mask->w[0]) + __builtin_popcountll(mask->w[1]);
+}
+
+/**
+ * This function parses an IPv6 address, optionally followed by /length.
+ *
+ * @param text the text, which need not be terminated
+ * @param len the number of characters of @text
+ * @param addr the value to be updated with the address (masked to the prefix)
+ * @param prefix the value to be updated with the prefix length (IPV6_BITS if there is
+ * none), or NULL if a prefix is not accepted
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+int ipv6_parse(const char *text, size_t len, ipv6_t *addr, int *prefix) {
+
+    char buf[IPV6_TEXT_SIZE];
+    const char *slash = memchr(text, '/', len);
+    size_t alen = slash ? (size_t) (slash - text) : len;
+    int bits = IPV6_BITS;
+
+    if (alen >= sizeof(buf) || (slash && !prefix)) {
+        return -1;
+    }
+
+    if (slash) {
+        const char *p = slash + 1;
+        const char *end = text + len;
+
+        if (p == end) {
+            return -1;
+        }
+
+        for (bits = 0; p < end; p++) {
+            if (*p < '0' || *p > '9' || (bits = bits * DECIMAL + *p - '0') > IPV6_BITS) {
+                return -1;
+            }
+        }
     }
 
-    if (match.src_port != MATCH_PORT_ANY
-            && match.src_port
-                    != packet.src_port && packet.src_port != MATCH_PORT_ANY) {
-        return 0;
+    memcpy(buf, text, alen);
+    buf[alen] = '\0';
+
+    unsigned char bytes[IPV6_BYTES];
+    if (inet_pton(AF_INET6, buf, bytes) != 1) {
+        return -1;
     }
 
-    if (match.dst_ip.a != packet.dst_ip.a || match.dst_ip.b != packet.dst_ip.b
-            || match.dst_ip.c != packet.dst_ip.c
-            || match.dst_ip.d != packet.dst_ip.d) {
-        return 0;
+    ipv6_t mask = ipv6_mask(bits);
+
+    for (int i = 0; i < IPV6_WORDS; i++) {
+        addr->w[i] = 0;
+        for (int b = 0; b < IPV6_WORD_BYTES; b++) {
+            addr->w[i] = addr->w[i] << BIT_SIZE | bytes[i * IPV6_WORD_BYTES + b];
+        }
+        addr->w[i] &= mask.w[i];
     }
 
-    if (match.dst_port != MATCH_PORT_ANY
-            && match.dst_port
-                    != packet.dst_port && packet.dst_port != MATCH_PORT_ANY) {
-        return 0;
+    if (prefix) {
+        *prefix = bits;
     }
 
-    return 1;
+    return 0;
+}
+
+/**
+ * This function writes an IPv6 address as text in its shortest form.
+ *
+ * @param addr the address
+ * @param text the buffer to be written to (IPV6_TEXT_SIZE long)
+ */
+void ipv6_format(const ipv6_t *addr, char *text) {
+
+    unsigned char bytes[IPV6_BYTES];
+
+    for (int i = 0; i < IPV6_BYTES; i++) {
+        int shift = (IPV6_WORD_BYTES - 1 - i % IPV6_WORD_BYTES) * BIT_SIZE;
+        bytes[i] = addr->w[i / IPV6_WORD_BYTES] >> shift & IP_OCTET_MAX;
+    }
+
+    inet_ntop(AF_INET6, bytes, text, IPV6_TEXT_SIZE);
+}
+
+/**
+ * This function writes an unsigned number as decimal text.
+ *
+ * @param n the number
+ * @param text the buffer to be written to (UINT_TEXT_SIZE long)
+ *
+ * @return the number of characters written, not counting the terminating null
+ */
+int uint_format(unsigned long n, char *text) {
+
+    char digits[UINT_TEXT_SIZE];
+    int len = 0;
+
+    //Digits come out least significant first
+    do {
+        digits[len++] = (char) ('0' + n % DECIMAL);
+        n /= DECIMAL;
+    } while (n > 0);
+
+    for (int i = 0; i < len; i++) {
+        text[i] = digits[len - 1 - i];
+    }
+    text[len] = '\0';
+
+    return len;
+}
+
+/**
+ * This function writes a packed IPv4 address as four octets.
+ *
+ * @param ip the packed address
+ * @param text the buffer to be written to (IPV4_TEXT_SIZE long)
+ *
+ * @return the number of characters written, not counting the terminating null
+ */
+int ipv4_format(uint32_t ip, char *text) {
+
+    int len = 0;
+
+    for (int shift = BIT_SIZE * 3; shift >= 0; shift -= BIT_SIZE) {
+        len += uint_format(ip >> shift & IP_OCTET_MAX, text + len);
+        text[len++] = shift > 0 ? '.' : '\0';
+    }
+
+    return len - 1;
+}
+
+/**
+ * This function packs the four octets of an address into a single 32-bit value with
+ * the first octet in the most significant byte.
+ *
+ * @param octets the octets in order
+ *
+ * @return the packed value of the address
+ */
+uint32_t ipaddr_pack(const unsigned int *octets) {
+
+    return ((uint32_t) octets[0] << (BIT_SIZE * 3))
+            | ((uint32_t) octets[1] << (BIT_SIZE * 2))
+            | ((uint32_t) octets[2] << BIT_SIZE) | (uint32_t) octets[3];
 }
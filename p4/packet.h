@@ -8,6 +8,9 @@
 #ifndef PACKET_H
 #define PACKET_H
 
+#include <stdint.h>
+#include <stddef.h>
+
 /** Protocol value indicating TCP */
 #define PROTO_TCP      0
 
@@ -29,63 +32,306 @@
 /** Bit size of the ip value */
 #define BIT_SIZE 8
 
-/**
- * Structure to store an IP address as a.b.c.d
- * where each part may hold values 0-255
- */
-typedef struct ipaddr {
-    unsigned int a :BIT_SIZE;
-    unsigned int b :BIT_SIZE;
-    unsigned int c :BIT_SIZE;
-    unsigned int d :BIT_SIZE;
-} ipaddr_t;
+/** Number of bits of an address in a key */
+#define KEY_ADDR_BITS 32
+
+/** Number of bits of a port in a key */
+#define KEY_PORT_BITS 16
+
+/** Position of the protocol in .ports of a key */
+#define KEY_PROTO_SHIFT 32
+
+/** Largest protocol a key holds */
+#define KEY_PROTO_MAX 0xFF
+
+/** Bits of .ports of a key holding the protocol */
+#define KEY_PROTO_MASK ((uint64_t) KEY_PROTO_MAX << KEY_PROTO_SHIFT)
+
+/** Bits of .ports of a key holding the source port */
+#define KEY_SRC_PORT_MASK ((uint64_t) PORT_MAX << KEY_PORT_BITS)
+
+/** Bits of .ports of a key holding the destination port */
+#define KEY_DST_PORT_MASK ((uint64_t) PORT_MAX)
+
+/** Bits of .addrs of a key holding both addresses */
+#define KEY_ADDRS_MASK UINT64_MAX
+
+/** Position of the IPv6 flag in .ports of a key */
+#define KEY_V6_SHIFT 40
+
+/** Bit of .ports of a key set for IPv6 packets */
+#define KEY_V6 ((uint64_t) 1 << KEY_V6_SHIFT)
+
+/** Number of bits of an IPv6 address */
+#define IPV6_BITS 128
+
+/** Number of 64-bit words of an IPv6 address */
+#define IPV6_WORDS 2
+
+/** Number of bits of a word of an IPv6 address */
+#define IPV6_WORD_BITS 64
+
+/** Room needed for an IPv6 address as text, including the terminator */
+#define IPV6_TEXT_SIZE 46
+
+/** Room needed for an IPv4 address as text, including the terminator */
+#define IPV4_TEXT_SIZE 16
+
+/** Room needed for an unsigned long as decimal text, including the terminator */
+#define UINT_TEXT_SIZE 21
 
 typedef unsigned int protocol_t;
 typedef unsigned short port_t;
 typedef int port_match_t;
 
 /**
- * Structure to store information of a packet
- * .protocol: the transport protocol (PROTO_TCP or PROTO_UDP)
- * .src_ip: the source IP address
- * .src_port: the source port address
- * .dst_ip: the destionation IP address
- * .dst_port: the destination port address
+ * Structure to store an IPv6 address
+ * .w: the address in two words, the first 64 bits in w[0], each in host order
+ */
+typedef struct ipv6 {
+    uint64_t w[IPV6_WORDS];
+} ipv6_t;
+
+/**
+ * Structure to store information of a packet, packed into a canonical key of two
+ * machine words. IPv4 addresses are packed with the first octet in the most significant
+ * byte. IPv6 addresses do not fit, so an IPv6 packet keeps them after its key in a
+ * packet6_t.
+ * .addrs: for IPv4, the source address in the high 32 bits and the destination
+ * address in the low 32 bits; 0 for IPv6
+ * .ports: the IPv6 flag (KEY_V6) in bit 40, the protocol (PROTO_TCP or PROTO_UDP) in
+ * bits 32-39, the source port in bits 16-31 and the destination port in bits 0-15
  */
 typedef struct packet {
-    protocol_t protocol;
-    ipaddr_t src_ip;
-    port_t src_port;
-    ipaddr_t dst_ip;
-    port_t dst_port;
+    uint64_t addrs;
+    uint64_t ports;
 } packet_t;
 
+/**
+ * Structure to store an IPv6 packet: its key followed by its addresses. The key of an
+ * IPv6 packet is always the .key of one of these, so code handed a key finds the
+ * addresses with PACKET_V6(), and code that keeps packets of either family keeps them
+ * as packet6_t.
+ * .key: the key, with KEY_V6 set
+ * .src: the source address
+ * .dst: the destination address
+ */
+typedef struct packet6 {
+    packet_t key;
+    ipv6_t src;
+    ipv6_t dst;
+} packet6_t;
+
+/** The IPv6 packet the key of an IPv6 packet is part of */
+#define PACKET_V6(k) ((const packet6_t *) (k))
+
+/** Whether a key is of an IPv6 packet */
+#define PACKET_IS_V6(k) (((k).ports & KEY_V6) != 0)
+
+/** The protocol of a key */
+#define PACKET_PROTOCOL(k) ((protocol_t) ((k).ports >> KEY_PROTO_SHIFT & KEY_PROTO_MAX))
+
+/** The packed source address of a key */
+#define PACKET_SRC_IP(k) ((uint32_t) ((k).addrs >> KEY_ADDR_BITS))
+
+/** The source port of a key */
+#define PACKET_SRC_PORT(k) ((port_t) ((k).ports >> KEY_PORT_BITS & PORT_MAX))
+
+/** The packed destination address of a key */
+#define PACKET_DST_IP(k) ((uint32_t) (k).addrs)
+
+/** The destination port of a key */
+#define PACKET_DST_PORT(k) ((port_t) ((k).ports & PORT_MAX))
+
 /**
  * Used in packet_match_t for ports if any port should match
  */
 #define MATCH_PORT_ANY -1
 
 /**
- * Structure used to match packets (used in rules)
- * .protocol: the transport protocol (PROTO_TCP or PROTO_UDP)
- * .src_ip: the source IP address to match
- * .src_port: the source port address to match (may be MATCH_PORT_ANY)
- * .dst_ip: the destination IP address to match
- * .dst_port: the destination port address to match (may be MATCH_PORT_ANY)
+ * Structure used to match packets (used in rules). A packet is matched when its key
+ * masked with .mask equals .value, so a wildcard port is a port left out of the mask.
+ * An IPv6 match leaves the addresses out of its mask; they are matched by the match6_t
+ * kept beside it. The IPv6 flag is always in the mask, so a rule only matches packets
+ * of its own family.
+ * .value: the key to match, with every bit outside .mask clear
+ * .mask: the bits of a key that are matched
  */
 typedef struct packet_match {
-    protocol_t protocol;
-    ipaddr_t src_ip;
-    port_match_t src_port;
-    ipaddr_t dst_ip;
-    port_match_t dst_port;
+    packet_t value;
+    packet_t mask;
 } packet_match_t;
 
 /**
- * This function checks if @packet is matched by @match.
+ * Structure used to match the addresses of IPv6 packets, kept beside the packet_match_t
+ * of an IPv6 rule so that IPv4 rules do not carry it. An address is matched when it
+ * masked with the mask of a prefix equals the prefix.
+ * .src: the source prefix, with every bit outside .src_mask clear
+ * .dst: the destination prefix, with every bit outside .dst_mask clear
+ * .src_mask: the mask of the source prefix
+ * .dst_mask: the mask of the destination prefix
+ */
+typedef struct match6 {
+    ipv6_t src;
+    ipv6_t dst;
+    ipv6_t src_mask;
+    ipv6_t dst_mask;
+} match6_t;
+
+/** The source port a match matches, or MATCH_PORT_ANY */
+#define MATCH_SRC_PORT(m) ((m).mask.ports & KEY_SRC_PORT_MASK \
+        ? (port_match_t) PACKET_SRC_PORT((m).value) : MATCH_PORT_ANY)
+
+/** The destination port a match matches, or MATCH_PORT_ANY */
+#define MATCH_DST_PORT(m) ((m).mask.ports & KEY_DST_PORT_MASK \
+        ? (port_match_t) PACKET_DST_PORT((m).value) : MATCH_PORT_ANY)
+
+/**
+ * This function packs the fields of a packet into its key.
+ *
+ * @param protocol the protocol
+ * @param src_ip the packed source address
+ * @param src_port the source port
+ * @param dst_ip the packed destination address
+ * @param dst_port the destination port
+ *
+ * @return the key
+ */
+packet_t packet_key(protocol_t protocol, uint32_t src_ip, port_t src_port,
+        uint32_t dst_ip, port_t dst_port);
+
+/**
+ * This function packs the fields a rule matches into a match.
+ *
+ * @param protocol the protocol
+ * @param src_ip the packed source address
+ * @param src_port the source port, or MATCH_PORT_ANY
+ * @param dst_ip the packed destination address
+ * @param dst_port the destination port, or MATCH_PORT_ANY
+ *
+ * @return the match
+ */
+packet_match_t packet_match_key(protocol_t protocol, uint32_t src_ip,
+        port_match_t src_port, uint32_t dst_ip, port_match_t dst_port);
+
+/**
+ * This function packs the fields of an IPv6 packet into its key and addresses.
+ *
+ * @param protocol the protocol
+ * @param src_ip the source address
+ * @param src_port the source port
+ * @param dst_ip the destination address
+ * @param dst_port the destination port
+ *
+ * @return the packet
+ */
+packet6_t packet_key6(protocol_t protocol, const ipv6_t *src_ip, port_t src_port,
+        const ipv6_t *dst_ip, port_t dst_port);
+
+/**
+ * This function packs the fields an IPv6 rule matches into a match and the match of
+ * its addresses.
+ *
+ * @param protocol the protocol
+ * @param src_ip the source prefix
+ * @param src_len the length of the source prefix (0 to IPV6_BITS)
+ * @param src_port the source port, or MATCH_PORT_ANY
+ * @param dst_ip the destination prefix
+ * @param dst_len the length of the destination prefix (0 to IPV6_BITS)
+ * @param dst_port the destination port, or MATCH_PORT_ANY
+ * @param match6 the value to be updated with the match of the addresses
+ *
+ * @return the match
+ */
+packet_match_t packet_match_key6(protocol_t protocol, const ipv6_t *src_ip, int src_len,
+        port_match_t src_port, const ipv6_t *dst_ip, int dst_len, port_match_t dst_port,
+        match6_t *match6);
+
+/**
+ * This function checks if @packet is matched by @match. The addresses of an IPv6
+ * packet are left to packet_match6().
+ *
+ * @return 1 if match and 0 if no match.
+ */
+int packet_match(const packet_match_t *match, const packet_t *packet);
+
+/**
+ * This function checks if the addresses of an IPv6 packet are matched by @match.
+ *
+ * @param match the match of the addresses of an IPv6 rule
+ * @param packet the packet
  *
  * @return 1 if match and 0 if no match.
  */
-int packet_match(packet_match_t match, packet_t packet);
+int packet_match6(const match6_t *match, const packet6_t *packet);
+
+/**
+ * This function finds the mask of an IPv6 prefix of a given length.
+ *
+ * @param len the length (0 to IPV6_BITS)
+ *
+ * @return the mask
+ */
+ipv6_t ipv6_mask(int len);
+
+/**
+ * This function finds the length of the prefix an IPv6 mask keeps.
+ *
+ * @param mask the mask, as made by ipv6_mask()
+ *
+ * @return the length
+ */
+int ipv6_prefix_len(const ipv6_t *mask);
+
+/**
+ * This function parses an IPv6 address, optionally followed by /length.
+ *
+ * @param text the text, which need not be terminated
+ * @param len the number of characters of @text
+ * @param addr the value to be updated with the address (masked to the prefix)
+ * @param prefix the value to be updated with the prefix length (IPV6_BITS if there is
+ * none), or NULL if a prefix is not accepted
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+int ipv6_parse(const char *text, size_t len, ipv6_t *addr, int *prefix);
+
+/**
+ * This function writes an IPv6 address as text in its shortest form.
+ *
+ * @param addr the address
+ * @param text the buffer to be written to (IPV6_TEXT_SIZE long)
+ */
+void ipv6_format(const ipv6_t *addr, char *text);
+
+/**
+ * This function writes an unsigned number as decimal text.
+ *
+ * @param n the number
+ * @param text the buffer to be written to (UINT_TEXT_SIZE long)
+ *
+ * @return the number of characters written, not counting the terminating null
+ */
+int uint_format(unsigned long n, char *text);
+
+/**
+ * This function writes a packed IPv4 address as four octets.
+ *
+ * @param ip the packed address
+ * @param text the buffer to be written to (IPV4_TEXT_SIZE long)
+ *
+ * @return the number of characters written, not counting the terminating null
+ */
+int ipv4_format(uint32_t ip, char *text);
+
+/**
+ * This function packs the four octets of an address into a single 32-bit value with
+ * the first octet in the most significant byte.
+ *
+ * @param octets the octets in order
+ *
+ * @return the packed value of the address
+ */
+uint32_t ipaddr_pack(const unsigned int *octets);
 
 #endif
@@ -0,0 +1,584 @@
+/**
+ * @file pipeline.c
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This component is responsible for classifying packets on several cores at once.
+ * The thread that parses the packets hashes each one's flow to a worker, RSS-style,
+ * and hands it over through that worker's single-producer/single-consumer ring. The
+ * hash is symmetric, so both directions of a connection reach the same worker and
+ * connection tracking sees them in order. Workers classify against the published
+ * policy snapshot, which no one changes in place, and pass their verdicts on through
+ * a second ring each.
+ * A third kind of ring carries the worker of every packet, in order, to the thread that
+ * writes the verdicts. Since each worker answers its packets in the order it got them,
+ * that thread only has to take the next verdict from the right worker to keep the
+ * output in order.
+ * Every stage counts its items and the time it spent working rather than waiting on a
+ * ring, so the stage that saturates first is the one busy nearly all of the time.
+ */
+
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "pipeline.h"
+#include "ring.h"
+#include "conntrack.h"
+#include "flowcache.h"
+#include "rcu.h"
+#include "stats.h"
+
+/** Number of packets each worker's rings hold (a power of two) */
+#define PIPELINE_RING_SLOTS 4096
+
+/** Number of packets the ring of workers in order holds (a power of two) */
+#define PIPELINE_ORDER_SLOTS 65536
+
+/** Most items a stage takes off a ring at once */
+#define PIPELINE_BURST 64
+
+/** Size of the buffer verdicts are written to before they reach the stream */
+#define PIPELINE_OUT_SIZE (1 << 20)
+
+/** Polls of an empty or full ring before a stage gives up its core */
+#define PIPELINE_SPINS 64
+
+/** Polls of an empty or full ring before a stage starts sleeping */
+#define PIPELINE_YIELDS 1024
+
+/** Nanoseconds a stage sleeps between polls once it has been idle a while */
+#define PIPELINE_SLEEP_NS 50000
+
+/** Multiplier used for hashing a flow (64-bit golden ratio) */
+#define PIPELINE_HASH_MULT 0x9E3779B97F4A7C15ULL
+
+/** Bit size of the upper half of the 64-bit hash */
+#define HALF_BITS 32
+
+/** Number of nanoseconds in a second */
+#define NSEC_PER_SEC 1000000000.0
+
+/** Used for turning a ratio into a percentage */
+#define PERCENT 100.0
+
+/**
+ * Representation of a verdict
+ * .action: the action the packet was given
+ * .pos: the position of the matched rule
+ */
+typedef struct verdict {
+    int action;
+    int pos;
+} verdict_t;
+
+/**
+ * Representation of what a stage has done, written only by its own thread
+ * .items: the number of items handled
+ * .busy_ns: the time spent handling them
+ * .waits: the number of times the stage found a ring full (or empty) mid-burst
+ */
+typedef struct stage {
+    unsigned long items;
+    long long busy_ns;
+    unsigned long waits;
+} stage_t;
+
+/**
+ * Representation of a worker
+ * .thread: the worker's thread
+ * .pipe: the pipeline the worker belongs to
+ * .in: the packets handed to the worker
+ * .out: the worker's verdicts, in the order of its packets
+ * .stage: what the worker has done
+ * .held: verdicts the gatherer has taken off .out but not written yet
+ * .next: the index of the next verdict in .held
+ * .count: the number of verdicts in .held
+ */
+typedef struct worker {
+    pthread_t thread;
+    struct pipeline *pipe;
+    ring_t *in;
+    ring_t *out;
+    stage_t stage;
+    verdict_t held[PIPELINE_BURST];
+    size_t next;
+    size_t count;
+} worker_t;
+
+/**
+ * Representation of a pipeline
+ * .workers: the number of workers
+ * .worker: the workers
+ * .order: the worker of every packet, in the order they were submitted
+ * .gatherer: the thread that writes the verdicts
+ * .gather: what the gatherer has done
+ * .parse: what the submitting thread has done
+ * .waited_ns: the time the submitting thread spent waiting on the other stages
+ * .format: the function that writes a verdict
+ * .text_size: the most characters .format writes
+ * .stream: the stream the verdicts are written to
+ * .out: the verdicts not yet written to .stream
+ * .out_len: the number of bytes in .out
+ * .submitted: the number of packets submitted
+ * .flushed: the number of verdicts written to .stream
+ * .stop: set once the threads should exit
+ * .start_ns: when the pipeline started
+ */
+struct pipeline {
+    int workers;
+    worker_t *worker;
+    ring_t *order;
+    pthread_t gatherer;
+    stage_t gather;
+    stage_t parse;
+    long long waited_ns;
+    pipeline_format_t format;
+    size_t text_size;
+    FILE *stream;
+    char *out;
+    size_t out_len;
+    unsigned long submitted;
+    unsigned long flushed;
+    int stop;
+    long long start_ns;
+};
+
+/**
+ * This function waits a little before a stage polls an empty or full ring again:
+ * it spins at first, then yields its core, then sleeps.
+ *
+ * @param polls the number of polls so far, updated
+ */
+static void idle_wait(unsigned int *polls) {
+
+    (*polls)++;
+
+    if (*polls < PIPELINE_SPINS) {
+        return;
+    }
+
+    if (*polls < PIPELINE_YIELDS) {
+        sched_yield();
+        return;
+    }
+
+    struct timespec ts = { 0, PIPELINE_SLEEP_NS };
+    nanosleep(&ts, NULL);
+}
+
+/**
+ * This function publishes what a stage has done so another thread may read it.
+ *
+ * @param stage the stage
+ * @param items the number of items just handled
+ * @param busy_ns the time spent handling them
+ * @param waits the number of waits on a ring meanwhile
+ */
+static void stage_add(stage_t *stage, unsigned long items, long long busy_ns,
+        unsigned long waits) {
+
+    __atomic_store_n(&stage->items, stage->items + items, __ATOMIC_RELAXED);
+    __atomic_store_n(&stage->busy_ns, stage->busy_ns + busy_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&stage->waits, stage->waits + waits, __ATOMIC_RELAXED);
+}
+
+/**
+ * This function hashes one end of a flow.
+ *
+ * @param pkt the packet
+ * @param dst 1 for the destination, 0 for the source
+ *
+ * @return the hash
+ */
+static uint64_t end_hash(const packet_t *pkt, int dst) {
+
+    uint64_t h;
+
+    if (PACKET_IS_V6(*pkt)) {
+        const ipv6_t *addr = dst ? &PACKET_V6(pkt)->dst : &PACKET_V6(pkt)->src;
+        h = (addr->w[0] * PIPELINE_HASH_MULT) ^ addr->w[1];
+    } else {
+        h = dst ? PACKET_DST_IP(*pkt) : PACKET_SRC_IP(*pkt);
+    }
+
+    h = (h * PIPELINE_HASH_MULT) ^ (dst ? PACKET_DST_PORT(*pkt) : PACKET_SRC_PORT(*pkt));
+
+    return h * PIPELINE_HASH_MULT;
+}
+
+/**
+ * This function picks the worker for a packet. Both directions of a flow get the same
+ * worker.
+ *
+ * @param pipe the pipeline
+ * @param pkt the packet
+ *
+ * @return the index of the worker
+ */
+static unsigned char flow_worker(pipeline_t *pipe, const packet_t *pkt) {
+
+    uint64_t h = (end_hash(pkt, 0) ^ end_hash(pkt, 1)) + PACKET_PROTOCOL(*pkt);
+    h *= PIPELINE_HASH_MULT;
+
+    return (unsigned char) ((h >> HALF_BITS) * pipe->workers >> HALF_BITS);
+}
+
+/**
+ * This function is the body of a worker: it classifies the packets handed to it until
+ * the pipeline stops.
+ *
+ * @param arg the worker
+ *
+ * @return NULL
+ */
+static void *worker_run(void *arg) {
+
+    worker_t *w = (worker_t *) arg;
+    packet6_t burst[PIPELINE_BURST];
+    verdict_t verdicts[PIPELINE_BURST];
+    unsigned int polls = 0;
+
+    while (1) {
+        size_t n = ring_pop(w->in, burst, PIPELINE_BURST);
+
+        if (n == 0) {
+            if (__atomic_load_n(&w->pipe->stop, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            idle_wait(&polls);
+            continue;
+        }
+        polls = 0;
+
+        long long start = stats_now_ns();
+
+        for (size_t i = 0; i < n; i++) {
+            verdicts[i].action = conntrack_test(&burst[i].key, &verdicts[i].pos);
+        }
+
+        long long busy = stats_now_ns() - start;
+        unsigned long waits = 0;
+
+        for (size_t i = 0; i < n; i++) {
+            unsigned int full = 0;
+
+            while (ring_push(w->out, &verdicts[i]) == -1) {
+                waits += full == 0;
+                idle_wait(&full);
+            }
+        }
+
+        stage_add(&w->stage, n, busy, waits);
+    }
+
+    flow_cache_free();
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+/**
+ * This function writes the verdicts gathered so far to the stream.
+ *
+ * @param pipe the pipeline
+ * @param written the number of verdicts gathered so far
+ */
+static void gather_flush(pipeline_t *pipe, unsigned long written) {
+
+    if (pipe->out_len > 0) {
+        fwrite(pipe->out, 1, pipe->out_len, pipe->stream);
+        pipe->out_len = 0;
+    }
+
+    __atomic_store_n(&pipe->flushed, written, __ATOMIC_RELEASE);
+}
+
+/**
+ * This function is the body of the gatherer: it writes the verdict of every packet in
+ * the order the packets were submitted until the pipeline stops.
+ *
+ * @param arg the pipeline
+ *
+ * @return NULL
+ */
+static void *gather_run(void *arg) {
+
+    pipeline_t *pipe = (pipeline_t *) arg;
+    unsigned char ids[PIPELINE_BURST];
+    unsigned long written = 0;
+    unsigned int polls = 0;
+
+    while (1) {
+        size_t n = ring_pop(pipe->order, ids, PIPELINE_BURST);
+
+        if (n == 0) {
+            gather_flush(pipe, written);
+
+            if (__atomic_load_n(&pipe->stop, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            idle_wait(&polls);
+            continue;
+        }
+        polls = 0;
+
+        long long start = stats_now_ns();
+        long long waited = 0;
+        unsigned long waits = 0;
+
+        for (size_t i = 0; i < n; i++) {
+            worker_t *w = &pipe->worker[ids[i]];
+
+            //Take the worker's next verdicts, waiting if it has not got this far
+            if (w->next == w->count) {
+                unsigned int empty = 0;
+                long long w0 = 0;
+
+                w->next = 0;
+                while ((w->count = ring_pop(w->out, w->held, PIPELINE_BURST)) == 0) {
+                    if (empty == 0) {
+                        w0 = stats_now_ns();
+                        waits++;
+                    }
+                    idle_wait(&empty);
+                }
+                waited += w0 ? stats_now_ns() - w0 : 0;
+            }
+
+            verdict_t v = w->held[w->next++];
+
+            if (pipe->out_len + pipe->text_size > PIPELINE_OUT_SIZE) {
+                gather_flush(pipe, written);
+            }
+            pipe->out_len += pipe->format(v.action, v.pos, pipe->out + pipe->out_len);
+            written++;
+        }
+
+        stage_add(&pipe->gather, n, stats_now_ns() - start - waited, waits);
+    }
+
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+/**
+ * This function starts a pipeline of @workers threads that classify packets and one
+ * thread that writes their verdicts to @stream in the order the packets were submitted.
+ *
+ * @param workers the number of worker threads (1 to PIPELINE_MAX_WORKERS)
+ * @param format the function that writes a verdict
+ * @param text_size the most characters @format writes for a verdict
+ * @param stream the file stream the verdicts are written to
+ *
+ * @return the pipeline, or NULL if it could not be started
+ */
+pipeline_t *pipeline_start(int workers, pipeline_format_t format, size_t text_size,
+        FILE *stream) {
+
+    if (workers < 1 || workers > PIPELINE_MAX_WORKERS) {
+        return NULL;
+    }
+
+    pipeline_t *pipe = (pipeline_t *) calloc(1, sizeof(pipeline_t));
+
+    if (!pipe) {
+        return NULL;
+    }
+
+    pipe->workers = workers;
+    pipe->format = format;
+    pipe->text_size = text_size;
+    pipe->stream = stream;
+    pipe->worker = (worker_t *) calloc(workers, sizeof(worker_t));
+    pipe->order = ring_new(PIPELINE_ORDER_SLOTS, sizeof(unsigned char));
+    pipe->out = (char *) malloc(PIPELINE_OUT_SIZE);
+
+    int ok = pipe->worker && pipe->order && pipe->out;
+
+    for (int i = 0; ok && i < workers; i++) {
+        pipe->worker[i].pipe = pipe;
+        pipe->worker[i].in = ring_new(PIPELINE_RING_SLOTS, sizeof(packet6_t));
+        pipe->worker[i].out = ring_new(PIPELINE_RING_SLOTS, sizeof(verdict_t));
+        ok = pipe->worker[i].in && pipe->worker[i].out;
+    }
+
+    //Start the threads only once everything they use exists
+    int started = 0;
+
+    while (ok && started < workers) {
+        worker_t *w = &pipe->worker[started];
+        ok = pthread_create(&w->thread, NULL, worker_run, w) == 0;
+        started += ok;
+    }
+
+    int gathering = ok && pthread_create(&pipe->gatherer, NULL, gather_run, pipe) == 0;
+
+    if (!gathering) {
+        __atomic_store_n(&pipe->stop, 1, __ATOMIC_RELEASE);
+        for (int i = 0; i < started; i++) {
+            pthread_join(pipe->worker[i].thread, NULL);
+        }
+        for (int i = 0; pipe->worker && i < workers; i++) {
+            ring_free(pipe->worker[i].in);
+            ring_free(pipe->worker[i].out);
+        }
+        free(pipe->worker);
+        ring_free(pipe->order);
+        free(pipe->out);
+        free(pipe);
+        return NULL;
+    }
+
+    pipe->start_ns = stats_now_ns();
+
+    return pipe;
+}
+
+/**
+ * This function hands a packet to the worker its flow hashes to, waiting while that
+ * worker is full.
+ *
+ * @param pipe the pipeline
+ * @param pkt the packet
+ */
+void pipeline_submit(pipeline_t *pipe, const packet6_t *pkt) {
+
+    unsigned char id = flow_worker(pipe, &pkt->key);
+    unsigned int polls = 0;
+    long long start = 0;
+
+    while (ring_push(pipe->worker[id].in, pkt) == -1) {
+        if (polls == 0) {
+            start = stats_now_ns();
+            pipe->parse.waits++;
+        }
+        idle_wait(&polls);
+    }
+
+    polls = 0;
+    while (ring_push(pipe->order, &id) == -1) {
+        if (polls == 0) {
+            start = start ? start : stats_now_ns();
+            pipe->parse.waits++;
+        }
+        idle_wait(&polls);
+    }
+
+    if (start) {
+        pipe->waited_ns += stats_now_ns() - start;
+    }
+
+    pipe->parse.items++;
+    pipe->submitted++;
+}
+
+/**
+ * This function waits until the verdict of every packet submitted so far has been
+ * written to the stream.
+ *
+ * @param pipe the pipeline
+ */
+void pipeline_drain(pipeline_t *pipe) {
+
+    if (__atomic_load_n(&pipe->flushed, __ATOMIC_ACQUIRE) == pipe->submitted) {
+        return;
+    }
+
+    long long start = stats_now_ns();
+    unsigned int polls = 0;
+
+    while (__atomic_load_n(&pipe->flushed, __ATOMIC_ACQUIRE) != pipe->submitted) {
+        idle_wait(&polls);
+    }
+
+    pipe->waited_ns += stats_now_ns() - start;
+}
+
+/**
+ * This function prints one stage's line of pipeline_print().
+ *
+ * @param stream the file stream to print to
+ * @param name the name of the stage
+ * @param items the number of items it handled
+ * @param busy_ns the time it spent handling them
+ * @param wall_ns the time the pipeline has been running
+ * @param waits the number of waits on a ring
+ * @param on what the stage waits on
+ */
+static void print_stage(FILE *stream, const char *name, unsigned long items,
+        long long busy_ns, long long wall_ns, unsigned long waits, const char *on) {
+
+    fprintf(stream, "  %s: %lu packets, %.1f%% busy", name, items,
+            wall_ns > 0 ? PERCENT * busy_ns / wall_ns : 0.0);
+    fprintf(stream, " (%.0f packets/sec while busy), %lu waits on %s\n",
+            busy_ns > 0 ? items * NSEC_PER_SEC / busy_ns : 0.0, waits, on);
+}
+
+/**
+ * This function prints how many packets each stage of the pipeline has handled, how
+ * much of the time it was busy and how fast it went while busy.
+ *
+ * @param pipe the pipeline, or NULL if there is none
+ * @param stream the file stream to print to
+ */
+void pipeline_print(pipeline_t *pipe, FILE *stream) {
+
+    if (!pipe) {
+        fprintf(stream, "Pipeline: off\n");
+        return;
+    }
+
+    long long wall = stats_now_ns() - pipe->start_ns;
+
+    fprintf(stream, "Pipeline: %d worker%s, %lu packets in %.6f s (%.0f packets/sec)\n",
+            pipe->workers, pipe->workers == 1 ? "" : "s", pipe->submitted,
+            wall / NSEC_PER_SEC, wall > 0 ? pipe->submitted * NSEC_PER_SEC / wall : 0.0);
+
+    //The parser is busy whenever it is not waiting on the pipeline
+    print_stage(stream, "parser", pipe->parse.items, wall - pipe->waited_ns, wall,
+            pipe->parse.waits, "full rings");
+
+    for (int i = 0; i < pipe->workers; i++) {
+        stage_t *s = &pipe->worker[i].stage;
+        char name[sizeof("worker ") + UINT_TEXT_SIZE];
+
+        snprintf(name, sizeof(name), "worker %d", i);
+        print_stage(stream, name, __atomic_load_n(&s->items, __ATOMIC_RELAXED),
+                __atomic_load_n(&s->busy_ns, __ATOMIC_RELAXED), wall,
+                __atomic_load_n(&s->waits, __ATOMIC_RELAXED), "the gatherer");
+    }
+
+    stage_t *g = &pipe->gather;
+    print_stage(stream, "gatherer", __atomic_load_n(&g->items, __ATOMIC_RELAXED),
+            __atomic_load_n(&g->busy_ns, __ATOMIC_RELAXED), wall,
+            __atomic_load_n(&g->waits, __ATOMIC_RELAXED), "workers");
+}
+
+/**
+ * This function drains the pipeline, stops its threads and frees it.
+ *
+ * @param pipe the pipeline
+ */
+void pipeline_stop(pipeline_t *pipe) {
+
+    if (!pipe) {
+        return;
+    }
+
+    pipeline_drain(pipe);
+    __atomic_store_n(&pipe->stop, 1, __ATOMIC_RELEASE);
+
+    for (int i = 0; i < pipe->workers; i++) {
+        pthread_join(pipe->worker[i].thread, NULL);
+        ring_free(pipe->worker[i].in);
+        ring_free(pipe->worker[i].out);
+    }
+
+    pthread_join(pipe->gatherer, NULL);
+    ring_free(pipe->order);
+    free(pipe->worker);
+    free(pipe->out);
+    free(pipe);
+}
@@ -0,0 +1,80 @@
+/**
+ * @file pipeline.h
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This file acts as the interface for the pipeline.c file
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdio.h>
+#include "packet.h"
+
+/** Most worker threads a pipeline runs */
+#define PIPELINE_MAX_WORKERS 32
+
+/**
+ * Function that writes the verdict for a packet as text
+ *
+ * @param action the action the packet was given
+ * @param pos the position of the matched rule, -1 for the default policy or
+ * CONNTRACK_ESTABLISHED
+ * @param text the buffer to be written to
+ *
+ * @return the number of characters written
+ */
+typedef int (*pipeline_format_t)(int action, int pos, char *text);
+
+/** Representation of a running pipeline */
+typedef struct pipeline pipeline_t;
+
+/**
+ * This function starts a pipeline of @workers threads that classify packets and one
+ * thread that writes their verdicts to @stream in the order the packets were submitted.
+ *
+ * @param workers the number of worker threads (1 to PIPELINE_MAX_WORKERS)
+ * @param format the function that writes a verdict
+ * @param text_size the most characters @format writes for a verdict
+ * @param stream the file stream the verdicts are written to
+ *
+ * @return the pipeline, or NULL if it could not be started
+ */
+pipeline_t *pipeline_start(int workers, pipeline_format_t format, size_t text_size,
+        FILE *stream);
+
+/**
+ * This function hands a packet to the worker its flow hashes to, waiting while that
+ * worker is full. Only the thread that started the pipeline may call it.
+ *
+ * @param pipe the pipeline
+ * @param pkt the packet, of which only the key is used for IPv4
+ */
+void pipeline_submit(pipeline_t *pipe, const packet6_t *pkt);
+
+/**
+ * This function waits until the verdict of every packet submitted so far has been
+ * written to the stream. The policy may be changed safely once it returns.
+ *
+ * @param pipe the pipeline
+ */
+void pipeline_drain(pipeline_t *pipe);
+
+/**
+ * This function prints how many packets each stage of the pipeline has handled, how
+ * much of the time it was busy and how fast it went while busy. The pipeline should be
+ * drained first.
+ *
+ * @param pipe the pipeline, or NULL if there is none
+ * @param stream the file stream to print to
+ */
+void pipeline_print(pipeline_t *pipe, FILE *stream);
+
+/**
+ * This function drains the pipeline, stops its threads and frees it.
+ *
+ * @param pipe the pipeline
+ */
+void pipeline_stop(pipeline_t *pipe);
+
+#endif
@@ -5,216 +5,3157 @@
  * This component is responsible for functionality pertaining to the policy and firewall rules.
  * It contains features used by the top-level component, fwsim.c, but it should never make
  * calls to code in fwsim.c.
+ *
+ * The policy is kept as an immutable snapshot. Changes build a new snapshot that shares
+ * the unchanged rules with the old one and publish it with a single atomic store, so
+ * any number of threads may call policy_test() while another thread changes the policy.
+ * Readers never block; old snapshots are released through rcu.c once no reader can
+ * still see them.
+ *
+ * The rules of a snapshot are kept in order in a persistent treap of small chunks of
+ * rules that counts the rules under each node. Inserting or deleting at a position
+ * copies one chunk and the O(log n) nodes on the path to it and shares the rest of the
+ * tree with the old snapshot, so a change costs O(log n) however large the policy is,
+ * while a scan still runs over contiguous arrays of rules.
+ *
+ * A snapshot may also be backed by a compiled image (see image.c), in which case the
+ * rules are read straight from it until the first change copies them out.
+ *
+ * When an engine other than the linear scan is selected (see engine.c), each snapshot
+ * is published with an index that engine built of its rules, and packets are classified
+ * with the index instead of scanning. An engine that cannot index a policy (it is too
+ * large, say) leaves it to the scan. An engine that can update its index (see tss.c)
+ * is handed each inserted or deleted rule instead of indexing the new snapshot afresh.
+ * A policy loaded with a matcher generated for it (see compiled.c) is indexed by that
+ * matcher until it is changed.
+ *
+ * IPv6 rules are indexed apart from the rest (see prefix6.c), since their prefixes do
+ * not fit the engines built for exact IPv4 addresses. Each index numbers only the rules
+ * of its own family, and the tree counts the IPv6 rules under each node so that the
+ * n-th rule of either family is found in O(log n). A change to the rules of one family
+ * leaves the index of the other as it is.
+ *
+ * Each snapshot also holds a Bloom filter of the keys its IPv4 rules match (see bloom.c),
+ * which is checked once the flow cache misses. A packet no rule can match is given the
+ * default policy straight away, so traffic the policy does not mention never reaches
+ * the index or the scan. The filter is shared between snapshots and rules inserted are
+ * added to it in place; rules deleted are left in it until it is rebuilt.
+ *
+ * Policies of millions of rules may be kept in a compact encoding instead (see
+ * policy_set_compact()). Each rule is then packed into 16 bytes: its IPv4 key, its action
+ * and the id of a wildcard template holding its mask, since the rules of a policy use
+ * only a handful of masks between them. IPv6 addresses are kept out of line with the
+ * shared rule, and rules, chunks and nodes are cut from arenas backed by huge pages (see
+ * arena.c) rather than allocated one at a time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "policy.h"
+#include "flowcache.h"
+#include "rcu.h"
+#include "stats.h"
+#include "engine.h"
+#include "prefix6.h"
+#include "bloom.h"
+#include "arena.h"
+
+/** Largest number of rules kept together in one node of the rule tree */
+#define POLICY_CHUNK 32
+
+/** Used for turning nanoseconds into milliseconds */
+#define NSEC_PER_MSEC 1000000.0
+
+/** Used for turning a ratio into a percentage */
+#define PERCENT 100.0
+
+/** High word of the talker key of an IPv4 source, kept as an IPv4-mapped IPv6 address */
+#define TALKER_V4_MAPPED 0xFFFF00000000ULL
+
+/** Shift of the protocol in the talker key of a source port */
+#define TALKER_PROTOCOL_SHIFT 16
+
+/** Number of top talkers the top command shows unless told otherwise */
+#define TALKER_TOP_DEFAULT 10
+
+/** Bit of a packed rule's ports word holding its action */
+#define PACKED_ACTION_SHIFT 47
+
+/** First bit of a packed rule's ports word holding its template id */
+#define PACKED_TEMPLATE_SHIFT 48
+
+/** Bits of a packed rule's ports word holding the ports, protocol and family it matches */
+#define PACKED_PORTS_MASK (((uint64_t) 1 << PACKED_ACTION_SHIFT) - 1)
+
+/** Number of bits of a template id that pick a template within a page */
+#define TEMPLATE_PAGE_BITS 8
+
+/** Number of templates in a page of the template table */
+#define TEMPLATE_PAGE (1 << TEMPLATE_PAGE_BITS)
+
+/** Number of pages in the template table, which bounds the number of templates */
+#define TEMPLATE_PAGES 256
+
+/** Initial number of slots in the table templates are looked up in when interned */
+#define TEMPLATE_SLOTS_INIT 64
+
+/** Multiplier the words of a mask are hashed with (64-bit golden ratio) */
+#define TEMPLATE_HASH_MULT 0x9E3779B97F4A7C15ULL
+
+/** Shift that keeps the well-mixed high half of a hash */
+#define TEMPLATE_HASH_SHIFT 32
+
+/** Used for turning bytes into kilobytes */
+#define KB_SHIFT 10
+
+/** Bytes malloc() adds to each allocation for its own use, as glibc lays them out */
+#define MALLOC_HEADER 8
+
+/** Alignment of an allocation from malloc(), as glibc lays them out */
+#define MALLOC_ALIGN 16
+
+/** Smallest block malloc() hands out, as glibc lays them out */
+#define MALLOC_MIN 32
+
+/** Bytes of a shared IPv4 rule in the normal encoding, which leaves out the IPv6 match */
+#define RULE_FULL_SIZE offsetof(shared_rule_t, data.full.match6)
+
+/** Bytes of a shared IPv6 rule in the normal encoding */
+#define RULE6_FULL_SIZE sizeof(shared_rule_t)
+
+/** The template with id @id (see template_intern()) */
+#define TEMPLATE(id) (template_pages[(id) >> TEMPLATE_PAGE_BITS] \
+        [(id) & (TEMPLATE_PAGE - 1)])
+
+/**
+ * Representation of a rule in the compact encoding. The mask of the rule is kept in a
+ * template shared with every rule using the same mask.
+ * .addrs: the addresses the rule matches (0 for an IPv6 rule)
+ * .ports: the ports, protocol and family the rule matches in the low bits, the action
+ * at bit PACKED_ACTION_SHIFT and the template id from bit PACKED_TEMPLATE_SHIFT
+ */
+typedef struct packed_rule {
+    uint64_t addrs;
+    uint64_t ports;
+} packed_rule_t;
+
+/**
+ * Representation of the masks rules in the compact encoding share
+ * .mask: the mask of the key
+ * .src6: the mask of the IPv6 source prefix (0 for an IPv4 rule)
+ * .dst6: the mask of the IPv6 destination prefix (0 for an IPv4 rule)
+ */
+typedef struct template {
+    packet_t mask;
+    ipv6_t src6;
+    ipv6_t dst6;
+} template_t;
+
+/**
+ * Representation of a rule in the normal encoding, less the match of the addresses of
+ * an IPv6 rule, which is kept out of line so that scanning IPv4 rules does not read it
+ * .action: the rule action
+ * .match: the packet match
+ */
+typedef struct full_rule {
+    unsigned int action;
+    packet_match_t match;
+} full_rule_t;
+
+/**
+ * Representation of a rule shared between snapshots. Only as much of it as the rule's
+ * family needs is allocated.
+ * .refs: the number of chunks holding the rule (only touched by the writer)
+ * .id: the id the rule's hit counters are kept under
+ * .data.full.rec: the rule, in the normal encoding
+ * .data.full.match6: the match of the IPv6 addresses, in the normal encoding (only
+ * allocated for an IPv6 rule)
+ * .data.packed.rec: the rule packed, in the compact encoding
+ * .data.packed.addrs6: the IPv6 source and destination addresses the rule matches, in
+ * the compact encoding (only allocated for an IPv6 rule)
+ */
+typedef struct shared_rule {
+    unsigned int refs;
+    int id;
+    union {
+        struct {
+            full_rule_t rec;
+            match6_t match6;
+        } full;
+        struct {
+            packed_rule_t rec;
+            ipv6_t addrs6[2];
+        } packed;
+    } data;
+} shared_rule_t;
+
+/**
+ * Representation of a run of consecutive rules, the unit the rule tree is built from.
+ * Chunks are never changed once they are in a tree; a change builds a new one.
+ * .refs: the number of tree nodes holding the chunk (only touched by the writer)
+ * .count: the number of rules in the chunk
+ * .v6: the number of IPv6 rules in the chunk
+ * .rules: the rules in order
+ * .match: copies of the rules, less any IPv6 addresses, so scanning a chunk reads one
+ * contiguous array; only the packed copies are allocated in the compact encoding
+ */
+typedef struct policy_chunk {
+    unsigned int refs;
+    unsigned int count;
+    unsigned int v6;
+    shared_rule_t *rules[POLICY_CHUNK];
+    union {
+        full_rule_t full[POLICY_CHUNK];
+        packed_rule_t packed[POLICY_CHUNK];
+    } match;
+} policy_chunk_t;
+
+/**
+ * Representation of a node of the rule tree. Nodes are never changed once they can be
+ * reached from a published snapshot; a change copies the nodes on its path instead.
+ * .refs: the number of nodes and snapshots holding the node (only touched by the writer)
+ * .size: the number of rules in the subtree
+ * .v6: the number of IPv6 rules in the subtree
+ * .prio: the heap priority that keeps the tree balanced
+ * .chunk: the rules at this position
+ * .left: the rules before these in the subtree
+ * .right: the rules after these in the subtree
+ */
+typedef struct policy_node {
+    unsigned int refs;
+    unsigned int size;
+    unsigned int v6;
+    unsigned int prio;
+    policy_chunk_t *chunk;
+    struct policy_node *left;
+    struct policy_node *right;
+} policy_node_t;
+
+/**
+ * Representation of the compiled image a snapshot is backed by
+ * .rules: the rules of the image
+ * .id: the id of the first rule's hit counters (the rest follow in order)
+ * .moved: whether the rules (and their ids) have been copied into another snapshot
+ * .release: the function called once the image is no longer used
+ * .arg: the value passed to .release
+ */
+typedef struct policy_image {
+    const image_rule_t *rules;
+    int id;
+    int moved;
+    void (*release)(void *);
+    void *arg;
+} policy_image_t;
+
+/**
+ * Representation of the index a classification engine built of a snapshot's rules.
+ * Snapshots with the same rules share one index.
+ * .refs: the number of snapshots holding the index (only touched by the writer)
+ * .engine: the engine that built the index
+ * .data: the index itself
+ * .actions: the action of each rule in order, or NULL if the engine updates its index
+ * (the actions are then read from the rules)
+ * .build_ns: how long the index took to build (or update) in nanoseconds
+ * .updated: whether the index was updated from the one before it rather than built
+ */
+typedef struct policy_index {
+    unsigned int refs;
+    const engine_t *engine;
+    void *data;
+    unsigned char *actions;
+    long long build_ns;
+    int updated;
+} policy_index_t;
+
+/**
+ * Representation of the filter of a snapshot's IPv4 rules. Snapshots share one filter
+ * until it is rebuilt, which happens once it is full or most of the rules in it have
+ * been deleted.
+ * .refs: the number of snapshots holding the filter (only touched by the writer)
+ * .bloom: the filter itself
+ * .added: the number of rules added to it, including any deleted since (only written
+ * by the writer)
+ */
+typedef struct policy_filter {
+    unsigned int refs;
+    bloom_t *bloom;
+    unsigned int added;
+} policy_filter_t;
+
+/**
+ * Representation of a matcher generated for the rules of a compiled image. It is held
+ * both by the image and by the index it is wrapped in, since a snapshot copied out of
+ * the image keeps the index.
+ * .refs: the number of images and indexes holding it (only touched by the writer)
+ * .match: the matcher
+ * .release: the function called once neither holds it
+ * .arg: the value passed to .release
+ */
+typedef struct policy_compiled {
+    unsigned int refs;
+    policy_matcher_t match;
+    void (*release)(void *);
+    void *arg;
+} policy_compiled_t;
+
+/**
+ * Representation of one published version of the policy
+ * .gen: the generation of the policy, used to invalidate cached results
+ * .def: the default policy
+ * .len: the number of rules
+ * .len6: the number of IPv6 rules (an image holds none)
+ * .root: the tree of rules (unused when .image is set)
+ * .image: the compiled image holding the rules, or NULL
+ * .index: the index the IPv4 rules are classified with, or NULL to scan them in order
+ * .index6: the index the IPv6 rules are classified with, or NULL to scan them in order
+ * .filter: the filter of the IPv4 rules, or NULL if there is none
+ */
+typedef struct policy_snapshot {
+    unsigned long gen;
+    unsigned int def;
+    unsigned int len;
+    unsigned int len6;
+    policy_node_t *root;
+    policy_image_t *image;
+    policy_index_t *index;
+    policy_index_t *index6;
+    policy_filter_t *filter;
+} policy_snapshot_t;
+
+/**
+ * Function called for each rule of a snapshot in order
+ *
+ * @param rule the rule
+ * @param id the id of the rule's hit counters
+ * @param pos the index of the rule
+ * @param arg the value passed to snapshot_walk()
+ */
+typedef void (*rule_visit_t)(rule_t *rule, int id, int pos, void *arg);
+
+/** The currently published snapshot. */
+static policy_snapshot_t *policy;
+
+/** Serializes writers; readers never take it */
+static pthread_mutex_t policy_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Engine new snapshots are indexed with, NULL for the linear scan (only touched by the writer) */
+static const engine_t *policy_engine;
+
+/** Generation of the last published snapshot */
+static unsigned long policy_gen;
+
+/** State of the generator for node priorities (only touched by the writer) */
+static unsigned int prio_state = 2463534242u;
+
+/** Whether rules are kept in the compact encoding; set before the policy is initialized */
+static int policy_compact;
+
+/** Arenas of IPv4 rules, IPv6 rules, chunks and nodes in the compact encoding */
+static arena_t rule_arena;
+static arena_t rule6_arena;
+static arena_t chunk_arena;
+static arena_t node_arena;
+
+/**
+ * Pages of the masks rules in the compact encoding share. Pages are never moved or freed
+ * while the policy is in use, so readers find a template by its id without a lock; a
+ * template is filled in before any snapshot holding a rule that uses it is published.
+ */
+static template_t *template_pages[TEMPLATE_PAGES];
+
+/** Number of templates (only touched by the writer) */
+static unsigned int template_count;
+
+/** Open-addressed table of template ids plus one, keyed by the hash of the mask */
+static unsigned int *template_slots;
+
+/** Number of slots in template_slots (a power of two) */
+static unsigned int template_cap;
+
+/**
+ * This function draws the priority for a new tree node (xorshift32).
+ *
+ * @return the priority
+ */
+static unsigned int prio_next() {
+
+    prio_state ^= prio_state << 13;
+    prio_state ^= prio_state >> 17;
+    prio_state ^= prio_state << 5;
+
+    return prio_state;
+}
+
+/**
+ * This function hashes the masks of a template.
+ *
+ * @param tmpl the template
+ *
+ * @return the hash
+ */
+static unsigned int template_hash(const template_t *tmpl) {
+
+    uint64_t words[] = { tmpl->mask.addrs, tmpl->mask.ports, tmpl->src6.w[0],
+            tmpl->src6.w[1], tmpl->dst6.w[0], tmpl->dst6.w[1] };
+    uint64_t h = 0;
+
+    for (unsigned int i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+        h = (h ^ words[i]) * TEMPLATE_HASH_MULT;
+    }
+
+    return (unsigned int) (h >> TEMPLATE_HASH_SHIFT);
+}
+
+/**
+ * This function finds the slot of template_slots holding a template, or the empty slot
+ * it would be put in.
+ *
+ * @param tmpl the template
+ *
+ * @return the index of the slot
+ */
+static unsigned int template_slot(const template_t *tmpl) {
+
+    unsigned int i = template_hash(tmpl) & (template_cap - 1);
+
+    while (template_slots[i]
+            && memcmp(&TEMPLATE(template_slots[i] - 1), tmpl, sizeof(template_t)) != 0) {
+        i = (i + 1) & (template_cap - 1);
+    }
+
+    return i;
+}
+
+/**
+ * This function finds the id of the template holding some masks, adding one if no rule
+ * has used them yet. Templates are kept until the policy is freed.
+ *
+ * @param tmpl the masks
+ *
+ * @return the id, or -1 if memory runs out or there are no ids left
+ */
+static int template_intern(const template_t *tmpl) {
+
+    //Keep the table at most half full, so lookups stay short
+    if (template_count * 2 >= template_cap) {
+        unsigned int cap = template_cap ? template_cap * 2 : TEMPLATE_SLOTS_INIT;
+        unsigned int *slots = (unsigned int *) calloc(cap, sizeof(unsigned int));
+
+        if (!slots) {
+            return -1;
+        }
+
+        free(template_slots);
+        template_slots = slots;
+        template_cap = cap;
+
+        for (unsigned int id = 0; id < template_count; id++) {
+            template_slots[template_slot(&TEMPLATE(id))] = id + 1;
+        }
+    }
+
+    unsigned int i = template_slot(tmpl);
+
+    if (template_slots[i]) {
+        return template_slots[i] - 1;
+    }
+
+    if (template_count == TEMPLATE_PAGES * TEMPLATE_PAGE) {
+        return -1;
+    }
+
+    unsigned int page = template_count >> TEMPLATE_PAGE_BITS;
+
+    if (!template_pages[page]) {
+        template_t *mem = (template_t *) malloc(TEMPLATE_PAGE * sizeof(template_t));
+
+        if (!mem) {
+            return -1;
+        }
+        __atomic_store_n(&template_pages[page], mem, __ATOMIC_RELEASE);
+    }
+
+    TEMPLATE(template_count) = *tmpl;
+    template_slots[i] = ++template_count;
+
+    return template_count - 1;
+}
+
+/**
+ * This function frees every template. No reader may be using the policy.
+ */
+static void templates_free() {
+
+    for (unsigned int page = 0; page < TEMPLATE_PAGES; page++) {
+        free(template_pages[page]);
+        template_pages[page] = NULL;
+    }
+
+    free(template_slots);
+    template_slots = NULL;
+    template_count = 0;
+    template_cap = 0;
+}
+
+/**
+ * This function finds the action of a shared rule.
+ *
+ * @param rule the rule
+ *
+ * @return the action
+ */
+static unsigned int rule_action(const shared_rule_t *rule) {
+
+    if (policy_compact) {
+        return rule->data.packed.rec.ports >> PACKED_ACTION_SHIFT & 1;
+    }
+
+    return rule->data.full.rec.action;
+}
+
+/**
+ * This function checks whether a shared rule matches IPv6 packets.
+ *
+ * @param rule the rule
+ *
+ * @return 1 if it does, 0 if it matches IPv4 packets
+ */
+static int rule_is_v6(const shared_rule_t *rule) {
+
+    if (policy_compact) {
+        return PACKET_IS_V6(rule->data.packed.rec);
+    }
+
+    return PACKET_IS_V6(rule->data.full.rec.match.value);
+}
+
+/**
+ * This function finds the rule a shared rule holds, unpacking it if it is kept in the
+ * compact encoding.
+ *
+ * @param rule the rule
+ *
+ * @return the rule
+ */
+static rule_t rule_get(const shared_rule_t *rule) {
+
+    rule_t temp;
+
+    if (!policy_compact) {
+        temp.action = rule->data.full.rec.action;
+        temp.match = rule->data.full.rec.match;
+
+        if (PACKET_IS_V6(temp.match.value)) {
+            temp.match6 = rule->data.full.match6;
+        } else {
+            memset(&temp.match6, 0, sizeof(match6_t));
+        }
+
+        return temp;
+    }
+
+    const packed_rule_t *rec = &rule->data.packed.rec;
+    const template_t *tmpl = &TEMPLATE(rec->ports >> PACKED_TEMPLATE_SHIFT);
+
+    temp.action = rec->ports >> PACKED_ACTION_SHIFT & 1;
+    temp.match.value.addrs = rec->addrs;
+    temp.match.value.ports = rec->ports & PACKED_PORTS_MASK;
+    temp.match.mask = tmpl->mask;
+    temp.match6.src_mask = tmpl->src6;
+    temp.match6.dst_mask = tmpl->dst6;
+
+    if (PACKET_IS_V6(*rec)) {
+        temp.match6.src = rule->data.packed.addrs6[0];
+        temp.match6.dst = rule->data.packed.addrs6[1];
+    } else {
+        memset(&temp.match6.src, 0, sizeof(ipv6_t));
+        memset(&temp.match6.dst, 0, sizeof(ipv6_t));
+    }
+
+    return temp;
+}
+
+/**
+ * This function checks whether a rule in the compact encoding matches a packet, the
+ * way packet_match() does.
+ *
+ * @param rec the packed rule
+ * @param rule the shared rule it was packed from
+ * @param pkt the packet
+ *
+ * @return 1 if the rule matches, 0 if not
+ */
+static int packed_match(const packed_rule_t *rec, const shared_rule_t *rule,
+        const packet_t *pkt) {
+
+    const template_t *tmpl = &TEMPLATE(rec->ports >> PACKED_TEMPLATE_SHIFT);
+
+    if (((pkt->addrs & tmpl->mask.addrs) != rec->addrs)
+            | ((pkt->ports & tmpl->mask.ports) != (rec->ports & PACKED_PORTS_MASK))) {
+        return 0;
+    }
+
+    //Only an IPv6 rule, which the key of an IPv6 packet alone has matched, goes on
+    if (!PACKET_IS_V6(*rec)) {
+        return 1;
+    }
+
+    const packet6_t *pkt6 = PACKET_V6(pkt);
+    const ipv6_t *addrs6 = rule->data.packed.addrs6;
+
+    return ((pkt6->src.w[0] & tmpl->src6.w[0]) == addrs6[0].w[0])
+            & ((pkt6->src.w[1] & tmpl->src6.w[1]) == addrs6[0].w[1])
+            & ((pkt6->dst.w[0] & tmpl->dst6.w[0]) == addrs6[1].w[0])
+            & ((pkt6->dst.w[1] & tmpl->dst6.w[1]) == addrs6[1].w[1]);
+}
+
+/**
+ * This function allocates a shared copy of @rule without an id, in the encoding the
+ * policy keeps its rules in.
+ *
+ * @param rule the rule to be copied
+ *
+ * @return the new rule with an id of -1, or NULL if unsuccessful
+ */
+static shared_rule_t *rule_make(const rule_t *rule) {
+
+    shared_rule_t *temp;
+    int v6 = PACKET_IS_V6(rule->match.value);
+
+    if (!policy_compact) {
+        temp = (shared_rule_t *) malloc(v6 ? RULE6_FULL_SIZE : RULE_FULL_SIZE);
+        if (temp) {
+            temp->data.full.rec.action = rule->action;
+            temp->data.full.rec.match = rule->match;
+        }
+        if (temp && v6) {
+            temp->data.full.match6 = rule->match6;
+        }
+    } else {
+        arena_t *arena = v6 ? &rule6_arena : &rule_arena;
+        template_t masks;
+
+        memset(&masks, 0, sizeof(masks));
+        masks.mask = rule->match.mask;
+        if (v6) {
+            masks.src6 = rule->match6.src_mask;
+            masks.dst6 = rule->match6.dst_mask;
+        }
+
+        int tmpl = template_intern(&masks);
+
+        temp = tmpl == -1 ? NULL : (shared_rule_t *) arena_alloc(arena);
+        if (temp) {
+            temp->data.packed.rec.addrs = rule->match.value.addrs;
+            temp->data.packed.rec.ports = rule->match.value.ports
+                    | (uint64_t) rule->action << PACKED_ACTION_SHIFT
+                    | (uint64_t) tmpl << PACKED_TEMPLATE_SHIFT;
+        }
+        if (temp && v6) {
+            temp->data.packed.addrs6[0] = rule->match6.src;
+            temp->data.packed.addrs6[1] = rule->match6.dst;
+        }
+    }
+
+    if (temp) {
+        temp->refs = 0;
+        temp->id = -1;
+    }
+
+    return temp;
+}
+
+/**
+ * This function frees a shared rule without releasing its id.
+ *
+ * @param rule the rule to be freed
+ */
+static void rule_discard(shared_rule_t *rule) {
+
+    if (policy_compact) {
+        arena_free(rule_is_v6(rule) ? &rule6_arena : &rule_arena, rule);
+    } else {
+        free(rule);
+    }
+}
+
+/**
+ * This function frees a rule that no snapshot holds any more.
+ *
+ * @param rule the rule to be freed
+ */
+static void rule_release(shared_rule_t *rule) {
+
+    stats_rule_id_release(rule->id);
+    rule_discard(rule);
+}
+
+/**
+ * This function allocates a shared copy of @rule.
+ *
+ * @param rule the rule to be copied
+ *
+ * @return the new rule, or NULL if unsuccessful
+ */
+static shared_rule_t *rule_alloc(rule_t rule) {
+
+    shared_rule_t *temp = rule_make(&rule);
+
+    if (temp) {
+        temp->id = stats_rule_id_alloc();
+    }
+
+    return temp;
+}
+
+/**
+ * This function allocates a chunk holding @n rules.
+ *
+ * @param rules the rules in order
+ * @param n the number of rules (at most POLICY_CHUNK)
+ *
+ * @return the new chunk with one reference, or NULL if unsuccessful
+ */
+static policy_chunk_t *chunk_new(shared_rule_t **rules, unsigned int n) {
+
+    policy_chunk_t *c = (policy_chunk_t *) (policy_compact ? arena_alloc(&chunk_arena)
+            : malloc(sizeof(policy_chunk_t)));
+
+    if (!c) {
+        return NULL;
+    }
+
+    c->refs = 1;
+    c->count = n;
+    c->v6 = 0;
+
+    for (unsigned int i = 0; i < n; i++) {
+        c->v6 += rule_is_v6(rules[i]);
+        if (policy_compact) {
+            c->match.packed[i] = rules[i]->data.packed.rec;
+        } else {
+            c->match.full[i] = rules[i]->data.full.rec;
+        }
+        c->rules[i] = rules[i];
+        rules[i]->refs++;
+    }
+
+    return c;
+}
+
+/**
+ * This function drops a reference to a chunk, freeing it (and any rule only it holds)
+ * when it was the last.
+ *
+ * @param c the chunk
+ */
+static void chunk_put(policy_chunk_t *c) {
+
+    if (--c->refs > 0) {
+        return;
+    }
+
+    for (unsigned int i = 0; i < c->count; i++) {
+        if (--c->rules[i]->refs == 0) {
+            rule_release(c->rules[i]);
+        }
+    }
+
+    if (policy_compact) {
+        arena_free(&chunk_arena, c);
+    } else {
+        free(c);
+    }
+}
+
+/**
+ * This function checks whether a rule of a chunk matches IPv6 packets.
+ *
+ * @param c the chunk
+ * @param i the index of the rule within the chunk
+ *
+ * @return 1 if it does, 0 if it matches IPv4 packets
+ */
+static int chunk_v6(const policy_chunk_t *c, unsigned int i) {
+
+    if (policy_compact) {
+        return PACKET_IS_V6(c->match.packed[i]);
+    }
+
+    return PACKET_IS_V6(c->match.full[i].match.value);
+}
+
+/**
+ * This function finds the number of rules in a subtree.
+ *
+ * @param t the subtree, or NULL
+ *
+ * @return the number of rules
+ */
+static unsigned int node_size(policy_node_t *t) {
+
+    return t ? t->size : 0;
+}
+
+/**
+ * This function finds the number of rules of one family in a subtree.
+ *
+ * @param t the subtree, or NULL
+ * @param v6 1 for IPv6 rules, 0 for IPv4 rules
+ *
+ * @return the number of rules
+ */
+static unsigned int node_family(policy_node_t *t, int v6) {
+
+    if (!t) {
+        return 0;
+    }
+
+    return v6 ? t->v6 : t->size - t->v6;
+}
+
+/**
+ * This function takes a reference to a node.
+ *
+ * @param t the node, or NULL
+ *
+ * @return @t
+ */
+static policy_node_t *node_hold(policy_node_t *t) {
+
+    if (t) {
+        t->refs++;
+    }
+
+    return t;
+}
+
+/**
+ * This function drops a reference to a node, freeing it (and whatever only it holds)
+ * when it was the last.
+ *
+ * @param t the node, or NULL
+ */
+static void node_put(policy_node_t *t) {
+
+    while (t && --t->refs == 0) {
+        policy_node_t *right = t->right;
+
+        node_put(t->left);
+        chunk_put(t->chunk);
+        if (policy_compact) {
+            arena_free(&node_arena, t);
+        } else {
+            free(t);
+        }
+
+        t = right;
+    }
+}
+
+/**
+ * This function allocates a node. It takes over the references to @chunk, @left and
+ * @right, and drops them if it fails.
+ *
+ * @param chunk the rules at the node
+ * @param prio the priority of the node
+ * @param left the rules before them
+ * @param right the rules after them
+ *
+ * @return the new node with one reference, or NULL if unsuccessful
+ */
+static policy_node_t *node_new(policy_chunk_t *chunk, unsigned int prio,
+        policy_node_t *left, policy_node_t *right) {
+
+    policy_node_t *t = (policy_node_t *) (policy_compact ? arena_alloc(&node_arena)
+            : malloc(sizeof(policy_node_t)));
+
+    if (!t) {
+        chunk_put(chunk);
+        node_put(left);
+        node_put(right);
+        return NULL;
+    }
+
+    t->refs = 1;
+    t->size = node_size(left) + chunk->count + node_size(right);
+    t->v6 = node_family(left, 1) + chunk->v6 + node_family(right, 1);
+    t->prio = prio;
+    t->chunk = chunk;
+    t->left = left;
+    t->right = right;
+
+    return t;
+}
+
+/**
+ * This function copies a node with new children, as node_new() does.
+ *
+ * @param t the node to be copied
+ * @param left the rules before it
+ * @param right the rules after it
+ *
+ * @return the new node with one reference, or NULL if unsuccessful
+ */
+static policy_node_t *node_copy(policy_node_t *t, policy_node_t *left,
+        policy_node_t *right) {
+
+    t->chunk->refs++;
+
+    return node_new(t->chunk, t->prio, left, right);
+}
+
+/**
+ * This function splits a tree into its first @k rules and the rest, without changing
+ * it. @k must fall between two chunks.
+ *
+ * @param t the tree
+ * @param k the number of rules in the first part
+ * @param l the value to be updated with a reference to the first part
+ * @param r the value to be updated with a reference to the rest
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int tree_split(policy_node_t *t, unsigned int k, policy_node_t **l,
+        policy_node_t **r) {
+
+    if (k == 0) {
+        *l = NULL;
+        *r = node_hold(t);
+        return 0;
+    }
+
+    if (k >= node_size(t)) {
+        *l = node_hold(t);
+        *r = NULL;
+        return 0;
+    }
+
+    unsigned int ls = node_size(t->left);
+    policy_node_t *a, *b;
+
+    if (k <= ls) {
+        if (tree_split(t->left, k, &a, &b) == -1) {
+            return -1;
+        }
+        *l = a;
+        *r = node_copy(t, b, node_hold(t->right));
+        if (!*r) {
+            node_put(a);
+            return -1;
+        }
+    } else {
+        if (tree_split(t->right, k - ls - t->chunk->count, &a, &b) == -1) {
+            return -1;
+        }
+        *l = node_copy(t, node_hold(t->left), a);
+        *r = b;
+        if (!*l) {
+            node_put(b);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * This function joins two trees, the rules of @a followed by those of @b, without
+ * changing either.
+ *
+ * @param a the first tree
+ * @param b the second tree
+ * @param out the value to be updated with a reference to the joined tree
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int tree_merge(policy_node_t *a, policy_node_t *b, policy_node_t **out) {
+
+    if (!a || !b) {
+        *out = node_hold(a ? a : b);
+        return 0;
+    }
+
+    policy_node_t *c;
+
+    if (a->prio > b->prio) {
+        if (tree_merge(a->right, b, &c) == -1) {
+            return -1;
+        }
+        *out = node_copy(a, node_hold(a->left), c);
+    } else {
+        if (tree_merge(a, b->left, &c) == -1) {
+            return -1;
+        }
+        *out = node_copy(b, c, node_hold(b->right));
+    }
+
+    return *out ? 0 : -1;
+}
+
+/**
+ * This function sets the sizes of a freshly built tree.
+ *
+ * @param t the tree
+ *
+ * @return the number of rules in it
+ */
+static unsigned int tree_count(policy_node_t *t) {
+
+    if (!t) {
+        return 0;
+    }
+
+    t->size = tree_count(t->left) + t->chunk->count + tree_count(t->right);
+    t->v6 = node_family(t->left, 1) + t->chunk->v6 + node_family(t->right, 1);
+
+    return t->size;
+}
+
+/**
+ * This function builds a tree holding @rules in order in linear time, packing them
+ * into full chunks and keeping the right spine of the tree on a stack.
+ *
+ * @param rules the rules in order
+ * @param n the number of rules
+ * @param out the value to be updated with a reference to the tree
+ *
+ * @return 0 if successful, -1 if unsuccessful (in which case no rule is held by it)
+ */
+static int tree_build(shared_rule_t **rules, unsigned int n, policy_node_t **out) {
+
+    unsigned int nodes = (n + POLICY_CHUNK - 1) / POLICY_CHUNK;
+    policy_node_t **spine = (policy_node_t **) malloc(
+            (nodes ? nodes : 1) * sizeof(policy_node_t *));
+    unsigned int top = 0;
+    int ret = 0;
+
+    *out = NULL;
+
+    if (!spine) {
+        return -1;
+    }
+
+    //Pin the rules so that cleaning up after a failure never frees one
+    for (unsigned int i = 0; i < n; i++) {
+        rules[i]->refs++;
+    }
+
+    for (unsigned int i = 0; i < n; i += POLICY_CHUNK) {
+        unsigned int count = n - i < POLICY_CHUNK ? n - i : POLICY_CHUNK;
+        policy_chunk_t *c = chunk_new(rules + i, count);
+        policy_node_t *t = c ? node_new(c, prio_next(), NULL, NULL) : NULL;
+
+        if (!t) {
+            //Everything built so far hangs off the bottom of the spine
+            if (top > 0) {
+                node_put(spine[0]);
+            }
+            top = 0;
+            ret = -1;
+            break;
+        }
+
+        policy_node_t *last = NULL;
+        while (top > 0 && spine[top - 1]->prio < t->prio) {
+            last = spine[--top];
+        }
+
+        t->left = last;
+        if (top > 0) {
+            spine[top - 1]->right = t;
+        }
+        spine[top++] = t;
+    }
+
+    if (top > 0) {
+        *out = spine[0];
+        tree_count(*out);
+    }
+
+    for (unsigned int i = 0; i < n; i++) {
+        rules[i]->refs--;
+    }
+
+    free(spine);
+
+    return ret;
+}
+
+/**
+ * This function finds the chunk holding an index of a tree.
+ *
+ * @param t the tree
+ * @param k the index (from 0), which must be in the tree
+ * @param start the value to be updated with the index of the chunk's first rule
+ *
+ * @return the chunk
+ */
+static policy_chunk_t *tree_find(policy_node_t *t, unsigned int k,
+        unsigned int *start) {
+
+    *start = 0;
+
+    while (1) {
+        unsigned int ls = node_size(t->left);
+
+        if (k < ls) {
+            t = t->left;
+        } else if (k < ls + t->chunk->count) {
+            *start += ls;
+            return t->chunk;
+        } else {
+            k -= ls + t->chunk->count;
+            *start += ls + t->chunk->count;
+            t = t->right;
+        }
+    }
+}
+
+/**
+ * This function finds the rule at an index of a tree.
+ *
+ * @param t the tree
+ * @param k the index (from 0), which must be in the tree
+ *
+ * @return the rule
+ */
+static shared_rule_t *tree_at(policy_node_t *t, unsigned int k) {
+
+    unsigned int start;
+    policy_chunk_t *c = tree_find(t, k, &start);
+
+    return c->rules[k - start];
+}
+
+/**
+ * This function finds the index of the @k-th rule of one family in a tree.
+ *
+ * @param t the tree
+ * @param v6 1 for IPv6 rules, 0 for IPv4 rules
+ * @param k the index (from 0) of the rule among the rules of its family, which must be
+ * in the tree
+ *
+ * @return the index (from 0) of the rule among all rules
+ */
+static unsigned int tree_family_at(policy_node_t *t, int v6, unsigned int k) {
+
+    unsigned int pos = 0;
+
+    while (1) {
+        unsigned int lf = node_family(t->left, v6);
+
+        if (k < lf) {
+            t = t->left;
+            continue;
+        }
+
+        k -= lf;
+        pos += node_size(t->left);
+
+        policy_chunk_t *c = t->chunk;
+        unsigned int cf = v6 ? c->v6 : c->count - c->v6;
+
+        if (k < cf) {
+            for (unsigned int i = 0; ; i++) {
+                if (chunk_v6(c, i) == v6 && k-- == 0) {
+                    return pos + i;
+                }
+            }
+        }
+
+        k -= cf;
+        pos += c->count;
+        t = t->right;
+    }
+}
+
+/**
+ * This function counts the rules of one family before an index of a tree.
+ *
+ * @param t the tree
+ * @param v6 1 for IPv6 rules, 0 for IPv4 rules
+ * @param pos the index (from 0), which may be one past the last rule
+ *
+ * @return the number of rules of the family before @pos
+ */
+static unsigned int tree_family_rank(policy_node_t *t, int v6, unsigned int pos) {
+
+    unsigned int rank = 0;
+
+    while (t && pos > 0) {
+        unsigned int ls = node_size(t->left);
+
+        if (pos <= ls) {
+            t = t->left;
+            continue;
+        }
+
+        rank += node_family(t->left, v6);
+        pos -= ls;
+
+        policy_chunk_t *c = t->chunk;
+
+        if (pos <= c->count) {
+            for (unsigned int i = 0; i < pos; i++) {
+                rank += chunk_v6(c, i) == v6;
+            }
+            return rank;
+        }
+
+        rank += v6 ? c->v6 : c->count - c->v6;
+        pos -= c->count;
+        t = t->right;
+    }
+
+    return rank;
+}
+
+/**
+ * This function replaces the chunk holding index @k with a copy that has @add inserted
+ * at @k, or the rule at @k removed when @add is NULL. A chunk that grows too big is
+ * split in two and one that becomes empty is dropped.
+ *
+ * @param t the tree
+ * @param k the index; for an insert it may be one past the last rule
+ * @param add the rule to insert, or NULL to delete (it is never freed here)
+ * @param out the value to be updated with a reference to the new tree
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int tree_edit(policy_node_t *t, unsigned int k, shared_rule_t *add,
+        policy_node_t **out) {
+
+    shared_rule_t *rules[POLICY_CHUNK + 1];
+    unsigned int start = 0;
+    unsigned int old = 0;
+    unsigned int n = 0;
+
+    if (t) {
+        policy_chunk_t *c = tree_find(t, k < t->size ? k : k - 1, &start);
+        unsigned int i = k - start;
+
+        old = c->count;
+        memcpy(rules, c->rules, i * sizeof(shared_rule_t *));
+        if (add) {
+            rules[i] = add;
+            memcpy(rules + i + 1, c->rules + i, (old - i) * sizeof(shared_rule_t *));
+            n = old + 1;
+        } else {
+            memcpy(rules + i, c->rules + i + 1,
+                    (old - i - 1) * sizeof(shared_rule_t *));
+            n = old - 1;
+        }
+    } else {
+        rules[0] = add;
+        n = 1;
+    }
+
+    //Cut the old chunk out, build its replacement and join the parts
+    policy_node_t *l, *rest, *mid, *r, *mid_node, *head;
+    int ret = -1;
+
+    if (tree_split(t, start, &l, &rest) == -1) {
+        return -1;
+    }
+
+    //Pin the new rule so that cleaning up after a failure never frees it
+    if (add) {
+        add->refs++;
+    }
+
+    if (tree_split(rest, old, &mid, &r) == 0) {
+        unsigned int half = n > POLICY_CHUNK ? n / 2 : n;
+        policy_node_t *parts[2] = { NULL, NULL };
+
+        if (n > 0) {
+            policy_chunk_t *a = chunk_new(rules, half);
+            parts[0] = a ? node_new(a, prio_next(), NULL, NULL) : NULL;
+        }
+
+        if (n > half) {
+            policy_chunk_t *b = chunk_new(rules + half, n - half);
+            parts[1] = b ? node_new(b, prio_next(), NULL, NULL) : NULL;
+        }
+
+        if ((n == 0 || parts[0]) && (n <= half || parts[1])
+                && tree_merge(parts[0], parts[1], &mid_node) == 0) {
+            if (tree_merge(l, mid_node, &head) == 0) {
+                ret = tree_merge(head, r, out);
+                node_put(head);
+            }
+            node_put(mid_node);
+        }
+
+        node_put(parts[0]);
+        node_put(parts[1]);
+        node_put(mid);
+        node_put(r);
+    }
+
+    node_put(l);
+    node_put(rest);
+
+    if (add) {
+        add->refs--;
+    }
+
+    return ret;
+}
+
+/**
+ * This function calls @fn for each rule of a tree in order.
+ *
+ * @param t the tree
+ * @param pos the index of the first rule of the tree
+ * @param fn the function to be called
+ * @param arg the value passed to @fn
+ */
+static void tree_walk(policy_node_t *t, int pos, rule_visit_t fn, void *arg) {
+
+    while (t) {
+        tree_walk(t->left, pos, fn, arg);
+        pos += node_size(t->left);
+
+        for (unsigned int i = 0; i < t->chunk->count; i++) {
+            rule_t rule = rule_get(t->chunk->rules[i]);
+            fn(&rule, t->chunk->rules[i]->id, pos++, arg);
+        }
+
+        t = t->right;
+    }
+}
+
+/**
+ * This function collects the shared rules of a tree in order.
+ *
+ * @param t the tree
+ * @param out the array to be populated
+ */
+static void tree_collect(policy_node_t *t, shared_rule_t **out) {
+
+    while (t) {
+        tree_collect(t->left, out);
+        out += node_size(t->left);
+
+        memcpy(out, t->chunk->rules, t->chunk->count * sizeof(shared_rule_t *));
+        out += t->chunk->count;
+
+        t = t->right;
+    }
+}
+
+/**
+ * This function finds the first rule matching a packet with a generated matcher.
+ *
+ * @param index the policy_compiled_t of the matcher
+ * @param pkt the packet
+ *
+ * @return the index (from 0) of the first matching rule, or -1
+ */
+static int compiled_lookup(void *index, packet_t *pkt) {
+
+    policy_compiled_t *compiled = (policy_compiled_t *) index;
+
+    stats_engine_count(1, 0);
+
+    return compiled->match(PACKET_PROTOCOL(*pkt), PACKET_SRC_IP(*pkt),
+            PACKET_SRC_PORT(*pkt), PACKET_DST_IP(*pkt), PACKET_DST_PORT(*pkt));
+}
+
+/**
+ * This function prints what there is to say about a generated matcher.
+ *
+ * @param index the policy_compiled_t of the matcher
+ * @param stream the file stream to print to
+ */
+static void compiled_print(void *index, FILE *stream) {
+
+    fprintf(stream, "Matcher: generated code, loaded from a shared object\n");
+}
+
+/**
+ * This function drops a reference to a generated matcher, releasing it once neither
+ * the image nor the index holds it.
+ *
+ * @param index the policy_compiled_t of the matcher
+ */
+static void compiled_put(void *index) {
+
+    policy_compiled_t *compiled = (policy_compiled_t *) index;
+
+    if (--compiled->refs == 0) {
+        compiled->release(compiled->arg);
+        free(compiled);
+    }
+}
+
+/** Engine of the index a generated matcher is wrapped in; it is never selected */
+static const engine_t compiled_engine = {
+    "compiled", 0, NULL, compiled_lookup, compiled_print, compiled_put, NULL, NULL
+};
+
+/** Engine of the index of IPv6 rules, used whenever an engine is selected */
+static const engine_t prefix6_engine = {
+    "prefix6", 0, prefix6_build, prefix6_lookup, prefix6_print, prefix6_free, NULL, NULL
+};
+
+/**
+ * This function takes another reference to an index (only called by the writer).
+ *
+ * @param index the index, or NULL
+ *
+ * @return @index
+ */
+static policy_index_t *index_hold(policy_index_t *index) {
+
+    if (index) {
+        index->refs++;
+    }
+
+    return index;
+}
+
+/**
+ * This function drops a reference to an index, freeing it once nothing holds it.
+ *
+ * @param index the index, or NULL
+ */
+static void index_put(policy_index_t *index) {
+
+    if (index && --index->refs == 0) {
+        index->engine->free(index->data);
+        free(index->actions);
+        free(index);
+    }
+}
+
+/**
+ * This function takes another reference to a filter (only called by the writer).
+ *
+ * @param filter the filter, or NULL
+ *
+ * @return @filter
+ */
+static policy_filter_t *filter_hold(policy_filter_t *filter) {
+
+    if (filter) {
+        filter->refs++;
+    }
+
+    return filter;
+}
+
+/**
+ * This function drops a reference to a filter, freeing it once nothing holds it.
+ *
+ * @param filter the filter, or NULL
+ */
+static void filter_put(policy_filter_t *filter) {
+
+    if (filter && --filter->refs == 0) {
+        bloom_free(filter->bloom);
+        free(filter);
+    }
+}
+
+/**
+ * This function allocates a snapshot.
+ *
+ * @param def the default policy of the snapshot
+ * @param root the tree of rules, whose reference the snapshot takes over
+ *
+ * @return the new snapshot, or NULL if unsuccessful (having dropped @root)
+ */
+static policy_snapshot_t *snapshot_alloc(unsigned int def, policy_node_t *root) {
+
+    policy_snapshot_t *snap = (policy_snapshot_t *) malloc(
+            sizeof(policy_snapshot_t));
+
+    if (!snap) {
+        node_put(root);
+        return NULL;
+    }
+
+    snap->gen = policy_gen + 1;
+    snap->def = def;
+    snap->len = node_size(root);
+    snap->len6 = node_family(root, 1);
+    snap->root = root;
+    snap->image = NULL;
+    snap->index = NULL;
+    snap->index6 = NULL;
+    snap->filter = NULL;
+
+    return snap;
+}
+
+/**
+ * This function releases a snapshot and every node and rule no other snapshot holds.
+ * It is only called by the writer, either directly or through rcu.c.
+ *
+ * @param ptr the snapshot to be released
+ */
+static void snapshot_release(void *ptr) {
+
+    policy_snapshot_t *snap = (policy_snapshot_t *) ptr;
+
+    if (snap->image) {
+        if (!snap->image->moved) {
+            for (int i = 0; i < snap->len; i++) {
+                stats_rule_id_release(snap->image->id + i);
+            }
+        }
+        snap->image->release(snap->image->arg);
+        free(snap->image);
+    }
+
+    index_put(snap->index);
+    index_put(snap->index6);
+    filter_put(snap->filter);
+    node_put(snap->root);
+    free(snap);
+}
+
+/**
+ * This function packs a rule into its image form.
+ *
+ * @param rule the rule
+ * @param rec the image rule to be populated
+ */
+void rule_pack(rule_t *rule, image_rule_t *rec) {
+
+    rec->src_ip = PACKET_SRC_IP(rule->match.value);
+    rec->dst_ip = PACKET_DST_IP(rule->match.value);
+    rec->src_port = MATCH_SRC_PORT(rule->match);
+    rec->dst_port = MATCH_DST_PORT(rule->match);
+    rec->protocol = PACKET_PROTOCOL(rule->match.value);
+    rec->action = rule->action;
+}
+
+/**
+ * This function unpacks a rule of a compiled image.
+ *
+ * @param rec the rule in the image
+ *
+ * @return the rule
+ */
+static rule_t image_rule(const image_rule_t *rec) {
+
+    rule_t rule;
+    rule.action = rec->action;
+    rule.match = packet_match_key(rec->protocol, rec->src_ip, rec->src_port,
+            rec->dst_ip, rec->dst_port);
+    memset(&rule.match6, 0, sizeof(match6_t));
+
+    return rule;
+}
+
+/**
+ * This function calls @fn for each rule of a snapshot in order, wherever it is kept.
+ *
+ * @param snap the snapshot
+ * @param fn the function to be called
+ * @param arg the value passed to @fn
+ */
+static void snapshot_walk(policy_snapshot_t *snap, rule_visit_t fn, void *arg) {
+
+    if (!snap->image) {
+        tree_walk(snap->root, 0, fn, arg);
+        return;
+    }
+
+    for (int i = 0; i < snap->len; i++) {
+        rule_t rule = image_rule(&snap->image->rules[i]);
+        fn(&rule, snap->image->id + i, i, arg);
+    }
+}
+
+/**
+ * This function finds a rule of a snapshot, wherever it is kept.
+ *
+ * @param snap the snapshot
+ * @param i the index of the rule
+ *
+ * @return the rule
+ */
+static rule_t snapshot_rule(policy_snapshot_t *snap, int i) {
+
+    if (snap->image) {
+        return image_rule(&snap->image->rules[i]);
+    }
+
+    return rule_get(tree_at(snap->root, i));
+}
+
+/**
+ * This function finds the id a rule of a snapshot keeps its hit counters under.
+ *
+ * @param snap the snapshot
+ * @param i the index of the rule
+ *
+ * @return the id
+ */
+static int snapshot_rule_id(policy_snapshot_t *snap, int i) {
+
+    if (snap->image) {
+        return snap->image->id + i;
+    }
+
+    return tree_at(snap->root, i)->id;
+}
+
+/**
+ * This function copies a rule into the array passed to policy_rules().
+ *
+ * @param rule the rule
+ * @param id the id of the rule's hit counters
+ * @param pos the index of the rule
+ * @param arg the array
+ */
+static void copy_rule(rule_t *rule, int id, int pos, void *arg) {
+
+    ((rule_t *) arg)[pos] = *rule;
+}
+
+/**
+ * This function copies the hit count of a rule into the array passed to policy_hits().
+ *
+ * @param rule the rule
+ * @param id the id of the rule's hit counters
+ * @param pos the index of the rule
+ * @param arg the array
+ */
+static void copy_hits(rule_t *rule, int id, int pos, void *arg) {
+
+    ((unsigned long *) arg)[pos] = stats_rule_hits(id);
+}
+
+/**
+ * Representation of the rules of one family being copied out of a snapshot
+ * .rules: the array to be populated
+ * .n: the number of rules copied so far
+ * .v6: 1 for IPv6 rules, 0 for IPv4 rules
+ */
+typedef struct family_copy {
+    rule_t *rules;
+    unsigned int n;
+    int v6;
+} family_copy_t;
+
+/**
+ * This function copies a rule into an array if it is of the family being copied.
+ *
+ * @param rule the rule
+ * @param id the id of the rule's hit counters
+ * @param pos the index of the rule
+ * @param arg the family_copy_t
+ */
+static void copy_family(rule_t *rule, int id, int pos, void *arg) {
+
+    family_copy_t *copy = (family_copy_t *) arg;
+
+    if (PACKET_IS_V6(rule->match.value) == copy->v6) {
+        copy->rules[copy->n++] = *rule;
+    }
+}
+
+/**
+ * This function builds the index the current engine classifies the rules of one family
+ * of a snapshot with. IPv4 rules are indexed by the selected engine and IPv6 rules by
+ * prefix6.c, unless the linear scan is selected. The caller must hold policy_lock.
+ *
+ * @param snap the snapshot
+ * @param v6 1 for the IPv6 rules, 0 for the IPv4 rules
+ *
+ * @return the index, or NULL if the rules are scanned linearly (including if the
+ * engine could not build an index of them)
+ */
+static policy_index_t *index_build(policy_snapshot_t *snap, int v6) {
+
+    const engine_t *engine = v6 && policy_engine ? &prefix6_engine : policy_engine;
+    unsigned int len = v6 ? snap->len6 : snap->len - snap->len6;
+
+    if (!engine || !engine->build || len == 0
+            || (engine->max_rules && len > engine->max_rules)) {
+        return NULL;
+    }
+
+    policy_index_t *index = (policy_index_t *) malloc(sizeof(policy_index_t));
+    unsigned char *actions = engine->insert ? NULL : (unsigned char *) malloc(len);
+    rule_t *rules = (rule_t *) malloc(len * sizeof(rule_t));
+    long long start = stats_now_ns();
+    void *data = NULL;
+
+    if (index && (actions || engine->insert) && rules) {
+        family_copy_t copy = { rules, 0, v6 };
+        snapshot_walk(snap, copy_family, &copy);
+        for (unsigned int i = 0; actions && i < len; i++) {
+            actions[i] = rules[i].action;
+        }
+        data = engine->build(rules, len);
+    }
+
+    free(rules);
+
+    if (!data) {
+        free(index);
+        free(actions);
+        return NULL;
+    }
+
+    index->refs = 1;
+    index->engine = engine;
+    index->data = data;
+    index->actions = actions;
+    index->build_ns = stats_now_ns() - start;
+    index->updated = 0;
+
+    return index;
+}
+
+/**
+ * This function updates an index of IPv4 rules with a rule inserted or deleted, if its
+ * engine can. The caller must hold policy_lock.
+ *
+ * @param index the index of the current snapshot, or NULL
+ * @param rule the rule inserted, or NULL if the rule at @pos was deleted
+ * @param pos the index of the rule inserted or deleted among the IPv4 rules
+ *
+ * @return the updated index, or NULL if the new snapshot is to be indexed afresh
+ */
+static policy_index_t *index_update(policy_index_t *index, rule_t *rule,
+        unsigned int pos) {
+
+    if (!index || index->engine != policy_engine || !index->engine->insert) {
+        return NULL;
+    }
+
+    policy_index_t *next = (policy_index_t *) malloc(sizeof(policy_index_t));
+    long long start = stats_now_ns();
+
+    if (!next) {
+        return NULL;
+    }
+
+    next->data = rule ? index->engine->insert(index->data, rule, pos)
+            : index->engine->remove(index->data, pos);
+
+    if (!next->data) {
+        free(next);
+        return NULL;
+    }
+
+    next->refs = 1;
+    next->engine = index->engine;
+    next->actions = NULL;
+    next->build_ns = stats_now_ns() - start;
+    next->updated = 1;
+
+    return next;
+}
+
+/**
+ * This function adds an IPv4 rule to the filter being built (a rule_visit_t).
+ *
+ * @param rule the rule
+ * @param id the id of the rule's hit counters
+ * @param pos the index of the rule
+ * @param arg the filter, whose Bloom filter is dropped if the rule cannot be added
+ */
+static void filter_visit(rule_t *rule, int id, int pos, void *arg) {
+
+    policy_filter_t *filter = (policy_filter_t *) arg;
+
+    if (!filter->bloom || PACKET_IS_V6(rule->match.value)) {
+        return;
+    }
+
+    if (bloom_add(filter->bloom, &rule->match) == -1) {
+        bloom_free(filter->bloom);
+        filter->bloom = NULL;
+        return;
+    }
+
+    filter->added++;
+}
+
+/**
+ * This function builds the filter of a snapshot's IPv4 rules, with room for as many
+ * rules again to be inserted before it has to be rebuilt.
+ *
+ * @param snap the snapshot
+ *
+ * @return the filter, or NULL if it could not be built
+ */
+static policy_filter_t *filter_build(policy_snapshot_t *snap) {
+
+    policy_filter_t *filter = (policy_filter_t *) malloc(sizeof(policy_filter_t));
+
+    if (!filter) {
+        return NULL;
+    }
+
+    filter->refs = 1;
+    filter->bloom = bloom_new(2 * (snap->len - snap->len6));
+    filter->added = 0;
+
+    if (filter->bloom) {
+        snapshot_walk(snap, filter_visit, filter);
+    }
+
+    if (!filter->bloom) {
+        free(filter);
+        return NULL;
+    }
+
+    return filter;
+}
+
+/**
+ * This function updates the filter of the current snapshot with an IPv4 rule inserted
+ * or deleted. An inserted rule is added in place, which at worst gives readers of older
+ * snapshots a false positive. A deleted rule is left in, which gives a false positive
+ * for its packets until the filter is rebuilt. The caller must hold policy_lock.
+ *
+ * @param filter the filter of the current snapshot, or NULL
+ * @param rule the rule inserted or deleted
+ * @param deleted whether the rule was deleted rather than inserted
+ * @param live the number of IPv4 rules once the rule is inserted or deleted
+ *
+ * @return another reference to @filter, or NULL if the new snapshot is to be given a
+ * filter afresh
+ */
+static policy_filter_t *filter_update(policy_filter_t *filter, rule_t *rule,
+        int deleted, unsigned int live) {
+
+    if (!filter) {
+        return NULL;
+    }
+
+    if (deleted) {
+        return filter->added - live > live ? NULL : filter_hold(filter);
+    }
+
+    if (filter->added >= filter->bloom->capacity
+            || bloom_add(filter->bloom, &rule->match) == -1) {
+        return NULL;
+    }
+
+    __atomic_store_n(&filter->added, filter->added + 1, __ATOMIC_RELAXED);
+
+    return filter_hold(filter);
+}
+
+/**
+ * This function publishes @snap as the current policy and retires the old one. It
+ * cannot fail, so a caller that gets this far has changed the policy.
+ * The caller must hold policy_lock.
+ *
+ * @param snap the snapshot to be published
+ */
+static void snapshot_publish(policy_snapshot_t *snap) {
+
+    if (!snap->index) {
+        snap->index = index_build(snap, 0);
+    }
+
+    if (!snap->index6) {
+        snap->index6 = index_build(snap, 1);
+    }
+
+    if (!snap->filter) {
+        snap->filter = filter_build(snap);
+    }
+
+    policy_snapshot_t *old = policy;
+    policy_gen = snap->gen;
+    __atomic_store_n(&policy, snap, __ATOMIC_SEQ_CST);
+
+    if (old) {
+        rcu_retire(old, snapshot_release);
+    }
+}
+
+/**
+ * This function builds and publishes a snapshot with the current default policy.
+ * The caller must hold policy_lock.
+ *
+ * @param root the tree of rules, whose reference the snapshot takes over
+ * @param index the index of the IPv4 rules, whose reference the snapshot takes over,
+ * or NULL to build one
+ * @param index6 the index of the IPv6 rules, whose reference the snapshot takes over,
+ * or NULL to build one
+ * @param filter the filter of the IPv4 rules, whose reference the snapshot takes over,
+ * or NULL to build one
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int snapshot_replace(policy_node_t *root, policy_index_t *index,
+        policy_index_t *index6, policy_filter_t *filter) {
+
+    policy_snapshot_t *snap = snapshot_alloc(policy->def, root);
+
+    if (!snap) {
+        index_put(index);
+        index_put(index6);
+        filter_put(filter);
+        return -1;
+    }
+
+    snap->index = index;
+    snap->index6 = index6;
+    snap->filter = filter;
+    snapshot_publish(snap);
+
+    return 0;
+}
+
+/**
+ * This function builds and publishes a snapshot with one rule inserted or deleted. The
+ * index of the other family is kept, and the index of the rule's own family is updated
+ * if its engine can. The filter is kept for an IPv6 rule and updated for an IPv4 one.
+ * The caller must hold policy_lock.
+ *
+ * @param root the new tree of rules, whose reference the snapshot takes over
+ * @param rule the rule inserted or deleted
+ * @param pos the index of the rule
+ * @param deleted whether the rule was deleted rather than inserted
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int snapshot_family_replace(policy_node_t *root, rule_t *rule, unsigned int pos,
+        int deleted) {
+
+    if (PACKET_IS_V6(rule->match.value)) {
+        policy_index_t *index = policy->index;
+        return snapshot_replace(root, index && index->engine == policy_engine
+                ? index_hold(index) : NULL, NULL, filter_hold(policy->filter));
+    }
+
+    unsigned int rank = tree_family_rank(policy->root, 0, pos);
+    unsigned int live = node_size(root) - node_family(root, 1);
+    policy_index_t *index = index_update(policy->index, deleted ? NULL : rule, rank);
+    policy_filter_t *filter = filter_update(policy->filter, rule, deleted, live);
+
+    return snapshot_replace(root, index, index_hold(policy->index6), filter);
+}
+
+/**
+ * This function makes sure the current snapshot owns its rules, copying them out of
+ * its compiled image if it has one. The copy keeps the rules' ids and the generation,
+ * since it classifies every packet the same way. The caller must hold policy_lock.
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int snapshot_own() {
+
+    if (!policy->image) {
+        return 0;
+    }
+
+    unsigned int len = policy->len;
+    shared_rule_t **rules = (shared_rule_t **) malloc(
+            (len ? len : 1) * sizeof(shared_rule_t *));
+
+    if (!rules) {
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < len; i++) {
+        rule_t rule = image_rule(&policy->image->rules[i]);
+
+        //The ids are handed over once nothing can fail, so they are never released
+        //while the image still owns them
+        rules[i] = rule_make(&rule);
+
+        if (!rules[i]) {
+            //The ids still belong to the image
+            for (unsigned int j = 0; j < i; j++) {
+                rule_discard(rules[j]);
+            }
+            free(rules);
+            return -1;
+        }
+    }
+
+    policy_node_t *root;
+    policy_snapshot_t *snap = NULL;
+
+    if (tree_build(rules, len, &root) == -1) {
+        for (unsigned int i = 0; i < len; i++) {
+            rule_discard(rules[i]);
+        }
+    } else {
+        snap = snapshot_alloc(policy->def, root);
+    }
+
+    for (unsigned int i = 0; i < len && snap; i++) {
+        rules[i]->id = policy->image->id + i;
+    }
+    free(rules);
+
+    if (!snap) {
+        return -1;
+    }
+
+    snap->gen = policy->gen;
+    snap->index = index_hold(policy->index);
+    snap->filter = filter_hold(policy->filter);
+    policy->image->moved = 1;
+    snapshot_publish(snap);
+
+    return 0;
+}
+
+/**
+ * This function will initialize the dynamically allocated policy structure.
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+int policy_init() {
+
+    pthread_mutex_lock(&policy_lock);
+
+    policy_snapshot_t *snap = snapshot_alloc(ACTION_DENY, NULL);
+
+    if (snap) {
+        snapshot_publish(snap);
+    }
+
+    pthread_mutex_unlock(&policy_lock);
+
+    return snap ? 0 : -1;
+}
+
+/**
+ * This function will select whether rules are kept in the compact encoding: packed into
+ * 16 bytes around a shared wildcard template and allocated from arenas backed by huge
+ * pages. It must be called before policy_init().
+ *
+ * @param compact 1 for the compact encoding, 0 for the normal one
+ */
+void policy_set_compact(int compact) {
+
+    size_t chunk = offsetof(policy_chunk_t, match) + POLICY_CHUNK * sizeof(packed_rule_t);
+
+    policy_compact = compact;
+
+    //Only as much of a shared rule as its family needs is allocated
+    arena_init(&rule_arena, offsetof(shared_rule_t, data) + sizeof(packed_rule_t));
+    arena_init(&rule6_arena, offsetof(shared_rule_t, data)
+            + sizeof(((shared_rule_t *) NULL)->data.packed));
+    arena_init(&chunk_arena, chunk);
+    arena_init(&node_arena, sizeof(policy_node_t));
+}
+
+/**
+ * This function will free the dynamically allocated policy structure and re-initialize
+ * values as appropriate.
+ */
+void policy_free() {
+
+    pthread_mutex_lock(&policy_lock);
+
+    policy_snapshot_t *old = policy;
+    __atomic_store_n(&policy, NULL, __ATOMIC_SEQ_CST);
+
+    if (old) {
+        rcu_retire(old, snapshot_release);
+    }
+    rcu_barrier();
+
+    //No reader is left to see the rules, so their arenas are unmapped all at once
+    if (policy_compact) {
+        arena_release(&rule_arena);
+        arena_release(&rule6_arena);
+        arena_release(&chunk_arena);
+        arena_release(&node_arena);
+        templates_free();
+    }
+
+    pthread_mutex_unlock(&policy_lock);
+}
+
+/**
+ * This function will set the default policy to the specified action.
+ * The starter files includes #define's for ACTION_ALLOW and ACTION_DENY.
+ *
+ * @param action the action for the default policy to be set to
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+int policy_set_default(int action) {
+
+    if (action != ACTION_DENY && action != ACTION_ALLOW) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&policy_lock);
+
+    policy_snapshot_t *snap = NULL;
+    int ret = -1;
+
+    if (snapshot_own() == 0) {
+        snap = snapshot_alloc(action, node_hold(policy->root));
+    }
+
+    if (snap) {
+        snap->index = index_hold(policy->index);
+        snap->index6 = index_hold(policy->index6);
+        snap->filter = filter_hold(policy->filter);
+        snapshot_publish(snap);
+        ret = 0;
+    }
+
+    pthread_mutex_unlock(&policy_lock);
+
+    return ret;
+}
+
+/**
+ * This function will select the engine the policy is classified with ("linear" scans
+ * the rules in order). The current policy is re-indexed with it straight away.
+ *
+ * @param name the name of the engine
+ *
+ * @return 0 if successful, -1 if unsuccessful (including if there is no such engine)
+ */
+int policy_set_engine(char *name) {
+
+    const engine_t *engine = engine_find(name);
+
+    if (!engine) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&policy_lock);
+
+    policy_engine = engine;
+
+    policy_snapshot_t *snap = NULL;
+    int ret = -1;
+
+    //The rules are unchanged, so the generation is kept; only the index is rebuilt
+    if (snapshot_own() == 0) {
+        snap = snapshot_alloc(policy->def, node_hold(policy->root));
+    }
+
+    if (snap) {
+        snap->gen = policy->gen;
+        snap->filter = filter_hold(policy->filter);
+        snapshot_publish(snap);
+        ret = 0;
+    }
+
+    pthread_mutex_unlock(&policy_lock);
+
+    return ret;
+}
+
+/**
+ * This function will append a rule to the policy.
+ *
+ * @param rule the rule to be appended
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+int policy_append(rule_t rule) {
+
+    return policy_insert(rule, -1);
+}
+
+/**
+ * This function will append @n rules to the policy at once, publishing a single new
+ * snapshot instead of one per rule.
+ *
+ * @param rules the rules to be appended in order
+ * @param n the number of rules
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+int policy_append_rules(rule_t *rules, unsigned int n) {
+
+    shared_rule_t **added = (shared_rule_t **) malloc(
+            (n ? n : 1) * sizeof(shared_rule_t *));
+
+    if (!added) {
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < n; i++) {
+        added[i] = rule_alloc(rules[i]);
+
+        if (!added[i]) {
+            for (unsigned int j = 0; j < i; j++) {
+                rule_release(added[j]);
+            }
+            free(added);
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&policy_lock);
+
+    policy_node_t *tail = NULL;
+    policy_node_t *root = NULL;
+    int ret = -1;
+
+    if (snapshot_own() == 0 && tree_build(added, n, &tail) == 0
+            && tree_merge(policy->root, tail, &root) == 0) {
+        ret = snapshot_replace(root, NULL, NULL, NULL);
+    }
+
+    //Rules no node took (only if something failed) are still owned here
+    for (unsigned int i = 0; i < n; i++) {
+        if (added[i]->refs == 0) {
+            rule_release(added[i]);
+        }
+    }
+    node_put(tail);
+
+    pthread_mutex_unlock(&policy_lock);
+
+    free(added);
+
+    return ret;
+}
+
+/**
+ * This function publishes a compiled image as the policy.
+ *
+ * @param rules the rules of the image in order, which must stay valid until @release
+ * @param n the number of rules
+ * @param def the default policy
+ * @param release the function called once the policy no longer uses @rules
+ * @param arg the value passed to @release
+ * @param index the index of the rules, whose reference the snapshot takes over if
+ * successful, or NULL to build one
+ *
+ * @return 0 if successful, -1 if unsuccessful (in which case @release is never called
+ * and @index is still the caller's)
+ */
+static int image_publish(const image_rule_t *rules, unsigned int n, unsigned int def,
+        void (*release)(void *), void *arg, policy_index_t *index) {
+
+    if (def != ACTION_DENY && def != ACTION_ALLOW) {
+        return -1;
+    }
+
+    policy_image_t *image = (policy_image_t *) malloc(sizeof(policy_image_t));
+
+    if (!image) {
+        return -1;
+    }
+
+    image->rules = rules;
+    image->id = stats_rule_id_alloc_range(n);
+    image->moved = 0;
+    image->release = release;
+    image->arg = arg;
+
+    if (image->id == -1) {
+        free(image);
+        return -1;
+    }
+
+    pthread_mutex_lock(&policy_lock);
+
+    policy_snapshot_t *snap = snapshot_alloc(def, NULL);
+    int ret = -1;
+
+    if (snap) {
+        snap->len = n;
+        snap->image = image;
+        snap->index = index;
+
+        snapshot_publish(snap);
+        ret = 0;
+    } else {
+        for (unsigned int i = 0; i < n; i++) {
+            stats_rule_id_release(image->id + i);
+        }
+        free(image);
+    }
+
+    pthread_mutex_unlock(&policy_lock);
+
+    return ret;
+}
+
+/**
+ * This function will replace the policy with a compiled image. The image is classified
+ * against as it is; its rules are only copied out the first time the policy is changed.
+ *
+ * @param rules the rules of the image in order, which must stay valid until @release
+ * @param n the number of rules
+ * @param def the default policy
+ * @param release the function called once the policy no longer uses @rules
+ * @param arg the value passed to @release
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+int policy_load_image(const image_rule_t *rules, unsigned int n, unsigned int def,
+        void (*release)(void *), void *arg) {
+
+    return image_publish(rules, n, def, release, arg, NULL);
+}
+
+/**
+ * This function will replace the policy with a compiled image that comes with a matcher
+ * generated for its rules. Packets are classified with @match until the policy is
+ * changed, when the selected engine takes over again.
+ *
+ * @param rules the rules of the image in order, which must stay valid until @release
+ * @param n the number of rules
+ * @param def the default policy
+ * @param match the matcher, which must stay valid until @release
+ * @param release the function called once the policy uses neither @rules nor @match
+ * @param arg the value passed to @release
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+int policy_load_matcher(const image_rule_t *rules, unsigned int n, unsigned int def,
+        policy_matcher_t match, void (*release)(void *), void *arg) {
+
+    policy_compiled_t *compiled = (policy_compiled_t *) malloc(
+            sizeof(policy_compiled_t));
+    policy_index_t *index = (policy_index_t *) malloc(sizeof(policy_index_t));
+
+    if (!compiled || !index) {
+        free(compiled);
+        free(index);
+        return -1;
+    }
+
+    //Held by the image and by the index
+    compiled->refs = 2;
+    compiled->match = match;
+    compiled->release = release;
+    compiled->arg = arg;
+
+    index->refs = 1;
+    index->engine = &compiled_engine;
+    index->data = compiled;
+    index->actions = NULL;
+    index->build_ns = 0;
+    index->updated = 0;
+
+    if (image_publish(rules, n, def, compiled_put, compiled, index) == -1) {
+        free(compiled);
+        free(index);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * This function will insert a rule at position.
+ *
+ * @param rule the rule to be inserted
+ * @param pos the position to be inserted at (past the end, or -1, appends)
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+int policy_insert(rule_t rule, int pos) {
+
+    if (pos == 0 || pos < -1) {
+        return -1;
+    }
+
+    shared_rule_t *temp = rule_alloc(rule);
+
+    if (!temp) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&policy_lock);
+
+    policy_node_t *root;
+    int ret = -1;
+
+    if (snapshot_own() == 0) {
+        unsigned int len = policy->len;
+        if (pos == -1 || pos > len) {
+            pos = len + 1;
+        }
+
+        if (tree_edit(policy->root, pos - 1, temp, &root) == 0) {
+            ret = snapshot_family_replace(root, &rule, pos - 1, 0);
+        }
+    }
+
+    if (temp->refs == 0) {
+        rule_release(temp);
+    }
+
+    pthread_mutex_unlock(&policy_lock);
+
+    return ret;
+}
+
+/**
+ * This function will delete the rule at position.
+ *
+ * @param pos the position of the rule
+ *
+ * @return It returns 0 if successful, -1 if unsuccessful.
+ */
+int policy_delete(int pos) {
+
+    pthread_mutex_lock(&policy_lock);
+
+    unsigned int len = policy->len;
+    if (pos - 1 < 0 || pos - 1 >= len || snapshot_own() == -1) {
+        pthread_mutex_unlock(&policy_lock);
+        return -1;
+    }
+
+    policy_node_t *root;
+    int ret = -1;
+    rule_t rule = rule_get(tree_at(policy->root, pos - 1));
+
+    if (tree_edit(policy->root, pos - 1, NULL, &root) == 0) {
+        ret = snapshot_family_replace(root, &rule, pos - 1, 1);
+    }
+
+    pthread_mutex_unlock(&policy_lock);
+
+    return ret;
+}
+
+/**
+ * This function applies the changes of a transaction to a private copy of the tree,
+ * which no reader sees until it is published. The caller must hold policy_lock.
+ *
+ * @param edits the changes in order
+ * @param n the number of changes
+ * @param added the rules inserted by each change (NULL for other changes)
+ * @param root the value to be updated with a reference to the new tree
+ * @param def the value to be updated with the new default policy
+ * @param touched the values to be updated with whether the IPv4 (0) and IPv6 (1) rules
+ * changed
+ *
+ * @return the number of changes applied, which is @n if they all were
+ */
+static unsigned int tree_commit(const policy_edit_t *edits, unsigned int n,
+        shared_rule_t **added, policy_node_t **root, unsigned int *def, int *touched) {
+
+    policy_node_t *t = node_hold(policy->root);
+    unsigned int i;
+
+    *def = policy->def;
+    touched[0] = 0;
+    touched[1] = 0;
+
+    for (i = 0; i < n; i++) {
+        const policy_edit_t *e = &edits[i];
+        unsigned int len = node_size(t);
+        policy_node_t *next;
+        int pos = e->pos;
+
+        if (e->kind == EDIT_DEFAULT) {
+            if (e->rule.action != ACTION_DENY && e->rule.action != ACTION_ALLOW) {
+                break;
+            }
+            *def = e->rule.action;
+            continue;
+        }
+
+        if (e->kind == EDIT_INSERT) {
+            if (pos == 0 || pos < -1) {
+                break;
+            }
+            if (pos == -1 || pos > len) {
+                pos = len + 1;
+            }
+            if (tree_edit(t, pos - 1, added[i], &next) == -1) {
+                break;
+            }
+            touched[rule_is_v6(added[i])] = 1;
+        } else {
+            if (pos < 1 || pos > len) {
+                break;
+            }
+            touched[rule_is_v6(tree_at(t, pos - 1))] = 1;
+            if (tree_edit(t, pos - 1, NULL, &next) == -1) {
+                break;
+            }
+        }
+
+        //Whatever only the last copy held, rules inserted and deleted again included,
+        //was never seen by a reader, so it is freed straight away
+        node_put(t);
+        t = next;
+    }
+
+    *root = t;
+
+    return i;
+}
+
+/**
+ * This function will apply a transaction: every change in order, as one. Readers see
+ * the policy from before the transaction until it is published whole, with the indexes
+ * of the families it changed rebuilt once. If any change fails, because it deletes a
+ * rule that does not exist by then for instance, none of them are applied.
+ *
+ * @param edits the changes in order
+ * @param n the number of changes
+ * @param failed the value to be updated with the index of the change that failed, or
+ * with @n if the transaction failed as a whole
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+int policy_commit(const policy_edit_t *edits, unsigned int n, unsigned int *failed) {
+
+    shared_rule_t **added = (shared_rule_t **) calloc(n ? n : 1,
+            sizeof(shared_rule_t *));
+
+    *failed = n;
+
+    if (!added) {
+        return -1;
+    }
+
+    //Every inserted rule is pinned, so it outlives the copies of the tree it is in
+    unsigned int ready = 0;
+
+    while (ready < n && (edits[ready].kind != EDIT_INSERT
+            || (added[ready] = rule_alloc(edits[ready].rule)))) {
+        if (added[ready]) {
+            added[ready]->refs = 1;
+        }
+        ready++;
+    }
+
+    int ret = -1;
+
+    if (ready == n) {
+        pthread_mutex_lock(&policy_lock);
+
+        policy_node_t *root;
+        unsigned int def;
+        int touched[2];
+
+        if (snapshot_own() == 0) {
+            unsigned int applied = tree_commit(edits, n, added, &root, &def, touched);
+
+            if (applied < n) {
+                *failed = applied;
+                node_put(root);
+            } else {
+                policy_snapshot_t *snap = snapshot_alloc(def, root);
+                policy_index_t *index = policy->index;
+
+                //An index is only rebuilt if the rules of its family changed
+                if (snap && !touched[0]) {
+                    snap->index = index && index->engine == policy_engine
+                            ? index_hold(index) : NULL;
+                    snap->filter = filter_hold(policy->filter);
+                }
+                if (snap && !touched[1]) {
+                    snap->index6 = index_hold(policy->index6);
+                }
+
+                if (snap) {
+                    snapshot_publish(snap);
+                    ret = 0;
+                }
+            }
+        }
+
+        pthread_mutex_unlock(&policy_lock);
+    }
+
+    for (unsigned int i = 0; i < ready; i++) {
+        if (added[i] && --added[i]->refs == 0) {
+            rule_release(added[i]);
+        }
+    }
+    free(added);
+
+    return ret;
+}
+
+/**
+ * This function finds the first rule of an image-backed snapshot matching @pkt,
+ * comparing the packed fields of the image directly.
+ *
+ * @param snap the snapshot being tested against
+ * @param pkt the packet being tested
+ * @param pos the value to be updated with the index of the matched rule, or -1
+ *
+ * @return the action for the packet
+ */
+static int classify_image(policy_snapshot_t *snap, packet_t *pkt, int *pos) {
+
+    const image_rule_t *rules = snap->image->rules;
+    uint32_t src = PACKET_SRC_IP(*pkt);
+    uint32_t dst = PACKET_DST_IP(*pkt);
+    protocol_t protocol = PACKET_PROTOCOL(*pkt);
+    port_match_t src_port = PACKET_SRC_PORT(*pkt);
+    port_match_t dst_port = PACKET_DST_PORT(*pkt);
+
+    for (int i = 0; i < snap->len; i++) {
+        const image_rule_t *r = &rules[i];
+
+        if (r->src_ip == src && r->dst_ip == dst && r->protocol == protocol
+                && (r->src_port == MATCH_PORT_ANY || r->src_port == src_port)
+                && (r->dst_port == MATCH_PORT_ANY || r->dst_port == dst_port)) {
+            *pos = i;
+            flow_cache_insert(pkt, snap->gen, r->action, i);
+            return r->action;
+        }
+    }
+
+    *pos = -1;
+    flow_cache_insert(pkt, snap->gen, snap->def, -1);
+    return snap->def;
+}
+
+/**
+ * This function finds the first rule of a tree matching @pkt.
+ *
+ * @param t the tree
+ * @param pkt the packet being tested
+ * @param pos the index of the first rule of the tree, updated past every rule that
+ * does not match
+ *
+ * @return the matched rule, or NULL
+ */
+static shared_rule_t *tree_match(policy_node_t *t, packet_t *pkt, int *pos) {
+
+    while (t) {
+        shared_rule_t *rule = tree_match(t->left, pkt, pos);
+
+        if (rule) {
+            return rule;
+        }
+
+        policy_chunk_t *c = t->chunk;
+        for (unsigned int i = 0; i < c->count && !policy_compact; i++) {
+            if (packet_match(&c->match.full[i].match, pkt) == 1 && (!PACKET_IS_V6(*pkt)
+                    || packet_match6(&c->rules[i]->data.full.match6, PACKET_V6(pkt)))) {
+                return c->rules[i];
+            }
+            (*pos)++;
+        }
+
+        for (unsigned int i = 0; i < c->count && policy_compact; i++) {
+            if (packed_match(&c->match.packed[i], c->rules[i], pkt)) {
+                return c->rules[i];
+            }
+            (*pos)++;
+        }
+
+        t = t->right;
+    }
+
+    return NULL;
+}
+
+/**
+ * This function finds the first rule of @snap matching @pkt with the index of the
+ * rules of the packet's family.
+ *
+ * @param snap the snapshot being tested against
+ * @param index the index of the rules of the packet's family
+ * @param v6 1 if the packet is IPv6, 0 if it is IPv4
+ * @param pkt the packet being tested
+ * @param pos the value to be updated with the index of the matched rule, or -1
+ *
+ * @return the action for the packet
+ */
+static int classify_index(policy_snapshot_t *snap, policy_index_t *index, int v6,
+        packet_t *pkt, int *pos) {
+
+    int rank = index->engine->lookup(index->data, pkt);
+
+    if (rank == -1) {
+        *pos = -1;
+        return snap->def;
+    }
+
+    //Indexes number the rules of their own family, which are all of them for an image
+    *pos = snap->len6 ? (int) tree_family_at(snap->root, v6, rank) : rank;
+
+    return index->actions ? index->actions[rank] : snapshot_rule(snap, *pos).action;
+}
+
+/**
+ * This function finds the first IPv4 rule of @snap matching @pkt with the index, the
+ * image or the scan, and caches the result in the calling thread's flow cache.
+ *
+ * @param snap the snapshot being tested against
+ * @param pkt the packet being tested
+ * @param pos the value to be updated with the index of the matched rule, or -1
+ *
+ * @return the action for the packet
+ */
+static int classify_rules(policy_snapshot_t *snap, packet_t *pkt, int *pos) {
+
+    int action;
+
+    if (snap->index) {
+        action = classify_index(snap, snap->index, 0, pkt, pos);
+        flow_cache_insert(pkt, snap->gen, action, *pos);
+        return action;
+    }
+
+    if (snap->image) {
+        return classify_image(snap, pkt, pos);
+    }
+
+    *pos = 0;
+    shared_rule_t *rule = tree_match(snap->root, pkt, pos);
+
+    if (rule) {
+        action = rule_action(rule);
+        flow_cache_insert(pkt, snap->gen, action, *pos);
+        return action;
+    }
+
+    //No rule is matched
+    *pos = -1;
+    flow_cache_insert(pkt, snap->gen, snap->def, -1);
+    return snap->def;
+}
+
+/**
+ * This function finds the first rule of @snap matching @pkt, using the calling
+ * thread's flow cache when it already knows the answer and the filter when it knows
+ * no rule matches. The flow cache and the filter only key IPv4 packets, so IPv6
+ * packets always go to the index or the scan.
+ *
+ * @param snap the snapshot being tested against
+ * @param pkt the packet being tested
+ * @param pos the value to be updated with the index of the matched rule, or -1
+ *
+ * @return the action for the packet
+ */
+static int classify(policy_snapshot_t *snap, packet_t *pkt, int *pos) {
+
+    int action;
+
+    if (PACKET_IS_V6(*pkt)) {
+        if (snap->index6) {
+            return classify_index(snap, snap->index6, 1, pkt, pos);
+        }
+
+        *pos = 0;
+        shared_rule_t *rule = snap->len6 ? tree_match(snap->root, pkt, pos) : NULL;
+
+        if (rule) {
+            return rule_action(rule);
+        }
+
+        *pos = -1;
+        return snap->def;
+    }
+
+    if (flow_cache_lookup(pkt, snap->gen, &action, pos)) {
+        return action;
+    }
+
+    if (!snap->filter) {
+        return classify_rules(snap, pkt, pos);
+    }
+
+    if (!bloom_test(snap->filter->bloom, pkt)) {
+        stats_filter_count(0, 0);
+        *pos = -1;
+        flow_cache_insert(pkt, snap->gen, snap->def, -1);
+        return snap->def;
+    }
+
+    action = classify_rules(snap, pkt, pos);
+    stats_filter_count(1, *pos != -1);
+
+    return action;
+}
+
+/**
+ * This function will copy the current rules out of the policy.
+ *
+ * @param rules the value to be updated with the dynamically allocated copy of the rules
+ * @param def the value to be updated with the default policy
+ * @param gen the value to be updated with the generation the copy was taken at
+ *
+ * @return the number of rules, or -1 if unsuccessful
+ */
+int policy_rules(rule_t **rules, unsigned int *def, unsigned long *gen) {
+
+    if (rcu_read_lock() == -1) {
+        return -1;
+    }
+
+    policy_snapshot_t *snap = __atomic_load_n(&policy, __ATOMIC_SEQ_CST);
+    int len = snap->len;
+
+    *rules = (rule_t *) malloc((len ? len : 1) * sizeof(rule_t));
+
+    if (*rules) {
+        snapshot_walk(snap, copy_rule, *rules);
+        *def = snap->def;
+        *gen = snap->gen;
+    } else {
+        len = -1;
+    }
+
+    rcu_read_unlock();
+
+    return len;
+}
+
+/**
+ * This function will copy the number of packets each current rule has matched.
+ *
+ * @param gen the generation the counts are wanted at
+ * @param hits the array (one per rule) to be populated
+ * @param n the number of rules @hits has room for
+ *
+ * @return 0 if successful, -1 if unsuccessful (including if the policy has changed
+ * since @gen)
+ */
+int policy_hits(unsigned long gen, unsigned long *hits, unsigned int n) {
+
+    if (rcu_read_lock() == -1) {
+        return -1;
+    }
+
+    policy_snapshot_t *snap = __atomic_load_n(&policy, __ATOMIC_SEQ_CST);
+    int ret = -1;
+
+    if (snap->gen == gen && snap->len <= n) {
+        snapshot_walk(snap, copy_hits, hits);
+        ret = 0;
+    }
+
+    rcu_read_unlock();
+
+    return ret;
+}
+
+/**
+ * This function will replace the rules of the policy with a selection of its current
+ * rules in a new order. Rules keep their identity (and hit counters).
+ *
+ * @param gen the generation the selection was computed against
+ * @param order the indexes (from 0) of the rules to keep, in their new order
+ * @param n the number of indexes
+ *
+ * @return 0 if successful, -1 if unsuccessful (including if the policy has changed
+ * since @gen)
+ */
+int policy_select(unsigned long gen, int *order, unsigned int n) {
+
+    pthread_mutex_lock(&policy_lock);
+
+    if (policy->gen != gen || snapshot_own() == -1) {
+        pthread_mutex_unlock(&policy_lock);
+        return -1;
+    }
+
+    unsigned int len = policy->len;
+    shared_rule_t **all = (shared_rule_t **) malloc(
+            (len ? len : 1) * sizeof(shared_rule_t *));
+    shared_rule_t **kept = (shared_rule_t **) malloc(
+            (n ? n : 1) * sizeof(shared_rule_t *));
+    policy_node_t *root;
+    int ret = -1;
+
+    if (all && kept) {
+        tree_collect(policy->root, all);
+        for (unsigned int i = 0; i < n; i++) {
+            kept[i] = all[order[i]];
+        }
+
+        if (tree_build(kept, n, &root) == 0) {
+            ret = snapshot_replace(root, NULL, NULL, NULL);
+        }
+    }
+
+    pthread_mutex_unlock(&policy_lock);
+
+    free(all);
+    free(kept);
+
+    return ret;
+}
+
+/**
+ * This function records the talkers of a classified packet: its source address, and
+ * its protocol and source port.
+ *
+ * @param pkt the packet
+ * @param action the action it was given
+ */
+static void talker_count(const packet_t *pkt, int action) {
+
+    sketch_key_t keys[STATS_TALKER_KINDS];
+
+    if (PACKET_IS_V6(*pkt)) {
+        keys[STATS_TALKER_ADDR].w[0] = PACKET_V6(pkt)->src.w[0];
+        keys[STATS_TALKER_ADDR].w[1] = PACKET_V6(pkt)->src.w[1];
+    } else {
+        keys[STATS_TALKER_ADDR].w[0] = 0;
+        keys[STATS_TALKER_ADDR].w[1] = TALKER_V4_MAPPED | PACKET_SRC_IP(*pkt);
+    }
+
+    keys[STATS_TALKER_PORT].w[0] = 0;
+    keys[STATS_TALKER_PORT].w[1] = (uint64_t) PACKET_PROTOCOL(*pkt) << TALKER_PROTOCOL_SHIFT
+            | PACKET_SRC_PORT(*pkt);
+
+    stats_talker_count(action, keys);
+}
+
+/**
+ * This function will test if @pkt is allowed or denied by the policy.
+ * It returns ACTION_ALLOW or ACTION_DENY.
+ * Additionally the value pointed to by @pos will be updated with the position
+ * number of the rule that is matched.
+ * If no rule is matched, the value will be set to -1.
+ * It may be called from any number of threads while the policy is being changed.
+ *
+ * @param pkt the packet being tested, which for an IPv6 packet is the .key of its
+ * packet6_t
+ * @param pos the position containing the value to be updated position of the rule that is matches
+ *
+ * @return It returns 0 if successful, -1 if unsuccessful.
  */
+int policy_test(packet_t *pkt, int *pos) {
 
-#include <stdio.h>
-#include <stdlib.h>
-#include "policy.h"
+    long long start = stats_now_ns();
 
-/** Array of pointers to dynamically allocated firewall rules. */
-static rule_t **policy;
+    if (rcu_read_lock() == -1) {
+        *pos = -1;
+        return -1;
+    }
 
-/** Size of the array of pointers */
-static unsigned int policy_len;
+    policy_snapshot_t *snap = __atomic_load_n(&policy, __ATOMIC_SEQ_CST);
+    int action = classify(snap, pkt, pos);
 
-/** Capacity of the array of pointers */
-static unsigned int policy_cap;
+    stats_count(*pos == -1 ? STATS_DEFAULT : snapshot_rule_id(snap, *pos),
+            stats_now_ns() - start);
+    talker_count(pkt, action);
 
-/** Default policy */
-static unsigned int policy_default;
+    rcu_read_unlock();
+
+    return action;
+}
 
 /**
- * This function will initialize the dynamically allocated policy structure.
+ * This function writes a string without its terminating null.
  *
- * @return 0 if successful, -1 if unsuccessful
+ * @param p where to write
+ * @param str the string
+ *
+ * @return the end of what was written
  */
-int policy_init() {
-
-    policy_len = 0;
-    policy_cap = POLICY_INIT_SIZE;
-    policy_default = ACTION_DENY;
-    policy = (rule_t **) malloc(policy_cap * sizeof(rule_t*));
-
-    if (policy) {
-
-        for (int i = 0; i < policy_cap; i++) {
-            policy[i] = NULL;
-        }
+static char *text_put(char *p, const char *str) {
 
-        return 0;
+    while (*str) {
+        *p++ = *str++;
     }
 
-    return -1;
+    return p;
 }
 
 /**
- * This function will free the dynamically allocated policy structure and re-initialize
- * values as appropriate.
+ * This function writes a packed address as four octets followed by a colon.
+ *
+ * @param p where to write
+ * @param ip the packed address
+ *
+ * @return the end of what was written
  */
-void policy_free() {
+static char *ipaddr_put(char *p, uint32_t ip) {
 
-    for (int i = 0; i < policy_len; i++) {
-        free(policy[i]);
-    }
-    free(policy);
+    p += ipv4_format(ip, p);
+    *p++ = ':';
+
+    return p;
 }
 
 /**
- * This function will set the default policy to the specified action.
- * The starter files includes #define's for ACTION_ALLOW and ACTION_DENY.
+ * This function writes an IPv6 prefix in brackets followed by a colon, leaving out the
+ * length of a single address.
  *
- * @param action the action for the default policy to be set to
+ * @param p where to write
+ * @param addr the address
+ * @param mask the mask of the prefix
  *
- * @return 0 if successful, -1 if unsuccessful
+ * @return the end of what was written
  */
-int policy_set_default(int action) {
+static char *ipv6_put(char *p, const ipv6_t *addr, const ipv6_t *mask) {
 
-    if (action == ACTION_DENY || action == ACTION_ALLOW) {
-        policy_default = action;
-        return 0;
+    int len = ipv6_prefix_len(mask);
+
+    *p++ = '[';
+    ipv6_format(addr, p);
+    p += strlen(p);
+
+    if (len != IPV6_BITS) {
+        *p++ = '/';
+        p += uint_format(len, p);
     }
 
-    return -1;
+    return text_put(p, "]:");
 }
 
 /**
- * This function will append a rule to the policy.
+ * This function writes a rule in the command language, without its position.
  *
- * @param rule the rule to be appended
+ * @param rule the rule
+ * @param text the buffer to be written to (RULE_TEXT_SIZE long)
  *
- * @return 0 if successful, -1 if unsuccessful
+ * @return the number of characters written, not counting the terminating null
  */
-int policy_append(rule_t rule) {
+int rule_format(rule_t *rule, char *text) {
 
-    //TODO Need to check if meets capacity and reallocate
-    if (policy_len >= policy_cap) {
-        policy_cap *= 2;
-        policy = (rule_t **) realloc(policy, policy_cap * sizeof(rule_t *));
+    char *p = text;
+    int v6 = PACKET_IS_V6(rule->match.value);
 
-        if (policy) {
-            for (int i = policy_cap / 2; i < policy_cap; i++) {
-                policy[i] = NULL;
-            }
-        } else {
-            return -1;
-        }
+    p = text_put(p, rule->action == ACTION_DENY ? "deny " : "allow ");
+    p = text_put(p, PACKET_PROTOCOL(rule->match.value) == PROTO_UDP ? "udp " : "tcp ");
+
+    if (v6) {
+        p = ipv6_put(p, &rule->match6.src, &rule->match6.src_mask);
+    } else {
+        p = ipaddr_put(p, PACKET_SRC_IP(rule->match.value));
     }
 
-    rule_t *temp = (rule_t *) malloc(sizeof(rule_t));
-    temp->action = rule.action;
-    temp->match.protocol = rule.match.protocol;
-    temp->match.src_ip = rule.match.src_ip;
-    temp->match.src_port = rule.match.src_port;
-    temp->match.dst_ip = rule.match.dst_ip;
-    temp->match.dst_port = rule.match.dst_port;
+    if (MATCH_SRC_PORT(rule->match) == MATCH_PORT_ANY) {
+        p = text_put(p, "* ");
+    } else {
+        p += uint_format(MATCH_SRC_PORT(rule->match), p);
+        *p++ = ' ';
+    }
 
-    policy[policy_len] = temp;
-    policy_len++;
+    if (v6) {
+        p = ipv6_put(p, &rule->match6.dst, &rule->match6.dst_mask);
+    } else {
+        p = ipaddr_put(p, PACKET_DST_IP(rule->match.value));
+    }
 
-    return 0;
+    if (MATCH_DST_PORT(rule->match) == MATCH_PORT_ANY) {
+        p = text_put(p, "*\n");
+    } else {
+        p += uint_format(MATCH_DST_PORT(rule->match), p);
+        p = text_put(p, " \n");
+    }
+
+    *p = '\0';
+
+    return p - text;
 }
 
 /**
- * This function will insert a rule at position.
+ * This function writes a rule in the command language after its position.
  *
- * @param rule the rule to be inserted
- * @param pos the position to be inserted at
+ * @param pos the position shown for the rule
+ * @param rule the rule
+ * @param text the buffer to be written to (RULE_TEXT_SIZE long)
  *
- * @return 0 if successful, -1 if unsuccessful
+ * @return the number of characters written, not counting the terminating null
  */
-int policy_insert(rule_t rule, int pos) {
+static int format_rule(int pos, rule_t *rule, char *text) {
 
-    if (policy_len >= policy_cap) {
-        policy_cap *= 2;
-        policy = (rule_t **) realloc(policy, policy_cap * sizeof(rule_t *));
+    char *p = text;
 
-        if (policy) {
-            for (int i = policy_cap / 2; i < policy_cap; i++) {
-                policy[i] = NULL;
-            }
-        } else {
-            return -1;
-        }
-    }
+    *p++ = '[';
+    p += uint_format(pos, p);
+    p = text_put(p, "] ");
 
-    if (pos > policy_len) {
-        policy_append(rule);
-    } else {
-        //Shifts all the entries in the array
-        for (int i = policy_len; i > pos - 1; i--) {
-            policy[i] = policy[i - 1];
-        }
+    return p - text + rule_format(rule, p);
+}
 
-        rule_t *temp = (rule_t *) malloc(sizeof(rule_t));
-        temp->action = rule.action;
-        temp->match.protocol = rule.match.protocol;
-        temp->match.src_ip = rule.match.src_ip;
-        temp->match.src_port = rule.match.src_port;
-        temp->match.dst_ip = rule.match.dst_ip;
-        temp->match.dst_port = rule.match.dst_port;
+/**
+ * This function prints a single rule in the command language, without its position.
+ *
+ * @param stream the file stream to print to
+ * @param rule the rule to be printed
+ */
+void rule_print(FILE *stream, rule_t *rule) {
 
-        policy[pos - 1] = temp;
-        policy_len++;
-    }
+    char text[RULE_TEXT_SIZE];
 
-    return 0;
+    fwrite(text, 1, rule_format(rule, text), stream);
 }
 
 /**
- * This function will delete the rule at position.
- *
- * @param pos the position of the rule
+ * This function prints a single rule in the command language.
  *
- * @return It returns 0 if successful, -1 if unsuccessful.
+ * @param stream the file stream to print to
+ * @param pos the position shown for the rule
+ * @param rule the rule to be printed
  */
-int policy_delete(int pos) {
+static void print_rule(FILE *stream, int pos, rule_t *rule) {
 
-    if (pos - 1 < 0 || pos - 1 >= policy_len) {
-        return -1;
-    }
+    char text[RULE_TEXT_SIZE];
 
-    if (policy[pos - 1] == NULL) {
-        return -1;
-    }
+    fwrite(text, 1, format_rule(pos, rule, text), stream);
+}
 
-    rule_t *temp = policy[pos - 1];
-    free(temp);
+/**
+ * This function prints a rule with its position, for policy_print().
+ *
+ * @param rule the rule
+ * @param id the id of the rule's hit counters
+ * @param pos the index of the rule
+ * @param arg the file stream to print to
+ */
+static void print_visit(rule_t *rule, int id, int pos, void *arg) {
 
-    //Shift everything
-    for (int i = pos - 1; i < policy_len; i++) {
-        policy[i] = policy[i + 1];
-    }
+    print_rule((FILE *) arg, pos + 1, rule);
+}
+
+/**
+ * This function prints a rule with its position and hits, for policy_print_counts().
+ *
+ * @param rule the rule
+ * @param id the id of the rule's hit counters
+ * @param pos the index of the rule
+ * @param arg the file stream to print to
+ */
+static void print_counts_visit(rule_t *rule, int id, int pos, void *arg) {
 
-    policy[policy_len - 1] = NULL;
-    policy_len--;
+    FILE *stream = (FILE *) arg;
 
-    return 0;
+    fprintf(stream, "[%d] hits=%lu ", pos + 1, stats_rule_hits(id));
+    rule_print(stream, rule);
 }
 
 /**
- * This function will test if @pkt is allowed or denied by the policy.
- * It returns ACTION_ALLOW or ACTION_DENY.
- * Additionally the value pointed to by @pos will be updated with the position
- * number of the rule that is matched.
- * If no rule is matched, the value will be set to -1.
+ * This function writes the rule at position @pos in the command language after its
+ * position, as policy_print_rule() prints it.
  *
- * @param pkt the packet being tested
- * @param pos the position containing the value to be updated position of the rule that is matches
+ * @param pos the position of the rule (from 1)
+ * @param text the buffer to be written to (RULE_TEXT_SIZE long)
  *
- * @return It returns 0 if successful, -1 if unsuccessful.
+ * @return the number of characters written, or -1 if @pos does not exist
  */
-int policy_test(packet_t pkt, int *pos) {
+int policy_format_rule(int pos, char *text) {
 
-    for (int i = 0; i < policy_cap; i++) {
-        if (policy[i] && packet_match(policy[i]->match, pkt) == 1) {
-            *pos = i;
-            return policy[i]->action;
-        }
+    if (rcu_read_lock() == -1) {
+        return -1;
     }
 
-    //No rule is matched
-    *pos = -1;
-    return policy_default;
+    policy_snapshot_t *snap = __atomic_load_n(&policy, __ATOMIC_SEQ_CST);
+    int len = -1;
+
+    if (pos - 1 >= 0 && pos - 1 < snap->len) {
+        rule_t rule = snapshot_rule(snap, pos - 1);
+        len = format_rule(pos, &rule, text);
+    }
+
+    rcu_read_unlock();
+
+    return len;
 }
 
 /**
@@ -227,109 +3168,405 @@ int policy_test(packet_t pkt, int *pos) {
  */
 int policy_print_rule(FILE *stream, int pos) {
 
-    if (pos - 1 < 0 || pos - 1 >= policy_len) {
+    if (rcu_read_lock() == -1) {
         return -1;
     }
 
-    if (!policy[pos - 1]) {
-        return -1;
+    policy_snapshot_t *snap = __atomic_load_n(&policy, __ATOMIC_SEQ_CST);
+    int ret = -1;
+
+    if (pos - 1 >= 0 && pos - 1 < snap->len) {
+        rule_t rule = snapshot_rule(snap, pos - 1);
+        print_rule(stream, pos, &rule);
+        ret = 0;
     }
 
-    fprintf(stream, "[%d] ", pos);
+    rcu_read_unlock();
 
-    if (policy[pos - 1]->action == ACTION_DENY) {
-        fprintf(stream, "deny ");
-    } else {
-        fprintf(stream, "allow ");
+    return ret;
+}
+
+/**
+ * This function will print the default policy followed by the policy rules in order to @stream.
+ *
+ * @param stream the file stream to print to
+ */
+void policy_print(FILE *stream) {
+
+    if (rcu_read_lock() == -1) {
+        return;
     }
 
-    if (policy[pos - 1]->match.protocol == PROTO_UDP) {
-        fprintf(stream, "udp ");
+    policy_snapshot_t *snap = __atomic_load_n(&policy, __ATOMIC_SEQ_CST);
+
+    fprintf(stream, "default ");
+
+    if (snap->def == ACTION_DENY) {
+        fprintf(stream, "deny\n");
     } else {
-        fprintf(stream, "tcp ");
+        fprintf(stream, "allow\n");
+    }
+
+    snapshot_walk(snap, print_visit, stream);
+
+    rcu_read_unlock();
+}
+
+/**
+ * This function will print the default policy followed by the policy rules in order to
+ * @stream, each with the number of packets it has matched.
+ *
+ * @param stream the file stream to print to
+ */
+void policy_print_counts(FILE *stream) {
+
+    if (rcu_read_lock() == -1) {
+        return;
+    }
+
+    policy_snapshot_t *snap = __atomic_load_n(&policy, __ATOMIC_SEQ_CST);
+
+    fprintf(stream, "default %s hits=%lu\n",
+            snap->def == ACTION_DENY ? "deny" : "allow",
+            stats_rule_hits(STATS_DEFAULT));
+
+    snapshot_walk(snap, print_counts_visit, stream);
+
+    rcu_read_unlock();
+}
+
+/**
+ * This function counts the nodes of a tree, which is also the number of its chunks.
+ *
+ * @param t the tree, or NULL
+ *
+ * @return the number of nodes
+ */
+static unsigned long tree_nodes(policy_node_t *t) {
+
+    unsigned long n = 0;
+
+    while (t) {
+        n += 1 + tree_nodes(t->left);
+        t = t->right;
+    }
+
+    return n;
+}
+
+/**
+ * This function finds how many bytes malloc() sets aside for a request, counting its
+ * own header and rounding.
+ *
+ * @param size the number of bytes requested
+ *
+ * @return the number of bytes set aside
+ */
+static size_t malloc_block(size_t size) {
+
+    size_t block = (size + MALLOC_HEADER + MALLOC_ALIGN - 1) & ~(size_t) (MALLOC_ALIGN - 1);
+
+    return block < MALLOC_MIN ? MALLOC_MIN : block;
+}
+
+/**
+ * This function finds the memory arenas have handed out beyond the objects still in
+ * use: region headers, objects freed and the tails of full regions.
+ *
+ * @param arenas the arenas
+ * @param n the number of arenas
+ * @param ahead the value to be updated with the number of bytes mapped that no object
+ * has been cut from yet
+ *
+ * @return the number of bytes handed out beyond the objects in use
+ */
+static size_t arena_overhead(arena_t **arenas, int n, size_t *ahead) {
+
+    size_t mapped = 0;
+    size_t used = 0;
+
+    *ahead = 0;
+
+    for (int i = 0; i < n; i++) {
+        mapped += arenas[i]->count * ARENA_REGION;
+        used += arenas[i]->live * arenas[i]->size;
+        *ahead += arenas[i]->end - arenas[i]->next;
     }
 
-    fprintf(stream, "%d.", policy[pos - 1]->match.src_ip.a);
-    fprintf(stream, "%d.", policy[pos - 1]->match.src_ip.b);
-    fprintf(stream, "%d.", policy[pos - 1]->match.src_ip.c);
-    fprintf(stream, "%d:", policy[pos - 1]->match.src_ip.d);
+    return mapped - *ahead - used;
+}
+
+/**
+ * This function will print the memory the current policy takes up: the bytes each rule
+ * costs in its record, its copy in a chunk and its pointer slot, the chunks and tree
+ * nodes holding them, the allocator's own overhead, and the filter and hit counters.
+ *
+ * @param stream the file stream to print to
+ */
+void policy_print_memory(FILE *stream) {
 
-    if (policy[pos - 1]->match.src_port == MATCH_PORT_ANY) {
-        fprintf(stream, "* ");
+    //The arenas are only touched by the writer, so hold off changes while reading them
+    pthread_mutex_lock(&policy_lock);
+
+    policy_snapshot_t *snap = policy;
+    unsigned long len = snap->len;
+    unsigned long len6 = snap->len6;
+    unsigned long nodes = snap->image ? 0 : tree_nodes(snap->root);
+    size_t rule_size = policy_compact ? rule_arena.size : RULE_FULL_SIZE;
+    size_t rule6_size = policy_compact ? rule6_arena.size : RULE6_FULL_SIZE;
+    size_t copy_size = policy_compact ? sizeof(packed_rule_t) : sizeof(full_rule_t);
+    size_t chunk_size = policy_compact ? chunk_arena.size : sizeof(policy_chunk_t);
+    size_t node_size = policy_compact ? node_arena.size : sizeof(policy_node_t);
+    size_t records, copies, slots, slack, tree, templates = 0, overhead, filter = 0;
+
+    fprintf(stream, "Rules: %lu (%lu IPv4, %lu IPv6), %s encoding\n", len, len - len6,
+            len6, policy_compact ? "compact" : "normal");
+
+    if (snap->image) {
+        records = len * sizeof(image_rule_t);
+        copies = slots = slack = tree = overhead = 0;
+        fprintf(stream, "  Rule records: %zu bytes (%zu per rule, in a compiled image)\n",
+                records, sizeof(image_rule_t));
     } else {
-        fprintf(stream, "%d ", policy[pos - 1]->match.src_port);
+        records = (len - len6) * rule_size + len6 * rule6_size;
+        copies = len * copy_size;
+        slots = len * sizeof(shared_rule_t *);
+        slack = nodes * chunk_size - copies - slots;
+        tree = nodes * node_size;
+
+        fprintf(stream, "  Rule records: %zu bytes (%zu per IPv4 rule, %zu per IPv6 "
+                "rule)\n", records, rule_size, rule6_size);
+        fprintf(stream, "  Chunk copies: %zu bytes (%zu per rule)\n", copies, copy_size);
+        fprintf(stream, "  Pointer slots: %zu bytes (%zu per rule)\n", slots,
+                sizeof(shared_rule_t *));
+        fprintf(stream, "  Chunk slack: %zu bytes (%lu unused slots in %lu chunks)\n",
+                slack, nodes * POLICY_CHUNK - len, nodes);
+        fprintf(stream, "  Tree nodes: %zu bytes (%lu nodes)\n", tree, nodes);
     }
 
-    fprintf(stream, "%d.", policy[pos - 1]->match.dst_ip.a);
-    fprintf(stream, "%d.", policy[pos - 1]->match.dst_ip.b);
-    fprintf(stream, "%d.", policy[pos - 1]->match.dst_ip.c);
-    fprintf(stream, "%d:", policy[pos - 1]->match.dst_ip.d);
+    if (policy_compact) {
+        arena_t *arenas[] = { &rule_arena, &rule6_arena, &chunk_arena, &node_arena };
+        unsigned long regions = 0, huge = 0;
 
-    if (policy[pos - 1]->match.dst_port == MATCH_PORT_ANY) {
-        fprintf(stream, "*\n");
+        for (unsigned int i = 0; i < sizeof(arenas) / sizeof(arenas[0]); i++) {
+            regions += arenas[i]->count;
+            huge += arenas[i]->huge;
+        }
+
+        templates = template_cap * sizeof(unsigned int);
+        for (unsigned int page = 0; page < TEMPLATE_PAGES && template_pages[page]; page++) {
+            templates += TEMPLATE_PAGE * sizeof(template_t);
+        }
+
+        size_t ahead;
+        overhead = arena_overhead(arenas, sizeof(arenas) / sizeof(arenas[0]), &ahead);
+        fprintf(stream, "  Templates: %zu bytes (%u masks shared by the rules)\n",
+                templates, template_count);
+        fprintf(stream, "  Allocator overhead: %zu bytes (%lu regions of %lu kB, %lu on "
+                "reserved huge pages, %zu kB mapped ahead of use)\n", overhead, regions,
+                ARENA_REGION >> KB_SHIFT, huge, ahead >> KB_SHIFT);
+    } else if (!snap->image) {
+        overhead = (len - len6) * (malloc_block(rule_size) - rule_size)
+                + len6 * (malloc_block(rule6_size) - rule6_size)
+                + nodes * (malloc_block(chunk_size) - chunk_size)
+                + nodes * (malloc_block(node_size) - node_size);
+        fprintf(stream, "  Allocator overhead: %zu bytes (%lu allocations)\n", overhead,
+                len + 2 * nodes);
+    }
+
+    if (snap->filter && snap->filter->bloom) {
+        filter = sizeof(policy_filter_t) + sizeof(bloom_t)
+                + (snap->filter->bloom->mask + 1) * sizeof(uint64_t);
+    }
+
+    size_t counters = stats_memory();
+    size_t total = records + copies + slots + slack + tree + templates + overhead + filter
+            + counters;
+
+    fprintf(stream, "  Filter: %zu bytes\n", filter);
+    fprintf(stream, "  Hit counters: %zu bytes\n", counters);
+
+    if (len) {
+        fprintf(stream, "Total: %zu bytes (%.1f bytes per rule)\n", total,
+                (double) total / len);
     } else {
-        fprintf(stream, "%d \n", policy[pos - 1]->match.dst_port);
+        fprintf(stream, "Total: %zu bytes\n", total);
     }
 
-    return 0;
+    pthread_mutex_unlock(&policy_lock);
 }
 
 /**
- * This function will print the default policy followed by the policy rules in order to @stream.
+ * This function finds how many bytes the policy has mapped straight from the system
+ * for the arenas of the compact encoding, which the heap does not account for.
  *
- * @param stream the file stream to print to
+ * @return the number of bytes
  */
-void policy_print(FILE *stream) {
+size_t policy_mapped() {
 
-    fprintf(stream, "default ");
+    arena_t *arenas[] = { &rule_arena, &rule6_arena, &chunk_arena, &node_arena };
+    size_t mapped = 0;
 
-    if (policy_default == ACTION_DENY) {
-        fprintf(stream, "deny\n");
+    pthread_mutex_lock(&policy_lock);
+
+    for (unsigned int i = 0; i < sizeof(arenas) / sizeof(arenas[0]); i++) {
+        mapped += arenas[i]->count * ARENA_REGION;
+    }
+
+    pthread_mutex_unlock(&policy_lock);
+
+    return mapped;
+}
+
+/**
+ * This function writes the text of a talker key.
+ *
+ * @param key the key
+ * @param kind STATS_TALKER_ADDR or STATS_TALKER_PORT
+ * @param text the buffer to be written to (IPV6_TEXT_SIZE long)
+ */
+static void talker_format(const sketch_key_t *key, int kind, char *text) {
+
+    if (kind == STATS_TALKER_PORT) {
+        int protocol = key->w[1] >> TALKER_PROTOCOL_SHIFT;
+
+        sprintf(text, "%u/%s", (unsigned int) (key->w[1] & PORT_MAX),
+                protocol == PROTO_UDP ? "udp" : "tcp");
+    } else if (key->w[0] == 0 && (key->w[1] & ~(uint64_t) UINT32_MAX) == TALKER_V4_MAPPED) {
+        ipv4_format((uint32_t) key->w[1], text);
     } else {
-        fprintf(stream, "allow\n");
+        ipv6_t addr;
+
+        addr.w[0] = key->w[0];
+        addr.w[1] = key->w[1];
+        ipv6_format(&addr, text);
     }
+}
+
+/**
+ * This function will print the heaviest talkers of each verdict: the source addresses,
+ * and the source ports, that sent the most of the packets allowed and of those denied.
+ * Counts come from sketches and may be overestimated, never underestimated.
+ *
+ * @param stream the file stream to print to
+ * @param n the number of talkers of each kind, or 0 for the default
+ */
+void policy_print_top(FILE *stream, int n) {
 
-    int pos = 1;
-    for (int i = 0; i < policy_cap; i++) {
+    stats_talker_t top[SKETCH_CANDIDATES];
 
-        if (policy[i]) {
-            fprintf(stream, "[%d] ", pos);
+    n = n <= 0 ? TALKER_TOP_DEFAULT : n > SKETCH_CANDIDATES ? SKETCH_CANDIDATES : n;
 
-            if (policy[i]->action == ACTION_DENY) {
-                fprintf(stream, "deny ");
-            } else {
-                fprintf(stream, "allow ");
-            }
+    for (int verdict = ACTION_ALLOW; verdict <= ACTION_DENY; verdict++) {
+        for (int kind = 0; kind < STATS_TALKER_KINDS; kind++) {
+            unsigned long total;
+            int len = stats_top(verdict, kind, top, n, &total);
 
-            if (policy[i]->match.protocol == PROTO_UDP) {
-                fprintf(stream, "udp ");
-            } else {
-                fprintf(stream, "tcp ");
+            if (len == -1) {
+                return;
             }
 
-            fprintf(stream, "%d.", policy[i]->match.src_ip.a);
-            fprintf(stream, "%d.", policy[i]->match.src_ip.b);
-            fprintf(stream, "%d.", policy[i]->match.src_ip.c);
-            fprintf(stream, "%d:", policy[i]->match.src_ip.d);
+            fprintf(stream, "Top source %s of %s packets (%lu packets):\n",
+                    kind == STATS_TALKER_ADDR ? "addresses" : "ports",
+                    verdict == ACTION_ALLOW ? "allowed" : "denied", total);
 
-            if (policy[i]->match.src_port == MATCH_PORT_ANY) {
-                fprintf(stream, "* ");
-            } else {
-                fprintf(stream, "%d ", policy[i]->match.src_port);
+            for (int i = 0; i < len; i++) {
+                char text[IPV6_TEXT_SIZE];
+
+                talker_format(&top[i].key, kind, text);
+                fprintf(stream, "  %s: %lu (%.1f%%)\n", text, top[i].count,
+                        PERCENT * top[i].count / total);
             }
+        }
+    }
+}
 
-            fprintf(stream, "%d.", policy[i]->match.dst_ip.a);
-            fprintf(stream, "%d.", policy[i]->match.dst_ip.b);
-            fprintf(stream, "%d.", policy[i]->match.dst_ip.c);
-            fprintf(stream, "%d:", policy[i]->match.dst_ip.d);
+/**
+ * This function will print the filter the current IPv4 rules are checked against
+ * before the engine: how many rules are in it, how many of those have since been
+ * deleted, and how full it is.
+ *
+ * @param stream the file stream to print to
+ */
+void policy_print_filter(FILE *stream) {
 
-            if (policy[i]->match.dst_port == MATCH_PORT_ANY) {
-                fprintf(stream, "*\n");
-            } else {
-                fprintf(stream, "%d \n", policy[i]->match.dst_port);
-            }
+    if (rcu_read_lock() == -1) {
+        return;
+    }
 
-            pos++;
-        }
+    policy_snapshot_t *snap = __atomic_load_n(&policy, __ATOMIC_SEQ_CST);
+    policy_filter_t *filter = snap->filter;
+
+    if (filter) {
+        unsigned int live = snap->len - snap->len6;
+        unsigned int added = __atomic_load_n(&filter->added, __ATOMIC_RELAXED);
+
+        fprintf(stream, "Filter: %u rules (%u deleted since it was built)\n", added,
+                added - live);
+        bloom_print(filter->bloom, stream);
+    } else {
+        fprintf(stream, "Filter: off (%u rules searched for every packet)\n",
+                snap->len - snap->len6);
+    }
+
+    rcu_read_unlock();
+}
+
+/**
+ * This function will print the engine the policy is classified with and the shape of
+ * the index it built of the current rules.
+ *
+ * @param stream the file stream to print to
+ */
+void policy_print_engine(FILE *stream) {
+
+    if (rcu_read_lock() == -1) {
+        return;
+    }
+
+    policy_snapshot_t *snap = __atomic_load_n(&policy, __ATOMIC_SEQ_CST);
+    policy_index_t *index = snap->index;
+    policy_index_t *index6 = snap->index6;
+
+    if (index) {
+        fprintf(stream, "Engine: %s (index of %u rules %s in %.3f ms)\n",
+                index->engine->name, snap->len - snap->len6,
+                index->updated ? "updated" : "built", index->build_ns / NSEC_PER_MSEC);
+        index->engine->print(index->data, stream);
+    } else {
+        fprintf(stream, "Engine: linear (%u rules scanned in order)\n",
+                snap->len - snap->len6);
+    }
+
+    if (index6) {
+        fprintf(stream, "IPv6: %s (index of %u rules built in %.3f ms)\n",
+                index6->engine->name, snap->len6, index6->build_ns / NSEC_PER_MSEC);
+        index6->engine->print(index6->data, stream);
+    } else if (snap->len6) {
+        fprintf(stream, "IPv6: linear (%u rules scanned in order)\n", snap->len6);
+    }
+
+    rcu_read_unlock();
+}
+
+/**
+ * This function finds the name of the engine the current rules are classified with,
+ * which is "linear" if the selected engine has no index of them. A policy of IPv6 rules
+ * alone is named for the engine of its IPv6 index.
+ *
+ * @return the name, which is static and stays valid after the policy changes
+ */
+const char *policy_engine_name() {
+
+    if (rcu_read_lock() == -1) {
+        return "linear";
     }
+
+    policy_snapshot_t *snap = __atomic_load_n(&policy, __ATOMIC_SEQ_CST);
+    policy_index_t *index = snap->index ? snap->index : snap->index6;
+    const char *name = index ? index->engine->name : "linear";
+
+    rcu_read_unlock();
+
+    return name;
 }
@@ -10,6 +10,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include "packet.h"
 
 /** Used to indicate an allow rule. */
@@ -18,19 +19,71 @@
 /** Used to indicate a deny rule. */
 #define ACTION_DENY    1
 
-/** Initial policy capacity */
-#define POLICY_INIT_SIZE 10
+/** Room needed for a rule written as text after its position, including the terminator */
+#define RULE_TEXT_SIZE 192
+
+/** Used to indicate a change of a transaction that inserts a rule. */
+#define EDIT_INSERT 0
+
+/** Used to indicate a change of a transaction that deletes a rule. */
+#define EDIT_DELETE 1
+
+/** Used to indicate a change of a transaction that sets the default policy. */
+#define EDIT_DEFAULT 2
 
 /**
  * Representation of a firewall rule
  * .action: the rule action (ACTION_ALLOW or ACTION_DENY)
  * .match: the packet match
+ * .match6: the match of the addresses of an IPv6 rule (all 0 for an IPv4 rule)
  */
 typedef struct rule {
     unsigned int action;
     packet_match_t match;
+    match6_t match6;
 } rule_t;
 
+/**
+ * Representation of one change of a transaction
+ * .kind: EDIT_INSERT, EDIT_DELETE or EDIT_DEFAULT
+ * .pos: the position (from 1) to insert at (past the end, or -1, appends) or delete
+ * .rule: the rule to insert, or for EDIT_DEFAULT the default policy in .rule.action
+ */
+typedef struct policy_edit {
+    int kind;
+    int pos;
+    rule_t rule;
+} policy_edit_t;
+
+/**
+ * Representation of a rule in a compiled policy image. Every field has a fixed width and
+ * addresses are packed with ipaddr_value(), so an image can be used straight from a
+ * file mapped into memory.
+ * .src_ip: the packed source address
+ * .dst_ip: the packed destination address
+ * .src_port: the source port, or MATCH_PORT_ANY
+ * .dst_port: the destination port, or MATCH_PORT_ANY
+ * .protocol: the protocol (PROTO_TCP or PROTO_UDP)
+ * .action: the rule action (ACTION_ALLOW or ACTION_DENY)
+ */
+typedef struct image_rule {
+    uint32_t src_ip;
+    uint32_t dst_ip;
+    int32_t src_port;
+    int32_t dst_port;
+    uint16_t protocol;
+    uint16_t action;
+} image_rule_t;
+
+/**
+ * Function generated for a policy (see compiled.c) that finds the first of its rules
+ * matching a packet, given the packet's fields with the addresses packed.
+ *
+ * @return the index (from 0) of the first matching rule, or -1
+ */
+typedef int (*policy_matcher_t)(uint32_t protocol, uint32_t src_ip, uint32_t src_port,
+        uint32_t dst_ip, uint32_t dst_port);
+
 /**
  * This function will initialize the dynamically allocated policy structure.
  *
@@ -38,6 +91,15 @@ typedef struct rule {
  */
 int policy_init();
 
+/**
+ * This function will select whether rules are kept in the compact encoding: packed into
+ * 16 bytes around a shared wildcard template and allocated from arenas backed by huge
+ * pages. It must be called before policy_init().
+ *
+ * @param compact 1 for the compact encoding, 0 for the normal one
+ */
+void policy_set_compact(int compact);
+
 /**
  * This function will free the dynamically allocated policy structure and re-initialize
  * values as appropriate.
@@ -54,6 +116,16 @@ void policy_free();
  */
 int policy_set_default(int action);
 
+/**
+ * This function will select the engine the policy is classified with ("linear" scans
+ * the rules in order). The current policy is re-indexed with it straight away.
+ *
+ * @param name the name of the engine
+ *
+ * @return 0 if successful, -1 if unsuccessful (including if there is no such engine)
+ */
+int policy_set_engine(char *name);
+
 /**
  * This function will append a rule to the policy.
  *
@@ -63,11 +135,54 @@ int policy_set_default(int action);
  */
 int policy_append(rule_t rule);
 
+/**
+ * This function will append @n rules to the policy at once, publishing a single new
+ * snapshot instead of one per rule.
+ *
+ * @param rules the rules to be appended in order
+ * @param n the number of rules
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+int policy_append_rules(rule_t *rules, unsigned int n);
+
+/**
+ * This function will replace the policy with a compiled image. The image is classified
+ * against as it is; its rules are only copied out the first time the policy is changed.
+ *
+ * @param rules the rules of the image in order, which must stay valid until @release
+ * @param n the number of rules
+ * @param def the default policy
+ * @param release the function called once the policy no longer uses @rules
+ * @param arg the value passed to @release
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+int policy_load_image(const image_rule_t *rules, unsigned int n, unsigned int def,
+        void (*release)(void *), void *arg);
+
+/**
+ * This function will replace the policy with a compiled image that comes with a matcher
+ * generated for its rules. Packets are classified with @match until the policy is
+ * changed, when the selected engine takes over again.
+ *
+ * @param rules the rules of the image in order, which must stay valid until @release
+ * @param n the number of rules
+ * @param def the default policy
+ * @param match the matcher, which must stay valid until @release
+ * @param release the function called once the policy uses neither @rules nor @match
+ * @param arg the value passed to @release
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+int policy_load_matcher(const image_rule_t *rules, unsigned int n, unsigned int def,
+        policy_matcher_t match, void (*release)(void *), void *arg);
+
 /**
  * This function will insert a rule at position.
  *
  * @param rule the rule to be inserted
- * @param pos the position to be inserted at
+ * @param pos the position to be inserted at (past the end, or -1, appends)
  *
  * @return 0 if successful, -1 if unsuccessful
  */
@@ -82,19 +197,109 @@ int policy_insert(rule_t rule, int pos);
  */
 int policy_delete(int pos);
 
+/**
+ * This function will apply a transaction: every change in order, as one. Readers see
+ * the policy from before the transaction until it is published whole, with the indexes
+ * of the families it changed rebuilt once. If any change fails, because it deletes a
+ * rule that does not exist by then for instance, none of them are applied.
+ *
+ * @param edits the changes in order
+ * @param n the number of changes
+ * @param failed the value to be updated with the index of the change that failed, or
+ * with @n if the transaction failed as a whole
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+int policy_commit(const policy_edit_t *edits, unsigned int n, unsigned int *failed);
+
+/**
+ * This function will copy the current rules out of the policy.
+ *
+ * @param rules the value to be updated with the dynamically allocated copy of the rules
+ * @param def the value to be updated with the default policy
+ * @param gen the value to be updated with the generation the copy was taken at
+ *
+ * @return the number of rules, or -1 if unsuccessful
+ */
+int policy_rules(rule_t **rules, unsigned int *def, unsigned long *gen);
+
+/**
+ * This function will copy the number of packets each current rule has matched.
+ *
+ * @param gen the generation the counts are wanted at
+ * @param hits the array (one per rule) to be populated
+ * @param n the number of rules @hits has room for
+ *
+ * @return 0 if successful, -1 if unsuccessful (including if the policy has changed
+ * since @gen)
+ */
+int policy_hits(unsigned long gen, unsigned long *hits, unsigned int n);
+
+/**
+ * This function will replace the rules of the policy with a selection of its current
+ * rules in a new order. Rules keep their identity (and hit counters).
+ *
+ * @param gen the generation the selection was computed against
+ * @param order the indexes (from 0) of the rules to keep, in their new order
+ * @param n the number of indexes
+ *
+ * @return 0 if successful, -1 if unsuccessful (including if the policy has changed
+ * since @gen)
+ */
+int policy_select(unsigned long gen, int *order, unsigned int n);
+
 /**
  * This function will test if @pkt is allowed or denied by the policy.
  * It returns ACTION_ALLOW or ACTION_DENY.
  * Additionally the value pointed to by @pos will be updated with the position
  * number of the rule that is matched.
  * If no rule is matched, the value will be set to -1.
+ * It may be called from any number of threads while the policy is being changed.
  *
- * @param pkt the packet being tested
+ * @param pkt the packet being tested, which for an IPv6 packet is the .key of its
+ * packet6_t
  * @param pos the position containing the value to be updated position of the rule that is matches
  *
  * @return It returns 0 if successful, -1 if unsuccessful.
  */
-int policy_test(packet_t pkt, int *pos);
+int policy_test(packet_t *pkt, int *pos);
+
+/**
+ * This function packs a rule into its image form.
+ *
+ * @param rule the rule
+ * @param rec the image rule to be populated
+ */
+void rule_pack(rule_t *rule, image_rule_t *rec);
+
+/**
+ * This function writes a rule in the command language, without its position.
+ *
+ * @param rule the rule
+ * @param text the buffer to be written to (RULE_TEXT_SIZE long)
+ *
+ * @return the number of characters written, not counting the terminating null
+ */
+int rule_format(rule_t *rule, char *text);
+
+/**
+ * This function prints a single rule in the command language, without its position.
+ *
+ * @param stream the file stream to print to
+ * @param rule the rule to be printed
+ */
+void rule_print(FILE *stream, rule_t *rule);
+
+/**
+ * This function writes the rule at position @pos in the command language after its
+ * position, as policy_print_rule() prints it.
+ *
+ * @param pos the position of the rule (from 1)
+ * @param text the buffer to be written to (RULE_TEXT_SIZE long)
+ *
+ * @return the number of characters written, or -1 if @pos does not exist
+ */
+int policy_format_rule(int pos, char *text);
 
 /**
  * This function will print to @stream the rule at position @pos.
@@ -113,4 +318,65 @@ int policy_print_rule(FILE *stream, int pos);
  */
 void policy_print(FILE *stream);
 
+/**
+ * This function will print the default policy followed by the policy rules in order to
+ * @stream, each with the number of packets it has matched.
+ *
+ * @param stream the file stream to print to
+ */
+void policy_print_counts(FILE *stream);
+
+/**
+ * This function will print the engine the policy is classified with and the shape of
+ * the index it built of the current rules.
+ *
+ * @param stream the file stream to print to
+ */
+void policy_print_engine(FILE *stream);
+
+/**
+ * This function will print the heaviest talkers of each verdict: the source addresses,
+ * and the source ports, that sent the most of the packets allowed and of those denied.
+ * Counts come from sketches and may be overestimated, never underestimated.
+ *
+ * @param stream the file stream to print to
+ * @param n the number of talkers of each kind, or 0 for the default
+ */
+void policy_print_top(FILE *stream, int n);
+
+/**
+ * This function will print the filter the current IPv4 rules are checked against
+ * before the engine: how many rules are in it, how many of those have since been
+ * deleted, and how full it is.
+ *
+ * @param stream the file stream to print to
+ */
+void policy_print_filter(FILE *stream);
+
+/**
+ * This function will print the memory the current policy takes up: the bytes each rule
+ * costs in its record, its copy in a chunk and its pointer slot, the chunks and tree
+ * nodes holding them, the allocator's own overhead, and the filter and hit counters.
+ *
+ * @param stream the file stream to print to
+ */
+void policy_print_memory(FILE *stream);
+
+/**
+ * This function finds how many bytes the policy has mapped straight from the system
+ * for the arenas of the compact encoding, which the heap does not account for.
+ *
+ * @return the number of bytes
+ */
+size_t policy_mapped();
+
+/**
+ * This function finds the name of the engine the current rules are classified with,
+ * which is "linear" if the selected engine has no index of them. A policy of IPv6 rules
+ * alone is named for the engine of its IPv6 index.
+ *
+ * @return the name
+ */
+const char *policy_engine_name();
+
 #endif
@@ -0,0 +1,740 @@
+/**
+ * @file prefix6.c
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This component is responsible for the classification engine of IPv6 rules, whose
+ * addresses are prefixes. Each address field keeps a hash table of the prefixes rules
+ * give for it, and the longest prefix containing an address is found by binary search
+ * on the distinct prefix lengths, probing the table once per step. For that to work
+ * every prefix leaves a marker at each shorter length the search passes on its way to
+ * it, and every entry remembers the longest prefix containing it, so a search that is
+ * led on by a marker and then finds nothing longer still knows its best prefix.
+ *
+ * A rule is filed under the pair of its source and destination prefixes. The prefixes
+ * containing an address are the longest one and the chain of shorter prefixes each
+ * is contained in, so a lookup probes the pair table for every pair along the two
+ * chains and compares ports against the rules of each pair in policy order, stopping
+ * at the first rule later than the best one found.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "prefix6.h"
+#include "stats.h"
+
+/** Smallest number of slots of a hash table */
+#define PREFIX6_MIN_SLOTS 16
+
+/** Length marking an empty slot of a prefix table */
+#define PREFIX6_EMPTY -1
+
+/** Id meaning no prefix */
+#define PREFIX6_NONE -1
+
+/** Index of the source address field */
+#define PREFIX6_SRC 0
+
+/** Index of the destination address field */
+#define PREFIX6_DST 1
+
+/** Number of address fields */
+#define PREFIX6_FIELDS 2
+
+/** First multiplier mixing a key into a hash */
+#define PREFIX6_MIX_A 0x9E3779B97F4A7C15ULL
+
+/** Second multiplier mixing a key into a hash */
+#define PREFIX6_MIX_B 0xC2B2AE3D27D4EB4FULL
+
+/** Shift folding the high bits of a hash into the low bits */
+#define PREFIX6_MIX_SHIFT 32
+
+/**
+ * Representation of an entry of the prefix table of a field, which is a prefix rules
+ * give, a marker left for the binary search, or both
+ * .addr: the address, masked to .len
+ * .len: the length, or PREFIX6_EMPTY for an empty slot
+ * .id: the id of the prefix, or PREFIX6_NONE for a marker only
+ * .best: the id of the longest prefix containing the entry, or PREFIX6_NONE
+ */
+typedef struct prefix6_entry {
+    ipv6_t addr;
+    int len;
+    int id;
+    int best;
+} prefix6_entry_t;
+
+/**
+ * Representation of the prefixes of one address field
+ * .table: the hash table of prefixes and markers, open-addressed
+ * .slots: the number of slots of .table, a power of two
+ * .used: the number of slots in use
+ * .count: the number of prefixes (ids run from 0)
+ * .lens: the distinct lengths of the prefixes, shortest first
+ * .masks: the mask of each length in .lens
+ * .nlens: the number of distinct lengths
+ * .parent: for each prefix, the id of the longest shorter prefix containing it, or
+ * PREFIX6_NONE
+ */
+typedef struct prefix6_field {
+    prefix6_entry_t *table;
+    unsigned int slots;
+    unsigned int used;
+    unsigned int count;
+    int lens[IPV6_BITS + 1];
+    ipv6_t masks[IPV6_BITS + 1];
+    int nlens;
+    int *parent;
+} prefix6_field_t;
+
+/**
+ * Representation of the rules filed under a pair of prefixes
+ * .src: the id of the source prefix, or PREFIX6_NONE for an empty slot
+ * .dst: the id of the destination prefix
+ * .start: the index in .rules of the index of the first rule of the pair
+ * .count: the number of rules of the pair
+ */
+typedef struct prefix6_pair {
+    int src;
+    int dst;
+    unsigned int start;
+    unsigned int count;
+} prefix6_pair_t;
+
+/**
+ * Representation of a rule in an index, where only the ports word is left to compare
+ * .ports: the ports word of the rule's match
+ * .mask: the mask of the ports word
+ * .pos: the index of the rule in the policy
+ */
+typedef struct prefix6_rule {
+    uint64_t ports;
+    uint64_t mask;
+    unsigned int pos;
+} prefix6_rule_t;
+
+/**
+ * Representation of a rule being sorted into its pair
+ * .src: the id of the source prefix
+ * .dst: the id of the destination prefix
+ * .pos: the index of the rule in the policy
+ */
+typedef struct prefix6_sort {
+    int src;
+    int dst;
+    unsigned int pos;
+} prefix6_sort_t;
+
+/**
+ * Representation of an index
+ * .fields: the prefixes of the source and destination addresses
+ * .pairs: the hash table of prefix pairs, open-addressed
+ * .slots: the number of slots of .pairs, a power of two
+ * .npairs: the number of pairs
+ * .longest: the most rules any pair has
+ * .rules: the rules, grouped by pair and in policy order within a pair
+ * .n: the number of rules
+ */
+typedef struct prefix6 {
+    prefix6_field_t fields[PREFIX6_FIELDS];
+    prefix6_pair_t *pairs;
+    unsigned int slots;
+    unsigned int npairs;
+    unsigned int longest;
+    prefix6_rule_t *rules;
+    unsigned int n;
+} prefix6_t;
+
+/**
+ * This function masks an address.
+ *
+ * @param addr the address
+ * @param mask the mask
+ *
+ * @return the masked address
+ */
+static ipv6_t mask_addr(const ipv6_t *addr, const ipv6_t *mask) {
+
+    ipv6_t masked = {{ addr->w[0] & mask->w[0], addr->w[1] & mask->w[1] }};
+
+    return masked;
+}
+
+/**
+ * This function hashes a prefix.
+ *
+ * @param addr the address, masked to the prefix
+ * @param len the length of the prefix
+ *
+ * @return the hash
+ */
+static unsigned int prefix_hash(const ipv6_t *addr, int len) {
+
+    uint64_t h = (addr->w[0] ^ (uint64_t) len) * PREFIX6_MIX_A;
+
+    h ^= addr->w[1] * PREFIX6_MIX_B;
+    h ^= h >> PREFIX6_MIX_SHIFT;
+
+    return (unsigned int) (h * PREFIX6_MIX_A >> PREFIX6_MIX_SHIFT);
+}
+
+/**
+ * This function hashes a pair of prefix ids.
+ *
+ * @param src the id of the source prefix
+ * @param dst the id of the destination prefix
+ *
+ * @return the hash
+ */
+static unsigned int pair_hash(int src, int dst) {
+
+    uint64_t h = ((uint64_t) (uint32_t) src << PREFIX6_MIX_SHIFT | (uint32_t) dst)
+            * PREFIX6_MIX_A;
+
+    return (unsigned int) (h >> PREFIX6_MIX_SHIFT);
+}
+
+/**
+ * This function finds the slot of a prefix in the table of a field, or the empty slot
+ * it would be added to.
+ *
+ * @param table the table
+ * @param slots the number of slots of the table
+ * @param addr the address, masked to the prefix
+ * @param len the length of the prefix
+ *
+ * @return the slot
+ */
+static prefix6_entry_t *table_slot(prefix6_entry_t *table, unsigned int slots,
+        const ipv6_t *addr, int len) {
+
+    unsigned int mask = slots - 1;
+    unsigned int i = prefix_hash(addr, len) & mask;
+
+    while (table[i].len != PREFIX6_EMPTY && (table[i].len != len
+            || table[i].addr.w[0] != addr->w[0] || table[i].addr.w[1] != addr->w[1])) {
+        i = (i + 1) & mask;
+    }
+
+    return &table[i];
+}
+
+/**
+ * This function finds a prefix or marker in the table of a field.
+ *
+ * @param f the field
+ * @param addr the address, masked to the prefix
+ * @param len the length of the prefix
+ *
+ * @return the entry, or NULL if there is none
+ */
+static const prefix6_entry_t *table_find(const prefix6_field_t *f, const ipv6_t *addr,
+        int len) {
+
+    const prefix6_entry_t *e = table_slot(f->table, f->slots, addr, len);
+
+    return e->len == PREFIX6_EMPTY ? NULL : e;
+}
+
+/**
+ * This function makes a table with no entries.
+ *
+ * @param slots the number of slots, a power of two
+ *
+ * @return the table, or NULL if memory runs out
+ */
+static prefix6_entry_t *table_new(unsigned int slots) {
+
+    prefix6_entry_t *table = (prefix6_entry_t *) malloc(slots * sizeof(prefix6_entry_t));
+
+    for (unsigned int i = 0; table && i < slots; i++) {
+        table[i].len = PREFIX6_EMPTY;
+    }
+
+    return table;
+}
+
+/**
+ * This function adds a prefix or marker to the table of a field unless it is already
+ * there, doubling the table whenever it would be more than half full. An entry added
+ * is neither a prefix nor has a best prefix yet.
+ *
+ * @param f the field
+ * @param addr the address, masked to the prefix
+ * @param len the length of the prefix
+ *
+ * @return the entry, which is valid until the next entry is added, or NULL if memory
+ * runs out
+ */
+static prefix6_entry_t *table_add(prefix6_field_t *f, const ipv6_t *addr, int len) {
+
+    if ((f->used + 1) * 2 > f->slots) {
+        prefix6_entry_t *grown = table_new(f->slots * 2);
+
+        if (!grown) {
+            return NULL;
+        }
+
+        for (unsigned int i = 0; i < f->slots; i++) {
+            if (f->table[i].len != PREFIX6_EMPTY) {
+                *table_slot(grown, f->slots * 2, &f->table[i].addr, f->table[i].len) =
+                        f->table[i];
+            }
+        }
+
+        free(f->table);
+        f->table = grown;
+        f->slots *= 2;
+    }
+
+    prefix6_entry_t *e = table_slot(f->table, f->slots, addr, len);
+
+    if (e->len == PREFIX6_EMPTY) {
+        e->addr = *addr;
+        e->len = len;
+        e->id = PREFIX6_NONE;
+        e->best = PREFIX6_NONE;
+        f->used++;
+    }
+
+    return e;
+}
+
+/**
+ * This function finds the longest prefix of a field shorter than a given length that
+ * contains an address, by probing each length in turn from the longest.
+ *
+ * @param f the field
+ * @param addr the address
+ * @param len the length every prefix found must be shorter than
+ *
+ * @return the id of the prefix, or PREFIX6_NONE
+ */
+static int field_shorter(const prefix6_field_t *f, const ipv6_t *addr, int len) {
+
+    for (int j = f->nlens - 1; j >= 0; j--) {
+        if (f->lens[j] >= len) {
+            continue;
+        }
+
+        ipv6_t key = mask_addr(addr, &f->masks[j]);
+        const prefix6_entry_t *e = table_find(f, &key, f->lens[j]);
+
+        if (e && e->id != PREFIX6_NONE) {
+            return e->id;
+        }
+    }
+
+    return PREFIX6_NONE;
+}
+
+/**
+ * This function finds the longest prefix of a field that contains an address, by
+ * binary search on the prefix lengths. Finding an entry means the prefix, if any, is
+ * at least that long, and finding none means it is shorter.
+ *
+ * @param f the field
+ * @param addr the address
+ * @param steps the value to be updated with the number of probes made
+ *
+ * @return the id of the prefix, or PREFIX6_NONE
+ */
+static int field_lookup(const prefix6_field_t *f, const ipv6_t *addr,
+        unsigned int *steps) {
+
+    int best = PREFIX6_NONE;
+    int lo = 0;
+    int hi = f->nlens - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        ipv6_t key = mask_addr(addr, &f->masks[mid]);
+        const prefix6_entry_t *e = table_find(f, &key, f->lens[mid]);
+
+        (*steps)++;
+
+        if (e) {
+            if (e->best != PREFIX6_NONE) {
+                best = e->best;
+            }
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * This function builds the prefix table of one address field: it adds the prefix of
+ * every rule, leaves the markers the binary search needs and works out the best
+ * prefix of every entry and the parent of every prefix.
+ *
+ * @param f the field, zeroed
+ * @param rules the rules in order
+ * @param n the number of rules
+ * @param field PREFIX6_SRC or PREFIX6_DST
+ * @param ids the array to be filled with the id of each rule's prefix
+ *
+ * @return 0 if successful, -1 if memory runs out
+ */
+static int field_build(prefix6_field_t *f, rule_t *rules, unsigned int n, int field,
+        int *ids) {
+
+    int seen[IPV6_BITS + 1] = { 0 };
+    ipv6_t *addrs = (ipv6_t *) malloc((n ? n : 1) * sizeof(ipv6_t));
+    int *lens = (int *) malloc((n ? n : 1) * sizeof(int));
+
+    f->slots = PREFIX6_MIN_SLOTS;
+    f->table = table_new(f->slots);
+    f->parent = (int *) malloc((n ? n : 1) * sizeof(int));
+
+    if (!addrs || !lens || !f->table || !f->parent) {
+        free(addrs);
+        free(lens);
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < n; i++) {
+        match6_t *m = &rules[i].match6;
+        const ipv6_t *addr = field == PREFIX6_SRC ? &m->src : &m->dst;
+        int len = ipv6_prefix_len(field == PREFIX6_SRC ? &m->src_mask : &m->dst_mask);
+        prefix6_entry_t *e = table_add(f, addr, len);
+
+        if (!e) {
+            free(addrs);
+            free(lens);
+            return -1;
+        }
+
+        if (e->id == PREFIX6_NONE) {
+            e->id = f->count;
+            addrs[f->count] = *addr;
+            lens[f->count] = len;
+            seen[len] = 1;
+            f->count++;
+        }
+
+        ids[i] = e->id;
+    }
+
+    for (int len = 0; len <= IPV6_BITS; len++) {
+        if (seen[len]) {
+            f->lens[f->nlens] = len;
+            f->masks[f->nlens] = ipv6_mask(len);
+            f->nlens++;
+        }
+    }
+
+    //A search for a prefix goes on to longer lengths at every shorter length it
+    //probes, so it must find an entry there
+    for (unsigned int id = 0; id < f->count; id++) {
+        int lo = 0;
+        int hi = f->nlens - 1;
+        int mid = (lo + hi) / 2;
+
+        while (f->lens[mid] != lens[id]) {
+            if (f->lens[mid] < lens[id]) {
+                ipv6_t key = mask_addr(&addrs[id], &f->masks[mid]);
+                if (!table_add(f, &key, f->lens[mid])) {
+                    free(addrs);
+                    free(lens);
+                    return -1;
+                }
+                lo = mid + 1;
+            } else {
+                hi = mid - 1;
+            }
+            mid = (lo + hi) / 2;
+        }
+    }
+
+    for (unsigned int i = 0; i < f->slots; i++) {
+        prefix6_entry_t *e = &f->table[i];
+
+        if (e->len != PREFIX6_EMPTY) {
+            e->best = e->id != PREFIX6_NONE ? e->id : field_shorter(f, &e->addr, e->len);
+        }
+    }
+
+    for (unsigned int id = 0; id < f->count; id++) {
+        f->parent[id] = field_shorter(f, &addrs[id], lens[id]);
+    }
+
+    free(addrs);
+    free(lens);
+
+    return 0;
+}
+
+/**
+ * This function sorts rules by source prefix, destination prefix and then policy
+ * order.
+ *
+ * @param a the first rule
+ * @param b the second rule
+ *
+ * @return negative, zero or positive as @a sorts before, with or after @b
+ */
+static int sort_cmp(const void *a, const void *b) {
+
+    const prefix6_sort_t *x = (const prefix6_sort_t *) a;
+    const prefix6_sort_t *y = (const prefix6_sort_t *) b;
+
+    if (x->src != y->src) {
+        return x->src < y->src ? -1 : 1;
+    }
+
+    if (x->dst != y->dst) {
+        return x->dst < y->dst ? -1 : 1;
+    }
+
+    return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+/**
+ * This function finds the rules of a pair of prefixes.
+ *
+ * @param t the index
+ * @param src the id of the source prefix
+ * @param dst the id of the destination prefix
+ *
+ * @return the pair, or NULL if no rule has it
+ */
+static const prefix6_pair_t *pair_find(const prefix6_t *t, int src, int dst) {
+
+    unsigned int mask = t->slots - 1;
+
+    for (unsigned int i = pair_hash(src, dst) & mask; t->pairs[i].src != PREFIX6_NONE;
+            i = (i + 1) & mask) {
+        if (t->pairs[i].src == src && t->pairs[i].dst == dst) {
+            return &t->pairs[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * This function files the rules under their pairs of prefixes.
+ *
+ * @param t the index, with both fields built
+ * @param rules the rules in order
+ * @param sorted the prefix ids of each rule, sorted by sort_cmp()
+ *
+ * @return 0 if successful, -1 if memory runs out
+ */
+static int pairs_build(prefix6_t *t, rule_t *rules, prefix6_sort_t *sorted) {
+
+    t->npairs = 0;
+    for (unsigned int i = 0; i < t->n; i++) {
+        t->npairs += i == 0 || sorted[i].src != sorted[i - 1].src
+                || sorted[i].dst != sorted[i - 1].dst;
+    }
+
+    for (t->slots = PREFIX6_MIN_SLOTS; t->slots < t->npairs * 2; t->slots *= 2);
+
+    t->pairs = (prefix6_pair_t *) malloc(t->slots * sizeof(prefix6_pair_t));
+    t->rules = (prefix6_rule_t *) malloc((t->n ? t->n : 1) * sizeof(prefix6_rule_t));
+
+    if (!t->pairs || !t->rules) {
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < t->slots; i++) {
+        t->pairs[i].src = PREFIX6_NONE;
+    }
+
+    unsigned int mask = t->slots - 1;
+
+    for (unsigned int lo = 0, hi; lo < t->n; lo = hi) {
+        for (hi = lo; hi < t->n && sorted[hi].src == sorted[lo].src
+                && sorted[hi].dst == sorted[lo].dst; hi++) {
+            packet_match_t *m = &rules[sorted[hi].pos].match;
+            t->rules[hi].ports = m->value.ports;
+            t->rules[hi].mask = m->mask.ports;
+            t->rules[hi].pos = sorted[hi].pos;
+        }
+
+        unsigned int i = pair_hash(sorted[lo].src, sorted[lo].dst) & mask;
+        while (t->pairs[i].src != PREFIX6_NONE) {
+            i = (i + 1) & mask;
+        }
+
+        t->pairs[i].src = sorted[lo].src;
+        t->pairs[i].dst = sorted[lo].dst;
+        t->pairs[i].start = lo;
+        t->pairs[i].count = hi - lo;
+
+        if (hi - lo > t->longest) {
+            t->longest = hi - lo;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * This function builds a prefix index of IPv6 rules: a table of the prefixes of each
+ * address field searched by binary search on their lengths, and a table of the rules
+ * of each pair of prefixes.
+ *
+ * @param rules the IPv6 rules in order
+ * @param n the number of rules
+ *
+ * @return the index, or NULL if memory runs out
+ */
+void *prefix6_build(rule_t *rules, unsigned int n) {
+
+    prefix6_t *t = (prefix6_t *) calloc(1, sizeof(prefix6_t));
+    int *src = (int *) malloc((n ? n : 1) * sizeof(int));
+    int *dst = (int *) malloc((n ? n : 1) * sizeof(int));
+    prefix6_sort_t *sorted = (prefix6_sort_t *) malloc(
+            (n ? n : 1) * sizeof(prefix6_sort_t));
+
+    if (!t || !src || !dst || !sorted
+            || field_build(&t->fields[PREFIX6_SRC], rules, n, PREFIX6_SRC, src) == -1
+            || field_build(&t->fields[PREFIX6_DST], rules, n, PREFIX6_DST, dst) == -1) {
+        free(src);
+        free(dst);
+        free(sorted);
+        if (t) {
+            prefix6_free(t);
+        }
+        return NULL;
+    }
+
+    t->n = n;
+
+    for (unsigned int i = 0; i < n; i++) {
+        sorted[i].src = src[i];
+        sorted[i].dst = dst[i];
+        sorted[i].pos = i;
+    }
+
+    qsort(sorted, n, sizeof(prefix6_sort_t), sort_cmp);
+
+    int built = pairs_build(t, rules, sorted);
+
+    free(src);
+    free(dst);
+    free(sorted);
+
+    if (built == -1) {
+        prefix6_free(t);
+        return NULL;
+    }
+
+    return t;
+}
+
+/**
+ * This function finds the first rule matching a packet by finding the longest prefix
+ * of each address field that contains the packet's address, then probing the rules of
+ * every pair of prefixes along the two chains of shorter prefixes containing them.
+ *
+ * @param index the index
+ * @param pkt the packet
+ *
+ * @return the index (from 0) of the first matching rule, or -1
+ */
+int prefix6_lookup(void *index, packet_t *pkt) {
+
+    prefix6_t *t = (prefix6_t *) index;
+    const prefix6_field_t *fs = &t->fields[PREFIX6_SRC];
+    const prefix6_field_t *fd = &t->fields[PREFIX6_DST];
+    unsigned int steps = 0;
+    unsigned int compared = 0;
+    unsigned int best = t->n;
+
+    int src = field_lookup(fs, &PACKET_V6(pkt)->src, &steps);
+    int dst = field_lookup(fd, &PACKET_V6(pkt)->dst, &steps);
+
+    for (int s = src; s != PREFIX6_NONE; s = fs->parent[s]) {
+        for (int d = dst; d != PREFIX6_NONE; d = fd->parent[d]) {
+            const prefix6_pair_t *p = pair_find(t, s, d);
+
+            steps++;
+            if (!p) {
+                continue;
+            }
+
+            const prefix6_rule_t *r = &t->rules[p->start];
+            for (unsigned int k = 0; k < p->count && r[k].pos < best; k++) {
+                compared++;
+                if ((pkt->ports & r[k].mask) == r[k].ports) {
+                    best = r[k].pos;
+                }
+            }
+        }
+    }
+
+    stats_engine_count(steps, compared);
+
+    return best < t->n ? (int) best : -1;
+}
+
+/**
+ * This function prints the lengths and number of prefixes and markers of a field.
+ *
+ * @param f the field
+ * @param name the name of the field
+ * @param stream the file stream to print to
+ */
+static void field_print(const prefix6_field_t *f, const char *name, FILE *stream) {
+
+    fprintf(stream, "  %s: %u prefixes, %u markers, lengths", name, f->count,
+            f->used - f->count);
+
+    for (int j = 0; j < f->nlens; j++) {
+        fprintf(stream, " /%d", f->lens[j]);
+    }
+
+    fprintf(stream, "\n");
+}
+
+/**
+ * This function prints the prefix lengths, markers and prefix pairs of an index.
+ *
+ * @param index the index
+ * @param stream the file stream to print to
+ */
+void prefix6_print(void *index, FILE *stream) {
+
+    prefix6_t *t = (prefix6_t *) index;
+    size_t bytes = sizeof(prefix6_t) + t->slots * sizeof(prefix6_pair_t)
+            + t->n * sizeof(prefix6_rule_t);
+
+    fprintf(stream, "Prefixes: binary search on length\n");
+    field_print(&t->fields[PREFIX6_SRC], "src", stream);
+    field_print(&t->fields[PREFIX6_DST], "dst", stream);
+
+    for (int i = 0; i < PREFIX6_FIELDS; i++) {
+        bytes += t->fields[i].slots * sizeof(prefix6_entry_t)
+                + t->fields[i].count * sizeof(int);
+    }
+
+    fprintf(stream, "Prefix pairs: %u, at most %u rules each\n", t->npairs, t->longest);
+    fprintf(stream, "Memory: %zu KB\n", bytes >> 10);
+}
+
+/**
+ * This function frees an index.
+ *
+ * @param index the index
+ */
+void prefix6_free(void *index) {
+
+    prefix6_t *t = (prefix6_t *) index;
+
+    for (int i = 0; i < PREFIX6_FIELDS; i++) {
+        free(t->fields[i].table);
+        free(t->fields[i].parent);
+    }
+
+    free(t->pairs);
+    free(t->rules);
+    free(t);
+}
@@ -0,0 +1,52 @@
+/**
+ * @file prefix6.h
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This file acts as the interface for the prefix6.c file
+ */
+
+#ifndef PREFIX6_H
+#define PREFIX6_H
+
+#include "policy.h"
+
+/**
+ * This function builds a prefix index of IPv6 rules: a table of the prefixes of each
+ * address field searched by binary search on their lengths, and a table of the rules
+ * of each pair of prefixes.
+ *
+ * @param rules the IPv6 rules in order
+ * @param n the number of rules
+ *
+ * @return the index, or NULL if memory runs out
+ */
+void *prefix6_build(rule_t *rules, unsigned int n);
+
+/**
+ * This function finds the first rule matching a packet by finding the longest prefix
+ * of each address field that contains the packet's address, then probing the rules of
+ * every pair of prefixes along the two chains of shorter prefixes containing them.
+ *
+ * @param index the index
+ * @param pkt the packet
+ *
+ * @return the index (from 0) of the first matching rule, or -1
+ */
+int prefix6_lookup(void *index, packet_t *pkt);
+
+/**
+ * This function prints the prefix lengths, markers and prefix pairs of an index.
+ *
+ * @param index the index
+ * @param stream the file stream to print to
+ */
+void prefix6_print(void *index, FILE *stream);
+
+/**
+ * This function frees an index.
+ *
+ * @param index the index
+ */
+void prefix6_free(void *index);
+
+#endif
@@ -0,0 +1,400 @@
+/**
+ * @file publish.c
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This component is responsible for sharing one policy between many processes. A
+ * control process publishes its policy as a compiled image in POSIX shared memory, and
+ * reader processes map the image and classify against it in place (see image.c), so
+ * however many readers there are, the box holds one copy of the rules.
+ *
+ * Each version of the policy is written to a segment of its own, named for the policy
+ * and the version. A small control segment, named for the policy alone, holds the
+ * current version behind a seqlock; readers poll it with one read of shared memory and
+ * map the new segment once it changes. Segments are never written once published, so
+ * a reader still classifying against an older version is never disturbed. The
+ * publisher unlinks the segment of the version it replaces, and the memory is freed
+ * once the last reader using it has moved on.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "publish.h"
+#include "image.h"
+
+/** Permissions segments are created with */
+#define PUBLISH_MODE 0644
+
+/** Room for the name of the segment holding one version */
+#define PUBLISH_SEGMENT_SIZE (PUBLISH_NAME_SIZE + UINT_TEXT_SIZE + 1)
+
+/** Sequence number that no consistent version has (they are all even) */
+#define PUBLISH_SEQ_NONE 1
+
+/** Number of times attaching waits for a publisher to finish switching versions */
+#define PUBLISH_ATTACH_TRIES 1000
+
+/**
+ * Representation of the mapped segment of one version
+ * .map: the start of the mapping
+ * .size: the size of the mapping
+ */
+typedef struct publish_map {
+    void *map;
+    size_t size;
+} publish_map_t;
+
+/** The control segment the process is attached to, or NULL */
+static publish_header_t *attached;
+
+/** The name of the policy the process is attached to */
+static char attached_name[PUBLISH_NAME_SIZE];
+
+/** The sequence number of the version last loaded, or PUBLISH_SEQ_NONE */
+static uint32_t attached_seq = PUBLISH_SEQ_NONE;
+
+/**
+ * This function turns the name of a policy into the name of its control segment,
+ * which starts with a slash and holds no other.
+ *
+ * @param name the name of the policy
+ * @param out the array to be populated, PUBLISH_NAME_SIZE long
+ *
+ * @return 0 if successful, -1 if the name is empty or too long or holds a slash
+ */
+static int publish_name(const char *name, char *out) {
+
+    if (name[0] == '/') {
+        name++;
+    }
+
+    size_t len = strlen(name);
+
+    if (len == 0 || len + 2 > PUBLISH_NAME_SIZE || strchr(name, '/')) {
+        return -1;
+    }
+
+    out[0] = '/';
+    memcpy(out + 1, name, len + 1);
+
+    return 0;
+}
+
+/**
+ * This function finds the name of the segment holding one version of a policy.
+ *
+ * @param name the name of the control segment
+ * @param version the version
+ * @param out the array to be populated, PUBLISH_SEGMENT_SIZE long
+ */
+static void segment_name(const char *name, uint64_t version, char *out) {
+
+    snprintf(out, PUBLISH_SEGMENT_SIZE, "%s.%llu", name, (unsigned long long) version);
+}
+
+/**
+ * This function unmaps the segment of a version once the policy no longer uses it.
+ *
+ * @param arg the publish_map_t of the segment
+ */
+static void segment_unmap(void *arg) {
+
+    publish_map_t *m = (publish_map_t *) arg;
+
+    munmap(m->map, m->size);
+    free(m);
+}
+
+/**
+ * This function maps the segment of a version and replaces the policy with its image.
+ *
+ * @param name the name of the control segment
+ * @param version the version
+ * @param size the size of its image
+ *
+ * @return the number of rules loaded, or -1 if unsuccessful
+ */
+static int segment_load(const char *name, uint64_t version, uint64_t size) {
+
+    char seg[PUBLISH_SEGMENT_SIZE];
+    segment_name(name, version, seg);
+
+    int fd = shm_open(seg, O_RDONLY, 0);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+    publish_map_t *m = NULL;
+
+    if (fstat(fd, &st) == 0 && st.st_size == size) {
+        m = (publish_map_t *) malloc(sizeof(publish_map_t));
+    }
+
+    if (m) {
+        m->size = size;
+        m->map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (m->map == MAP_FAILED) {
+            free(m);
+            m = NULL;
+        }
+    }
+
+    close(fd);
+
+    if (!m) {
+        return -1;
+    }
+
+    //Once loaded, the policy owns the mapping and unmaps it when done
+    int count = image_use((const char *) m->map, m->size, segment_unmap, m);
+
+    if (count == -1) {
+        segment_unmap(m);
+    }
+
+    return count;
+}
+
+/**
+ * This function maps the control segment of a policy, creating it if asked to.
+ *
+ * @param name the name of the control segment
+ * @param create 1 to create it (and map it writable), 0 to map an existing one read-only
+ *
+ * @return the mapping, or NULL if unsuccessful
+ */
+static publish_header_t *control_map(const char *name, int create) {
+
+    int fd = shm_open(name, create ? O_RDWR | O_CREAT : O_RDONLY, PUBLISH_MODE);
+
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat st;
+    int ok = fstat(fd, &st) == 0;
+
+    //A new segment is zero-filled, so it starts out at version 0
+    if (ok && create && st.st_size == 0) {
+        ok = ftruncate(fd, sizeof(publish_header_t)) == 0;
+        st.st_size = sizeof(publish_header_t);
+    }
+
+    void *map = MAP_FAILED;
+
+    if (ok && st.st_size == sizeof(publish_header_t)) {
+        map = mmap(NULL, sizeof(publish_header_t),
+                create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    }
+
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    publish_header_t *hdr = (publish_header_t *) map;
+
+    if (create && hdr->magic[0] == '\0') {
+        hdr->byte_order = IMAGE_BYTE_ORDER;
+        memcpy(hdr->magic, PUBLISH_MAGIC, sizeof(PUBLISH_MAGIC));
+    }
+
+    if (memcmp(hdr->magic, PUBLISH_MAGIC, sizeof(PUBLISH_MAGIC)) != 0
+            || hdr->byte_order != IMAGE_BYTE_ORDER) {
+        munmap(map, sizeof(publish_header_t));
+        return NULL;
+    }
+
+    return hdr;
+}
+
+/**
+ * This function publishes the current policy under @name for other processes to use.
+ * The policy is written as a compiled image into a new shared memory segment, which
+ * the control segment is then pointed at; the segment of the version before is
+ * unlinked, though readers still using it keep it mapped. Images only hold IPv4 rules,
+ * so a policy with IPv6 rules is not published.
+ *
+ * @param name the name of the policy (a POSIX shared memory name, with or without the
+ * leading slash)
+ *
+ * @return the number of rules published, or -1 if unsuccessful
+ */
+int publish_policy(char *name) {
+
+    char shm[PUBLISH_NAME_SIZE];
+    size_t size;
+    int count;
+    char *image = publish_name(name, shm) == -1 ? NULL : image_encode(&size, &count);
+
+    if (!image) {
+        return -1;
+    }
+
+    publish_header_t *hdr = control_map(shm, 1);
+
+    if (!hdr) {
+        free(image);
+        return -1;
+    }
+
+    uint64_t old = hdr->version;
+    char seg[PUBLISH_SEGMENT_SIZE];
+    segment_name(shm, old + 1, seg);
+
+    //A publisher that died before switching to its segment may have left it behind
+    shm_unlink(seg);
+
+    int fd = shm_open(seg, O_RDWR | O_CREAT | O_EXCL, PUBLISH_MODE);
+    void *map = MAP_FAILED;
+
+    if (fd != -1 && ftruncate(fd, size) == 0) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+
+    if (fd != -1) {
+        close(fd);
+    }
+
+    if (map == MAP_FAILED) {
+        if (fd != -1) {
+            shm_unlink(seg);
+        }
+        munmap(hdr, sizeof(publish_header_t));
+        free(image);
+        return -1;
+    }
+
+    memcpy(map, image, size);
+    munmap(map, size);
+    free(image);
+
+    //Switch readers over: an odd sequence number tells them to come back later
+    uint32_t seq = hdr->seq;
+
+    __atomic_store_n(&hdr->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&hdr->version, old + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&hdr->size, (uint64_t) size, __ATOMIC_RELAXED);
+    __atomic_store_n(&hdr->seq, seq + 2, __ATOMIC_RELEASE);
+
+    if (old) {
+        segment_name(shm, old, seg);
+        shm_unlink(seg);
+    }
+
+    munmap(hdr, sizeof(publish_header_t));
+
+    return count;
+}
+
+/**
+ * This function loads the version the control segment points at, unless it is the one
+ * loaded already or the publisher is switching versions.
+ *
+ * @param busy the value to be updated with 1 if the publisher was switching versions
+ *
+ * @return the number of rules loaded, or -1 if none were
+ */
+static int version_load(int *busy) {
+
+    uint32_t seq = __atomic_load_n(&attached->seq, __ATOMIC_ACQUIRE);
+
+    *busy = 0;
+
+    if (seq == attached_seq) {
+        return -1;
+    }
+
+    uint64_t version = __atomic_load_n(&attached->version, __ATOMIC_RELAXED);
+    uint64_t size = __atomic_load_n(&attached->size, __ATOMIC_RELAXED);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if ((seq & 1) || __atomic_load_n(&attached->seq, __ATOMIC_RELAXED) != seq) {
+        *busy = 1;
+        return -1;
+    }
+
+    //If the segment is gone a newer version has replaced it, and the sequence number
+    //has moved on with it, so it is picked up next time
+    attached_seq = seq;
+
+    return version ? segment_load(attached_name, version, size) : -1;
+}
+
+/**
+ * This function attaches the calling process to the policy published under @name and
+ * replaces its policy with the current version. Later versions are picked up by
+ * publish_refresh().
+ *
+ * @param name the name of the policy
+ *
+ * @return the number of rules loaded, or -1 if unsuccessful
+ */
+int publish_attach(char *name) {
+
+    char shm[PUBLISH_NAME_SIZE];
+    publish_header_t *hdr = publish_name(name, shm) == -1 ? NULL : control_map(shm, 0);
+
+    if (!hdr) {
+        return -1;
+    }
+
+    publish_detach();
+
+    attached = hdr;
+    strcpy(attached_name, shm);
+
+    int busy = 1;
+    int count = -1;
+
+    for (int i = 0; i < PUBLISH_ATTACH_TRIES && busy; i++) {
+        count = version_load(&busy);
+        if (busy) {
+            sched_yield();
+        }
+    }
+
+    if (count == -1) {
+        publish_detach();
+    }
+
+    return count;
+}
+
+/**
+ * This function replaces the policy with the newest published version if it has
+ * changed since it was last loaded. When nothing has changed, which is checked with a
+ * single read of shared memory, it returns straight away. It does nothing if the
+ * process is not attached.
+ *
+ * @return 1 if a new version was loaded, 0 if not
+ */
+int publish_refresh() {
+
+    int busy;
+
+    return attached && version_load(&busy) != -1;
+}
+
+/**
+ * This function detaches the process from the published policy. The policy it last
+ * loaded stays in use.
+ */
+void publish_detach() {
+
+    if (attached) {
+        munmap(attached, sizeof(publish_header_t));
+        attached = NULL;
+        attached_seq = PUBLISH_SEQ_NONE;
+    }
+}
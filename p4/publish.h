@@ -0,0 +1,79 @@
+/**
+ * @file publish.h
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This file acts as the interface for the publish.c file
+ */
+
+#ifndef PUBLISH_H
+#define PUBLISH_H
+
+#include <stdint.h>
+
+/** Magic bytes at the start of the control segment of a published policy */
+#define PUBLISH_MAGIC "FWSHARE"
+
+/** Longest name a policy may be published under, including the terminator */
+#define PUBLISH_NAME_SIZE 240
+
+/**
+ * Representation of the control segment of a published policy, which readers poll for
+ * new versions. It is a seqlock: the publisher makes .seq odd while it changes the
+ * other fields and even again once they are consistent, so a reader that sees the same
+ * even .seq before and after reading them has read one version whole.
+ * .magic: PUBLISH_MAGIC
+ * .byte_order: IMAGE_BYTE_ORDER
+ * .seq: the sequence number of the seqlock
+ * .version: the version of the policy, which names the segment holding its image
+ * .size: the size of that image
+ */
+typedef struct publish_header {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t seq;
+    uint64_t version;
+    uint64_t size;
+} publish_header_t;
+
+/**
+ * This function publishes the current policy under @name for other processes to use.
+ * The policy is written as a compiled image into a new shared memory segment, which
+ * the control segment is then pointed at; the segment of the version before is
+ * unlinked, though readers still using it keep it mapped. Images only hold IPv4 rules,
+ * so a policy with IPv6 rules is not published.
+ *
+ * @param name the name of the policy (a POSIX shared memory name, with or without the
+ * leading slash)
+ *
+ * @return the number of rules published, or -1 if unsuccessful
+ */
+int publish_policy(char *name);
+
+/**
+ * This function attaches the calling process to the policy published under @name and
+ * replaces its policy with the current version. Later versions are picked up by
+ * publish_refresh().
+ *
+ * @param name the name of the policy
+ *
+ * @return the number of rules loaded, or -1 if unsuccessful
+ */
+int publish_attach(char *name);
+
+/**
+ * This function replaces the policy with the newest published version if it has
+ * changed since it was last loaded. When nothing has changed, which is checked with a
+ * single read of shared memory, it returns straight away. It does nothing if the
+ * process is not attached.
+ *
+ * @return 1 if a new version was loaded, 0 if not
+ */
+int publish_refresh();
+
+/**
+ * This function detaches the process from the published policy. The policy it last
+ * loaded stays in use.
+ */
+void publish_detach();
+
+#endif
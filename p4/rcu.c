@@ -0,0 +1,192 @@
+/**
+ * @file rcu.c
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This component is responsible for epoch-based reclamation of shared objects.
+ * Readers announce the global epoch they started in; a writer that unpublishes an
+ * object advances the epoch and tags the object with it. The object may be freed
+ * once every active reader has announced an epoch at least as new as its tag, since
+ * those readers started after it was unpublished.
+ */
+
+#include <stdlib.h>
+#include <sched.h>
+#include "rcu.h"
+
+/**
+ * Representation of an object waiting to be released
+ * .ptr: the retired object
+ * .release: the function that frees the object
+ * .epoch: the epoch after which no new reader can see the object
+ * .next: the next retired object
+ */
+typedef struct retired {
+    void *ptr;
+    void (*release)(void *);
+    unsigned long epoch;
+    struct retired *next;
+} retired_t;
+
+/** Global epoch, starts at 1 since 0 marks an idle reader slot */
+static unsigned long rcu_epoch = 1;
+
+/** Epoch announced by each reader slot (0 if not reading) */
+static unsigned long rcu_slots[RCU_MAX_THREADS];
+
+/** Whether each reader slot is owned by a thread */
+static int rcu_owned[RCU_MAX_THREADS];
+
+/** Objects waiting to be released, only touched by the writer */
+static retired_t *rcu_limbo;
+
+/** Reader slot owned by the calling thread (-1 if none) */
+static __thread int rcu_slot = -1;
+
+/** Nesting depth of the calling thread's read-side critical sections */
+static __thread int rcu_depth;
+
+/**
+ * This function claims a reader slot for the calling thread.
+ *
+ * @return 0 if successful, -1 if all slots are taken
+ */
+static int rcu_register_thread() {
+
+    for (int i = 0; i < RCU_MAX_THREADS; i++) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&rcu_owned[i], &expected, 1, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            rcu_slot = i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * This function marks the start of a read-side critical section. Anything published
+ * with rcu_retire() that the calling thread can see stays allocated until the matching
+ * rcu_read_unlock(). It never blocks and may be nested.
+ *
+ * @return 0 if successful, -1 if there are no free reader slots
+ */
+int rcu_read_lock() {
+
+    if (rcu_slot == -1 && rcu_register_thread() == -1) {
+        return -1;
+    }
+
+    if (rcu_depth++ == 0) {
+        //Sequentially consistent so the announcement is visible before any load
+        //of a published pointer
+        unsigned long epoch = __atomic_load_n(&rcu_epoch, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&rcu_slots[rcu_slot], epoch, __ATOMIC_SEQ_CST);
+    }
+
+    return 0;
+}
+
+/**
+ * This function marks the end of a read-side critical section.
+ */
+void rcu_read_unlock() {
+
+    if (--rcu_depth == 0) {
+        __atomic_store_n(&rcu_slots[rcu_slot], 0, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * This function releases the reader slot held by the calling thread. Threads that
+ * read should call it before they exit.
+ */
+void rcu_unregister_thread() {
+
+    if (rcu_slot != -1) {
+        __atomic_store_n(&rcu_slots[rcu_slot], 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&rcu_owned[rcu_slot], 0, __ATOMIC_RELEASE);
+        rcu_slot = -1;
+        rcu_depth = 0;
+    }
+}
+
+/**
+ * This function schedules @ptr to be released with @release once no reader can still
+ * hold a reference to it. It must be called after @ptr has been unpublished, and calls
+ * must be serialized by the caller (there is only ever one writer at a time). It cannot
+ * fail: if @ptr cannot be queued, it waits for the readers and releases @ptr itself, so
+ * it must not be called from inside a read-side critical section.
+ *
+ * @param ptr the object that is no longer reachable by new readers
+ * @param release the function that frees @ptr
+ */
+void rcu_retire(void *ptr, void (*release)(void *)) {
+
+    retired_t *node = (retired_t *) malloc(sizeof(retired_t));
+    unsigned long epoch = __atomic_add_fetch(&rcu_epoch, 1, __ATOMIC_SEQ_CST);
+
+    if (!node) {
+        //Wait out every reader that entered before @ptr was unpublished
+        for (int i = 0; i < RCU_MAX_THREADS; i++) {
+            unsigned long seen = __atomic_load_n(&rcu_slots[i], __ATOMIC_SEQ_CST);
+            while (seen != 0 && seen < epoch) {
+                sched_yield();
+                seen = __atomic_load_n(&rcu_slots[i], __ATOMIC_SEQ_CST);
+            }
+        }
+
+        release(ptr);
+        return;
+    }
+
+    node->ptr = ptr;
+    node->release = release;
+    node->epoch = epoch;
+    node->next = rcu_limbo;
+    rcu_limbo = node;
+
+    rcu_reclaim();
+}
+
+/**
+ * This function releases every retired object that is no longer visible to any reader.
+ * It never waits for readers.
+ */
+void rcu_reclaim() {
+
+    //Find the oldest epoch a reader is still in
+    unsigned long oldest = __atomic_load_n(&rcu_epoch, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < RCU_MAX_THREADS; i++) {
+        unsigned long epoch = __atomic_load_n(&rcu_slots[i], __ATOMIC_SEQ_CST);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    retired_t **link = &rcu_limbo;
+    while (*link) {
+        retired_t *node = *link;
+
+        if (node->epoch <= oldest) {
+            *link = node->next;
+            node->release(node->ptr);
+            free(node);
+        } else {
+            link = &node->next;
+        }
+    }
+}
+
+/**
+ * This function waits until every retired object has been released.
+ */
+void rcu_barrier() {
+
+    rcu_reclaim();
+
+    while (rcu_limbo) {
+        sched_yield();
+        rcu_reclaim();
+    }
+}
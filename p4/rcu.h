@@ -0,0 +1,57 @@
+/**
+ * @file rcu.h
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This file acts as the interface for the rcu.c file
+ */
+
+#ifndef RCU_H
+#define RCU_H
+
+/** Maximum number of threads that may read at the same time */
+#define RCU_MAX_THREADS 64
+
+/**
+ * This function marks the start of a read-side critical section. Anything published
+ * with rcu_retire() that the calling thread can see stays allocated until the matching
+ * rcu_read_unlock(). It never blocks and may be nested.
+ *
+ * @return 0 if successful, -1 if there are no free reader slots
+ */
+int rcu_read_lock();
+
+/**
+ * This function marks the end of a read-side critical section.
+ */
+void rcu_read_unlock();
+
+/**
+ * This function releases the reader slot held by the calling thread. Threads that
+ * read should call it before they exit.
+ */
+void rcu_unregister_thread();
+
+/**
+ * This function schedules @ptr to be released with @release once no reader can still
+ * hold a reference to it. It must be called after @ptr has been unpublished, and calls
+ * must be serialized by the caller (there is only ever one writer at a time). It cannot
+ * fail: if @ptr cannot be queued, it waits for the readers and releases @ptr itself, so
+ * it must not be called from inside a read-side critical section.
+ *
+ * @param ptr the object that is no longer reachable by new readers
+ * @param release the function that frees @ptr
+ */
+void rcu_retire(void *ptr, void (*release)(void *));
+
+/**
+ * This function releases every retired object that is no longer visible to any reader.
+ * It never waits for readers.
+ */
+void rcu_reclaim();
+
+/**
+ * This function waits until every retired object has been released.
+ */
+void rcu_barrier();
+
+#endif
@@ -0,0 +1,416 @@
+/**
+ * @file replay.c
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This component is responsible for replaying captured traffic through the policy.
+ * The pcap file is mapped read-only and headers are decoded in place, so packet data is
+ * never copied. Packets are parsed in batches and each batch is then classified back to
+ * back to keep the classifier hot. With connection tracking on, the capture's timestamps
+ * drive the connection tracking clock.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "replay.h"
+#include "policy.h"
+#include "stats.h"
+#include "conntrack.h"
+
+/** Magic number of a pcap file with microsecond timestamps */
+#define PCAP_MAGIC 0xA1B2C3D4
+
+/** Magic number of a pcap file with nanosecond timestamps */
+#define PCAP_MAGIC_NS 0xA1B23C4D
+
+/** Size of the pcap global header */
+#define PCAP_HDR_LEN 24
+
+/** Offset of the link type in the pcap global header */
+#define PCAP_LINKTYPE_OFF 20
+
+/** Size of a pcap record header */
+#define PCAP_REC_LEN 16
+
+/** Offset of the timestamp's seconds in a pcap record header */
+#define PCAP_TS_SEC_OFF 0
+
+/** Offset of the captured length in a pcap record header */
+#define PCAP_INCL_OFF 8
+
+/** Link type for Ethernet */
+#define LINKTYPE_ETHERNET 1
+
+/** Size of an Ethernet header */
+#define ETH_HDR_LEN 14
+
+/** Offset of the EtherType in an Ethernet header */
+#define ETH_TYPE_OFF 12
+
+/** Size of an 802.1Q tag */
+#define VLAN_TAG_LEN 4
+
+/** EtherType for IPv4 */
+#define ETHERTYPE_IPV4 0x0800
+
+/** EtherType for IPv6 */
+#define ETHERTYPE_IPV6 0x86DD
+
+/** EtherType for an 802.1Q tag */
+#define ETHERTYPE_VLAN 0x8100
+
+/** Minimum size of an IPv4 header */
+#define IPV4_HDR_MIN 20
+
+/** Offset of the fragment field in an IPv4 header */
+#define IPV4_FRAG_OFF 6
+
+/** Mask for the fragment offset in the fragment field */
+#define IPV4_FRAG_MASK 0x1FFF
+
+/** Offset of the protocol in an IPv4 header */
+#define IPV4_PROTO_OFF 9
+
+/** Offset of the source address in an IPv4 header */
+#define IPV4_SRC_OFF 12
+
+/** Offset of the destination address in an IPv4 header */
+#define IPV4_DST_OFF 16
+
+/** Size of an IPv6 header */
+#define IPV6_HDR_LEN 40
+
+/** Offset of the next header in an IPv6 header */
+#define IPV6_NEXT_OFF 6
+
+/** Offset of the source address in an IPv6 header */
+#define IPV6_SRC_OFF 8
+
+/** Offset of the destination address in an IPv6 header */
+#define IPV6_DST_OFF 24
+
+/** Number of bytes of an IPv6 address */
+#define IPV6_ADDR_LEN 16
+
+/** IP protocol number for TCP */
+#define IPPROTO_NUM_TCP 6
+
+/** IP protocol number for UDP */
+#define IPPROTO_NUM_UDP 17
+
+/** Bytes of the transport header needed for both ports */
+#define L4_PORTS_LEN 4
+
+/** Number of nanoseconds in a second */
+#define NSEC_PER_SEC 1000000000LL
+
+/**
+ * This function reads a 16-bit big-endian value.
+ *
+ * @param p the bytes to be read
+ *
+ * @return the value
+ */
+static unsigned int be16(const unsigned char *p) {
+
+    return (p[0] << BIT_SIZE) | p[1];
+}
+
+/**
+ * This function reads a 32-bit big-endian value.
+ *
+ * @param p the bytes to be read
+ *
+ * @return the value
+ */
+static uint32_t be32(const unsigned char *p) {
+
+    return ((uint32_t) be16(p) << (BIT_SIZE * 2)) | be16(p + 2);
+}
+
+/**
+ * This function reads a 64-bit big-endian value.
+ *
+ * @param p the bytes to be read
+ *
+ * @return the value
+ */
+static uint64_t be64(const unsigned char *p) {
+
+    return ((uint64_t) be32(p) << KEY_ADDR_BITS) | be32(p + 4);
+}
+
+/**
+ * This function reads an IPv6 address.
+ *
+ * @param p the bytes to be read
+ *
+ * @return the address
+ */
+static ipv6_t read_ipv6(const unsigned char *p) {
+
+    ipv6_t addr = {{ be64(p), be64(p + IPV6_ADDR_LEN / 2) }};
+
+    return addr;
+}
+
+/**
+ * This function reads a 32-bit value in the byte order of the pcap file.
+ *
+ * @param p the bytes to be read
+ * @param swap whether the file was written on a machine of the other byte order
+ *
+ * @return the value
+ */
+static unsigned int rd32(const unsigned char *p, int swap) {
+
+    unsigned int v;
+    memcpy(&v, p, sizeof(v));
+
+    if (swap) {
+        v = __builtin_bswap32(v);
+    }
+
+    return v;
+}
+
+/**
+ * This function maps an IP protocol number onto the protocols rules match.
+ *
+ * @param number the IP protocol number
+ * @param protocol the value to be updated with the protocol
+ *
+ * @return 0 if successful, -1 if it is neither TCP nor UDP
+ */
+static int decode_protocol(unsigned int number, protocol_t *protocol) {
+
+    if (number == IPPROTO_NUM_TCP) {
+        *protocol = PROTO_TCP;
+    } else if (number == IPPROTO_NUM_UDP) {
+        *protocol = PROTO_UDP;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * This function decodes an IPv6 packet into @pkt. Only a TCP or UDP header straight
+ * after the IPv6 header is decoded; packets with extension headers are skipped.
+ *
+ * @param ip the captured bytes of the packet
+ * @param len the number of captured bytes
+ * @param pkt the packet to be populated
+ *
+ * @return 0 if successful, -1 if the packet is not TCP or UDP
+ */
+static int decode_ipv6(const unsigned char *ip, unsigned int len, packet6_t *pkt) {
+
+    protocol_t protocol;
+
+    if (len < IPV6_HDR_LEN + L4_PORTS_LEN || (ip[0] >> 4) != 6
+            || decode_protocol(ip[IPV6_NEXT_OFF], &protocol) == -1) {
+        return -1;
+    }
+
+    const unsigned char *l4 = ip + IPV6_HDR_LEN;
+    ipv6_t src = read_ipv6(ip + IPV6_SRC_OFF);
+    ipv6_t dst = read_ipv6(ip + IPV6_DST_OFF);
+
+    *pkt = packet_key6(protocol, &src, be16(l4), &dst, be16(l4 + 2));
+
+    return 0;
+}
+
+/**
+ * This function decodes one captured Ethernet frame into @pkt.
+ *
+ * @param frame the captured bytes of the frame
+ * @param len the number of captured bytes
+ * @param pkt the packet to be populated (only its key for an IPv4 packet)
+ *
+ * @return 0 if successful, -1 if the frame is not TCP or UDP over IPv4 or IPv6
+ */
+static int decode_frame(const unsigned char *frame, unsigned int len,
+        packet6_t *pkt) {
+
+    if (len < ETH_HDR_LEN) {
+        return -1;
+    }
+
+    unsigned int off = ETH_HDR_LEN;
+    unsigned int type = be16(frame + ETH_TYPE_OFF);
+
+    while (type == ETHERTYPE_VLAN && len >= off + VLAN_TAG_LEN) {
+        type = be16(frame + off + 2);
+        off += VLAN_TAG_LEN;
+    }
+
+    if (type == ETHERTYPE_IPV6) {
+        return decode_ipv6(frame + off, len - off, pkt);
+    }
+
+    if (type != ETHERTYPE_IPV4 || len < off + IPV4_HDR_MIN) {
+        return -1;
+    }
+
+    const unsigned char *ip = frame + off;
+    unsigned int ihl = (ip[0] & 0x0F) * 4;
+
+    if ((ip[0] >> 4) != 4 || ihl < IPV4_HDR_MIN
+            || len < off + ihl + L4_PORTS_LEN) {
+        return -1;
+    }
+
+    //Only the first fragment carries the ports
+    if (be16(ip + IPV4_FRAG_OFF) & IPV4_FRAG_MASK) {
+        return -1;
+    }
+
+    protocol_t protocol;
+
+    if (decode_protocol(ip[IPV4_PROTO_OFF], &protocol) == -1) {
+        return -1;
+    }
+
+    //Addresses are in network order, which is the order they are packed in
+    const unsigned char *l4 = ip + ihl;
+    pkt->key = packet_key(protocol, be32(ip + IPV4_SRC_OFF), be16(l4),
+            be32(ip + IPV4_DST_OFF), be16(l4 + 2));
+
+    return 0;
+}
+
+/**
+ * This function classifies every TCP and UDP packet over IPv4 or IPv6 in the pcap
+ * file @filename against the current policy and prints the throughput, per-action
+ * counts and latency distribution to @stream. The latencies are the ones the policy
+ * records for each packet it classifies, so packets of established connections are
+ * left out of them.
+ *
+ * @param filename the name of the pcap file to replay
+ * @param stream the file stream to print to
+ *
+ * @return 0 if successful, -1 if the file could not be read
+ */
+int replay_pcap(char *filename, FILE *stream) {
+
+    int fd = open(filename, O_RDONLY);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < PCAP_HDR_LEN) {
+        close(fd);
+        return -1;
+    }
+
+    size_t size = st.st_size;
+    const unsigned char *map = (const unsigned char *) mmap(NULL, size,
+            PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    madvise((void *) map, size, MADV_SEQUENTIAL);
+
+    //Work out the byte order from the magic number
+    unsigned int magic = rd32(map, 0);
+    int swap = 0;
+    if (magic != PCAP_MAGIC && magic != PCAP_MAGIC_NS) {
+        swap = 1;
+        magic = rd32(map, 1);
+    }
+
+    if ((magic != PCAP_MAGIC && magic != PCAP_MAGIC_NS)
+            || rd32(map + PCAP_LINKTYPE_OFF, swap) != LINKTYPE_ETHERNET) {
+        munmap((void *) map, size);
+        return -1;
+    }
+
+    unsigned long counts[2] = { 0, 0 };
+    unsigned long via_default = 0;
+    unsigned long established = 0;
+    unsigned long skipped = 0;
+
+    packet6_t batch[REPLAY_BATCH];
+    unsigned long stamps[REPLAY_BATCH];
+    unsigned long clock_base = conntrack_now();
+    unsigned long first = 0;
+    int started = 0;
+    size_t off = PCAP_HDR_LEN;
+    long long start = stats_now_ns();
+
+    while (off + PCAP_REC_LEN <= size) {
+
+        //Parse a batch of packets
+        int n = 0;
+        while (n < REPLAY_BATCH && off + PCAP_REC_LEN <= size) {
+            unsigned int incl = rd32(map + off + PCAP_INCL_OFF, swap);
+            unsigned long ts = rd32(map + off + PCAP_TS_SEC_OFF, swap);
+            const unsigned char *frame = map + off + PCAP_REC_LEN;
+
+            if (incl > size - off - PCAP_REC_LEN) {
+                //Truncated capture, stop at the last complete record
+                off = size;
+                break;
+            }
+            off += PCAP_REC_LEN + incl;
+
+            if (!started) {
+                first = ts;
+                started = 1;
+            }
+
+            if (decode_frame(frame, incl, &batch[n]) == 0) {
+                stamps[n++] = ts >= first ? clock_base + ts - first : clock_base;
+            } else {
+                skipped++;
+            }
+        }
+
+        //Classify the batch
+        for (int i = 0; i < n; i++) {
+            int pos;
+            conntrack_advance(stamps[i]);
+
+            int action = conntrack_test(&batch[i].key, &pos);
+            counts[action == ACTION_ALLOW ? ACTION_ALLOW : ACTION_DENY]++;
+            if (pos == -1) {
+                via_default++;
+            } else if (pos == CONNTRACK_ESTABLISHED) {
+                established++;
+            }
+        }
+    }
+
+    long long elapsed = stats_now_ns() - start;
+    munmap((void *) map, size);
+
+    unsigned long total = counts[ACTION_ALLOW] + counts[ACTION_DENY];
+    double secs = elapsed > 0 ? (double) elapsed / NSEC_PER_SEC : 0.0;
+
+    fprintf(stream, "Replayed %lu packets in %.6f s", total, secs);
+    if (secs > 0.0) {
+        fprintf(stream, " (%.0f packets/sec)", total / secs);
+    }
+    fprintf(stream, "\n");
+    fprintf(stream, "Allowed: %lu\n", counts[ACTION_ALLOW]);
+    fprintf(stream, "Denied: %lu\n", counts[ACTION_DENY]);
+    fprintf(stream, "Via default policy: %lu\n", via_default);
+    if (conntrack_enabled()) {
+        fprintf(stream, "Via established connection: %lu\n", established);
+    }
+    fprintf(stream, "Skipped (not TCP/UDP over IPv4/IPv6): %lu\n", skipped);
+
+    stats_print_latency(stream);
+
+    return 0;
+}
@@ -0,0 +1,28 @@
+/**
+ * @file replay.h
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This file acts as the interface for the replay.c file
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdio.h>
+
+/** Number of packets parsed before they are classified together */
+#define REPLAY_BATCH 64
+
+/**
+ * This function classifies every TCP and UDP packet over IPv4 or IPv6 in the pcap
+ * file @filename against the current policy and prints the throughput, per-action
+ * counts and latency distribution to @stream.
+ *
+ * @param filename the name of the pcap file to replay
+ * @param stream the file stream to print to
+ *
+ * @return 0 if successful, -1 if the file could not be read
+ */
+int replay_pcap(char *filename, FILE *stream);
+
+#endif
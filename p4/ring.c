@@ -0,0 +1,119 @@
+/**
+ * @file ring.c
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This component is responsible for passing items between two threads without locks.
+ * The producer publishes items by advancing the head with a release store, and the
+ * consumer frees slots by advancing the tail the same way, so each side only ever
+ * reads the other's counter. Each side rereads the other's counter only when its last
+ * view says the ring is full (or empty), which keeps the shared cache lines quiet
+ * while both sides are busy.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "ring.h"
+
+/**
+ * This function creates an empty ring.
+ *
+ * @param slots the number of items it holds (a power of two)
+ * @param item the size of an item in bytes
+ *
+ * @return the ring, or NULL if memory runs out
+ */
+ring_t *ring_new(size_t slots, size_t item) {
+
+    void *mem;
+
+    if (posix_memalign(&mem, RING_CACHE_LINE, sizeof(ring_t)) != 0) {
+        return NULL;
+    }
+
+    ring_t *ring = (ring_t *) mem;
+
+    memset(ring, 0, sizeof(ring_t));
+    ring->slots = (char *) malloc(slots * item);
+    ring->mask = slots - 1;
+    ring->item = item;
+
+    if (!ring->slots) {
+        free(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+/**
+ * This function adds an item to the ring. Only the producer may call it.
+ *
+ * @param ring the ring
+ * @param item the item to be copied in
+ *
+ * @return 0 if successful, -1 if the ring is full
+ */
+int ring_push(ring_t *ring, const void *item) {
+
+    size_t head = ring->head;
+
+    if (head - ring->tail_seen > ring->mask) {
+        ring->tail_seen = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+        if (head - ring->tail_seen > ring->mask) {
+            return -1;
+        }
+    }
+
+    memcpy(ring->slots + (head & ring->mask) * ring->item, item, ring->item);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/**
+ * This function takes up to @max items off the ring. Only the consumer may call it.
+ *
+ * @param ring the ring
+ * @param items the buffer the items are copied to
+ * @param max the most items taken
+ *
+ * @return the number of items taken, 0 if the ring is empty
+ */
+size_t ring_pop(ring_t *ring, void *items, size_t max) {
+
+    size_t tail = ring->tail;
+
+    if (ring->head_seen == tail) {
+        ring->head_seen = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    }
+
+    size_t n = ring->head_seen - tail;
+    if (n > max) {
+        n = max;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        memcpy((char *) items + i * ring->item,
+                ring->slots + ((tail + i) & ring->mask) * ring->item, ring->item);
+    }
+
+    if (n > 0) {
+        __atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
+    }
+
+    return n;
+}
+
+/**
+ * This function frees a ring.
+ *
+ * @param ring the ring
+ */
+void ring_free(ring_t *ring) {
+
+    if (ring) {
+        free(ring->slots);
+        free(ring);
+    }
+}
@@ -0,0 +1,76 @@
+/**
+ * @file ring.h
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This file acts as the interface for the ring.c file
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+
+/** Size of a cache line, which the two ends of a ring are kept apart by */
+#define RING_CACHE_LINE 64
+
+/**
+ * Representation of a bounded single-producer/single-consumer ring of fixed-size items.
+ * Each end is written by one thread only and sits on its own cache line, along with
+ * that thread's last view of the other end.
+ * .head: the number of items ever pushed, written by the producer
+ * .tail_seen: the producer's last view of .tail
+ * .tail: the number of items ever popped, written by the consumer
+ * .head_seen: the consumer's last view of .head
+ * .slots: the items
+ * .mask: the number of slots less one
+ * .item: the size of an item in bytes
+ */
+typedef struct ring {
+    size_t head __attribute__((aligned(RING_CACHE_LINE)));
+    size_t tail_seen;
+    size_t tail __attribute__((aligned(RING_CACHE_LINE)));
+    size_t head_seen;
+    char *slots __attribute__((aligned(RING_CACHE_LINE)));
+    size_t mask;
+    size_t item;
+} ring_t;
+
+/**
+ * This function creates an empty ring.
+ *
+ * @param slots the number of items it holds (a power of two)
+ * @param item the size of an item in bytes
+ *
+ * @return the ring, or NULL if memory runs out
+ */
+ring_t *ring_new(size_t slots, size_t item);
+
+/**
+ * This function adds an item to the ring. Only the producer may call it.
+ *
+ * @param ring the ring
+ * @param item the item to be copied in
+ *
+ * @return 0 if successful, -1 if the ring is full
+ */
+int ring_push(ring_t *ring, const void *item);
+
+/**
+ * This function takes up to @max items off the ring. Only the consumer may call it.
+ *
+ * @param ring the ring
+ * @param items the buffer the items are copied to
+ * @param max the most items taken
+ *
+ * @return the number of items taken, 0 if the ring is empty
+ */
+size_t ring_pop(ring_t *ring, void *items, size_t max);
+
+/**
+ * This function frees a ring.
+ *
+ * @param ring the ring
+ */
+void ring_free(ring_t *ring);
+
+#endif
@@ -0,0 +1,284 @@
+/**
+ * @file sketch.c
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This component is responsible for finding the heaviest keys of a stream in bounded
+ * memory. A Count-Min sketch estimates how often each key was seen: every key bumps
+ * one counter in each of SKETCH_DEPTH rows and its estimate is the smallest of them,
+ * which collisions can only inflate. Beside it the sketch keeps the SKETCH_CANDIDATES
+ * keys with the highest estimates, replacing the lowest one whenever a key overtakes
+ * it, the way Space-Saving does.
+ *
+ * Counting a key costs one hash and SKETCH_DEPTH counter bumps. The candidates are only
+ * looked at once a key's estimate passes the lowest of them, and then through a small
+ * table indexed by the hash, so the list is only searched when a key first becomes
+ * heavy. A key has to pass the lowest candidate by a margin to replace it, which keeps
+ * traffic spread evenly over many keys from churning the list on every packet. Sketches of the same stream split between threads merge by adding their
+ * counters, so each thread counts into a sketch of its own.
+ */
+
+#include "sketch.h"
+
+/** Multipliers used for hashing keys */
+#define SKETCH_HASH_MULT 0x9E3779B97F4A7C15ULL
+#define SKETCH_HASH_MULT2 0xC4CEB9FE1A85EC53ULL
+
+/** Number of bits in a word of the hash */
+#define SKETCH_HASH_BITS 64
+
+/** Number of times a reader tries to copy a candidate its owner keeps replacing */
+#define SKETCH_READ_TRIES 8
+
+/**
+ * This function hashes a key. The low bits index the rows of counters and the high
+ * bits the table of candidates.
+ *
+ * @param key the key
+ *
+ * @return the hash
+ */
+static uint64_t key_hash(const sketch_key_t *key) {
+
+    uint64_t h = key->w[0] * SKETCH_HASH_MULT ^ key->w[1];
+
+    h ^= h >> (SKETCH_HASH_BITS / 2);
+    h *= SKETCH_HASH_MULT2;
+
+    return h ^ h >> (SKETCH_HASH_BITS / 2 - 3);
+}
+
+/**
+ * This function finds the counter a hash bumps in one row.
+ *
+ * @param h the hash
+ * @param d the row
+ *
+ * @return the index of the counter within the row
+ */
+static unsigned int row_index(uint64_t h, int d) {
+
+    return (h >> (d * SKETCH_WIDTH_BITS)) & (SKETCH_WIDTH - 1);
+}
+
+/**
+ * This function finds the entry of the table of candidates a hash is kept at.
+ *
+ * @param h the hash
+ *
+ * @return the index of the entry
+ */
+static unsigned int index_slot(uint64_t h) {
+
+    return h >> (SKETCH_HASH_BITS - SKETCH_INDEX_BITS);
+}
+
+/**
+ * This function checks whether two keys are the same.
+ *
+ * @param a the first key
+ * @param b the second key
+ *
+ * @return 1 if they are, 0 if not
+ */
+static int key_equal(const sketch_key_t *a, const sketch_key_t *b) {
+
+    return a->w[0] == b->w[0] && a->w[1] == b->w[1];
+}
+
+/**
+ * This function writes the key of a candidate while readers may be copying it.
+ *
+ * @param c the candidate
+ * @param key the key
+ */
+static void candidate_set(sketch_candidate_t *c, const sketch_key_t *key) {
+
+    uint32_t seq = c->seq;
+
+    __atomic_store_n(&c->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&c->key.w[0], key->w[0], __ATOMIC_RELAXED);
+    __atomic_store_n(&c->key.w[1], key->w[1], __ATOMIC_RELAXED);
+    __atomic_store_n(&c->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * This function finds the lowest count of the candidates.
+ *
+ * @param s the sketch, which must have at least one candidate
+ *
+ * @return the index of the candidate with the lowest count
+ */
+static int candidate_min(sketch_t *s) {
+
+    int min = 0;
+
+    for (int i = 1; i < s->len; i++) {
+        if (s->candidates[i].count < s->candidates[min].count) {
+            min = i;
+        }
+    }
+
+    return min;
+}
+
+/**
+ * This function offers a key whose estimate has passed the floor to the candidates.
+ * It is brought up to date if it is one already, added if there is room, and otherwise
+ * replaces the candidate with the lowest count if it has overtaken it.
+ *
+ * @param s the sketch
+ * @param key the key
+ * @param h the hash of the key
+ * @param est the estimated count of the key
+ */
+static void candidate_offer(sketch_t *s, const sketch_key_t *key, uint64_t h,
+        uint32_t est) {
+
+    int found = -1;
+
+    for (int i = 0; i < s->len && found == -1; i++) {
+        if (key_equal(&s->candidates[i].key, key)) {
+            found = i;
+        }
+    }
+
+    if (found == -1 && s->len < SKETCH_CANDIDATES) {
+        found = s->len;
+        candidate_set(&s->candidates[found], key);
+        __atomic_store_n(&s->len, s->len + 1, __ATOMIC_RELEASE);
+    } else if (found == -1) {
+        int min = candidate_min(s);
+
+        if (est <= s->candidates[min].count) {
+            s->floor = s->candidates[min].count;
+            return;
+        }
+
+        found = min;
+        candidate_set(&s->candidates[found], key);
+    }
+
+    s->candidates[found].count = est;
+    s->index[index_slot(h)] = found + 1;
+
+    if (s->len == SKETCH_CANDIDATES) {
+        s->floor = s->candidates[candidate_min(s)].count;
+    }
+}
+
+/**
+ * This function counts one occurrence of a key. Only the sketch's owner may call it.
+ *
+ * @param s the sketch
+ * @param key the key
+ */
+void sketch_update(sketch_t *s, const sketch_key_t *key) {
+
+    uint64_t h = key_hash(key);
+    uint32_t est = UINT32_MAX;
+
+    for (int d = 0; d < SKETCH_DEPTH; d++) {
+        uint32_t *counter = &s->rows[d][row_index(h, d)];
+        uint32_t n = __atomic_load_n(counter, __ATOMIC_RELAXED) + 1;
+
+        __atomic_store_n(counter, n, __ATOMIC_RELAXED);
+        est = n < est ? n : est;
+    }
+
+    __atomic_store_n(&s->total, s->total + 1, __ATOMIC_RELAXED);
+
+    if (est <= s->floor) {
+        return;
+    }
+
+    //Most keys heavy enough to get here are candidates already
+    int slot = s->index[index_slot(h)];
+
+    if (slot && key_equal(&s->candidates[slot - 1].key, key)) {
+        s->candidates[slot - 1].count = est;
+        return;
+    }
+
+    //When many keys are about as heavy, they would otherwise keep replacing each other
+    if (s->len == SKETCH_CANDIDATES && est - s->floor <= s->floor >> SKETCH_MARGIN_BITS) {
+        return;
+    }
+
+    candidate_offer(s, key, h, est);
+}
+
+/**
+ * This function adds the counters of one sketch to another, which must not be
+ * updated concurrently. The sketch added may be.
+ *
+ * @param into the sketch to add to
+ * @param from the sketch to add
+ */
+void sketch_merge(sketch_t *into, sketch_t *from) {
+
+    for (int d = 0; d < SKETCH_DEPTH; d++) {
+        for (int i = 0; i < SKETCH_WIDTH; i++) {
+            into->rows[d][i] += __atomic_load_n(&from->rows[d][i], __ATOMIC_RELAXED);
+        }
+    }
+
+    into->total += __atomic_load_n(&from->total, __ATOMIC_RELAXED);
+}
+
+/**
+ * This function estimates how many times a key was counted. The estimate is never
+ * below the true count.
+ *
+ * @param s the sketch, which must not be updated concurrently
+ * @param key the key
+ *
+ * @return the estimate
+ */
+unsigned long sketch_estimate(sketch_t *s, const sketch_key_t *key) {
+
+    uint64_t h = key_hash(key);
+    uint32_t est = UINT32_MAX;
+
+    for (int d = 0; d < SKETCH_DEPTH; d++) {
+        uint32_t n = s->rows[d][row_index(h, d)];
+        est = n < est ? n : est;
+    }
+
+    return est;
+}
+
+/**
+ * This function copies out the heaviest keys a sketch has seen, in no particular order.
+ * The sketch may be updated concurrently.
+ *
+ * @param s the sketch
+ * @param keys the array to be populated, SKETCH_CANDIDATES long
+ *
+ * @return the number of keys
+ */
+int sketch_candidates(sketch_t *s, sketch_key_t *keys) {
+
+    int len = __atomic_load_n(&s->len, __ATOMIC_ACQUIRE);
+    int n = 0;
+
+    for (int i = 0; i < len; i++) {
+        sketch_candidate_t *c = &s->candidates[i];
+
+        //A candidate being replaced is skipped if it keeps changing under the copy
+        for (int t = 0; t < SKETCH_READ_TRIES; t++) {
+            uint32_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+
+            keys[n].w[0] = __atomic_load_n(&c->key.w[0], __ATOMIC_RELAXED);
+            keys[n].w[1] = __atomic_load_n(&c->key.w[1], __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+            if (!(seq & 1) && __atomic_load_n(&c->seq, __ATOMIC_RELAXED) == seq) {
+                n++;
+                break;
+            }
+        }
+    }
+
+    return n;
+}
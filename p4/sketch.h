@@ -0,0 +1,115 @@
+/**
+ * @file sketch.h
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This file acts as the interface for the sketch.c file
+ */
+
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdint.h>
+
+/** Number of rows of counters, each indexed by its own bits of the key's hash */
+#define SKETCH_DEPTH 2
+
+/** Number of bits of the hash that index a row */
+#define SKETCH_WIDTH_BITS 11
+
+/** Number of counters in a row */
+#define SKETCH_WIDTH (1 << SKETCH_WIDTH_BITS)
+
+/** Number of heavy hitters each sketch keeps track of */
+#define SKETCH_CANDIDATES 64
+
+/** A key must overtake the lowest candidate by 1 / 2^SKETCH_MARGIN_BITS to replace it */
+#define SKETCH_MARGIN_BITS 3
+
+/** Number of bits of the hash that index the table of candidates */
+#define SKETCH_INDEX_BITS 10
+
+/** Number of entries in the table of candidates */
+#define SKETCH_INDEX_SIZE (1 << SKETCH_INDEX_BITS)
+
+/**
+ * Representation of a key counted by a sketch
+ * .w: the key, as two words
+ */
+typedef struct sketch_key {
+    uint64_t w[2];
+} sketch_key_t;
+
+/**
+ * Representation of a key the sketch counts as one of the heaviest. The key is
+ * guarded by a sequence number, odd while the owner replaces it, so a reader
+ * never sees half of two keys.
+ * .key: the key
+ * .count: the key's estimated count when it was last seen
+ * .seq: the sequence number
+ */
+typedef struct sketch_candidate {
+    sketch_key_t key;
+    uint32_t count;
+    uint32_t seq;
+} sketch_candidate_t;
+
+/**
+ * Representation of a Count-Min sketch with the heaviest keys it has seen kept beside
+ * it. Only its owner updates it, though other threads may read it at any time.
+ * .rows: the counters, SKETCH_DEPTH rows of SKETCH_WIDTH
+ * .total: the number of keys counted
+ * .candidates: the heaviest keys
+ * .len: the number of candidates
+ * .floor: no more than the smallest count of a candidate once there are
+ * SKETCH_CANDIDATES of them, and 0 before
+ * .index: the candidate (plus one) each hash was last seen at, or 0
+ */
+typedef struct sketch {
+    uint32_t rows[SKETCH_DEPTH][SKETCH_WIDTH];
+    unsigned long total;
+    sketch_candidate_t candidates[SKETCH_CANDIDATES];
+    int len;
+    uint32_t floor;
+    uint8_t index[SKETCH_INDEX_SIZE];
+} sketch_t;
+
+/**
+ * This function counts one occurrence of a key. Only the sketch's owner may call it.
+ *
+ * @param s the sketch
+ * @param key the key
+ */
+void sketch_update(sketch_t *s, const sketch_key_t *key);
+
+/**
+ * This function adds the counters of one sketch to another, which must not be
+ * updated concurrently. The sketch added may be.
+ *
+ * @param into the sketch to add to
+ * @param from the sketch to add
+ */
+void sketch_merge(sketch_t *into, sketch_t *from);
+
+/**
+ * This function estimates how many times a key was counted. The estimate is never
+ * below the true count.
+ *
+ * @param s the sketch, which must not be updated concurrently
+ * @param key the key
+ *
+ * @return the estimate
+ */
+unsigned long sketch_estimate(sketch_t *s, const sketch_key_t *key);
+
+/**
+ * This function copies out the heaviest keys a sketch has seen, in no particular order.
+ * The sketch may be updated concurrently.
+ *
+ * @param s the sketch
+ * @param keys the array to be populated, SKETCH_CANDIDATES long
+ *
+ * @return the number of keys
+ */
+int sketch_candidates(sketch_t *s, sketch_key_t *keys);
+
+#endif
@@ -0,0 +1,676 @@
+/**
+ * @file stats.c
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This component is responsible for counting classified packets per rule and timing
+ * classification. Every thread counts into its own shard, so the classification path
+ * never contends on a shared cache line; the shards are only summed when read.
+ * Counters are kept in fixed-size chunks that are never moved, so a reader can merge
+ * them while their owner keeps counting. Each shard also holds sketches of the talkers
+ * of each verdict (see sketch.c), merged the same way when read.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "stats.h"
+
+/** Number of nanoseconds in a second */
+#define NSEC_PER_SEC 1000000000LL
+
+/** Used for turning a ratio into a percentage */
+#define PERCENT 100.0
+
+/** Used for turning a percentile into a rank */
+#define PERCENT_INT 100
+
+/** Percentiles reported from the latency histogram */
+#define P50 50
+#define P90 90
+#define P99 99
+
+/** Initial capacity of the list of released rule ids */
+#define FREE_IDS_INIT 64
+
+/**
+ * Representation of one thread's counters
+ * .chunks: the per-rule hit counters, indexed by rule id
+ * .def: the number of packets handled by the default policy
+ * .packets: the number of packets classified
+ * .hist: the classification latency histogram
+ * .lookups: the number of lookups made through an engine's index
+ * .steps: the number of index steps (nodes, blocks) those lookups took
+ * .rules: the number of rules those lookups compared the packet against
+ * .rejected: the number of packets the filter found no rule could match
+ * .passed: the number of packets the filter let through to the rules
+ * .unmatched: the number of packets let through that no rule matched
+ * .cache_hits: the number of lookups that hit the thread's flow cache
+ * .cache_misses: the number of lookups that missed the thread's flow cache
+ * .talkers: the talker sketches, STATS_TALKER_KINDS for each verdict, or NULL until the
+ * thread counts a talker
+ * .next: the next shard
+ */
+typedef struct stats_shard {
+    unsigned long *chunks[STATS_MAX_CHUNKS];
+    unsigned long def;
+    unsigned long packets;
+    unsigned long hist[STATS_LAT_BUCKETS];
+    unsigned long lookups;
+    unsigned long steps;
+    unsigned long rules;
+    unsigned long rejected;
+    unsigned long passed;
+    unsigned long unmatched;
+    unsigned long cache_hits;
+    unsigned long cache_misses;
+    sketch_t *talkers;
+    struct stats_shard *next;
+} stats_shard_t;
+
+/** Every thread's shard */
+static stats_shard_t *shards;
+
+/** The calling thread's shard */
+static __thread stats_shard_t *shard;
+
+/** Protects the list of shards and the rule id allocator */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Ids that have been released and can be handed out again */
+static int *free_ids;
+
+/** Number of released ids */
+static int free_len;
+
+/** Capacity of the list of released ids */
+static int free_cap;
+
+/** Next id that has never been handed out */
+static int next_id;
+
+/**
+ * This function reads the monotonic clock.
+ *
+ * @return the current time in nanoseconds
+ */
+long long stats_now_ns() {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * This function finds the latency histogram bucket of a classification time.
+ *
+ * @param ns the time in nanoseconds
+ *
+ * @return the bucket, where bucket i holds times below 2^(i+1) ns
+ */
+int stats_lat_bucket(long long ns) {
+
+    int b = 0;
+    while (b < STATS_LAT_BUCKETS - 1 && (ns >> (b + 1)) > 0) {
+        b++;
+    }
+
+    return b;
+}
+
+/**
+ * This function finds the upper bound of the bucket that holds a percentile.
+ *
+ * @param hist the latency histogram
+ * @param total the number of samples in the histogram
+ * @param pct the percentile
+ *
+ * @return the upper bound in nanoseconds
+ */
+static long long lat_percentile(unsigned long *hist, unsigned long total,
+        int pct) {
+
+    unsigned long want = (total * pct + PERCENT_INT - 1) / PERCENT_INT;
+    unsigned long seen = 0;
+
+    for (int b = 0; b < STATS_LAT_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= want && seen > 0) {
+            return 1LL << (b + 1);
+        }
+    }
+
+    return 1LL << STATS_LAT_BUCKETS;
+}
+
+/**
+ * This function prints a latency histogram with its percentiles.
+ *
+ * @param stream the file stream to print to
+ * @param hist the histogram, STATS_LAT_BUCKETS buckets long
+ */
+void stats_print_histogram(FILE *stream, unsigned long *hist) {
+
+    unsigned long total = 0;
+    for (int b = 0; b < STATS_LAT_BUCKETS; b++) {
+        total += hist[b];
+    }
+
+    if (total == 0) {
+        fprintf(stream, "Latency: no packets classified\n");
+        return;
+    }
+
+    fprintf(stream, "Latency: p50 < %lld ns, p90 < %lld ns, p99 < %lld ns\n",
+            lat_percentile(hist, total, P50), lat_percentile(hist, total, P90),
+            lat_percentile(hist, total, P99));
+
+    for (int b = 0; b < STATS_LAT_BUCKETS; b++) {
+        if (hist[b]) {
+            fprintf(stream, "  < %8lld ns: %lu (%.1f%%)\n", 1LL << (b + 1),
+                    hist[b], PERCENT * hist[b] / total);
+        }
+    }
+}
+
+/**
+ * This function creates and registers the calling thread's shard.
+ *
+ * @return the shard, or NULL if it could not be allocated
+ */
+static stats_shard_t *shard_register() {
+
+    stats_shard_t *s = (stats_shard_t *) calloc(1, sizeof(stats_shard_t));
+
+    if (s) {
+        pthread_mutex_lock(&stats_lock);
+        s->next = shards;
+        __atomic_store_n(&shards, s, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&stats_lock);
+    }
+
+    return s;
+}
+
+/**
+ * This function adds one to a counter owned by the calling thread. Other threads may
+ * read it at any time.
+ *
+ * @param counter the counter
+ */
+static void bump(unsigned long *counter) {
+
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + 1,
+            __ATOMIC_RELAXED);
+}
+
+/**
+ * This function adds to a counter owned by the calling thread. Other threads may read
+ * it at any time.
+ *
+ * @param counter the counter
+ * @param n the amount to be added
+ */
+static void bump_by(unsigned long *counter, unsigned long n) {
+
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+            __ATOMIC_RELAXED);
+}
+
+/**
+ * This function hands out an id for a new rule. Ids are reused once released.
+ *
+ * @return the id, or -1 if there are no ids left
+ */
+int stats_rule_id_alloc() {
+
+    int id = -1;
+
+    pthread_mutex_lock(&stats_lock);
+
+    if (free_len > 0) {
+        id = free_ids[--free_len];
+    } else if (next_id < STATS_MAX_CHUNKS * STATS_CHUNK_SIZE) {
+        id = next_id++;
+    }
+
+    pthread_mutex_unlock(&stats_lock);
+
+    return id;
+}
+
+/**
+ * This function hands out @n consecutive fresh ids at once, for rules that are created
+ * together. Each id is released on its own like one from stats_rule_id_alloc().
+ *
+ * @param n the number of ids
+ *
+ * @return the first id, or -1 if there are not enough ids left
+ */
+int stats_rule_id_alloc_range(int n) {
+
+    int id = -1;
+
+    pthread_mutex_lock(&stats_lock);
+
+    if (n >= 0 && next_id <= STATS_MAX_CHUNKS * STATS_CHUNK_SIZE - n) {
+        id = next_id;
+        next_id += n;
+    }
+
+    pthread_mutex_unlock(&stats_lock);
+
+    return id;
+}
+
+/**
+ * This function releases the id of a rule that no reader can see any more and resets
+ * its counters.
+ *
+ * @param id the id of the rule
+ */
+void stats_rule_id_release(int id) {
+
+    if (id < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&stats_lock);
+
+    for (stats_shard_t *s = shards; s; s = s->next) {
+        unsigned long *chunk = __atomic_load_n(&s->chunks[id >> STATS_CHUNK_BITS],
+                __ATOMIC_ACQUIRE);
+        if (chunk) {
+            __atomic_store_n(&chunk[id & (STATS_CHUNK_SIZE - 1)], 0,
+                    __ATOMIC_RELAXED);
+        }
+    }
+
+    if (free_len == free_cap) {
+        int cap = free_cap ? free_cap * 2 : FREE_IDS_INIT;
+        int *grown = (int *) realloc(free_ids, cap * sizeof(int));
+
+        if (!grown) {
+            //Losing the id only wastes one counter
+            pthread_mutex_unlock(&stats_lock);
+            return;
+        }
+        free_ids = grown;
+        free_cap = cap;
+    }
+    free_ids[free_len++] = id;
+
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/**
+ * This function records one classified packet in the calling thread's counters.
+ *
+ * @param id the id of the matched rule, or STATS_DEFAULT
+ * @param ns how long the classification took in nanoseconds
+ */
+void stats_count(int id, long long ns) {
+
+    if (!shard && !(shard = shard_register())) {
+        return;
+    }
+
+    bump(&shard->packets);
+    bump(&shard->hist[stats_lat_bucket(ns)]);
+
+    if (id == STATS_DEFAULT) {
+        bump(&shard->def);
+        return;
+    }
+
+    if (id < 0) {
+        return;
+    }
+
+    unsigned long **slot = &shard->chunks[id >> STATS_CHUNK_BITS];
+    if (!*slot) {
+        unsigned long *chunk = (unsigned long *) calloc(STATS_CHUNK_SIZE,
+                sizeof(unsigned long));
+        if (!chunk) {
+            return;
+        }
+        __atomic_store_n(slot, chunk, __ATOMIC_RELEASE);
+    }
+
+    bump(&(*slot)[id & (STATS_CHUNK_SIZE - 1)]);
+}
+
+/**
+ * This function records the work of one lookup through an engine's index in the
+ * calling thread's counters.
+ *
+ * @param steps the number of index steps (nodes, blocks) the lookup took
+ * @param rules the number of rules the packet was compared against
+ */
+void stats_engine_count(unsigned int steps, unsigned int rules) {
+
+    if (!shard && !(shard = shard_register())) {
+        return;
+    }
+
+    bump(&shard->lookups);
+    bump_by(&shard->steps, steps);
+    bump_by(&shard->rules, rules);
+}
+
+/**
+ * This function sums the work of lookups through an engine's index over every thread.
+ *
+ * @param lookups the value to be updated with the number of lookups
+ * @param steps the value to be updated with the number of index steps they took
+ * @param rules the value to be updated with the number of rules they compared
+ */
+void stats_engine(unsigned long *lookups, unsigned long *steps, unsigned long *rules) {
+
+    *lookups = 0;
+    *steps = 0;
+    *rules = 0;
+
+    for (stats_shard_t *s = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); s;
+            s = s->next) {
+        *lookups += __atomic_load_n(&s->lookups, __ATOMIC_RELAXED);
+        *steps += __atomic_load_n(&s->steps, __ATOMIC_RELAXED);
+        *rules += __atomic_load_n(&s->rules, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * This function records one packet checked against the filter of the IPv4 rules in the
+ * calling thread's counters.
+ *
+ * @param passed whether the filter let the packet through to the rules
+ * @param matched whether a rule matched the packet once let through
+ */
+void stats_filter_count(int passed, int matched) {
+
+    if (!shard && !(shard = shard_register())) {
+        return;
+    }
+
+    if (!passed) {
+        bump(&shard->rejected);
+        return;
+    }
+
+    bump(&shard->passed);
+    if (!matched) {
+        bump(&shard->unmatched);
+    }
+}
+
+/**
+ * This function sums the packets checked against the filter over every thread.
+ *
+ * @param rejected the value to be updated with the number the filter rejected
+ * @param passed the value to be updated with the number it let through
+ * @param unmatched the value to be updated with the number let through that no rule
+ * matched (its false positives)
+ */
+void stats_filter(unsigned long *rejected, unsigned long *passed,
+        unsigned long *unmatched) {
+
+    *rejected = 0;
+    *passed = 0;
+    *unmatched = 0;
+
+    for (stats_shard_t *s = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); s;
+            s = s->next) {
+        *rejected += __atomic_load_n(&s->rejected, __ATOMIC_RELAXED);
+        *passed += __atomic_load_n(&s->passed, __ATOMIC_RELAXED);
+        *unmatched += __atomic_load_n(&s->unmatched, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * This function records one lookup in the calling thread's flow cache in its counters.
+ *
+ * @param hit whether the lookup hit the cache
+ */
+void stats_cache_count(int hit) {
+
+    if (!shard && !(shard = shard_register())) {
+        return;
+    }
+
+    bump(hit ? &shard->cache_hits : &shard->cache_misses);
+}
+
+/**
+ * This function sums the lookups in the flow caches over every thread.
+ *
+ * @param hits the value to be updated with the number of hits
+ * @param misses the value to be updated with the number of misses
+ */
+void stats_cache(unsigned long *hits, unsigned long *misses) {
+
+    *hits = 0;
+    *misses = 0;
+
+    for (stats_shard_t *s = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); s;
+            s = s->next) {
+        *hits += __atomic_load_n(&s->cache_hits, __ATOMIC_RELAXED);
+        *misses += __atomic_load_n(&s->cache_misses, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * This function records the talkers of one classified packet in the calling thread's
+ * sketches.
+ *
+ * @param verdict the action the packet was given
+ * @param keys the keys of the packet's talkers, STATS_TALKER_KINDS long
+ */
+void stats_talker_count(int verdict, const sketch_key_t *keys) {
+
+    if (!shard && !(shard = shard_register())) {
+        return;
+    }
+
+    if (!shard->talkers) {
+        sketch_t *talkers = (sketch_t *) calloc(STATS_VERDICTS * STATS_TALKER_KINDS,
+                sizeof(sketch_t));
+        if (!talkers) {
+            return;
+        }
+        __atomic_store_n(&shard->talkers, talkers, __ATOMIC_RELEASE);
+    }
+
+    sketch_t *s = &shard->talkers[verdict * STATS_TALKER_KINDS];
+
+    for (int k = 0; k < STATS_TALKER_KINDS; k++) {
+        sketch_update(&s[k], &keys[k]);
+    }
+}
+
+/**
+ * This function finds the heaviest talkers of a verdict over every thread, heaviest
+ * first.
+ *
+ * @param verdict the action
+ * @param kind STATS_TALKER_ADDR or STATS_TALKER_PORT
+ * @param top the array to be populated
+ * @param n the length of the array
+ * @param total the value to be updated with the number of packets given the verdict
+ *
+ * @return the number of talkers found, or -1 if unsuccessful
+ */
+int stats_top(int verdict, int kind, stats_talker_t *top, int n, unsigned long *total) {
+
+    sketch_t *merged = (sketch_t *) calloc(1, sizeof(sketch_t));
+    sketch_key_t keys[SKETCH_CANDIDATES];
+    int len = 0;
+
+    if (!merged) {
+        return -1;
+    }
+
+    int which = verdict * STATS_TALKER_KINDS + kind;
+    stats_shard_t *first = __atomic_load_n(&shards, __ATOMIC_ACQUIRE);
+
+    for (stats_shard_t *s = first; s; s = s->next) {
+        sketch_t *talkers = __atomic_load_n(&s->talkers, __ATOMIC_ACQUIRE);
+        if (talkers) {
+            sketch_merge(merged, &talkers[which]);
+        }
+    }
+
+    //Every heavy talker is a candidate in the shard of at least one thread it went
+    //through, so the candidates of all shards, estimated over the merged counters,
+    //hold the heaviest talkers overall
+    for (stats_shard_t *s = first; s; s = s->next) {
+        sketch_t *talkers = __atomic_load_n(&s->talkers, __ATOMIC_ACQUIRE);
+        int found = talkers ? sketch_candidates(&talkers[which], keys) : 0;
+
+        for (int i = 0; i < found; i++) {
+            int dup = 0;
+            for (int j = 0; j < len && !dup; j++) {
+                dup = top[j].key.w[0] == keys[i].w[0] && top[j].key.w[1] == keys[i].w[1];
+            }
+
+            unsigned long count = dup ? 0 : sketch_estimate(merged, &keys[i]);
+            if (count == 0 || (len == n && count <= top[n - 1].count)) {
+                continue;
+            }
+
+            //Insert it in order, dropping the lightest if the array is full
+            int j = len < n ? len++ : n - 1;
+            for (; j > 0 && top[j - 1].count < count; j--) {
+                top[j] = top[j - 1];
+            }
+            top[j].key = keys[i];
+            top[j].count = count;
+        }
+    }
+
+    *total = merged->total;
+    free(merged);
+
+    return len;
+}
+
+/**
+ * This function sums the hits of a rule over every thread.
+ *
+ * @param id the id of the rule, or STATS_DEFAULT
+ *
+ * @return the number of packets the rule matched
+ */
+unsigned long stats_rule_hits(int id) {
+
+    unsigned long hits = 0;
+
+    for (stats_shard_t *s = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); s;
+            s = s->next) {
+        if (id == STATS_DEFAULT) {
+            hits += __atomic_load_n(&s->def, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if (id < 0) {
+            continue;
+        }
+
+        unsigned long *chunk = __atomic_load_n(&s->chunks[id >> STATS_CHUNK_BITS],
+                __ATOMIC_ACQUIRE);
+        if (chunk) {
+            hits += __atomic_load_n(&chunk[id & (STATS_CHUNK_SIZE - 1)],
+                    __ATOMIC_RELAXED);
+        }
+    }
+
+    return hits;
+}
+
+/**
+ * This function sums the number of classified packets over every thread.
+ *
+ * @return the number of classified packets
+ */
+unsigned long stats_packets() {
+
+    unsigned long packets = 0;
+
+    for (stats_shard_t *s = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); s;
+            s = s->next) {
+        packets += __atomic_load_n(&s->packets, __ATOMIC_RELAXED);
+    }
+
+    return packets;
+}
+
+/**
+ * This function sums the memory every thread's counters take up, including the hit
+ * counters of every rule each thread has counted a hit for.
+ *
+ * @return the number of bytes
+ */
+size_t stats_memory() {
+
+    size_t bytes = 0;
+
+    for (stats_shard_t *s = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); s;
+            s = s->next) {
+        bytes += sizeof(stats_shard_t);
+
+        for (int i = 0; i < STATS_MAX_CHUNKS; i++) {
+            if (__atomic_load_n(&s->chunks[i], __ATOMIC_ACQUIRE)) {
+                bytes += STATS_CHUNK_SIZE * sizeof(unsigned long);
+            }
+        }
+    }
+
+    return bytes;
+}
+
+/**
+ * This function prints the classification latency histogram merged over every thread.
+ *
+ * @param stream the file stream to print to
+ */
+void stats_print_latency(FILE *stream) {
+
+    unsigned long hist[STATS_LAT_BUCKETS] = { 0 };
+
+    for (stats_shard_t *s = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); s;
+            s = s->next) {
+        for (int b = 0; b < STATS_LAT_BUCKETS; b++) {
+            hist[b] += __atomic_load_n(&s->hist[b], __ATOMIC_RELAXED);
+        }
+    }
+
+    stats_print_histogram(stream, hist);
+}
+
+/**
+ * This function frees every thread's counters. No thread may be classifying packets.
+ */
+void stats_free() {
+
+    pthread_mutex_lock(&stats_lock);
+
+    while (shards) {
+        stats_shard_t *s = shards;
+        shards = s->next;
+
+        for (int i = 0; i < STATS_MAX_CHUNKS; i++) {
+            free(s->chunks[i]);
+        }
+        free(s->talkers);
+        free(s);
+    }
+
+    free(free_ids);
+    free_ids = NULL;
+    free_len = 0;
+    free_cap = 0;
+    next_id = 0;
+
+    pthread_mutex_unlock(&stats_lock);
+
+    shard = NULL;
+}
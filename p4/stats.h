@@ -0,0 +1,220 @@
+/**
+ * @file stats.h
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This file acts as the interface for the stats.c file
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include "sketch.h"
+
+/** Number of bits of a rule id used to index within a chunk of counters */
+#define STATS_CHUNK_BITS 12
+
+/** Number of counters in a chunk */
+#define STATS_CHUNK_SIZE (1 << STATS_CHUNK_BITS)
+
+/** Maximum number of chunks, which bounds the number of rules that can be counted */
+#define STATS_MAX_CHUNKS 4096
+
+/** Number of buckets in the latency histogram (powers of two nanoseconds) */
+#define STATS_LAT_BUCKETS 24
+
+/** Rule id used for packets handled by the default policy */
+#define STATS_DEFAULT -1
+
+/** Number of verdicts top talkers are counted for, indexed by the action */
+#define STATS_VERDICTS 2
+
+/** Kind of top talker keyed by the source address */
+#define STATS_TALKER_ADDR 0
+
+/** Kind of top talker keyed by the protocol and source port */
+#define STATS_TALKER_PORT 1
+
+/** Number of kinds of top talker */
+#define STATS_TALKER_KINDS 2
+
+/**
+ * Representation of one of the heaviest talkers of a verdict
+ * .key: the key of the talker
+ * .count: the estimated number of packets it sent, which is never below the true number
+ */
+typedef struct stats_talker {
+    sketch_key_t key;
+    unsigned long count;
+} stats_talker_t;
+
+/**
+ * This function reads the monotonic clock.
+ *
+ * @return the current time in nanoseconds
+ */
+long long stats_now_ns();
+
+/**
+ * This function finds the latency histogram bucket of a classification time.
+ *
+ * @param ns the time in nanoseconds
+ *
+ * @return the bucket, where bucket i holds times below 2^(i+1) ns
+ */
+int stats_lat_bucket(long long ns);
+
+/**
+ * This function prints a latency histogram with its percentiles.
+ *
+ * @param stream the file stream to print to
+ * @param hist the histogram, STATS_LAT_BUCKETS buckets long
+ */
+void stats_print_histogram(FILE *stream, unsigned long *hist);
+
+/**
+ * This function hands out an id for a new rule. Ids are reused once released.
+ *
+ * @return the id, or -1 if there are no ids left
+ */
+int stats_rule_id_alloc();
+
+/**
+ * This function hands out @n consecutive fresh ids at once, for rules that are created
+ * together. Each id is released on its own like one from stats_rule_id_alloc().
+ *
+ * @param n the number of ids
+ *
+ * @return the first id, or -1 if there are not enough ids left
+ */
+int stats_rule_id_alloc_range(int n);
+
+/**
+ * This function releases the id of a rule that no reader can see any more and resets
+ * its counters.
+ *
+ * @param id the id of the rule
+ */
+void stats_rule_id_release(int id);
+
+/**
+ * This function records one classified packet in the calling thread's counters.
+ *
+ * @param id the id of the matched rule, or STATS_DEFAULT
+ * @param ns how long the classification took in nanoseconds
+ */
+void stats_count(int id, long long ns);
+
+/**
+ * This function records the work of one lookup through an engine's index in the
+ * calling thread's counters.
+ *
+ * @param steps the number of index steps (nodes, blocks) the lookup took
+ * @param rules the number of rules the packet was compared against
+ */
+void stats_engine_count(unsigned int steps, unsigned int rules);
+
+/**
+ * This function sums the work of lookups through an engine's index over every thread.
+ *
+ * @param lookups the value to be updated with the number of lookups
+ * @param steps the value to be updated with the number of index steps they took
+ * @param rules the value to be updated with the number of rules they compared
+ */
+void stats_engine(unsigned long *lookups, unsigned long *steps, unsigned long *rules);
+
+/**
+ * This function records one packet checked against the filter of the IPv4 rules in the
+ * calling thread's counters.
+ *
+ * @param passed whether the filter let the packet through to the rules
+ * @param matched whether a rule matched the packet once let through
+ */
+void stats_filter_count(int passed, int matched);
+
+/**
+ * This function sums the packets checked against the filter over every thread.
+ *
+ * @param rejected the value to be updated with the number the filter rejected
+ * @param passed the value to be updated with the number it let through
+ * @param unmatched the value to be updated with the number let through that no rule
+ * matched (its false positives)
+ */
+void stats_filter(unsigned long *rejected, unsigned long *passed,
+        unsigned long *unmatched);
+
+/**
+ * This function records one lookup in the calling thread's flow cache in its counters.
+ *
+ * @param hit whether the lookup hit the cache
+ */
+void stats_cache_count(int hit);
+
+/**
+ * This function sums the lookups in the flow caches over every thread.
+ *
+ * @param hits the value to be updated with the number of hits
+ * @param misses the value to be updated with the number of misses
+ */
+void stats_cache(unsigned long *hits, unsigned long *misses);
+
+/**
+ * This function records the talkers of one classified packet in the calling thread's
+ * sketches.
+ *
+ * @param verdict the action the packet was given
+ * @param keys the keys of the packet's talkers, STATS_TALKER_KINDS long
+ */
+void stats_talker_count(int verdict, const sketch_key_t *keys);
+
+/**
+ * This function finds the heaviest talkers of a verdict over every thread, heaviest
+ * first.
+ *
+ * @param verdict the action
+ * @param kind STATS_TALKER_ADDR or STATS_TALKER_PORT
+ * @param top the array to be populated
+ * @param n the length of the array
+ * @param total the value to be updated with the number of packets given the verdict
+ *
+ * @return the number of talkers found, or -1 if unsuccessful
+ */
+int stats_top(int verdict, int kind, stats_talker_t *top, int n, unsigned long *total);
+
+/**
+ * This function sums the hits of a rule over every thread.
+ *
+ * @param id the id of the rule, or STATS_DEFAULT
+ *
+ * @return the number of packets the rule matched
+ */
+unsigned long stats_rule_hits(int id);
+
+/**
+ * This function sums the number of classified packets over every thread.
+ *
+ * @return the number of classified packets
+ */
+unsigned long stats_packets();
+
+/**
+ * This function sums the memory every thread's counters take up, including the hit
+ * counters of every rule each thread has counted a hit for.
+ *
+ * @return the number of bytes
+ */
+size_t stats_memory();
+
+/**
+ * This function prints the classification latency histogram merged over every thread.
+ *
+ * @param stream the file stream to print to
+ */
+void stats_print_latency(FILE *stream);
+
+/**
+ * This function frees every thread's counters. No thread may be classifying packets.
+ */
+void stats_free();
+
+#endif
@@ -2,18 +2,26 @@
 FAIL=0
 
 # Function to run the program against a test case and check
-# its output and exit status for correct behavior
+# its output and exit status for correct behavior, optionally with
+# a classification engine other than the default and other options
 test_fwsim() {
   TESTNO=$1
+  OPTS=""
+  if [ -n "$2" ]; then
+      OPTS=" --engine $2"
+  fi
+  if [ -n "$3" ]; then
+      OPTS="$OPTS $3"
+  fi
 
   rm -f output.txt
 
   if [ $TESTNO -ge 12 ]; then
-      echo "Test $TESTNO: ./fwsim -r rules-$TESTNO.txt < input-$TESTNO.txt > output.txt 2>&1"
-      ./fwsim -r rules-$TESTNO.txt < input-$TESTNO.txt > output.txt 2>&1
+      echo "Test $TESTNO: ./fwsim$OPTS -r rules-$TESTNO.txt < input-$TESTNO.txt > output.txt 2>&1"
+      ./fwsim$OPTS -r rules-$TESTNO.txt < input-$TESTNO.txt > output.txt 2>&1
   else
-      echo "Test $TESTNO: ./fwsim < input-$TESTNO.txt > output.txt 2>&1"
-      ./fwsim < input-$TESTNO.txt > output.txt 2>&1
+      echo "Test $TESTNO: ./fwsim$OPTS < input-$TESTNO.txt > output.txt 2>&1"
+      ./fwsim$OPTS < input-$TESTNO.txt > output.txt 2>&1
   fi
   STATUS=$?
 
@@ -36,32 +44,187 @@ test_fwsim() {
   return 0
 }
 
+# Function to compile a test's rules into a shared object with fwcompile and check
+# that fwsim behaves the same with it loaded
+test_compiled() {
+  TESTNO=$1
+
+  rm -f output.txt output-gen.c output.so
+
+  echo "Test $TESTNO: ./fwcompile rules-$TESTNO.txt > output-gen.c && ./fwsim --compiled ./output.so < input-$TESTNO.txt > output.txt 2>&1"
+  if ! ./fwcompile rules-$TESTNO.txt > output-gen.c \
+          || ! gcc -O2 -shared -fPIC output-gen.c -o output.so; then
+      echo "**** Test $TESTNO FAILED - rules didn't compile"
+      FAIL=1
+      return 1
+  fi
+
+  ./fwsim --compiled ./output.so < input-$TESTNO.txt > output.txt 2>&1
+  STATUS=$?
+
+  # Make sure the program exited successfully
+  if [ $STATUS -ne 0 ]; then
+      echo "**** Test $TESTNO FAILED - incorrect exit status"
+      FAIL=1
+      return 1
+  fi
+
+  # Make sure any output to standard out looks right.
+  if ! diff -q expected-$TESTNO.txt output.txt >/dev/null 2>&1
+  then
+      echo "**** Test $TESTNO FAILED - output didn't match the expected output"
+      FAIL=1
+      return 1
+  fi
+
+  echo "Test $TESTNO PASS"
+  return 0
+}
+
+# Function to publish a test's policy to shared memory with one fwsim and check that
+# another fwsim attached to it sees it, and the versions published after
+test_published() {
+  TESTNO=$1
+  OPTS=""
+  if [ -n "$2" ]; then
+      OPTS=" --engine $2"
+  fi
+  NAME=fwsim-test-$TESTNO
+
+  rm -f output.txt /dev/shm/$NAME /dev/shm/$NAME.*
+
+  echo "Test $TESTNO: ./fwsim$OPTS -r rules-$TESTNO.txt < input-$TESTNO.txt > output.txt 2>&1 && ./fwsim$OPTS --attach $NAME < attach-$TESTNO.txt >> output.txt 2>&1"
+  ./fwsim$OPTS -r rules-$TESTNO.txt < input-$TESTNO.txt > output.txt 2>&1 \
+          && ./fwsim$OPTS --attach $NAME < attach-$TESTNO.txt >> output.txt 2>&1
+  STATUS=$?
+
+  rm -f /dev/shm/$NAME /dev/shm/$NAME.*
+
+  if [ $STATUS -ne 0 ]; then
+      echo "**** Test $TESTNO FAILED - incorrect exit status"
+      FAIL=1
+      return 1
+  fi
+
+  if ! diff -q expected-$TESTNO.txt output.txt >/dev/null 2>&1
+  then
+      echo "**** Test $TESTNO FAILED - output didn't match the expected output"
+      FAIL=1
+      return 1
+  fi
+
+  echo "Test $TESTNO PASS"
+  return 0
+}
+
+# Function to replay a test's capture through its rules and check the counts, leaving
+# out the timings
+test_replay() {
+  TESTNO=$1
+  OPTS=""
+  if [ -n "$2" ]; then
+      OPTS=" --engine $2"
+  fi
+
+  rm -f output.txt
+
+  echo "Test $TESTNO: ./fwsim$OPTS -r rules-$TESTNO.txt --replay trace-$TESTNO.pcap > output.txt 2>&1"
+  ./fwsim$OPTS -r rules-$TESTNO.txt --replay trace-$TESTNO.pcap > output.txt 2>&1
+  STATUS=$?
+
+  if [ $STATUS -ne 0 ]; then
+      echo "**** Test $TESTNO FAILED - incorrect exit status"
+      FAIL=1
+      return 1
+  fi
+
+  if ! sed -n -e 's/^\(Replayed [0-9]* packets\) in .*/\1/p' \
+          -e '/^\(Allowed\|Denied\|Via\|Skipped\)/p' output.txt \
+          | diff -q expected-$TESTNO.txt - >/dev/null 2>&1
+  then
+      echo "**** Test $TESTNO FAILED - output didn't match the expected output"
+      FAIL=1
+      return 1
+  fi
+
+  echo "Test $TESTNO PASS"
+  return 0
+}
+
 # make a fresh copy of the target programs
 make clean
-make
+make all
 
 if [ -x fwsim ] ; then
-    test_fwsim 01
-    test_fwsim 02
-    test_fwsim 03
-    test_fwsim 04
-    test_fwsim 05
-    test_fwsim 06
-    test_fwsim 07
-    test_fwsim 08
-    test_fwsim 09
-    test_fwsim 10
-    test_fwsim 11
-    test_fwsim 12
-    test_fwsim 13
-    test_fwsim 14
-    test_fwsim 15
-    test_fwsim 16
-    test_fwsim 17
-    test_fwsim 18
-    test_fwsim 19
-    test_fwsim 20
-    test_fwsim 21
+    for ENGINE in linear bitvector hicuts tss; do
+        test_fwsim 01 $ENGINE
+        test_fwsim 02 $ENGINE
+        test_fwsim 03 $ENGINE
+        test_fwsim 04 $ENGINE
+        test_fwsim 05 $ENGINE
+        test_fwsim 06 $ENGINE
+        test_fwsim 07 $ENGINE
+        test_fwsim 08 $ENGINE
+        test_fwsim 09 $ENGINE
+        test_fwsim 10 $ENGINE
+        test_fwsim 11 $ENGINE
+        test_fwsim 12 $ENGINE
+        test_fwsim 13 $ENGINE
+        test_fwsim 14 $ENGINE
+        test_fwsim 15 $ENGINE
+        test_fwsim 16 $ENGINE
+        test_fwsim 17 $ENGINE
+        test_fwsim 18 $ENGINE
+        test_fwsim 19 $ENGINE
+        test_fwsim 20 $ENGINE
+        test_fwsim 21 $ENGINE
+        test_fwsim 22 $ENGINE
+        test_fwsim 23 $ENGINE
+        test_fwsim 24 $ENGINE
+        test_fwsim 25 $ENGINE
+        test_fwsim 26 $ENGINE
+        test_fwsim 27 $ENGINE
+        test_fwsim 28 $ENGINE "--conntrack 3"
+        test_fwsim 29 $ENGINE "--batch"
+        test_fwsim 30 $ENGINE "--batch --compact"
+        test_fwsim 31 $ENGINE "--workers 3"
+        test_fwsim 32 $ENGINE
+        test_fwsim 33 $ENGINE
+        test_fwsim 34 $ENGINE
+        test_published 35 $ENGINE
+        test_fwsim 36 $ENGINE
+        test_fwsim 37 $ENGINE
+        test_fwsim 38 $ENGINE "--workers 2"
+        test_fwsim 39 $ENGINE
+        test_replay 40 $ENGINE
+    done
+
+    # The compact encoding must classify and print every policy the same way
+    for ENGINE in linear tss; do
+        for TESTNO in 01 02 03 04 05 06 07 08 09 10 11 12 13 14 15 16 17 18 19 20 21 \
+                22 23 24 25 26 27 32 33 37; do
+            test_fwsim $TESTNO $ENGINE "--compact-rules"
+        done
+        test_fwsim 28 $ENGINE "--conntrack 3 --compact-rules"
+        test_fwsim 29 $ENGINE "--batch --compact-rules"
+        test_fwsim 30 $ENGINE "--batch --compact --compact-rules"
+        test_fwsim 31 $ENGINE "--workers 3 --compact-rules"
+        test_fwsim 38 $ENGINE "--workers 2 --compact-rules"
+    done
+
+    for TESTNO in 12 13 14 15 16 17 18 19 20 21 22 23 24 25 26; do
+        test_compiled $TESTNO
+    done
+    rm -f output-gen.c output.so
+
+    # Every engine must agree with the reference matcher on random policies
+    echo "Fuzz: make check"
+    if make -s check; then
+        echo "Fuzz PASS"
+    else
+        echo "**** Fuzz FAILED - an engine disagreed with the reference matcher"
+        FAIL=1
+    fi
 else
     echo "**** Your program didn't compile successfully, so we couldn't test it."
     FAIL=1
@@ -0,0 +1,1452 @@
+/**
+ * @file tss.c
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This component is responsible for the tuple space search classification engine.
+ * Rules are grouped into tuples by which of their ports are wildcards, and each tuple
+ * keeps a hash table of its rules keyed by the fields they match exactly, so a lookup
+ * probes one table per tuple and takes the earliest rule it finds. Tuples are probed in
+ * order of the earliest rule they may hold, and the search stops once no tuple left
+ * can hold an earlier rule than the one found.
+ *
+ * Unlike the other engines an index is updated rather than rebuilt when a rule is
+ * inserted or deleted. Each version of an index is immutable and shares whatever an
+ * update does not touch with the version before it, as the rule tree of the policy
+ * does: the hash tables are tries of the keys' hashes, and the rules are also kept in a
+ * treap under order keys that leave gaps for later inserts, which turns the order key
+ * of the rule found back into its position. Only when an insert finds no gap left are
+ * the keys dealt out again by rebuilding the index.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "tss.h"
+#include "stats.h"
+
+/** Number of tuples, one for each combination of wildcard ports */
+#define TSS_TUPLES 4
+
+/** Tuple bit set when the source port is a wildcard */
+#define TSS_SRC_ANY 1
+
+/** Tuple bit set when the destination port is a wildcard */
+#define TSS_DST_ANY 2
+
+/** Number of bits of a hash each level of a trie indexes with */
+#define TSS_RADIX_BITS 5
+
+/** Number of children a trie node may have */
+#define TSS_RADIX (1U << TSS_RADIX_BITS)
+
+/** Number of bits of a hash (a whole number of levels) */
+#define TSS_HASH_BITS 60
+
+/** Gap left between the order keys of consecutive rules when an index is built */
+#define TSS_STEP (1ULL << 32)
+
+/** Order key meaning no rule */
+#define TSS_NONE UINT64_MAX
+
+/**
+ * Representation of a rule in an index
+ * .order: the order key of the rule, which increases with its position
+ * .rule: the rule, packed
+ */
+typedef struct tss_entry {
+    uint64_t order;
+    image_rule_t rule;
+} tss_entry_t;
+
+/**
+ * Representation of the rules of a tuple whose keys share a hash. Buckets are never
+ * changed once they are in an index; an update builds a new one.
+ * .refs: the number of trie nodes holding the bucket
+ * .count: the number of rules
+ * .hash: the hash of the rules' keys
+ * .entries: the rules in order
+ */
+typedef struct tss_bucket {
+    unsigned int refs;
+    unsigned int count;
+    uint64_t hash;
+    tss_entry_t entries[];
+} tss_bucket_t;
+
+/**
+ * Representation of a node of a trie, indexed by TSS_RADIX_BITS bits of a hash.
+ * Nodes are never changed once they are in an index; an update copies its path.
+ * .refs: the number of indexes and nodes holding the node
+ * .map: the bits of the indexes that are in use
+ * .buckets: the bits of the indexes in use that hold a bucket rather than a node
+ * .slots: the children in order of their indexes
+ */
+typedef struct tss_node {
+    unsigned int refs;
+    uint32_t map;
+    uint32_t buckets;
+    void *slots[];
+} tss_node_t;
+
+/**
+ * Representation of a node of the treap of every rule of an index by order key
+ * .refs: the number of indexes and nodes holding the node
+ * .size: the number of rules in the subtree
+ * .prio: the heap priority that keeps the tree balanced
+ * .entry: the rule
+ * .left: the rules with lower order keys
+ * .right: the rules with higher order keys
+ */
+typedef struct tss_order {
+    unsigned int refs;
+    unsigned int size;
+    unsigned int prio;
+    tss_entry_t entry;
+    struct tss_order *left;
+    struct tss_order *right;
+} tss_order_t;
+
+/**
+ * Representation of a tuple
+ * .root: the trie of the tuple's rules, or NULL
+ * .rules: the number of rules
+ * .first: an order key no rule of the tuple is below (the first rule's, until it is
+ * deleted)
+ */
+typedef struct tss_tuple {
+    tss_node_t *root;
+    unsigned int rules;
+    uint64_t first;
+} tss_tuple_t;
+
+/**
+ * Representation of a version of an index
+ * .order: the treap of every rule by order key
+ * .tuples: the tuples
+ * .probe: the tuples in use, in the order they are probed
+ * .probes: the number of tuples in use
+ * .updates: the number of updates since the index was built
+ * .rebuilds: the number of times an insert found no gap and rebuilt the index
+ */
+typedef struct tss {
+    tss_order_t *order;
+    tss_tuple_t tuples[TSS_TUPLES];
+    unsigned char probe[TSS_TUPLES];
+    unsigned int probes;
+    unsigned long updates;
+    unsigned long rebuilds;
+} tss_t;
+
+/**
+ * Representation of a rule being sorted into the tries of a new index
+ * .tuple: the tuple of the rule
+ * .hash: the hash of its key
+ * .entry: the rule
+ */
+typedef struct tss_item {
+    unsigned int tuple;
+    uint64_t hash;
+    tss_entry_t entry;
+} tss_item_t;
+
+/** State of the generator for treap priorities (only touched by the writer) */
+static unsigned int prio_state = 88675123u;
+
+/**
+ * This function draws the priority for a new treap node (xorshift32).
+ *
+ * @return the priority
+ */
+static unsigned int prio_next() {
+
+    prio_state ^= prio_state << 13;
+    prio_state ^= prio_state >> 17;
+    prio_state ^= prio_state << 5;
+
+    return prio_state;
+}
+
+/**
+ * This function finds the tuple of a rule.
+ *
+ * @param r the rule
+ *
+ * @return the tuple
+ */
+static unsigned int rule_tuple(const image_rule_t *r) {
+
+    return (r->src_port == MATCH_PORT_ANY ? TSS_SRC_ANY : 0)
+            | (r->dst_port == MATCH_PORT_ANY ? TSS_DST_ANY : 0);
+}
+
+/**
+ * This function finds the bits of the .ports word of a key a tuple matches on.
+ *
+ * @param tuple the tuple
+ *
+ * @return the mask
+ */
+static uint64_t tuple_mask(unsigned int tuple) {
+
+    return KEY_PROTO_MASK | (tuple & TSS_SRC_ANY ? 0 : KEY_SRC_PORT_MASK)
+            | (tuple & TSS_DST_ANY ? 0 : KEY_DST_PORT_MASK);
+}
+
+/**
+ * This function hashes the two words of a key, with the ports its tuple does not match
+ * on already masked out.
+ *
+ * @param addrs the packed addresses
+ * @param ports the packed protocol and ports
+ *
+ * @return the hash, below 2^TSS_HASH_BITS
+ */
+static uint64_t key_hash(uint64_t addrs, uint64_t ports) {
+
+    uint64_t x = addrs * 0x9E3779B97F4A7C15ULL;
+    x ^= ports * 0xC2B2AE3D27D4EB4FULL;
+    x ^= x >> 29;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 32;
+
+    return x >> (64 - TSS_HASH_BITS);
+}
+
+/**
+ * This function hashes the key of a rule in its tuple.
+ *
+ * @param r the rule
+ * @param tuple the tuple of the rule
+ *
+ * @return the hash
+ */
+static uint64_t rule_hash(const image_rule_t *r, unsigned int tuple) {
+
+    packet_t key = packet_key(r->protocol, r->src_ip, (port_t) r->src_port, r->dst_ip,
+            (port_t) r->dst_port);
+
+    return key_hash(key.addrs, key.ports & tuple_mask(tuple));
+}
+
+/**
+ * This function finds the index a level of a trie uses for a hash.
+ *
+ * @param hash the hash
+ * @param depth the level (from 0 at the root)
+ *
+ * @return the index
+ */
+static unsigned int hash_digit(uint64_t hash, unsigned int depth) {
+
+    return (hash >> (TSS_HASH_BITS - TSS_RADIX_BITS * (depth + 1))) & (TSS_RADIX - 1);
+}
+
+/**
+ * This function finds where the child for an index is kept in a node.
+ *
+ * @param map the bits of the indexes in use
+ * @param digit the index
+ *
+ * @return the position of the child in .slots
+ */
+static unsigned int slot_index(uint32_t map, unsigned int digit) {
+
+    return __builtin_popcount(map & ((1U << digit) - 1));
+}
+
+/**
+ * This function allocates a bucket.
+ *
+ * @param hash the hash of the rules' keys
+ * @param count the number of rules
+ *
+ * @return the new bucket with one reference, or NULL if unsuccessful
+ */
+static tss_bucket_t *bucket_alloc(uint64_t hash, unsigned int count) {
+
+    tss_bucket_t *b = (tss_bucket_t *) malloc(
+            sizeof(tss_bucket_t) + count * sizeof(tss_entry_t));
+
+    if (b) {
+        b->refs = 1;
+        b->count = count;
+        b->hash = hash;
+    }
+
+    return b;
+}
+
+/**
+ * This function allocates a trie node with room for a child at each index in use.
+ *
+ * @param map the bits of the indexes in use
+ * @param buckets the bits of the indexes that hold a bucket
+ *
+ * @return the new node with one reference, or NULL if unsuccessful
+ */
+static tss_node_t *node_alloc(uint32_t map, uint32_t buckets) {
+
+    tss_node_t *t = (tss_node_t *) malloc(
+            sizeof(tss_node_t) + __builtin_popcount(map) * sizeof(void *));
+
+    if (t) {
+        t->refs = 1;
+        t->map = map;
+        t->buckets = buckets;
+    }
+
+    return t;
+}
+
+/**
+ * This function takes a reference to a child of a trie node.
+ *
+ * @param slot the child
+ * @param bucket whether the child is a bucket
+ *
+ * @return @slot
+ */
+static void *slot_hold(void *slot, int bucket) {
+
+    if (bucket) {
+        ((tss_bucket_t *) slot)->refs++;
+    } else {
+        ((tss_node_t *) slot)->refs++;
+    }
+
+    return slot;
+}
+
+/**
+ * This function drops a reference to a child of a trie node, freeing it (and whatever
+ * only it holds) when it was the last.
+ *
+ * @param slot the child, or NULL
+ * @param bucket whether the child is a bucket
+ */
+static void slot_put(void *slot, int bucket) {
+
+    if (!slot) {
+        return;
+    }
+
+    if (bucket) {
+        tss_bucket_t *b = (tss_bucket_t *) slot;
+        if (--b->refs == 0) {
+            free(b);
+        }
+        return;
+    }
+
+    tss_node_t *t = (tss_node_t *) slot;
+    if (--t->refs > 0) {
+        return;
+    }
+
+    unsigned int k = 0;
+    for (unsigned int d = 0; d < TSS_RADIX; d++) {
+        if (t->map & (1U << d)) {
+            slot_put(t->slots[k++], (t->buckets >> d) & 1);
+        }
+    }
+
+    free(t);
+}
+
+/**
+ * This function copies a trie node with the child at one index replaced, added or
+ * removed, sharing its other children. It takes over the reference to @slot, and drops
+ * it if it fails.
+ *
+ * @param t the node, or NULL for a node with no children
+ * @param digit the index
+ * @param slot the new child, or NULL to remove the child
+ * @param bucket whether @slot is a bucket
+ * @param out the value to be updated with the new node, or NULL if it has no children
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int node_with(tss_node_t *t, unsigned int digit, void *slot, int bucket,
+        tss_node_t **out) {
+
+    uint32_t bit = 1U << digit;
+    uint32_t map = t ? t->map : 0;
+    uint32_t buckets = t ? t->buckets : 0;
+    uint32_t new_map = slot ? map | bit : map & ~bit;
+    uint32_t new_buckets = slot && bucket ? buckets | bit : buckets & ~bit;
+
+    *out = NULL;
+
+    if (new_map == 0) {
+        return 0;
+    }
+
+    tss_node_t *n = node_alloc(new_map, new_buckets);
+
+    if (!n) {
+        slot_put(slot, bucket);
+        return -1;
+    }
+
+    unsigned int k = 0;
+    for (unsigned int d = 0; d < TSS_RADIX; d++) {
+        if (d == digit) {
+            if (slot) {
+                n->slots[k++] = slot;
+            }
+        } else if (new_map & (1U << d)) {
+            n->slots[k++] = slot_hold(t->slots[slot_index(map, d)], (buckets >> d) & 1);
+        }
+    }
+
+    *out = n;
+
+    return 0;
+}
+
+/**
+ * This function finds the bucket of a hash in a trie.
+ *
+ * @param t the trie, or NULL
+ * @param hash the hash
+ *
+ * @return the bucket, or NULL if no key has the hash
+ */
+static tss_bucket_t *trie_find(tss_node_t *t, uint64_t hash) {
+
+    for (unsigned int depth = 0; t; depth++) {
+        uint32_t bit = 1U << hash_digit(hash, depth);
+
+        if (!(t->map & bit)) {
+            return NULL;
+        }
+
+        void *slot = t->slots[slot_index(t->map, hash_digit(hash, depth))];
+
+        if (t->buckets & bit) {
+            tss_bucket_t *b = (tss_bucket_t *) slot;
+            return b->hash == hash ? b : NULL;
+        }
+
+        t = (tss_node_t *) slot;
+    }
+
+    return NULL;
+}
+
+/**
+ * This function makes a copy of a bucket with a rule added in order.
+ *
+ * @param b the bucket, or NULL for an empty one
+ * @param hash the hash of the rule's key
+ * @param e the rule
+ *
+ * @return the new bucket with one reference, or NULL if unsuccessful
+ */
+static tss_bucket_t *bucket_insert(tss_bucket_t *b, uint64_t hash, tss_entry_t *e) {
+
+    unsigned int count = b ? b->count : 0;
+    tss_bucket_t *n = bucket_alloc(hash, count + 1);
+
+    if (!n) {
+        return NULL;
+    }
+
+    unsigned int i = 0;
+    while (i < count && b->entries[i].order < e->order) {
+        i++;
+    }
+
+    if (count > 0) {
+        memcpy(n->entries, b->entries, i * sizeof(tss_entry_t));
+        memcpy(n->entries + i + 1, b->entries + i, (count - i) * sizeof(tss_entry_t));
+    }
+    n->entries[i] = *e;
+
+    return n;
+}
+
+/**
+ * This function makes a copy of a bucket with a rule removed.
+ *
+ * @param b the bucket
+ * @param order the order key of the rule
+ * @param out the value to be updated with the new bucket, or NULL if it is empty
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int bucket_remove(tss_bucket_t *b, uint64_t order, tss_bucket_t **out) {
+
+    *out = NULL;
+
+    if (b->count == 1) {
+        return 0;
+    }
+
+    tss_bucket_t *n = bucket_alloc(b->hash, b->count - 1);
+
+    if (!n) {
+        return -1;
+    }
+
+    unsigned int k = 0;
+    for (unsigned int i = 0; i < b->count; i++) {
+        if (b->entries[i].order != order) {
+            n->entries[k++] = b->entries[i];
+        }
+    }
+
+    *out = n;
+
+    return 0;
+}
+
+/**
+ * This function makes a copy of a trie with a rule added, copying the path to its
+ * bucket and sharing the rest.
+ *
+ * @param t the trie, or NULL
+ * @param depth the level of @t
+ * @param hash the hash of the rule's key
+ * @param e the rule
+ * @param out the value to be updated with the new trie
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int trie_insert(tss_node_t *t, unsigned int depth, uint64_t hash,
+        tss_entry_t *e, tss_node_t **out) {
+
+    unsigned int digit = hash_digit(hash, depth);
+    uint32_t bit = 1U << digit;
+    void *slot = NULL;
+    int bucket = 1;
+
+    if (!t || !(t->map & bit)) {
+        slot = bucket_insert(NULL, hash, e);
+    } else {
+        void *old = t->slots[slot_index(t->map, digit)];
+
+        if (!(t->buckets & bit)) {
+            tss_node_t *sub;
+            if (trie_insert((tss_node_t *) old, depth + 1, hash, e, &sub) == 0) {
+                slot = sub;
+                bucket = 0;
+            }
+        } else if (((tss_bucket_t *) old)->hash == hash) {
+            slot = bucket_insert((tss_bucket_t *) old, hash, e);
+        } else {
+            //Push the bucket down a level; the hashes differ, so they part somewhere
+            tss_node_t *pair, *sub;
+            uint64_t other = ((tss_bucket_t *) old)->hash;
+
+            if (node_with(NULL, hash_digit(other, depth + 1), slot_hold(old, 1), 1,
+                    &pair) == 0) {
+                if (trie_insert(pair, depth + 1, hash, e, &sub) == 0) {
+                    slot = sub;
+                    bucket = 0;
+                }
+                slot_put(pair, 0);
+            }
+        }
+    }
+
+    if (!slot) {
+        return -1;
+    }
+
+    return node_with(t, digit, slot, bucket, out);
+}
+
+/**
+ * This function makes a copy of a trie with a rule removed, copying the path to its
+ * bucket and sharing the rest. A node left holding a single bucket is replaced by it.
+ *
+ * @param t the trie, which must hold the rule
+ * @param depth the level of @t
+ * @param hash the hash of the rule's key
+ * @param order the order key of the rule
+ * @param out the value to be updated with the new trie, or NULL if it is empty
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int trie_remove(tss_node_t *t, unsigned int depth, uint64_t hash,
+        uint64_t order, tss_node_t **out) {
+
+    unsigned int digit = hash_digit(hash, depth);
+    uint32_t bit = 1U << digit;
+    void *old = t->slots[slot_index(t->map, digit)];
+    void *slot;
+    int bucket = 1;
+
+    if (t->buckets & bit) {
+        tss_bucket_t *b;
+        if (bucket_remove((tss_bucket_t *) old, order, &b) == -1) {
+            return -1;
+        }
+        slot = b;
+    } else {
+        tss_node_t *sub;
+        if (trie_remove((tss_node_t *) old, depth + 1, hash, order, &sub) == -1) {
+            return -1;
+        }
+
+        slot = sub;
+        bucket = 0;
+
+        if (sub && sub->map == sub->buckets && __builtin_popcount(sub->map) == 1) {
+            slot = slot_hold(sub->slots[0], 1);
+            bucket = 1;
+            slot_put(sub, 0);
+        }
+    }
+
+    return node_with(t, digit, slot, bucket, out);
+}
+
+/**
+ * This function builds a trie of rules sorted by the hash of their keys.
+ *
+ * @param items the rules, sorted by hash and then order
+ * @param n the number of rules (at least 1)
+ * @param depth the level of the trie
+ * @param out the value to be updated with the trie
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int trie_build(tss_item_t *items, unsigned int n, unsigned int depth,
+        tss_node_t **out) {
+
+    uint32_t map = 0;
+    uint32_t buckets = 0;
+
+    for (unsigned int lo = 0, hi; lo < n; lo = hi) {
+        unsigned int digit = hash_digit(items[lo].hash, depth);
+        for (hi = lo + 1; hi < n && hash_digit(items[hi].hash, depth) == digit; hi++);
+
+        map |= 1U << digit;
+        if (items[lo].hash == items[hi - 1].hash) {
+            buckets |= 1U << digit;
+        }
+    }
+
+    tss_node_t *t = node_alloc(map, buckets);
+
+    if (!t) {
+        return -1;
+    }
+
+    memset(t->slots, 0, __builtin_popcount(map) * sizeof(void *));
+
+    unsigned int k = 0;
+    for (unsigned int lo = 0, hi; lo < n; lo = hi) {
+        unsigned int digit = hash_digit(items[lo].hash, depth);
+        for (hi = lo + 1; hi < n && hash_digit(items[hi].hash, depth) == digit; hi++);
+
+        if (buckets & (1U << digit)) {
+            tss_bucket_t *b = bucket_alloc(items[lo].hash, hi - lo);
+            if (b) {
+                for (unsigned int i = lo; i < hi; i++) {
+                    b->entries[i - lo] = items[i].entry;
+                }
+            }
+            t->slots[k] = b;
+        } else {
+            tss_node_t *sub = NULL;
+            trie_build(items + lo, hi - lo, depth + 1, &sub);
+            t->slots[k] = sub;
+        }
+
+        if (!t->slots[k++]) {
+            slot_put(t, 0);
+            return -1;
+        }
+    }
+
+    *out = t;
+
+    return 0;
+}
+
+/**
+ * This function finds the number of rules in a treap.
+ *
+ * @param t the treap, or NULL
+ *
+ * @return the number of rules
+ */
+static unsigned int order_size(tss_order_t *t) {
+
+    return t ? t->size : 0;
+}
+
+/**
+ * This function takes a reference to a treap node.
+ *
+ * @param t the node, or NULL
+ *
+ * @return @t
+ */
+static tss_order_t *order_hold(tss_order_t *t) {
+
+    if (t) {
+        t->refs++;
+    }
+
+    return t;
+}
+
+/**
+ * This function drops a reference to a treap node, freeing it (and whatever only it
+ * holds) when it was the last.
+ *
+ * @param t the node, or NULL
+ */
+static void order_put(tss_order_t *t) {
+
+    while (t && --t->refs == 0) {
+        tss_order_t *right = t->right;
+
+        order_put(t->left);
+        free(t);
+
+        t = right;
+    }
+}
+
+/**
+ * This function allocates a treap node. It takes over the references to @left and
+ * @right, and drops them if it fails.
+ *
+ * @param e the rule
+ * @param prio the priority of the node
+ * @param left the rules with lower order keys
+ * @param right the rules with higher order keys
+ *
+ * @return the new node with one reference, or NULL if unsuccessful
+ */
+static tss_order_t *order_new(tss_entry_t *e, unsigned int prio, tss_order_t *left,
+        tss_order_t *right) {
+
+    tss_order_t *t = (tss_order_t *) malloc(sizeof(tss_order_t));
+
+    if (!t) {
+        order_put(left);
+        order_put(right);
+        return NULL;
+    }
+
+    t->refs = 1;
+    t->size = order_size(left) + 1 + order_size(right);
+    t->prio = prio;
+    t->entry = *e;
+    t->left = left;
+    t->right = right;
+
+    return t;
+}
+
+/**
+ * This function splits a treap into the rules below an order key and the rest, without
+ * changing it.
+ *
+ * @param t the treap
+ * @param order the order key
+ * @param l the value to be updated with a reference to the rules below @order
+ * @param r the value to be updated with a reference to the rest
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int order_split(tss_order_t *t, uint64_t order, tss_order_t **l,
+        tss_order_t **r) {
+
+    if (!t) {
+        *l = *r = NULL;
+        return 0;
+    }
+
+    tss_order_t *a, *b;
+
+    if (t->entry.order < order) {
+        if (order_split(t->right, order, &a, &b) == -1) {
+            return -1;
+        }
+        *l = order_new(&t->entry, t->prio, order_hold(t->left), a);
+        *r = b;
+        if (!*l) {
+            order_put(b);
+            return -1;
+        }
+    } else {
+        if (order_split(t->left, order, &a, &b) == -1) {
+            return -1;
+        }
+        *l = a;
+        *r = order_new(&t->entry, t->prio, b, order_hold(t->right));
+        if (!*r) {
+            order_put(a);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * This function joins two treaps, every order key of @a being below those of @b,
+ * without changing either.
+ *
+ * @param a the first treap
+ * @param b the second treap
+ * @param out the value to be updated with a reference to the joined treap
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int order_merge(tss_order_t *a, tss_order_t *b, tss_order_t **out) {
+
+    if (!a || !b) {
+        *out = order_hold(a ? a : b);
+        return 0;
+    }
+
+    tss_order_t *c;
+
+    if (a->prio > b->prio) {
+        if (order_merge(a->right, b, &c) == -1) {
+            return -1;
+        }
+        *out = order_new(&a->entry, a->prio, order_hold(a->left), c);
+    } else {
+        if (order_merge(a, b->left, &c) == -1) {
+            return -1;
+        }
+        *out = order_new(&b->entry, b->prio, c, order_hold(b->right));
+    }
+
+    return *out ? 0 : -1;
+}
+
+/**
+ * This function makes a copy of a treap with a rule added (@e is NULL) or the rule
+ * under @order removed, copying the paths it touches and sharing the rest.
+ *
+ * @param t the treap
+ * @param e the rule to be added, or NULL
+ * @param order the order key of the rule
+ * @param out the value to be updated with a reference to the new treap
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int order_edit(tss_order_t *t, tss_entry_t *e, uint64_t order,
+        tss_order_t **out) {
+
+    tss_order_t *l, *rest, *mid, *r, *head;
+    int ret = -1;
+
+    if (order_split(t, order, &l, &rest) == -1) {
+        return -1;
+    }
+
+    if (order_split(rest, order + 1, &mid, &r) == 0) {
+        tss_order_t *single = e ? order_new(e, prio_next(), NULL, NULL) : NULL;
+
+        if ((!e || single) && order_merge(l, single, &head) == 0) {
+            ret = order_merge(head, r, out);
+            order_put(head);
+        }
+
+        order_put(single);
+        order_put(mid);
+        order_put(r);
+    }
+
+    order_put(l);
+    order_put(rest);
+
+    return ret;
+}
+
+/**
+ * This function finds the rule at a position of a treap.
+ *
+ * @param t the treap
+ * @param k the position (from 0), which must be in the treap
+ *
+ * @return the rule
+ */
+static tss_entry_t *order_at(tss_order_t *t, unsigned int k) {
+
+    while (1) {
+        unsigned int ls = order_size(t->left);
+
+        if (k < ls) {
+            t = t->left;
+        } else if (k == ls) {
+            return &t->entry;
+        } else {
+            k -= ls + 1;
+            t = t->right;
+        }
+    }
+}
+
+/**
+ * This function finds the position of the rule under an order key.
+ *
+ * @param t the treap
+ * @param order the order key
+ *
+ * @return the number of rules with lower order keys
+ */
+static unsigned int order_rank(tss_order_t *t, uint64_t order) {
+
+    unsigned int rank = 0;
+
+    while (t) {
+        if (order <= t->entry.order) {
+            if (order == t->entry.order) {
+                return rank + order_size(t->left);
+            }
+            t = t->left;
+        } else {
+            rank += order_size(t->left) + 1;
+            t = t->right;
+        }
+    }
+
+    return rank;
+}
+
+/**
+ * This function collects the rules of a treap in order.
+ *
+ * @param t the treap
+ * @param out the array to be populated
+ */
+static void order_collect(tss_order_t *t, image_rule_t *out) {
+
+    while (t) {
+        order_collect(t->left, out);
+        out += order_size(t->left);
+
+        *out++ = t->entry.rule;
+
+        t = t->right;
+    }
+}
+
+/**
+ * This function sets the sizes of a freshly built treap.
+ *
+ * @param t the treap
+ *
+ * @return the number of rules in it
+ */
+static unsigned int order_count(tss_order_t *t) {
+
+    if (!t) {
+        return 0;
+    }
+
+    t->size = order_count(t->left) + 1 + order_count(t->right);
+
+    return t->size;
+}
+
+/**
+ * This function builds a treap of rules already in order in linear time, keeping its
+ * right spine on a stack.
+ *
+ * @param entries the rules in order
+ * @param n the number of rules
+ * @param out the value to be updated with a reference to the treap
+ *
+ * @return 0 if successful, -1 if unsuccessful
+ */
+static int order_build(tss_entry_t *entries, unsigned int n, tss_order_t **out) {
+
+    tss_order_t **spine = (tss_order_t **) malloc((n ? n : 1) * sizeof(tss_order_t *));
+    unsigned int top = 0;
+
+    *out = NULL;
+
+    if (!spine) {
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < n; i++) {
+        tss_order_t *t = order_new(&entries[i], prio_next(), NULL, NULL);
+
+        if (!t) {
+            //Everything built so far hangs off the bottom of the spine
+            if (top > 0) {
+                order_put(spine[0]);
+            }
+            free(spine);
+            return -1;
+        }
+
+        tss_order_t *last = NULL;
+        while (top > 0 && spine[top - 1]->prio < t->prio) {
+            last = spine[--top];
+        }
+
+        t->left = last;
+        if (top > 0) {
+            spine[top - 1]->right = t;
+        }
+        spine[top++] = t;
+    }
+
+    if (top > 0) {
+        *out = spine[0];
+        order_count(*out);
+    }
+
+    free(spine);
+
+    return 0;
+}
+
+/**
+ * This function sorts the rules of a new index into tuples, by hash and then order.
+ *
+ * @param a the first rule
+ * @param b the second rule
+ *
+ * @return negative, zero or positive as @a sorts before, with or after @b
+ */
+static int item_cmp(const void *a, const void *b) {
+
+    const tss_item_t *x = (const tss_item_t *) a;
+    const tss_item_t *y = (const tss_item_t *) b;
+
+    if (x->tuple != y->tuple) {
+        return x->tuple < y->tuple ? -1 : 1;
+    }
+
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+
+    return x->entry.order < y->entry.order ? -1 : x->entry.order > y->entry.order;
+}
+
+/**
+ * This function sorts the tuples in use by the earliest rule they may hold, the order
+ * they are probed in.
+ *
+ * @param t the index
+ */
+static void probe_sort(tss_t *t) {
+
+    t->probes = 0;
+
+    for (unsigned int i = 0; i < TSS_TUPLES; i++) {
+        if (t->tuples[i].rules == 0) {
+            continue;
+        }
+
+        unsigned int k = t->probes++;
+        while (k > 0 && t->tuples[t->probe[k - 1]].first > t->tuples[i].first) {
+            t->probe[k] = t->probe[k - 1];
+            k--;
+        }
+        t->probe[k] = i;
+    }
+}
+
+/**
+ * This function frees an index, along with whatever it shares with no other index.
+ *
+ * @param index the index
+ */
+void tss_free(void *index) {
+
+    tss_t *t = (tss_t *) index;
+
+    if (!t) {
+        return;
+    }
+
+    order_put(t->order);
+    for (unsigned int i = 0; i < TSS_TUPLES; i++) {
+        slot_put(t->tuples[i].root, 0);
+    }
+
+    free(t);
+}
+
+/**
+ * This function builds an index of packed rules, dealing out order keys TSS_STEP apart.
+ *
+ * @param rules the rules in order
+ * @param n the number of rules
+ *
+ * @return the index, or NULL if memory runs out
+ */
+static tss_t *tss_make(image_rule_t *rules, unsigned int n) {
+
+    tss_t *t = (tss_t *) calloc(1, sizeof(tss_t));
+    tss_entry_t *entries = (tss_entry_t *) malloc((n ? n : 1) * sizeof(tss_entry_t));
+    tss_item_t *items = (tss_item_t *) malloc((n ? n : 1) * sizeof(tss_item_t));
+    int ok = t && entries && items;
+
+    for (unsigned int i = 0; ok && i < n; i++) {
+        entries[i].order = (i + 1) * TSS_STEP;
+        entries[i].rule = rules[i];
+
+        items[i].tuple = rule_tuple(&rules[i]);
+        items[i].hash = rule_hash(&rules[i], items[i].tuple);
+        items[i].entry = entries[i];
+    }
+
+    if (ok) {
+        for (unsigned int i = 0; i < TSS_TUPLES; i++) {
+            t->tuples[i].first = TSS_NONE;
+        }
+        qsort(items, n, sizeof(tss_item_t), item_cmp);
+        ok = order_build(entries, n, &t->order) == 0;
+    }
+
+    for (unsigned int lo = 0, hi; ok && lo < n; lo = hi) {
+        tss_tuple_t *tuple = &t->tuples[items[lo].tuple];
+
+        for (hi = lo; hi < n && items[hi].tuple == items[lo].tuple; hi++) {
+            if (items[hi].entry.order < tuple->first) {
+                tuple->first = items[hi].entry.order;
+            }
+        }
+
+        tuple->rules = hi - lo;
+        ok = trie_build(items + lo, hi - lo, 0, &tuple->root) == 0;
+    }
+
+    free(entries);
+    free(items);
+
+    if (!ok) {
+        tss_free(t);
+        return NULL;
+    }
+
+    probe_sort(t);
+
+    return t;
+}
+
+/**
+ * This function builds a tuple space index of a policy, grouping the rules by which of
+ * their ports are wildcards and keeping a hash table of each group.
+ *
+ * @param rules the rules in order
+ * @param n the number of rules
+ *
+ * @return the index, or NULL if memory runs out
+ */
+void *tss_build(rule_t *rules, unsigned int n) {
+
+    image_rule_t *packed = (image_rule_t *) malloc((n ? n : 1) * sizeof(image_rule_t));
+
+    if (!packed) {
+        return NULL;
+    }
+
+    for (unsigned int i = 0; i < n; i++) {
+        rule_pack(&rules[i], &packed[i]);
+    }
+
+    tss_t *t = tss_make(packed, n);
+
+    free(packed);
+
+    return t;
+}
+
+/**
+ * This function finds the first rule matching a packet by probing the hash table of
+ * each tuple that may hold an earlier rule than the best one found so far.
+ *
+ * @param index the index
+ * @param pkt the packet
+ *
+ * @return the index (from 0) of the first matching rule, or -1
+ */
+int tss_lookup(void *index, packet_t *pkt) {
+
+    tss_t *t = (tss_t *) index;
+    uint32_t src = PACKET_SRC_IP(*pkt);
+    uint32_t dst = PACKET_DST_IP(*pkt);
+    protocol_t protocol = PACKET_PROTOCOL(*pkt);
+    int32_t src_port = PACKET_SRC_PORT(*pkt);
+    int32_t dst_port = PACKET_DST_PORT(*pkt);
+    uint64_t best = TSS_NONE;
+    unsigned int probes = 0;
+    unsigned int compared = 0;
+
+    for (unsigned int i = 0; i < t->probes; i++) {
+        unsigned int tuple = t->probe[i];
+
+        //No tuple left can hold an earlier rule
+        if (t->tuples[tuple].first >= best) {
+            break;
+        }
+
+        int src_any = tuple & TSS_SRC_ANY;
+        int dst_any = tuple & TSS_DST_ANY;
+        tss_bucket_t *b = trie_find(t->tuples[tuple].root,
+                key_hash(pkt->addrs, pkt->ports & tuple_mask(tuple)));
+        probes++;
+
+        for (unsigned int k = 0; b && k < b->count && b->entries[k].order < best; k++) {
+            const image_rule_t *r = &b->entries[k].rule;
+            compared++;
+
+            if (r->src_ip == src && r->dst_ip == dst && r->protocol == protocol
+                    && (src_any || r->src_port == src_port)
+                    && (dst_any || r->dst_port == dst_port)) {
+                best = b->entries[k].order;
+                break;
+            }
+        }
+    }
+
+    stats_engine_count(probes, compared);
+
+    return best == TSS_NONE ? -1 : (int) order_rank(t->order, best);
+}
+
+/**
+ * This function makes a copy of an index to be updated, sharing everything with it.
+ *
+ * @param t the index
+ *
+ * @return the copy, or NULL if unsuccessful
+ */
+static tss_t *tss_copy(tss_t *t) {
+
+    tss_t *n = (tss_t *) malloc(sizeof(tss_t));
+
+    if (!n) {
+        return NULL;
+    }
+
+    *n = *t;
+    order_hold(n->order);
+    for (unsigned int i = 0; i < TSS_TUPLES; i++) {
+        if (n->tuples[i].root) {
+            slot_hold(n->tuples[i].root, 0);
+        }
+    }
+    n->updates++;
+
+    return n;
+}
+
+/**
+ * This function rebuilds an index with a rule inserted, dealing out the order keys
+ * again. It is used when an insert finds no gap between the order keys around it.
+ *
+ * @param t the index
+ * @param rule the rule to be inserted
+ * @param pos the index (from 0) the rule is inserted at
+ *
+ * @return the new index, or NULL if memory runs out
+ */
+static tss_t *tss_rebuild(tss_t *t, image_rule_t *rule, unsigned int pos) {
+
+    unsigned int n = order_size(t->order);
+    image_rule_t *rules = (image_rule_t *) malloc((n + 1) * sizeof(image_rule_t));
+
+    if (!rules) {
+        return NULL;
+    }
+
+    order_collect(t->order, rules);
+    memmove(rules + pos + 1, rules + pos, (n - pos) * sizeof(image_rule_t));
+    rules[pos] = *rule;
+
+    tss_t *next = tss_make(rules, n + 1);
+
+    free(rules);
+
+    if (next) {
+        next->updates = t->updates + 1;
+        next->rebuilds = t->rebuilds + 1;
+    }
+
+    return next;
+}
+
+/**
+ * This function makes a copy of an index with a rule inserted, sharing everything the
+ * rule does not touch with @index, which is left as it is.
+ *
+ * @param index the index
+ * @param rule the rule to be inserted
+ * @param pos the index (from 0) the rule is inserted at
+ *
+ * @return the new index, or NULL if memory runs out
+ */
+void *tss_insert(void *index, rule_t *rule, unsigned int pos) {
+
+    tss_t *t = (tss_t *) index;
+    unsigned int n = order_size(t->order);
+    uint64_t prev = pos > 0 ? order_at(t->order, pos - 1)->order : 0;
+    uint64_t next = pos < n ? order_at(t->order, pos)->order : TSS_NONE;
+    tss_entry_t e;
+
+    rule_pack(rule, &e.rule);
+
+    if (next - prev < 2) {
+        return tss_rebuild(t, &e.rule, pos);
+    }
+
+    //Halve the gap, but keep appends TSS_STEP apart so they never run out of room
+    uint64_t gap = (next - prev) / 2;
+    e.order = prev + (gap < TSS_STEP ? gap : TSS_STEP);
+
+    unsigned int tuple = rule_tuple(&e.rule);
+    tss_t *copy = tss_copy(t);
+    tss_order_t *order;
+    tss_node_t *root;
+
+    if (!copy) {
+        return NULL;
+    }
+
+    if (order_edit(t->order, &e, e.order, &order) == -1) {
+        tss_free(copy);
+        return NULL;
+    }
+    order_put(copy->order);
+    copy->order = order;
+
+    if (trie_insert(t->tuples[tuple].root, 0, rule_hash(&e.rule, tuple), &e,
+            &root) == -1) {
+        tss_free(copy);
+        return NULL;
+    }
+    slot_put(copy->tuples[tuple].root, 0);
+    copy->tuples[tuple].root = root;
+
+    copy->tuples[tuple].rules++;
+    if (e.order < copy->tuples[tuple].first) {
+        copy->tuples[tuple].first = e.order;
+    }
+    probe_sort(copy);
+
+    return copy;
+}
+
+/**
+ * This function makes a copy of an index with a rule removed, sharing everything the
+ * rule does not touch with @index, which is left as it is.
+ *
+ * @param index the index
+ * @param pos the index (from 0) of the rule to be removed
+ *
+ * @return the new index, or NULL if memory runs out
+ */
+void *tss_remove(void *index, unsigned int pos) {
+
+    tss_t *t = (tss_t *) index;
+    tss_entry_t e = *order_at(t->order, pos);
+    unsigned int tuple = rule_tuple(&e.rule);
+    tss_t *copy = tss_copy(t);
+    tss_order_t *order;
+    tss_node_t *root;
+
+    if (!copy) {
+        return NULL;
+    }
+
+    if (order_edit(t->order, NULL, e.order, &order) == -1) {
+        tss_free(copy);
+        return NULL;
+    }
+    order_put(copy->order);
+    copy->order = order;
+
+    if (trie_remove(t->tuples[tuple].root, 0, rule_hash(&e.rule, tuple), e.order,
+            &root) == -1) {
+        tss_free(copy);
+        return NULL;
+    }
+    slot_put(copy->tuples[tuple].root, 0);
+    copy->tuples[tuple].root = root;
+
+    //The earliest order key is left as it is; it still bounds the rules that are left
+    if (--copy->tuples[tuple].rules == 0) {
+        copy->tuples[tuple].first = TSS_NONE;
+    }
+    probe_sort(copy);
+
+    return copy;
+}
+
+/**
+ * This function measures a trie.
+ *
+ * @param t the trie
+ * @param depth the level of @t
+ * @param keys the value to be increased by the number of buckets
+ * @param deepest the value to be updated with the deepest level
+ *
+ * @return the number of bytes the trie takes
+ */
+static size_t trie_measure(tss_node_t *t, unsigned int depth, size_t *keys,
+        unsigned int *deepest) {
+
+    size_t bytes = sizeof(tss_node_t) + __builtin_popcount(t->map) * sizeof(void *);
+    unsigned int k = 0;
+
+    if (depth + 1 > *deepest) {
+        *deepest = depth + 1;
+    }
+
+    for (unsigned int d = 0; d < TSS_RADIX; d++) {
+        if (!(t->map & (1U << d))) {
+            continue;
+        }
+
+        if (t->buckets & (1U << d)) {
+            tss_bucket_t *b = (tss_bucket_t *) t->slots[k];
+            bytes += sizeof(tss_bucket_t) + b->count * sizeof(tss_entry_t);
+            (*keys)++;
+        } else {
+            bytes += trie_measure((tss_node_t *) t->slots[k], depth + 1, keys, deepest);
+        }
+        k++;
+    }
+
+    return bytes;
+}
+
+/**
+ * This function prints the tuples of an index.
+ *
+ * @param index the index
+ * @param stream the file stream to print to
+ */
+void tss_print(void *index, FILE *stream) {
+
+    tss_t *t = (tss_t *) index;
+    size_t bytes = sizeof(tss_t) + order_size(t->order) * sizeof(tss_order_t);
+
+    fprintf(stream, "Tuples: %u in use, probed earliest rule first\n", t->probes);
+
+    for (unsigned int i = 0; i < t->probes; i++) {
+        unsigned int tuple = t->probe[i];
+        size_t keys = 0;
+        unsigned int depth = 0;
+
+        bytes += trie_measure(t->tuples[tuple].root, 0, &keys, &depth);
+        fprintf(stream, "  src port %s, dst port %s: %u rules, %zu keys, depth %u\n",
+                tuple & TSS_SRC_ANY ? "*" : "exact", tuple & TSS_DST_ANY ? "*" : "exact",
+                t->tuples[tuple].rules, keys, depth);
+    }
+
+    fprintf(stream, "Updates: %lu since built (%lu rebuilt for want of a gap)\n",
+            t->updates, t->rebuilds);
+    fprintf(stream, "Memory: %zu KB\n", bytes >> 10);
+}
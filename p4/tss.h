@@ -0,0 +1,73 @@
+/**
+ * @file tss.h
+ * @author Bilal Mohamad (bmohama)
+ *
+ * This file acts as the interface for the tss.c file
+ */
+
+#ifndef TSS_H
+#define TSS_H
+
+#include "policy.h"
+
+/**
+ * This function builds a tuple space index of a policy, grouping the rules by which of
+ * their ports are wildcards and keeping a hash table of each group.
+ *
+ * @param rules the rules in order
+ * @param n the number of rules
+ *
+ * @return the index, or NULL if memory runs out
+ */
+void *tss_build(rule_t *rules, unsigned int n);
+
+/**
+ * This function finds the first rule matching a packet by probing the hash table of
+ * each tuple that may hold an earlier rule than the best one found so far.
+ *
+ * @param index the index
+ * @param pkt the packet
+ *
+ * @return the index (from 0) of the first matching rule, or -1
+ */
+int tss_lookup(void *index, packet_t *pkt);
+
+/**
+ * This function makes a copy of an index with a rule inserted, sharing everything the
+ * rule does not touch with @index, which is left as it is.
+ *
+ * @param index the index
+ * @param rule the rule to be inserted
+ * @param pos the index (from 0) the rule is inserted at
+ *
+ * @return the new index, or NULL if memory runs out
+ */
+void *tss_insert(void *index, rule_t *rule, unsigned int pos);
+
+/**
+ * This function makes a copy of an index with a rule removed, sharing everything the
+ * rule does not touch with @index, which is left as it is.
+ *
+ * @param index the index
+ * @param pos the index (from 0) of the rule to be removed
+ *
+ * @return the new index, or NULL if memory runs out
+ */
+void *tss_remove(void *index, unsigned int pos);
+
+/**
+ * This function prints the tuples of an index.
+ *
+ * @param index the index
+ * @param stream the file stream to print to
+ */
+void tss_print(void *index, FILE *stream);
+
+/**
+ * This function frees an index, along with whatever it shares with no other index.
+ *
+ * @param index the index
+ */
+void tss_free(void *index);
+
+#endif